@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <sys/time.h>
 
+#include "threadfuture.h"
+
 long long getus()
 {
     struct timeval tv;
@@ -15,6 +17,60 @@ int called_async(int m)
     return m+1;
 }
 
+/* runs the same loop as main's std::async version, using lwtAsync */
+class LwtTest : public Thread {
+public:
+    int _count;
+    int _totala;
+    int _totalb;
+
+    LwtTest(int count) {
+        _count = count;
+        _totala = 0;
+        _totalb = 0;
+    }
+
+    void *start() {
+        int i;
+        ThreadFuture<int> a;
+        ThreadFuture<int> b;
+
+        for(i=0; i<_count; i += 2) {
+            int ta = _totala;
+            int tb = _totalb;
+            a = lwtAsync([ta]() { return called_async(ta); });
+            b = lwtAsync([tb]() { return called_async(tb); });
+            _totala = a.get();
+            _totalb = b.get();
+        }
+        return NULL;
+    }
+};
+
+/* a chain of then continuations, each running as a task */
+class ThenTest : public Thread {
+public:
+    int _count;
+    int _total;
+
+    ThenTest(int count) {
+        _count = count;
+        _total = 0;
+    }
+
+    void *start() {
+        int i;
+        ThreadPromise<int> promise;
+        ThreadFuture<int> future = promise.getFuture();
+
+        for(i=0; i<_count; i++) {
+            future = future.then([](ThreadFuture<int> &f) { return called_async(f.get()); });
+        }
+        promise.setValue(0);
+        _total = future.get();
+        return NULL;
+    }
+};
 
 int
 main(int argc, char **argv)
@@ -49,5 +105,26 @@ main(int argc, char **argv)
 
     start = getus() - start;
 
-    printf("ta=%d tb=%d us=%lld ns each\n", totala, totalb, start*1000/count);
+    printf("std::async: ta=%d tb=%d us=%lld ns each\n", totala, totalb, start*1000/count);
+
+    ThreadDispatcher::setup(/* # of pthreads */ 2);
+
+    LwtTest *lwtp = new LwtTest(count);
+    lwtp->setJoinable();
+    start = getus();
+    lwtp->queue();
+    lwtp->join(NULL);
+    start = getus() - start;
+
+    printf("lwtAsync:   ta=%d tb=%d us=%lld ns each\n",
+           lwtp->_totala, lwtp->_totalb, start*1000/count);
+
+    ThenTest *thenp = new ThenTest(count);
+    thenp->setJoinable();
+    start = getus();
+    thenp->queue();
+    thenp->join(NULL);
+    start = getus() - start;
+
+    printf("then chain: total=%d us=%lld ns each\n", thenp->_total, start*1000/count);
 }
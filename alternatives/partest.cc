@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <execution>
+#include <numeric>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "threadparallel.h"
+
+long long getus()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+/* some CPU-bound work per element */
+static double
+work(double x)
+{
+    return sqrt(x) * sin(x);
+}
+
+static void
+report(const char *namep, long count, long long us)
+{
+    printf("%-28s %8lld us, %ld ns each\n", namep, us, (long) (us * 1000 / count));
+}
+
+/* compares serial loops, std::execution::par and ThreadParallel on the
+ * same data; the lwt versions run from a lightweight thread.
+ */
+class ParTest : public Thread {
+public:
+    long _count;
+
+    ParTest(long count) {
+        _count = count;
+    }
+
+    void *start() {
+        std::vector<double> in(_count);
+        std::vector<double> out(_count);
+        std::vector<int> keys(_count);
+        std::vector<int> sorted;
+        long long start;
+        double serialSum;
+        double sum;
+        long i;
+
+        for(i=0;i<_count;i++) {
+            in[i] = i;
+            keys[i] = random();
+        }
+
+        /* transform */
+        start = getus();
+        std::transform(in.begin(), in.end(), out.begin(), work);
+        report("serial transform", _count, getus() - start);
+
+        start = getus();
+        std::transform(std::execution::par, in.begin(), in.end(), out.begin(), work);
+        report("std::execution::par transform", _count, getus() - start);
+
+        start = getus();
+        ThreadParallel::parallelTransform(in.begin(), in.end(), out.begin(), work);
+        report("lwt transform", _count, getus() - start);
+
+        /* reduce */
+        start = getus();
+        serialSum = 0;
+        for(i=0;i<_count;i++)
+            serialSum += work(in[i]);
+        report("serial reduce", _count, getus() - start);
+
+        start = getus();
+        sum = std::transform_reduce(std::execution::par, in.begin(), in.end(), 0.0,
+                                    std::plus<double>(), work);
+        report("std::execution::par reduce", _count, getus() - start);
+
+        start = getus();
+        sum = ThreadParallel::parallelReduce(0, _count, 0.0,
+                                             [&in](long i) { return work(in[i]); },
+                                             [](double a, double b) { return a + b; });
+        report("lwt reduce", _count, getus() - start);
+        assert(fabs(sum - serialSum) <= 1e-6 * fabs(serialSum));
+
+        /* sort */
+        sorted = keys;
+        start = getus();
+        std::sort(sorted.begin(), sorted.end());
+        report("serial sort", _count, getus() - start);
+
+        sorted = keys;
+        start = getus();
+        std::sort(std::execution::par, sorted.begin(), sorted.end());
+        report("std::execution::par sort", _count, getus() - start);
+
+        sorted = keys;
+        start = getus();
+        ThreadParallel::parallelSort(sorted.begin(), sorted.end());
+        report("lwt sort", _count, getus() - start);
+        assert(std::is_sorted(sorted.begin(), sorted.end()));
+
+        return NULL;
+    }
+};
+
+int
+main(int argc, char **argv)
+{
+    ParTest *testp;
+
+    if (argc<2) {
+        printf("usage: partest <count> [dispatchers]\n");
+        return -1;
+    }
+
+    ThreadDispatcher::setup(argc > 2? atoi(argv[2]) : 8);
+
+    testp = new ParTest(atol(argv[1]));
+    testp->setJoinable();
+    testp->queue();
+    testp->join(NULL);
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <malloc.h>
+#include <atomic>
+
+#include "threadcoro.h"
+
+std::atomic<long> main_done;
+
+ThreadMutex main_mutex;
+ThreadCond main_cv;
+long main_counter;
+long main_produced;
+
+/* each coroutine bumps a counter under a contended mutex */
+ThreadCoro
+counter(long count)
+{
+    long i;
+
+    for(i=0;i<count;i++) {
+        co_await ThreadCoro::take(&main_mutex);
+        main_counter++;
+        co_await ThreadCoro::release(&main_mutex);
+    }
+    main_done++;
+}
+
+/* waits on a CV until main_produced reaches target */
+ThreadCoro
+consumer(long target)
+{
+    co_await ThreadCoro::take(&main_mutex);
+    while(main_produced < target)
+        co_await ThreadCoro::wait(&main_cv, &main_mutex);
+    co_await ThreadCoro::release(&main_mutex);
+    main_done++;
+}
+
+/* a coroutine that takes the mutex and has a subroutine coroutine release it */
+ThreadCoro
+releaser()
+{
+    co_await ThreadCoro::release(&main_mutex);
+}
+
+ThreadCoro
+nested()
+{
+    co_await ThreadCoro::take(&main_mutex);
+    main_counter++;
+    co_await releaser();
+    main_done++;
+}
+
+ThreadCoro
+sleeper(uint32_t ms)
+{
+    co_await ThreadCoro::sleep(ms);
+    main_done++;
+}
+
+ThreadCoro
+joiner(Thread *threadp)
+{
+    void *valuep;
+    int32_t code;
+
+    code = co_await ThreadCoro::join(threadp, &valuep);
+    assert(code == 0 && valuep == (void *) 17);
+    threadp->releaseThread();
+    main_done++;
+}
+
+ThreadCoro
+reader(EpollEvent *eventp, int fd)
+{
+    int32_t code;
+    char tc;
+
+    co_await ThreadCoro::wait(eventp, EpollEvent::epollIn, &code);
+    assert(code == 0);
+    code = read(fd, &tc, 1);
+    assert(code == 1 && tc == 'x');
+    main_done++;
+}
+
+/* parks on the CV forever; used to measure memory per waiting request */
+ThreadCoro
+parked()
+{
+    co_await ThreadCoro::take(&main_mutex);
+    while(1)
+        co_await ThreadCoro::wait(&main_cv, &main_mutex);
+}
+
+class ParkedThread : public Thread {
+public:
+    void *start() {
+        main_mutex.take();
+        while(1)
+            main_cv.wait(&main_mutex);
+    }
+};
+
+/* bytes allocated, including large blocks that malloc mmaps, like stacks */
+static size_t
+heapBytes()
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+static void
+waitDone(long count)
+{
+    while(main_done.load() < count)
+        usleep(100);
+}
+
+int
+main(int argc, char **argv)
+{
+    long i;
+    long count;
+    long perCoro = 1000;
+    static const long nCoros = 8;
+    EpollSys *sysp;
+    EpollEvent *eventp;
+    int pipeFds[2];
+    size_t startBytes;
+
+    if (argc<2) {
+        printf("usage: corotest <count>\n");
+        return -1;
+    }
+    count = atoi(argv[1]);
+
+    ThreadDispatcher::setup(/* # of pthreads */ 2);
+    ThreadTimer::init();
+    main_cv.setMutex(&main_mutex);
+
+    printf("Starting mutex test\n");
+    main_done = 0;
+    for(i=0;i<nCoros;i++)
+        counter(perCoro).queue();
+    waitDone(nCoros);
+    assert(main_counter == nCoros * perCoro);
+
+    printf("Starting cv test\n");
+    main_done = 0;
+    for(i=0;i<nCoros;i++)
+        consumer(nCoros).queue();
+    for(i=0;i<nCoros;i++) {
+        main_mutex.take();
+        main_produced++;
+        main_cv.broadcast();
+        main_mutex.release();
+    }
+    waitDone(nCoros);
+
+    printf("Starting nested release test\n");
+    main_done = 0;
+    main_counter = 0;
+    for(i=0;i<nCoros;i++)
+        nested().queue();
+    waitDone(nCoros);
+    assert(main_counter == nCoros);
+    main_mutex.take();
+    main_mutex.release();
+
+    printf("Starting sleep test\n");
+    main_done = 0;
+    sleeper(20).queue();
+    waitDone(1);
+
+    printf("Starting join test\n");
+    main_done = 0;
+    for(i=0;i<nCoros;i++) {
+        Thread *threadp;
+        threadp = Thread::spawn("Joined", []() { usleep(1000); return (void *) 17; },
+                                ThreadSpawnOptions().joinable());
+        joiner(threadp).queue();
+    }
+    waitDone(nCoros);
+
+    printf("Starting epoll test\n");
+    main_done = 0;
+    sysp = new EpollSys("corotest");
+    pipe(pipeFds);
+    eventp = new EpollEvent(sysp, pipeFds[0], /* !isWrite */ 0);
+    reader(eventp, pipeFds[0]).queue();
+    usleep(10000);
+    write(pipeFds[1], "x", 1);
+    waitDone(1);
+    eventp->close();
+
+    /* compare the memory tied up by requests waiting on a CV */
+    printf("Starting memory test for %ld waiters\n", count);
+    startBytes = heapBytes();
+    for(i=0;i<count;i++)
+        parked().queue();
+    usleep(100000);
+    printf("%ld bytes per waiting coroutine\n",
+           (long) ((heapBytes() - startBytes) / count));
+
+    startBytes = heapBytes();
+    for(i=0;i<count;i++)
+        (new ParkedThread())->queue();
+    usleep(100000);
+    printf("%ld bytes per waiting thread\n",
+           (long) ((heapBytes() - startBytes) / count));
+
+    printf("All done\n");
+    _exit(0);
+    return 0;
+}
@@ -156,6 +156,7 @@ template <class TT> class dqueue {
         else {
             _tailp->_dqNextp = srcp->_headp;
             srcp->_headp->_dqPrevp = _tailp;
+            _tailp = srcp->_tailp;
             _queueCount += srcp->_queueCount;
         }
 
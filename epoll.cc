@@ -52,13 +52,10 @@ EpollOne::init(EpollSys *sysp, const char * threadName) {
     pthread_setname_np(junkId, threadName);
 }
 
-/* The way that shutting down this code works is first, you close all the EpollEvent
- * objects, which drops their reference counts.  When they hit zero, they drop
- * *their* reference to the EpollOne object.  When the user then calls ::close on
- * the EpollOne object, it sets a flag in the sys object, wakes up the pthread,
- * which exits immediately after dropping the original reference count returned to
- * the user when the EpollOne was created.  When the reference count goes to 0,
- * the EpollOne object is finally freed.
+/* The poller for one shard.  It runs for the life of the process: closing
+ * the EpollOne only moves its events to the removing queue, which we empty
+ * here, releasing the events, and we never exit, so the EpollOne, and the
+ * EpollSys that holds it, are never freed.
  */
 void *
 EpollOne::threadStart(void *argp)
@@ -69,11 +66,10 @@ EpollOne::threadStart(void *argp)
     EpollEvent *ep;
     EpollEvent *nep;
     EpollOne *onep = (EpollOne *) argp;
-    static const uint32_t nevents = 16;
+    static const uint32_t nevents = 256;
     epoll_event localEvents[nevents];
     epoll_event *eventp;
     int32_t i;
-    EpollSys *sysp = onep->_sysp;
     
     /* turn this pthread into a dispatcher for a dedicated thread, so we can
      * wait for thread locks correctly.
@@ -92,7 +88,7 @@ EpollOne::threadStart(void *argp)
 
     while(1) {
         /* collect updates */
-        sysp->_lock.take();
+        onep->_lock.take();
 
         for(ep = onep->_removingEvents.head(); ep; ep = nep) {
             nep = ep->_dqNextp;
@@ -113,7 +109,7 @@ EpollOne::threadStart(void *argp)
 
         onep->_running = 0;
 
-        sysp->_lock.release();
+        onep->_lock.release();
         
         /* do the wait */
         evCount = epoll_wait(onep->_epFd, localEvents, nevents, -1);
@@ -124,7 +120,7 @@ EpollOne::threadStart(void *argp)
             thread_assert("epoll_wait failed" == 0);
         }
 
-        sysp->_lock.take();
+        onep->_lock.take();
         onep->_running = 0;
         for( i=0, eventp = localEvents;
              i<evCount;
@@ -140,17 +136,16 @@ EpollOne::threadStart(void *argp)
                 code = read(onep->_readWakeupFd, &tc, 1);
             }
         }
-        sysp->_lock.release();
+        onep->_lock.release();
     }
 }
 
+/* an EpollSys is never freed, even at a count of 0; see epoll.h */
 void
 EpollSys::releaseNL()
 {
     thread_assert(_refCount > 0);
-    if (--_refCount == 0) {
-        delete this;
-    }
+    _refCount--;
 }
 
 void
@@ -171,7 +166,7 @@ EpollOne::close()
     EpollEvent *ep;
     EpollEvent *nep;
 
-    _sysp->_lock.take();
+    _lock.take();
 
     for(ep=_activeEvents.head(); ep; ep=nep) {
         nep = ep->_dqNextp;
@@ -181,7 +176,7 @@ EpollOne::close()
     }
     wakeThreadNL();
 
-    _sysp->_lock.release();
+    _lock.release();
 }
 
 void
@@ -213,13 +208,14 @@ EpollEvent::releaseNL()
 {
     thread_assert(_refCount > 0);
     if (--_refCount == 0) {
-        _sysp->releaseNL();
+        /* we hold our EpollOne's lock, not the system's */
+        _sysp->release();
         _sysp = NULL;
         delete this;
     }
 }
 
-/* called with system lock held */
+/* called with our EpollOne's lock held */
 void
 EpollEvent::closeNL() {
     epoll_event ev;
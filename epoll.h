@@ -33,7 +33,12 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  *
  * Internall, we start by creating an EpollOne object for the read
  * side and the write side, each of which which has an associated
- * pthread that does the actual waiting.  Then you create a new
+ * pthread that does the actual waiting.  There's a pair of these for
+ * each of the EpollSys's shards, one per dispatcher unless you ask for
+ * a particular number, and each file descriptor is hashed to a shard,
+ * so that readiness handling doesn't funnel through two pthreads.  Each
+ * EpollOne has its own lock, protecting its queues and the state of its
+ * events, so shards don't contend with one another.  Then you create a new
  * EpollEvent for a file descriptor, and you call the wait method with
  * either epollIn or epollOut, to wait for either input to be
  * available, or for at least *some* room for output to be available.
@@ -53,8 +58,11 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  * When done with an epoll event, you call close on the event object;
  * this will release its reference and free the underlying storage.
  *
- * Similarly, after releasing any events from the epollSys, you can
- * close the epollSys object and its storage will eventually be freed.
+ * An EpollSys, on the other hand, is never destroyed.  Its pollers
+ * run for the life of the process, with no way to stop them, and each
+ * uses its shard's EpollOne, so neither the shards nor the EpollSys
+ * can be freed.  Create one when starting up and keep it; closing it
+ * only closes its events.
  */
 #include <sys/epoll.h>
 #include <pthread.h>
@@ -81,6 +89,7 @@ class EpollOne {
     uint8_t _setChanged;
     uint8_t _specialEventWakeup;  /* addresse used to distinguish special event */
     uint8_t _running;
+    ThreadMutex _lock;          /* protects this and our events */
     dqueue<EpollEvent> _activeEvents;
     dqueue<EpollEvent> _removingEvents;
 
@@ -98,22 +107,50 @@ class EpollOne {
 class EpollSys {
     friend class EpollOne;
     friend class EpollEvent;
+    friend class ThreadCoro;
 
     uint32_t _refCount;
-    ThreadMutex _lock;
+    ThreadMutex _lock;          /* protects _refCount */
 
-    EpollOne _readOne;
-    EpollOne _writeOne;
+    uint32_t _shardCount;
+    EpollOne *_readOnesp;       /* _shardCount of each, never freed */
+    EpollOne *_writeOnesp;
+
+    /* the pollers never exit, and use the shards; see above */
+    ~EpollSys() = delete;
 
  public:
-    EpollSys(const char *name = NULL) {
-        _refCount = 1;
+    /* shardCount of 0 means one per dispatcher */
+    EpollSys(const char *name = NULL, uint32_t shardCount = 0) {
         char thr_name[32];
+        uint32_t i;
 
-        snprintf(thr_name, sizeof(thr_name), "%s:rp", name ? name : "unk");
-        _readOne.init(this,thr_name);
-        snprintf(thr_name, sizeof(thr_name), "%s:wp", name ? name : "unk");
-        _writeOne.init(this,thr_name);
+        _refCount = 1;
+        if (shardCount == 0)
+            shardCount = ThreadDispatcher::getDispatcherCount();
+        if (shardCount == 0)
+            shardCount = 1;
+        _shardCount = shardCount;
+        _readOnesp = new EpollOne[shardCount];
+        _writeOnesp = new EpollOne[shardCount];
+
+        for(i=0;i<shardCount;i++) {
+            snprintf(thr_name, sizeof(thr_name), "%s:rp%d", name ? name : "unk", i);
+            _readOnesp[i].init(this,thr_name);
+            snprintf(thr_name, sizeof(thr_name), "%s:wp%d", name ? name : "unk", i);
+            _writeOnesp[i].init(this,thr_name);
+        }
+    }
+
+    /* the poller for fd; both sides of an fd use the same shard */
+    EpollOne *getOne(int fd, int isWrite) {
+        uint32_t ix = (uint32_t) fd % _shardCount;
+
+        return (isWrite? &_writeOnesp[ix] : &_readOnesp[ix]);
+    }
+
+    uint32_t getShardCount() {
+        return _shardCount;
     }
 
     void hold() {
@@ -132,21 +169,21 @@ class EpollSys {
     }
 
     void close() {
-        _readOne.close();
-        _writeOne.close();
+        uint32_t i;
+
+        for(i=0;i<_shardCount;i++) {
+            _readOnesp[i].close();
+            _writeOnesp[i].close();
+        }
     }
 };
 
 /* reference counting works as follows: users keep refcount to
  * EpollEvent, and they're freed whenever the count hits zero.  User
  * keeps a reference to the EpollSys as well, and each event also
- * keeps a reference to the system.  The polling pthread also keeps a
- * long term reference to the system.
- *
- * When the user calls shutdown and subsequently drops their sys
- * reference, the pthread will terminate and drop its reference, and
- * all events will trigger with a shutdown indication.  Once all user
- * references to events and sys are gone, all memory will be freed.
+ * keeps a reference to the system.  The system's count is only
+ * kept for its users' benefit, since, as above, a system is never
+ * freed, even once the count reaches zero.
  *
  * The way that events work is that they're disabled once they
  * trigger, until we reenable them.  The typical use is for the user
@@ -166,6 +203,7 @@ class EpollSys {
 class EpollEvent {
     friend class EpollOne;
     friend class EpollSys;
+    friend class ThreadCoro;
 
  public:
     /* these are bitmasks */
@@ -212,9 +250,9 @@ class EpollEvent {
         _failed = 0;
         _flags = (Flags) 0;
         _sysp = sysp;
-        _onep = (isWrite? &sysp->_writeOne : &sysp->_readOne);
+        _onep = sysp->getOne(fd, isWrite);
         _sysp->hold();
-        _cv.setMutex(&_sysp->_lock);
+        _cv.setMutex(&_onep->_lock);
         _dqPrevp = NULL;
         _dqNextp = NULL;
         _inQueue = inNoQueue;
@@ -236,16 +274,21 @@ class EpollEvent {
         _inQueue = inNoQueue;
     }
 
-    /* note that this returns immediately if the event has been closed */
-    int32_t wait(Flags fl) {
-        _sysp->_lock.take();
+    /* note that this returns immediately if the event has been closed.
+     * Returns ThreadCancel::TC_ERR_CANCELED if cancelp is canceled first.
+     */
+    int32_t wait(Flags fl, ThreadCancel *cancelp = NULL) {
+        int32_t code;
+        ThreadMutex *lockp = &_onep->_lock;
+
+        lockp->take();
 
         /* if this event has already been triggered, turn off the indicator
          * and return.
          */
         if (_triggered) {
             _triggered = 0;
-            _sysp->_lock.release();
+            lockp->release();
             return 0;
         }
 
@@ -255,19 +298,23 @@ class EpollEvent {
              */
             reenableNL(fl);
 
-            _cv.wait(&_sysp->_lock);
+            code = _cv.wait(cancelp, lockp);
+            if (code != 0) {
+                lockp->release();
+                return code;
+            }
         }
         _triggered = 0;
-        _sysp->_lock.release();
+        lockp->release();
         return (_closed? -1 : 0);
     }
 
     void hold() {
-        EpollSys *sysp = _sysp;
+        EpollOne *onep = _onep;
 
-        sysp->_lock.take();
+        onep->_lock.take();
         holdNL();
-        sysp->_lock.release();
+        onep->_lock.release();
     }
 
     void holdNL() {
@@ -277,7 +324,6 @@ class EpollEvent {
     void closeNL();
 
     void close() {
-        EpollSys *sysp = _sysp;
         EpollOne *onep = _onep;
 
         /* move the event into the removal queue, drop our reference,
@@ -289,21 +335,21 @@ class EpollEvent {
          * be released and freed, so pull out fields we need from it
          * first.
          */
-        sysp->_lock.take();
+        onep->_lock.take();
         closeNL();
         onep->wakeThreadNL();
-        sysp->_lock.release();
+        onep->_lock.release();
     }
 
     /* drop a reference; this is for internal use only; owners of an event
      * should call close on it, which will move it to a queue for releasing.
      */
     void release() {
-        EpollSys *sysp = _sysp;
+        EpollOne *onep = _onep;
 
-        sysp->_lock.take();
+        onep->_lock.take();
         releaseNL();
-        sysp->_lock.release();
+        onep->_lock.release();
     };
 
     void releaseNL();
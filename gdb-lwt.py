@@ -2,8 +2,8 @@ import gdb
 from collections import defaultdict
 
 # this is based on kazar's version of gdb/amd64-linux-tdep.cc.  Note
-# that r8 is stored 0x28 bytes into the saved context ucontext_t, or
-# 0x58 bytes into the Thread structure itself.  This labels each 8
+# that r8 is stored 0x28 bytes into the saved context ucontext_t, which
+# the Thread structure points to with its _ctxp field.  This labels each 8
 # byte starting value in the context.  The ones labelled none
 # represent values that aren't actually stored.
 SAVED_REGS = ["r8", "r9", "none", "none",
@@ -13,20 +13,20 @@ SAVED_REGS = ["r8", "r9", "none", "none",
               "rip"]
 
 # This is another way of expressing what's in the context field
-# set $r8=$3._ctx.uc_mcontext.gregs[0]
-# set $r9=$3._ctx.uc_mcontext.gregs[1]
-# set $r12=$3._ctx.uc_mcontext.gregs[4]
-# set $r13=$3._ctx.uc_mcontext.gregs[5]
-# set $r14=$3._ctx.uc_mcontext.gregs[6]
-# set $r15=$3._ctx.uc_mcontext.gregs[7]
-# set $rdi=$3._ctx.uc_mcontext.gregs[8]
-# set $rsi=$3._ctx.uc_mcontext.gregs[9]
-# set $rbp=$3._ctx.uc_mcontext.gregs[10]
-# set $rbx=$3._ctx.uc_mcontext.gregs[11]
-# set $rdx=$3._ctx.uc_mcontext.gregs[12]
-# set $rcx=$3._ctx.uc_mcontext.gregs[14]
-# set $rsp=$3._ctx.uc_mcontext.gregs[15]
-# set $rip=$3._ctx.uc_mcontext.gregs[16]
+# set $r8=$3._ctxp->uc_mcontext.gregs[0]
+# set $r9=$3._ctxp->uc_mcontext.gregs[1]
+# set $r12=$3._ctxp->uc_mcontext.gregs[4]
+# set $r13=$3._ctxp->uc_mcontext.gregs[5]
+# set $r14=$3._ctxp->uc_mcontext.gregs[6]
+# set $r15=$3._ctxp->uc_mcontext.gregs[7]
+# set $rdi=$3._ctxp->uc_mcontext.gregs[8]
+# set $rsi=$3._ctxp->uc_mcontext.gregs[9]
+# set $rbp=$3._ctxp->uc_mcontext.gregs[10]
+# set $rbx=$3._ctxp->uc_mcontext.gregs[11]
+# set $rdx=$3._ctxp->uc_mcontext.gregs[12]
+# set $rcx=$3._ctxp->uc_mcontext.gregs[14]
+# set $rsp=$3._ctxp->uc_mcontext.gregs[15]
+# set $rip=$3._ctxp->uc_mcontext.gregs[16]
 
 # One of these for each load of this script.  ThreadContext maintains
 # a copy of the initial register state for the first gdb thread (pthread)
@@ -110,11 +110,12 @@ class uthread(gdb.Command):
                 print("Register state already restored")
             return
 
-        # NB: the 88 is the offset of the general registers in the thread structure
-        # when counting sizes don't forget that there's a _vptr at the
-        # start of the thread structure
+        # NB: the context lives at the base of the thread's stack
+        # allocation, and the 40 (0x28) is the offset of the general
+        # registers within the ucontext_t.
         arg = gdb.parse_and_eval(argv[0])
-        v = int(arg) + 88
+        threadp = arg.cast(gdb.lookup_type("Thread").pointer())
+        v = int(threadp.dereference()["_ctxp"]) + 40
         t1 = gdb.lookup_type("ucontext_t").pointer()
         ptr = gdb.Value(v).cast(t1)
         self.thread_context.set_machine_regs_from_thread(ptr)
@@ -1,9 +1,14 @@
 #include <stdio.h>
 #include <string.h>
+#include <vector>
 
 #include "thread.h"
 #include "threadmutex.h"
 #include "threadtimer.h"
+#include "threadseqlock.h"
+#include "threadparkinglot.h"
+#include "threadrcu.h"
+#include "threadsync.h"
 
 class BasicTestState {
 public:
@@ -45,9 +50,11 @@ public:
     public:
         ThreadMutex _lock;
         uint32_t _exclCounter;
+        int _perf;      /* short critical sections, for timing the mutex */
 
         TestState() {
             _exclCounter = 0;
+            _perf = 0;
         }
     };
 
@@ -57,6 +64,15 @@ public:
         uint32_t value;
         uint32_t spin;
 
+        if (_statep->_perf) {
+            for(spin = 0; spin < _statep->_maxSpins; spin++) {
+                _statep->_lock.take();
+                ++_statep->_exclCounter;
+                _statep->_lock.release();
+            }
+            return NULL;
+        }
+
         printf("Starting thread %p\n", Thread::getCurrent());
         for(spin = 0; spin < _statep->_maxSpins; spin++) {
             if (random() % 1) {
@@ -92,7 +108,7 @@ public:
     }
 };
 
-class RwTest : public Thread {
+template<class L> class RwTest : public Thread {
 public:
     /* exclCounter is only examined with at least a read lock, and is
      * updated only with a write lock.  sharedCounter is updated and
@@ -105,7 +121,7 @@ public:
      */
     class TestState : public BasicTestState {
     public:
-        ThreadLockRw _lock;
+        L _lock;
         uint32_t _exclCounter;
         uint32_t _sharedCounter;
         uint32_t _sharedRaces;
@@ -214,27 +230,435 @@ public:
     }
 };
 
+/* times a read-mostly workload: writePct percent of the operations
+ * take a write lock and update the pair, and the rest take a read lock
+ * and check it.
+ */
+template<class L> class RwPerf : public Thread {
+public:
+    class TestState {
+    public:
+        L _lock;
+        uint32_t _writePct;
+        uint32_t _ops;
+        uint64_t _a;
+        uint64_t _b;
+        uint64_t _writes;
+
+        TestState(uint32_t writePct, uint32_t ops) {
+            _writePct = writePct;
+            _ops = ops;
+            _a = 0;
+            _b = 0;
+            _writes = 0;
+        }
+    };
+
+    TestState *_statep;
+    uint32_t _seed;
+
+    void *start() {
+        uint32_t i;
+
+        for(i=0; i<_statep->_ops; i++) {
+            /* random() takes a lock, so use our own generator */
+            _seed = _seed * 1103515245 + 12345;
+            if ((_seed >> 16) % 100 < _statep->_writePct) {
+                _statep->_lock.lockWrite();
+                _statep->_a++;
+                _statep->_b++;
+                _statep->_writes++;
+                _statep->_lock.releaseWrite();
+            }
+            else {
+                _statep->_lock.lockRead();
+                assert(_statep->_a == _statep->_b);
+                _statep->_lock.releaseRead();
+            }
+        }
+        return NULL;
+    }
+
+    RwPerf(TestState *statep, uint32_t seed) {
+        _statep = statep;
+        _seed = seed;
+    }
+
+    /* returns ns per operation */
+    static long long run(uint32_t threads, uint32_t ops, uint32_t writePct) {
+        TestState state(writePct, ops);
+        std::vector<RwPerf *> testsp(threads);
+        long long startUs;
+        long long elapsedUs;
+        uint32_t i;
+
+        startUs = osp_getUs();
+        for(i=0; i<threads; i++) {
+            testsp[i] = new RwPerf(&state, i+1);
+            testsp[i]->setJoinable();
+            testsp[i]->queue();
+        }
+        for(i=0; i<threads; i++) {
+            testsp[i]->join(NULL);
+        }
+        elapsedUs = osp_getUs() - startUs;
+        assert(state._a == state._writes);
+        return elapsedUs * 1000 / ((long long) ops * threads);
+    }
+};
+
+/* times reads of a small snapshot, through a ThreadSeqValue, under a
+ * read lock, or through an RCU protected pointer, while the first
+ * thread updates it once every 1000 reads.
+ */
+class SeqPerf : public Thread {
+public:
+    enum Mode {
+        _modeSeq = 0,
+        _modeRw = 1,
+        _modeBiased = 2,
+        _modeRcu = 3
+    };
+
+    class Snapshot {
+    public:
+        uint64_t _a;
+        uint64_t _b;
+        uint64_t _c;
+        uint64_t _d;
+    };
+
+    class TestState {
+    public:
+        Mode _mode;
+        uint32_t _ops;
+        ThreadSeqValue<Snapshot> _seqValue;
+        ThreadLockRw _rwLock;
+        ThreadLockRwBiased _biasedLock;
+        Snapshot _value;
+        std::atomic<Snapshot *> _rcuValuep;
+
+        TestState(Mode mode, uint32_t ops) {
+            _mode = mode;
+            _ops = ops;
+            memset(&_value, 0, sizeof(_value));
+            _rcuValuep = new Snapshot(_value);
+        }
+
+        ~TestState() {
+            delete _rcuValuep.load();
+        }
+    };
+
+    TestState *_statep;
+    int _writer;
+
+    void write() {
+        if (_statep->_mode == _modeSeq) {
+            _statep->_seqValue.update([](Snapshot *snapp) {
+                    snapp->_a++; snapp->_b++; snapp->_c++; snapp->_d++;
+                });
+        }
+        else if (_statep->_mode == _modeRw) {
+            _statep->_rwLock.lockWrite();
+            _statep->_value._a++; _statep->_value._b++; _statep->_value._c++; _statep->_value._d++;
+            _statep->_rwLock.releaseWrite();
+        }
+        else if (_statep->_mode == _modeBiased) {
+            _statep->_biasedLock.lockWrite();
+            _statep->_value._a++; _statep->_value._b++; _statep->_value._c++; _statep->_value._d++;
+            _statep->_biasedLock.releaseWrite();
+        }
+        else {
+            /* we're the only writer */
+            Snapshot *oldp = _statep->_rcuValuep.load(std::memory_order_relaxed);
+            Snapshot *newp = new Snapshot(*oldp);
+
+            newp->_a++; newp->_b++; newp->_c++; newp->_d++;
+            ThreadRcu::assign(&_statep->_rcuValuep, newp);
+            ThreadRcu::call([oldp]() {
+                    oldp->_a = ~0ULL;   /* poison, so a late reader would notice */
+                    delete oldp;
+                });
+        }
+    }
+
+    Snapshot read() {
+        Snapshot snap;
+
+        if (_statep->_mode == _modeSeq)
+            return _statep->_seqValue.load();
+        else if (_statep->_mode == _modeRw) {
+            _statep->_rwLock.lockRead();
+            snap = _statep->_value;
+            _statep->_rwLock.releaseRead();
+        }
+        else if (_statep->_mode == _modeBiased) {
+            _statep->_biasedLock.lockRead();
+            snap = _statep->_value;
+            _statep->_biasedLock.releaseRead();
+        }
+        else {
+            ThreadRcu::readLock();
+            snap = *ThreadRcu::dereference(&_statep->_rcuValuep);
+            ThreadRcu::readUnlock();
+        }
+        return snap;
+    }
+
+    void *start() {
+        Snapshot snap;
+        uint32_t i;
+
+        for(i=0; i<_statep->_ops; i++) {
+            if (_writer && (i % 1000) == 0)
+                write();
+            snap = read();
+            assert(snap._a == snap._b && snap._b == snap._c && snap._c == snap._d);
+        }
+        return NULL;
+    }
+
+    SeqPerf(TestState *statep, int writer) {
+        _statep = statep;
+        _writer = writer;
+    }
+
+    /* returns ns per read */
+    static long long run(Mode mode, uint32_t threads, uint32_t ops) {
+        TestState state(mode, ops);
+        std::vector<SeqPerf *> testsp(threads);
+        long long startUs;
+        long long elapsedUs;
+        uint32_t i;
+
+        startUs = osp_getUs();
+        for(i=0; i<threads; i++) {
+            testsp[i] = new SeqPerf(&state, (i == 0));
+            testsp[i]->setJoinable();
+            testsp[i]->queue();
+        }
+        for(i=0; i<threads; i++) {
+            testsp[i]->join(NULL);
+        }
+        elapsedUs = osp_getUs() - startUs;
+        if (mode == _modeRcu)
+            ThreadRcu::barrier();
+        return elapsedUs * 1000 / ((long long) ops * threads);
+    }
+};
+
+/* per-object locking: threads increment counters, each guarded by its
+ * own lock of type L, picked pseudo-randomly from a table of lockCount.
+ * With one lock, this times a contended lock instead.
+ */
+template<class L> class CompactPerf : public Thread {
+public:
+    class Entry {
+    public:
+        L _lock;
+        uint32_t _counter;
+    };
+
+    class TestState {
+    public:
+        std::vector<Entry> _entries;
+        uint32_t _ops;
+
+        TestState(uint32_t lockCount, uint32_t ops) : _entries(lockCount) {
+            _ops = ops;
+        }
+    };
+
+    TestState *_statep;
+    uint32_t _seed;
+
+    void *start() {
+        Entry *entryp;
+        uint32_t i;
+
+        for(i=0; i<_statep->_ops; i++) {
+            _seed = _seed * 1103515245 + 12345;
+            entryp = &_statep->_entries[(_seed >> 8) % _statep->_entries.size()];
+            entryp->_lock.take();
+            entryp->_counter++;
+            entryp->_lock.release();
+        }
+        return NULL;
+    }
+
+    CompactPerf(TestState *statep, uint32_t seed) {
+        _statep = statep;
+        _seed = seed;
+    }
+
+    /* returns ns per take/release pair */
+    static long long run(uint32_t lockCount, uint32_t threads, uint32_t ops) {
+        TestState state(lockCount, ops);
+        std::vector<CompactPerf *> testsp(threads);
+        long long startUs;
+        long long elapsedUs;
+        uint64_t total = 0;
+        uint32_t i;
+
+        for(i=0; i<lockCount; i++)
+            state._entries[i]._counter = 0;
+        startUs = osp_getUs();
+        for(i=0; i<threads; i++) {
+            testsp[i] = new CompactPerf(&state, i);
+            testsp[i]->setJoinable();
+            testsp[i]->queue();
+        }
+        for(i=0; i<threads; i++) {
+            testsp[i]->join(NULL);
+        }
+        elapsedUs = osp_getUs() - startUs;
+        for(i=0; i<lockCount; i++)
+            total += state._entries[i]._counter;
+        assert(total == (uint64_t) ops * threads);
+        return elapsedUs * 1000 / ((long long) ops * threads);
+    }
+};
+
+/* the barrier we'd otherwise build from a mutex and condition variable */
+class CondBarrier {
+    ThreadMutex _mutex;
+    ThreadCond _cv;
+    uint32_t _parties;
+    uint32_t _arrived;
+    uint32_t _phase;
+
+public:
+    CondBarrier(uint32_t parties) : _cv(&_mutex) {
+        _parties = parties;
+        _arrived = 0;
+        _phase = 0;
+    }
+
+    int arriveAndWait() {
+        uint32_t phase;
+
+        _mutex.take();
+        phase = _phase;
+        if (++_arrived == _parties) {
+            _arrived = 0;
+            _phase++;
+            _cv.broadcast();
+            _mutex.release();
+            return 1;
+        }
+        while(_phase == phase)
+            _cv.wait();
+        _mutex.release();
+        return 0;
+    }
+};
+
+/* threads run phases of a little work each, separated by a barrier of type B */
+template<class B> class BarrierPerf : public Thread {
+public:
+    class TestState {
+    public:
+        B _barrier;
+        uint32_t _parties;
+        uint32_t _phases;
+        std::atomic<uint32_t> _work;
+
+        TestState(uint32_t parties, uint32_t phases) : _barrier(parties) {
+            _parties = parties;
+            _phases = phases;
+            _work = 0;
+        }
+    };
+
+    TestState *_statep;
+
+    void *start() {
+        uint32_t i;
+
+        for(i=0; i<_statep->_phases; i++) {
+            _statep->_work.fetch_add(1, std::memory_order_relaxed);
+            _statep->_barrier.arriveAndWait();
+            /* everyone's done this phase's work */
+            assert(_statep->_work.load() >= (i+1) * _statep->_parties);
+        }
+        return NULL;
+    }
+
+    BarrierPerf(TestState *statep) {
+        _statep = statep;
+    }
+
+    /* returns us per phase */
+    static double run(uint32_t threads, uint32_t phases) {
+        TestState state(threads, phases);
+        std::vector<BarrierPerf *> testsp(threads);
+        long long startUs;
+        uint32_t i;
+
+        startUs = osp_getUs();
+        for(i=0; i<threads; i++) {
+            testsp[i] = new BarrierPerf(&state);
+            testsp[i]->setJoinable();
+            testsp[i]->queue();
+        }
+        for(i=0; i<threads; i++) {
+            testsp[i]->join(NULL);
+        }
+        assert(state._work.load() == threads * phases);
+        return (double) (osp_getUs() - startUs) / phases;
+    }
+};
+
+/* run the rwlock test threads on statep's lock, and check the results */
+template<class L> static void
+rwTestRun(typename RwTest<L>::TestState *statep, uint32_t threads, uint32_t spins)
+{
+    std::vector<RwTest<L> *> testsp(threads);
+    uint32_t i;
+
+    statep->setTotalSpins(spins * threads);
+    for(i=0; i<threads; i++) {
+        testsp[i] = new RwTest<L>(statep, spins);
+        testsp[i]->setJoinable();
+        testsp[i]->queue();
+    }
+    for(i=0; i<threads; i++) {
+        testsp[i]->join(NULL);
+    }
+    printf("SharedRaces=%d UpgradeRaces=%d\n", statep->_sharedRaces, statep->_upgradeRaces);
+    printf("RwLock state counter=%ld\n", statep->_lock._trackerQueue.count());
+}
+
 int
 main(int argc, char **argv)
 {
     uint32_t i;
     MutexTest::TestState mutexState;
-    RwTest::TestState rwState;
+    RwTest<ThreadLockRw>::TestState rwState;
+    RwTest<ThreadLockRwBiased>::TestState biasedState;
     BasicTestState *basicTestStatep;
     uint32_t spins;
     uint32_t threads;
     static const uint32_t maxThreads = 512;
     Thread *childThreadsp[maxThreads];
     MonitorTest *monitorp;
+    uint32_t dispatchers;
     int rwTest = 0;
+    long long startUs;
+    long long elapsedUs;
 
     if (argc < 2) {
-        printf("usage: locktest {mutex,rwlock} <threads=8> <spins=1000>\n");
+        printf("usage: locktest {mutex,mutexperf,rwlock,seqlock,compact,barrier} <threads=8> <spins=1000> <dispatchers=2>\n");
         return -1;
     }
 
+    dispatchers = 2;
+    if (argc > 4)
+        dispatchers = atoi(argv[4]);
+
     /* start the dispatcher */
-    ThreadDispatcher::setup(/* # of pthreads */ 2);
+    ThreadDispatcher::setup(/* # of pthreads */ dispatchers);
     ThreadTimer::init();
 
     threads = 8;
@@ -251,8 +675,11 @@ main(int argc, char **argv)
 
     printf("Running %d test threads with %d spins\n", threads, spins);
 
-    if (strcmp(argv[1], "mutex") == 0) {
+    if (strcmp(argv[1], "mutex") == 0 || strcmp(argv[1], "mutexperf") == 0) {
         /* create all the threads */
+        mutexState._perf = (strcmp(argv[1], "mutexperf") == 0);
+        if (!mutexState._perf)
+            mutexState._lock.setName("locktest");
         basicTestStatep = &mutexState;
         for(i=0;i<threads;i++) {
             childThreadsp[i] = new MutexTest(&mutexState, spins);
@@ -260,11 +687,49 @@ main(int argc, char **argv)
     }
     else if (strcmp(argv[1], "rwlock") == 0) {
         rwTest = 1;
+        rwState._lock.setName("locktest");
         basicTestStatep = &rwState;
         for(i=0;i<threads;i++) {
-            childThreadsp[i] = new RwTest(&rwState, spins);
+            childThreadsp[i] = new RwTest<ThreadLockRw>(&rwState, spins);
         }
     }
+    else if (strcmp(argv[1], "seqlock") == 0) {
+        /* 1000 reads for each spin */
+        printf("Snapshot reads, %d dispatchers, ns per read: ThreadSeqValue %lld ThreadLockRw %lld ThreadLockRwBiased %lld ThreadRcu %lld\n",
+               dispatchers,
+               SeqPerf::run(SeqPerf::_modeSeq, threads, spins * 1000),
+               SeqPerf::run(SeqPerf::_modeRw, threads, spins * 1000),
+               SeqPerf::run(SeqPerf::_modeBiased, threads, spins * 1000),
+               SeqPerf::run(SeqPerf::_modeRcu, threads, spins * 1000));
+        printf("RCU grace periods %lld, callbacks run %lld\n",
+               (long long) ThreadRcu::getGracePeriods(), (long long) ThreadRcu::getReclaimed());
+        printf("All tests done\n");
+        return 0;
+    }
+    else if (strcmp(argv[1], "barrier") == 0) {
+        /* a phase for each spin */
+        printf("%d threads, %d dispatchers, us per phase: ThreadBarrier %.2f mutex and CV %.2f\n",
+               threads, dispatchers,
+               BarrierPerf<ThreadBarrier>::run(threads, spins),
+               BarrierPerf<CondBarrier>::run(threads, spins));
+        printf("All tests done\n");
+        return 0;
+    }
+    else if (strcmp(argv[1], "compact") == 0) {
+        /* 1000 takes for each spin */
+        printf("Lock sizes: ThreadMutex %d ThreadCompactMutex %d\n",
+               (int) sizeof(ThreadMutex), (int) sizeof(ThreadCompactMutex));
+        printf("1 lock, %d dispatchers, ns per take: ThreadMutex %lld ThreadCompactMutex %lld\n",
+               dispatchers,
+               CompactPerf<ThreadMutex>::run(1, threads, spins * 1000),
+               CompactPerf<ThreadCompactMutex>::run(1, threads, spins * 1000));
+        printf("65536 locks, %d dispatchers, ns per take: ThreadMutex %lld ThreadCompactMutex %lld\n",
+               dispatchers,
+               CompactPerf<ThreadMutex>::run(65536, threads, spins * 1000),
+               CompactPerf<ThreadCompactMutex>::run(65536, threads, spins * 1000));
+        printf("All tests done\n");
+        return 0;
+    }
     else {
         printf("unknown test '%s'\n", argv[1]);
         return -1;
@@ -272,6 +737,7 @@ main(int argc, char **argv)
 
     basicTestStatep->setTotalSpins(spins * threads);
 
+    startUs = osp_getUs();
     for(i=0; i<threads; i++) {
         childThreadsp[i]->setJoinable();
         childThreadsp[i]->queue();
@@ -284,11 +750,39 @@ main(int argc, char **argv)
     for(i=0; i<threads; i++) {
         childThreadsp[i]->join(NULL);
     }
+    elapsedUs = osp_getUs() - startUs;
 
     if (rwTest) {
         printf("SharedRaces=%d UpgradeRaces=%d\n", rwState._sharedRaces, rwState._upgradeRaces);
         printf("RwLock state counter=%ld\n", rwState._lock._trackerQueue.count());
+
+        printf("Running the same test on a ThreadLockRwBiased\n");
+        rwTestRun<ThreadLockRwBiased>(&biasedState, threads, spins);
+
+        /* 100 short operations for each spin of the tests above */
+        printf("Read-mostly timings, %d dispatchers, ns per operation:\n", dispatchers);
+        for(i=0; i<2; i++) {
+            uint32_t writePct = (i == 0? 1 : 10);
+
+            printf("%2d%% writes: ThreadLockRw %lld ThreadLockRwBiased %lld\n", writePct,
+                   RwPerf<ThreadLockRw>::run(threads, spins * 100, writePct),
+                   RwPerf<ThreadLockRwBiased>::run(threads, spins * 100, writePct));
+        }
     }
+    else {
+        printf("Mutex contended=%lld spinAcquires=%lld parks=%lld spinTicks=%d\n",
+               (long long) mutexState._lock.getContended(),
+               (long long) mutexState._lock.getSpinAcquires(),
+               (long long) mutexState._lock.getParks(),
+               mutexState._lock.getSpinTicks());
+        if (mutexState._perf) {
+            assert(mutexState._exclCounter == spins * threads);
+            printf("%d dispatchers: %lld ns per take/release\n",
+                   dispatchers, elapsedUs * 1000 / ((long long) spins * threads));
+        }
+    }
+
+    ThreadLockProfiler::report();
 
     printf("All tests done\n");
 
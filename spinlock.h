@@ -1,7 +1,23 @@
 #ifndef __SPINLOCK_H_ENV__
 #define __SPINLOCK_H_ENV__ 1
 
-/* a simple spin lock, available to external callers */
+/* tell the CPU we're spinning, which saves power and gets a sibling
+ * hyperthread more of the core.
+ */
+static __inline void
+spinLockPause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__ ("yield");
+#endif
+}
+
+/* a simple spin lock, available to external callers.  Waiters spin
+ * reading the lock word, and only retry the CAS once it looks free, so
+ * that they don't keep stealing the cache line from the holder.
+ */
 class SpinLock {
  public:
     std::atomic<int> _owningPid;
@@ -13,20 +29,15 @@ class SpinLock {
     /* grab the lock */
     void take() {
         int exchangeValue;
-        int newValue;
 
         while(1) {
             exchangeValue = 0;
-            newValue = 1;
-            if (_owningPid.compare_exchange_strong(exchangeValue, 
-                                                   newValue,
-                                                   std::memory_order_acquire)) {
+            if (_owningPid.compare_exchange_weak(exchangeValue, 1, std::memory_order_acquire)) {
                 /* success */
                 break;
             }
-            else {
-                continue;
-            }
+            while(_owningPid.load(std::memory_order_relaxed) != 0)
+                spinLockPause();
         }
     }
 
@@ -49,16 +60,269 @@ class SpinLock {
     }
 };
 
+/* Alternative spin locks with the same take, tryLock and release
+ * interface as SpinLock, for locks that see heavy contention.  Each
+ * counts acquisitions, and how many of them had to wait; the counters
+ * are updated while holding the lock, so they cost no extra atomics.
+ * spintest compares their throughput as the number of contending
+ * pthreads grows.
+ *
+ * SpinLockBackoff is test-and-test-and-set with exponential backoff:
+ * cheap when uncontended, and backing off keeps waiters from all
+ * retrying the moment the lock is released.  It isn't fair.
+ *
+ * SpinLockTicket hands the lock out in FIFO order.  Waiters spin on a
+ * single shared word, so each release still invalidates every waiter's
+ * cache, but nobody starves.
+ *
+ * SpinLockMcs is a queue lock: each waiter spins on a flag in its own
+ * queue node, on its own stack, and the releasing thread hands the
+ * lock to the next node directly, so a release touches just one
+ * waiter's cache line.  To keep SpinLock's interface, the holder's
+ * queue links live in the lock itself (the K42 variant of MCS).
+ */
+class SpinLockStats {
+ public:
+    uint64_t _acquires;
+    uint64_t _contended;
+
+    SpinLockStats() {
+        _acquires = 0;
+        _contended = 0;
+    }
+
+    /* called with the lock held */
+    void acquired(int waited) {
+        _acquires++;
+        if (waited)
+            _contended++;
+    }
+
+    uint64_t getAcquires() {
+        return _acquires;
+    }
+
+    uint64_t getContended() {
+        return _contended;
+    }
+};
+
+class SpinLockBackoff : public SpinLockStats {
+    std::atomic<int> _locked;
+
+ public:
+    /* pauses between retries start at _minBackoff and double up to _maxBackoff */
+    static const uint32_t _minBackoff = 4;
+    static const uint32_t _maxBackoff = 1024;
+
+    SpinLockBackoff() {
+        _locked = 0;
+    }
+
+    void take() {
+        uint32_t backoff = _minBackoff;
+        uint32_t i;
+        int waited = 0;
+
+        while(1) {
+            if (_locked.load(std::memory_order_relaxed) == 0 &&
+                _locked.exchange(1, std::memory_order_acquire) == 0)
+                break;
+            waited = 1;
+            for(i=0;i<backoff;i++)
+                spinLockPause();
+            if (backoff < _maxBackoff)
+                backoff <<= 1;
+        }
+        acquired(waited);
+    }
+
+    int tryLock() {
+        if (_locked.load(std::memory_order_relaxed) != 0 ||
+            _locked.exchange(1, std::memory_order_acquire) != 0)
+            return 0;
+        acquired(0);
+        return 1;
+    }
+
+    void release() {
+        _locked.store(0, std::memory_order_release);
+    }
+};
+
+class SpinLockTicket : public SpinLockStats {
+    std::atomic<uint32_t> _next;
+    std::atomic<uint32_t> _serving;
+
+ public:
+    SpinLockTicket() {
+        _next = 0;
+        _serving = 0;
+    }
+
+    void take() {
+        uint32_t ticket;
+        uint32_t serving;
+        uint32_t i;
+        int waited = 0;
+
+        ticket = _next.fetch_add(1, std::memory_order_relaxed);
+        while((serving = _serving.load(std::memory_order_acquire)) != ticket) {
+            /* back off in proportion to our place in line */
+            waited = 1;
+            for(i = (ticket - serving) * 16; i > 0; i--)
+                spinLockPause();
+        }
+        acquired(waited);
+    }
+
+    int tryLock() {
+        uint32_t ticket;
+
+        ticket = _serving.load(std::memory_order_relaxed);
+        if (!_next.compare_exchange_strong(ticket, ticket+1, std::memory_order_acquire))
+            return 0;
+        acquired(0);
+        return 1;
+    }
+
+    void release() {
+        /* only the holder writes _serving */
+        _serving.store(_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+class SpinLockMcs : public SpinLockStats {
+    class Node {
+     public:
+        std::atomic<Node *> _nextp;
+        std::atomic<int> _waiting;
+    };
+
+    /* the last node in the queue, NULL when the lock is free, or
+     * &_holder when it's held and nobody's waiting.
+     */
+    std::atomic<Node *> _tailp;
+
+    /* stands in for the holder's node; _holder._nextp is the first waiter */
+    Node _holder;
+
+ public:
+    SpinLockMcs() {
+        _tailp = NULL;
+        _holder._nextp = NULL;
+        _holder._waiting = 0;
+    }
+
+    void take() {
+        Node node;
+        Node *predp;
+        Node *succp;
+        Node *expectedp;
+
+        while(1) {
+            predp = _tailp.load(std::memory_order_relaxed);
+            if (predp == NULL) {
+                if (_tailp.compare_exchange_weak(predp, &_holder, std::memory_order_acquire)) {
+                    acquired(0);
+                    return;
+                }
+                continue;
+            }
+
+            node._nextp.store(NULL, std::memory_order_relaxed);
+            node._waiting.store(1, std::memory_order_relaxed);
+            if (_tailp.compare_exchange_weak(predp, &node, std::memory_order_acq_rel))
+                break;
+        }
+
+        /* we're queued behind predp; link in and wait for a handoff */
+        predp->_nextp.store(&node, std::memory_order_release);
+        while(node._waiting.load(std::memory_order_acquire))
+            spinLockPause();
+
+        /* we hold the lock, so move our queue position into _holder */
+        succp = node._nextp.load(std::memory_order_acquire);
+        if (succp == NULL) {
+            _holder._nextp.store(NULL, std::memory_order_relaxed);
+            expectedp = &node;
+            if (!_tailp.compare_exchange_strong(expectedp, &_holder, std::memory_order_acq_rel)) {
+                /* someone's queueing behind us; wait for them to link in */
+                while((succp = node._nextp.load(std::memory_order_acquire)) == NULL)
+                    spinLockPause();
+                _holder._nextp.store(succp, std::memory_order_relaxed);
+            }
+        }
+        else {
+            _holder._nextp.store(succp, std::memory_order_relaxed);
+        }
+        acquired(1);
+    }
+
+    int tryLock() {
+        Node *predp = NULL;
+
+        if (!_tailp.compare_exchange_strong(predp, &_holder, std::memory_order_acquire))
+            return 0;
+        acquired(0);
+        return 1;
+    }
+
+    void release() {
+        Node *succp;
+        Node *expectedp;
+
+        succp = _holder._nextp.load(std::memory_order_acquire);
+        if (succp == NULL) {
+            expectedp = &_holder;
+            if (_tailp.compare_exchange_strong(expectedp, NULL, std::memory_order_release))
+                return;
+
+            /* a waiter has swung the tail, but not yet linked in */
+            while((succp = _holder._nextp.load(std::memory_order_acquire)) == NULL)
+                spinLockPause();
+        }
+        succp->_waiting.store(0, std::memory_order_release);
+    }
+};
+
+/* runs an initialization function once.  Callers that arrive while
+ * it's running wait for it to finish: lightweight threads park (see
+ * threadsync.h), rather than spinning for as long as the function
+ * takes, and plain pthreads yield the CPU while they poll.  Once it's
+ * done, call is a single load.
+ */
 class Once {
     typedef void (OnceProc) (void *handlep);
-    SpinLock _lock;
-    uint8_t _called;
+
+    static const uint8_t _idle = 0;
+    static const uint8_t _running = 1;
+    static const uint8_t _runningWaiters = 2;
+    static const uint8_t _done = 3;
+
+    std::atomic<uint8_t> _state;
+
+    int callSlow(OnceProc *procp, void *contextp);
+
+    void waitSlow();
+
  public:
     Once() {
-        _called = 0;
+        _state = _idle;
     }
 
-    int call(OnceProc *procp, void *contextp);
+    /* returns 1 if we called procp, and 0 if someone else did, in which
+     * case it has returned.
+     */
+    int call(OnceProc *procp, void *contextp) {
+        if (__builtin_expect(_state.load(std::memory_order_acquire) == _done, 1))
+            return 0;
+        return callSlow(procp, contextp);
+    }
+
+    int called() {
+        return _state.load(std::memory_order_acquire) == _done;
+    }
 };
 
 #endif /* SPINLOCK */
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <type_traits>
+
+#include "thread.h"
+#include "osp.h"
+
+/* compare the spin lock variants in spinlock.h: for each, run 1, 2, 4,
+ * ... pthreads hammering one lock for a while, and report the total
+ * lock throughput and how often a take had to wait.
+ */
+
+template<class L> class SpinTest {
+ public:
+    L _lock;
+    uint64_t _counter;
+    std::atomic<int> _stop;
+
+    SpinTest() {
+        _counter = 0;
+        _stop = 0;
+    }
+
+    static void *worker(void *contextp) {
+        SpinTest *testp = (SpinTest *) contextp;
+        uint64_t ops = 0;
+        volatile uint32_t work;
+        uint32_t i;
+
+        while(!testp->_stop.load(std::memory_order_relaxed)) {
+            testp->_lock.take();
+            testp->_counter++;
+            testp->_lock.release();
+            ops++;
+
+            /* a little work outside the lock, like a real caller */
+            for(i=0, work=0; i<20; i++)
+                work = work + i;
+        }
+        return (void *) ops;
+    }
+
+    /* returns ops per second */
+    double run(uint32_t threads, uint32_t ms) {
+        pthread_t ids[threads];
+        uint64_t ops = 0;
+        void *resultp;
+        long long startUs;
+        long long elapsedUs;
+        uint32_t i;
+
+        startUs = osp_getUs();
+        for(i=0;i<threads;i++)
+            pthread_create(&ids[i], NULL, worker, this);
+        usleep(ms * 1000);
+        _stop = 1;
+        for(i=0;i<threads;i++) {
+            pthread_join(ids[i], &resultp);
+            ops += (uint64_t) resultp;
+        }
+        elapsedUs = osp_getUs() - startUs;
+
+        osp_assert(ops == _counter);
+        return (double) ops * 1000000.0 / elapsedUs;
+    }
+};
+
+template<class L> static void
+runVariant(const char *namep, uint32_t maxThreads, uint32_t ms)
+{
+    SpinTest<L> *testp;
+    uint32_t threads;
+    double opsPerSec;
+
+    for(threads = 1; ; threads = (threads*2 > maxThreads && threads < maxThreads ? maxThreads : threads*2)) {
+        if (threads > maxThreads)
+            break;
+        testp = new SpinTest<L>();
+        opsPerSec = testp->run(threads, ms);
+        if constexpr (std::is_base_of<SpinLockStats, L>::value) {
+            printf("%-8s threads=%-3d %8.2f Mops/sec  contended=%5.1f%%\n",
+                   namep, threads, opsPerSec / 1000000.0,
+                   100.0 * testp->_lock.getContended() / testp->_lock.getAcquires());
+        }
+        else {
+            printf("%-8s threads=%-3d %8.2f Mops/sec\n",
+                   namep, threads, opsPerSec / 1000000.0);
+        }
+        delete testp;
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    uint32_t maxThreads;
+    uint32_t ms;
+
+    maxThreads = ThreadDispatcher::getCpuCount();
+    ms = 200;
+
+    if (argc > 1)
+        maxThreads = atoi(argv[1]);
+    if (argc > 2)
+        ms = atoi(argv[2]);
+
+    if (maxThreads < 1 || argc > 3) {
+        printf("usage: spintest <maxThreads=#cpus> <ms=200>\n");
+        return -1;
+    }
+
+    runVariant<SpinLock>("ttas", maxThreads, ms);
+    runVariant<SpinLockBackoff>("backoff", maxThreads, ms);
+    runVariant<SpinLockTicket>("ticket", maxThreads, ms);
+    runVariant<SpinLockMcs>("mcs", maxThreads, ms);
+
+    return 0;
+}
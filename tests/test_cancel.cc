@@ -0,0 +1,153 @@
+#include <gtest/gtest.h>
+
+#include "thread.h"
+#include "threadmutex.h"
+#include "threadcancel.h"
+#include "threadtimer.h"
+#include "threadpipe.h"
+#include "epoll.h"
+#include "osp.h"
+
+/* run fn on its own thread and wait for it */
+template<class F> static void
+runAndJoin(F &&fn)
+{
+    Thread *threadp;
+
+    threadp = Thread::spawn("CancelTest", fn, ThreadSpawnOptions().joinable());
+    threadp->join(NULL);
+    threadp->releaseThread();
+}
+
+TEST(ThreadCancel, AlreadyCanceled)
+{
+    ThreadMutex mutex;
+    ThreadCancel token;
+    int32_t code = 0;
+
+    token.cancel();
+
+    /* no waiting needed, so the take still works */
+    EXPECT_EQ(mutex.take(&token), 0);
+    runAndJoin([&]() { code = mutex.take(&token); });
+    EXPECT_EQ(code, ThreadCancel::TC_ERR_CANCELED);
+    mutex.release();
+}
+
+TEST(ThreadCancel, MutexDeadline)
+{
+    ThreadMutex mutex;
+    ThreadCancel token;
+    int32_t code = 0;
+
+    token.setDeadline(20);
+    mutex.take();
+    runAndJoin([&]() { code = mutex.take(&token); });
+    EXPECT_EQ(code, ThreadCancel::TC_ERR_CANCELED);
+    mutex.release();
+
+    /* the canceled waiter must have been removed from the wait queue */
+    EXPECT_TRUE(mutex.tryLock());
+    mutex.release();
+}
+
+TEST(ThreadCancel, CondCancel)
+{
+    ThreadMutex mutex;
+    ThreadCond cv(&mutex);
+    ThreadCancel token;
+    Thread *threadp;
+    int32_t code = 0;
+
+    threadp = Thread::spawn("CondWaiter", [&]() {
+            mutex.take();
+            code = cv.wait(&token);
+
+            /* asserts unless the wait reobtained the mutex */
+            mutex.release();
+        }, ThreadSpawnOptions().joinable());
+    ThreadTimer::sleep(20);
+    token.cancel();
+    threadp->join(NULL);
+    threadp->releaseThread();
+
+    EXPECT_EQ(code, ThreadCancel::TC_ERR_CANCELED);
+}
+
+TEST(ThreadCancel, PipeRead)
+{
+    ThreadPipe pipe;
+    ThreadCancel token;
+    char buffer[4];
+
+    token.setDeadline(20);
+    EXPECT_EQ(pipe.read(buffer, sizeof(buffer), &token), ThreadCancel::TC_ERR_CANCELED);
+}
+
+TEST(ThreadCancel, TimerSleep)
+{
+    ThreadCancel token;
+    long long startMs;
+
+    token.setDeadline(20);
+    startMs = osp_getMs();
+    EXPECT_EQ(ThreadTimer::sleep(10000, &token), ThreadCancel::TC_ERR_CANCELED);
+    EXPECT_LT(osp_getMs() - startMs, 5000);
+
+    /* an uncanceled sleep still completes normally */
+    ThreadCancel token2;
+    EXPECT_EQ(ThreadTimer::sleep(10, &token2), 0);
+}
+
+TEST(ThreadCancel, EpollWait)
+{
+    EpollSys *sysp;
+    EpollEvent *eventp;
+    ThreadCancel token;
+    int pipeFds[2];
+
+    ASSERT_EQ(pipe(pipeFds), 0);
+    sysp = new EpollSys("canceltest");
+    eventp = new EpollEvent(sysp, pipeFds[0], /* !isWrite */ 0);
+    token.setDeadline(20);
+    EXPECT_EQ(eventp->wait(EpollEvent::epollIn, &token), ThreadCancel::TC_ERR_CANCELED);
+    eventp->close();
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+}
+
+/* a new deadline replaces the old one, and a token canceled by
+ * another thread wakes a sleep early.
+ */
+TEST(ThreadCancel, DeadlineResetAndCancelSleep)
+{
+    ThreadCancel token;
+    ThreadCancel token2;
+    Thread *threadp;
+    long long startMs;
+
+    token.setDeadline(10000);
+    token.setDeadline(20);
+    startMs = osp_getMs();
+    EXPECT_EQ(ThreadTimer::sleep(10000, &token), ThreadCancel::TC_ERR_CANCELED);
+    EXPECT_LT(osp_getMs() - startMs, 5000);
+
+    threadp = Thread::spawn("Canceler", [&]() {
+            ThreadTimer::sleep(20);
+            token2.cancel();
+        }, ThreadSpawnOptions().joinable());
+    startMs = osp_getMs();
+    EXPECT_EQ(ThreadTimer::sleep(10000, &token2), ThreadCancel::TC_ERR_CANCELED);
+    EXPECT_LT(osp_getMs() - startMs, 5000);
+    threadp->join(NULL);
+    threadp->releaseThread();
+}
+
+TEST(ThreadCancel, DeleteWithDeadline)
+{
+    ThreadCancel *tokenp;
+
+    tokenp = new ThreadCancel();
+    tokenp->setDeadline(10000);
+    delete tokenp;
+}
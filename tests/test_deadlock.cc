@@ -0,0 +1,169 @@
+#include <gtest/gtest.h>
+
+#include "thread.h"
+#include "threadmutex.h"
+#include "threadtimer.h"
+
+/* wait for threadp to block on lockp; it may block on others, like the
+ * timer's, on the way.
+ */
+static void
+waitUntilBlocked(Thread *threadp, void *lockp)
+{
+    while(threadp->_blockingMutexp != lockp && (void *) threadp->_blockingRwp != lockp)
+        ThreadTimer::sleep(1);
+}
+
+static void
+joinAndRelease(Thread *threadp)
+{
+    threadp->join(NULL);
+    threadp->releaseThread();
+}
+
+/* two threads taking two mutexes in opposite orders; the timed takes
+ * break the deadlock once we've seen it.
+ */
+TEST(ThreadMutexDetect, MutexCycle)
+{
+    ThreadMutexDetect detect;
+    ThreadMutex mutexA;
+    ThreadMutex mutexB;
+    Thread *abp;
+    Thread *bap;
+    int started = 0;
+
+    mutexA.setName("A");
+    abp = Thread::spawn("AB", [&]() {
+            mutexA.take();
+            started++;
+            while(started < 2)
+                ThreadTimer::sleep(1);
+            if (mutexB.takeFor(2000) == 0)
+                mutexB.release();
+            mutexA.release();
+        }, ThreadSpawnOptions().joinable());
+    bap = Thread::spawn("BA", [&]() {
+            mutexB.take();
+            started++;
+            while(started < 2)
+                ThreadTimer::sleep(1);
+            if (mutexA.takeFor(2000) == 0)
+                mutexA.release();
+            mutexB.release();
+        }, ThreadSpawnOptions().joinable());
+    waitUntilBlocked(abp, &mutexB);
+    waitUntilBlocked(bap, &mutexA);
+
+    /* the first snapshot only finds a candidate */
+    EXPECT_EQ(detect.checkForDeadlocks(), 0);
+    ThreadTimer::sleep(10);
+    EXPECT_EQ(detect.checkForDeadlocks(), 1);
+
+    /* and it's only reported once */
+    EXPECT_EQ(detect.checkForDeadlocks(), 0);
+    EXPECT_EQ(detect.getDeadlocks(), 1);
+
+    joinAndRelease(abp);
+    joinAndRelease(bap);
+}
+
+/* a queued waiter learns its new owner when the mutex is handed to
+ * the thread queued ahead of it, which then deadlocks with it.
+ */
+TEST(ThreadMutexDetect, MutexCycleAfterHandoff)
+{
+    ThreadMutexDetect detect;
+    ThreadMutex mutexM;
+    ThreadMutex mutexN;
+    Thread *ap;
+    Thread *bp;
+
+    mutexM.take();
+    bp = Thread::spawn("B", [&]() {
+            mutexM.take();
+            if (mutexN.takeFor(2000) == 0)
+                mutexN.release();
+            mutexM.release();
+        }, ThreadSpawnOptions().joinable());
+    waitUntilBlocked(bp, &mutexM);
+    ap = Thread::spawn("A", [&]() {
+            mutexN.take();
+            if (mutexM.takeFor(2000) == 0)
+                mutexM.release();
+            mutexN.release();
+        }, ThreadSpawnOptions().joinable());
+    waitUntilBlocked(ap, &mutexM);
+
+    /* B gets the mutex, and then waits for A */
+    mutexM.release();
+    waitUntilBlocked(bp, &mutexN);
+
+    EXPECT_EQ(detect.checkForDeadlocks(), 0);
+    ThreadTimer::sleep(10);
+    EXPECT_EQ(detect.checkForDeadlocks(), 1);
+
+    joinAndRelease(ap);
+    joinAndRelease(bp);
+}
+
+/* a waiter whose owner is running isn't deadlocked */
+TEST(ThreadMutexDetect, NoCycle)
+{
+    ThreadMutexDetect detect;
+    ThreadMutex mutex;
+    Thread *threadp;
+
+    mutex.take();
+    threadp = Thread::spawn("Waiter", [&]() {
+            mutex.take();
+            mutex.release();
+        }, ThreadSpawnOptions().joinable());
+    waitUntilBlocked(threadp, &mutex);
+    EXPECT_EQ(detect.checkForDeadlocks(), 0);
+    ThreadTimer::sleep(10);
+    EXPECT_EQ(detect.checkForDeadlocks(), 0);
+    mutex.release();
+    joinAndRelease(threadp);
+}
+
+/* a writer waits for a tracked reader, which waits for a mutex the writer holds */
+TEST(ThreadMutexDetect, RwLockCycle)
+{
+    ThreadMutexDetect detect;
+    ThreadMutex mutex;
+    ThreadLockRw lock;
+    Thread *readerp;
+    Thread *writerp;
+    int started = 0;
+
+    readerp = Thread::spawn("Reader", [&]() {
+            ThreadLockTracker tracker;
+
+            lock.lockRead(&tracker);
+            started++;
+            while(started < 2)
+                ThreadTimer::sleep(1);
+            if (mutex.takeFor(2000) == 0)
+                mutex.release();
+            lock.releaseRead(&tracker);
+        }, ThreadSpawnOptions().joinable());
+    writerp = Thread::spawn("Writer", [&]() {
+            mutex.take();
+            started++;
+            while(started < 2)
+                ThreadTimer::sleep(1);
+            if (lock.lockWriteFor(2000) == 0)
+                lock.releaseWrite();
+            mutex.release();
+        }, ThreadSpawnOptions().joinable());
+    waitUntilBlocked(readerp, &mutex);
+    waitUntilBlocked(writerp, &lock);
+
+    EXPECT_EQ(detect.checkForDeadlocks(), 0);
+    ThreadTimer::sleep(10);
+    EXPECT_EQ(detect.checkForDeadlocks(), 1);
+
+    joinAndRelease(readerp);
+    joinAndRelease(writerp);
+}
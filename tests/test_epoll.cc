@@ -0,0 +1,78 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include "thread.h"
+#include "epoll.h"
+
+/* spawn count joinable threads running fn(i), and join them all */
+template<class F> static void
+runThreads(uint32_t count, F &&fn)
+{
+    std::vector<Thread *> threads(count);
+    uint32_t i;
+
+    for(i=0;i<count;i++)
+        threads[i] = Thread::spawn("EpollTest", [&fn, i]() { fn(i); }, ThreadSpawnOptions().joinable());
+    for(i=0;i<count;i++) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+    }
+}
+
+TEST(EpollSys, Shards)
+{
+    EpollSys *sysp;
+    uint32_t i;
+
+    sysp = new EpollSys("shardtest", 3);
+    EXPECT_EQ(sysp->getShardCount(), 3u);
+
+    /* both sides of an fd share a shard index, and fds spread out */
+    for(i=0;i<3;i++) {
+        EXPECT_NE(sysp->getOne(i, 0), sysp->getOne(i, 1));
+        EXPECT_EQ(sysp->getOne(i, 0), sysp->getOne(i + 3, 0));
+        EXPECT_NE(sysp->getOne(i, 0), sysp->getOne(i + 1, 0));
+    }
+
+    /* the default is one shard per dispatcher */
+    sysp = new EpollSys("defaulttest");
+    EXPECT_EQ(sysp->getShardCount(), (uint32_t) ThreadDispatcher::getDispatcherCount());
+}
+
+/* readers on pipes spread over all of the shards each see their data */
+TEST(EpollSys, ManyPipes)
+{
+    static const uint32_t pipeCount = 16;
+    EpollSys *sysp;
+    int pipeFds[pipeCount][2];
+    uint32_t i;
+
+    sysp = new EpollSys("pipetest", 4);
+    for(i=0;i<pipeCount;i++)
+        ASSERT_EQ(pipe(pipeFds[i]), 0);
+
+    runThreads(2 * pipeCount, [&](uint32_t ix) {
+            uint32_t pipeIx = ix / 2;
+            EpollEvent *eventp;
+            char tc;
+
+            if (ix & 1) {
+                eventp = new EpollEvent(sysp, pipeFds[pipeIx][1], /* isWrite */ 1);
+                EXPECT_EQ(eventp->wait(EpollEvent::epollOut), 0);
+                tc = 'a' + pipeIx;
+                EXPECT_EQ(write(pipeFds[pipeIx][1], &tc, 1), 1);
+            }
+            else {
+                eventp = new EpollEvent(sysp, pipeFds[pipeIx][0], /* !isWrite */ 0);
+                EXPECT_EQ(eventp->wait(EpollEvent::epollIn), 0);
+                EXPECT_EQ(read(pipeFds[pipeIx][0], &tc, 1), 1);
+                EXPECT_EQ(tc, (char) ('a' + pipeIx));
+            }
+            eventp->close();
+        });
+
+    for(i=0;i<pipeCount;i++) {
+        close(pipeFds[i][0]);
+        close(pipeFds[i][1]);
+    }
+}
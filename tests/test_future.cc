@@ -0,0 +1,97 @@
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+
+#include "threadfuture.h"
+#include "threadtimer.h"
+
+TEST(ThreadFuture, Async)
+{
+    ThreadFuture<int> future;
+
+    future = lwtAsync([]() { return 41 + 1; });
+    EXPECT_EQ(future.get(), 42);
+
+    /* get can be repeated, and copies share the result */
+    ThreadFuture<int> copy = future;
+    EXPECT_TRUE(copy.isReady());
+    EXPECT_EQ(copy.get(), 42);
+}
+
+TEST(ThreadFuture, PromiseWakesWaiter)
+{
+    ThreadPromise<std::string> promise;
+    ThreadFuture<std::string> future = promise.getFuture();
+
+    Thread::spawn("Setter", [&promise]() {
+            ThreadTimer::sleep(10);
+            promise.setValue(std::string("done"));
+        });
+    EXPECT_EQ(future.get(), "done");
+}
+
+TEST(ThreadFuture, Exception)
+{
+    ThreadFuture<int> future;
+    ThreadFuture<void> broken;
+
+    future = lwtAsync([]() -> int { throw std::runtime_error("failed"); });
+    EXPECT_THROW(future.get(), std::runtime_error);
+
+    {
+        ThreadPromise<void> promise;
+        broken = promise.getFuture();
+    }
+    EXPECT_THROW(broken.get(), std::future_error);
+}
+
+TEST(ThreadFuture, Then)
+{
+    ThreadPromise<int> promise;
+    ThreadFuture<int> future = promise.getFuture();
+    ThreadFuture<long> doubled;
+    ThreadFuture<void> printed;
+    long result = 0;
+
+    doubled = future.then([](ThreadFuture<int> &f) { return 2L * f.get(); });
+    printed = doubled.then([&result](ThreadFuture<long> &f) { result = f.get(); });
+    promise.setValue(21);
+    printed.get();
+    EXPECT_EQ(result, 42);
+
+    /* continuations added after the fact still run */
+    EXPECT_EQ(future.then([](ThreadFuture<int> &f) { return f.get() + 1; }).get(), 22);
+}
+
+TEST(ThreadFuture, WhenAll)
+{
+    std::vector<ThreadFuture<int>> futures;
+    int total = 0;
+
+    for(int i=1;i<=10;i++) {
+        futures.push_back(lwtAsync([i]() {
+                    ThreadTimer::sleep(i);
+                    return i;
+                }));
+    }
+    ThreadFuture<int>::whenAll(futures).get();
+    for(auto &future : futures) {
+        EXPECT_TRUE(future.isReady());
+        total += future.get();
+    }
+    EXPECT_EQ(total, 55);
+
+    std::vector<ThreadFuture<int>> none;
+    EXPECT_TRUE(ThreadFuture<int>::whenAll(none).isReady());
+}
+
+TEST(ThreadFuture, WhenAny)
+{
+    std::vector<ThreadFuture<void>> futures;
+    ThreadPromise<void> slow;
+
+    futures.push_back(slow.getFuture());
+    futures.push_back(lwtAsync([]() { ThreadTimer::sleep(5); }));
+    EXPECT_EQ(ThreadFuture<void>::whenAny(futures).get(), 1u);
+    slow.setValue();
+}
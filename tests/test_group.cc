@@ -0,0 +1,58 @@
+#include <gtest/gtest.h>
+
+#include "thread.h"
+#include "threadtimer.h"
+
+/* sum of [lo, hi), split in half down to single elements */
+static long
+treeSum(long lo, long hi)
+{
+    ThreadGroup group;
+    long mid;
+    long left;
+    long right;
+
+    if (hi - lo == 1)
+        return lo;
+
+    mid = lo + (hi - lo) / 2;
+    group.spawn([&left, lo, mid]() { left = treeSum(lo, mid); });
+    right = treeSum(mid, hi);
+    group.sync();
+    return left + right;
+}
+
+TEST(ThreadGroup, Recursion)
+{
+    EXPECT_EQ(treeSum(0, 100000), 100000L * 99999 / 2);
+}
+
+TEST(ThreadGroup, BlockingChildren)
+{
+    ThreadGroup group;
+    std::atomic<long> done(0);
+
+    /* children that sleep, whether inline or promoted from tasks */
+    for(long i=0;i<8;i++) {
+        group.spawn([&done]() {
+                ThreadTimer::sleep(2);
+                done++;
+            });
+    }
+    group.sync();
+    EXPECT_EQ(done.load(), 8);
+    EXPECT_EQ(group.getInlined() + group.getQueued(), 8u);
+
+    /* the group can be reused */
+    group.spawn([&done]() { done++; });
+    group.sync();
+    EXPECT_EQ(done.load(), 9);
+}
+
+TEST(ThreadGroup, Empty)
+{
+    ThreadGroup group;
+
+    group.sync();
+    group.sync();
+}
@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+
+#include "thread.h"
+#include "threadtimer.h"
+
+/* a joinable thread that sleeps for ms and then returns value */
+static Thread *
+sleeper(uint32_t ms, long value)
+{
+    return Thread::spawn("JoinSetTest", [ms, value]() {
+            ThreadTimer::sleep(ms);
+            return (void *) value;
+        }, ThreadSpawnOptions().joinable());
+}
+
+TEST(ThreadJoinSet, ExitOrder)
+{
+    ThreadJoinSet set;
+    Thread *threadp;
+    void *valuep;
+
+    set.add(sleeper(60, 3));
+    set.add(sleeper(10, 1));
+    set.add(sleeper(30, 2));
+    EXPECT_EQ(set.count(), 3u);
+
+    /* threads come back in the order they finished */
+    for(long i=1;i<=3;i++) {
+        threadp = set.waitAny(&valuep);
+        ASSERT_NE(threadp, nullptr);
+        EXPECT_EQ((long) valuep, i);
+        threadp->releaseThread();
+    }
+    EXPECT_EQ(set.count(), 0u);
+    EXPECT_EQ(set.waitAny(), nullptr);
+}
+
+TEST(ThreadJoinSet, WaitAll)
+{
+    ThreadJoinSet set;
+    Thread *threadp;
+    void *valuep;
+    long total = 0;
+
+    for(long i=1;i<=8;i++)
+        set.add(sleeper(i*3, i));
+    set.waitAll();
+    EXPECT_EQ(set.count(), 8u);
+
+    while((threadp = set.waitAny(&valuep)) != NULL) {
+        total += (long) valuep;
+        threadp->releaseThread();
+    }
+    EXPECT_EQ(total, 36);
+}
+
+TEST(ThreadJoinSet, AlreadyExited)
+{
+    ThreadJoinSet set;
+    Thread *threadp;
+    Thread *donep;
+    void *valuep;
+
+    threadp = sleeper(0, 7);
+
+    /* let it exit and park on the global join list before adding it */
+    ThreadTimer::sleep(20);
+    set.add(threadp);
+    donep = set.waitAny(&valuep);
+    EXPECT_EQ(donep, threadp);
+    EXPECT_EQ((long) valuep, 7);
+    donep->releaseThread();
+}
+
+TEST(ThreadJoinSet, Empty)
+{
+    ThreadJoinSet set;
+
+    set.waitAll();
+    EXPECT_EQ(set.waitAny(), nullptr);
+}
@@ -0,0 +1,180 @@
+#include <gtest/gtest.h>
+
+#include "thread.h"
+#include "threadmutex.h"
+#include "threadlockprofile.h"
+#include "threadtimer.h"
+
+static std::string
+reportString()
+{
+    char *bufferp = NULL;
+    size_t size = 0;
+    FILE *filep;
+    std::string result;
+
+    filep = open_memstream(&bufferp, &size);
+    ThreadLockProfiler::report(filep, 100);
+    fclose(filep);
+    result = bufferp;
+    free(bufferp);
+    return result;
+}
+
+TEST(ThreadLockProfile, Unprofiled)
+{
+    ThreadMutex mutex;
+
+    EXPECT_EQ(mutex._profilep, (ThreadLockProfile *) NULL);
+    mutex.take();
+    mutex.release();
+}
+
+TEST(ThreadLockProfile, MutexWaitAndHold)
+{
+    ThreadMutex mutex;
+    Thread *threadp;
+    std::string report;
+
+    mutex.setName("testMutex");
+    ASSERT_NE(mutex._profilep, (ThreadLockProfile *) NULL);
+
+    mutex.take();
+    threadp = Thread::spawn("ProfileWaiter", [&]() {
+            mutex.take();
+            mutex.release();
+        }, ThreadSpawnOptions().joinable());
+    ThreadTimer::sleep(20);
+    mutex.release();
+    threadp->join(NULL);
+    threadp->releaseThread();
+
+    EXPECT_EQ(mutex._profilep->_acquires, 2);
+    EXPECT_EQ(mutex._profilep->_contended, 1);
+    EXPECT_EQ(mutex._profilep->_holds, 2);
+    EXPECT_GT(mutex._profilep->_waitTicks, 0);
+    EXPECT_GE(mutex._profilep->_maxHoldTicks, mutex._profilep->_maxWaitTicks);
+
+    report = reportString();
+    EXPECT_NE(report.find("mutex testMutex acquires=2 contended=1"), std::string::npos);
+    EXPECT_NE(report.find("site 1 waits"), std::string::npos);
+}
+
+/* a lock named while held doesn't record that hold, whose start it missed */
+TEST(ThreadLockProfile, NamedWhileHeld)
+{
+    ThreadMutex mutex;
+
+    mutex.take();
+    mutex.setName("testNamedHeld");
+    mutex.release();
+    EXPECT_EQ(mutex._profilep->_holds, 0);
+    EXPECT_EQ(mutex._profilep->_maxHoldTicks, 0);
+
+    mutex.take();
+    mutex.release();
+    EXPECT_EQ(mutex._profilep->_holds, 1);
+}
+
+static ThreadMutex *siteMutexp;
+
+static __attribute__((noinline)) void
+takeAtSiteA()
+{
+    siteMutexp->take();
+    siteMutexp->release();
+}
+
+static __attribute__((noinline)) void
+takeAtSiteB()
+{
+    siteMutexp->take();
+    siteMutexp->release();
+}
+
+/* contended takes from two places are recorded as two call sites */
+TEST(ThreadLockProfile, CallSites)
+{
+    ThreadMutex mutex;
+    Thread *threadA;
+    Thread *threadB;
+    ThreadLockProfile::Site *sitesp;
+    std::string report;
+    size_t pos;
+    uint32_t siteLines = 0;
+
+    mutex.setName("testSites");
+    siteMutexp = &mutex;
+
+    mutex.take();
+    threadA = Thread::spawn("SiteA", []() { takeAtSiteA(); }, ThreadSpawnOptions().joinable());
+    threadB = Thread::spawn("SiteB", []() { takeAtSiteB(); }, ThreadSpawnOptions().joinable());
+    ThreadTimer::sleep(20);
+    mutex.release();
+    threadA->join(NULL);
+    threadA->releaseThread();
+    threadB->join(NULL);
+    threadB->releaseThread();
+
+    EXPECT_EQ(mutex._profilep->_contended, 2);
+    sitesp = mutex._profilep->_sites;
+    EXPECT_NE(sitesp[0]._pcp, (void *) NULL);
+    EXPECT_NE(sitesp[1]._pcp, (void *) NULL);
+    EXPECT_NE(sitesp[0]._pcp, sitesp[1]._pcp);
+    EXPECT_EQ(sitesp[0]._count, 1);
+    EXPECT_EQ(sitesp[1]._count, 1);
+
+    report = reportString();
+    for(pos = report.find("site 1 waits"); pos != std::string::npos; pos = report.find("site 1 waits", pos + 1))
+        siteLines++;
+    EXPECT_EQ(siteLines, 2u);
+}
+
+TEST(ThreadLockProfile, RwLockAndRanking)
+{
+    ThreadLockRw rwlock;
+    ThreadMutex quiet;
+    Thread *threadp;
+    std::string report;
+
+    rwlock.setName("testRw");
+    quiet.setName("testQuiet");
+
+    rwlock.lockWrite();
+    threadp = Thread::spawn("ProfileReader", [&]() {
+            rwlock.lockRead();
+            rwlock.releaseRead();
+        }, ThreadSpawnOptions().joinable());
+    ThreadTimer::sleep(20);
+    rwlock.releaseWrite();
+    threadp->join(NULL);
+    threadp->releaseThread();
+
+    quiet.take();
+    quiet.release();
+
+    EXPECT_EQ(rwlock._profilep->_acquires, 2);
+    EXPECT_EQ(rwlock._profilep->_contended, 1);
+    EXPECT_EQ(rwlock._profilep->_holds, 1);
+
+    /* the contended lock ranks ahead of the quiet one */
+    report = reportString();
+    EXPECT_NE(report.find("rwlock testRw"), std::string::npos);
+    EXPECT_LT(report.find("testRw"), report.find("testQuiet"));
+}
+
+TEST(ThreadLockProfile, ProfileAll)
+{
+    ThreadLockProfiler::profileAll(1);
+    ThreadMutex *mutexp = new ThreadMutex();
+    ThreadLockProfiler::profileAll(0);
+    ThreadMutex unprofiled;
+
+    ASSERT_NE(mutexp->_profilep, (ThreadLockProfile *) NULL);
+    EXPECT_EQ(unprofiled._profilep, (ThreadLockProfile *) NULL);
+    EXPECT_NE(reportString().find("mutex 0x"), std::string::npos);
+
+    /* and destroying the lock drops its profile */
+    delete mutexp;
+    EXPECT_EQ(reportString().find("mutex 0x"), std::string::npos);
+}
@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include "thread.h"
+#include "threadtimer.h"
 
 class TestRunner : public Thread {
 public:
@@ -24,6 +25,7 @@ int main(int argc, char **argv)
     // Run all the tests in an lwt thread as well as "normal" pthread 
     // to ensure that the exception handling and stack tracing are tested with lwt threads
     ThreadDispatcher::setup(1, 1000);
+    ThreadTimer::init();
 
     auto test = new TestRunner();
     test->setJoinable();
@@ -0,0 +1,369 @@
+#include <gtest/gtest.h>
+#include <type_traits>
+
+#include "thread.h"
+#include "threadmutex.h"
+#include "threadtimer.h"
+
+/* every contended take either spins its way to the mutex or parks */
+TEST(ThreadMutex, ContendedStats)
+{
+    static const uint32_t threadCount = 8;
+    static const uint32_t loops = 20000;
+    ThreadMutex mutex;
+    Thread *threads[threadCount];
+    uint64_t counter = 0;
+    uint32_t i;
+
+    for(i=0;i<threadCount;i++) {
+        threads[i] = Thread::spawn("MutexTest", [&]() {
+                uint32_t j;
+
+                for(j=0;j<loops;j++) {
+                    mutex.take();
+                    counter++;
+                    mutex.release();
+                }
+            }, ThreadSpawnOptions().joinable());
+    }
+    for(i=0;i<threadCount;i++) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+    }
+
+    EXPECT_EQ(counter, (uint64_t) threadCount * loops);
+    EXPECT_EQ(mutex.getContended(), mutex.getSpinAcquires() + mutex.getParks());
+    EXPECT_GE(mutex.getSpinTicks(), (uint32_t) ThreadMutex::_minSpinTicks);
+}
+
+/* an owner that's asleep isn't worth spinning for */
+TEST(ThreadMutex, SleepingOwnerParks)
+{
+    ThreadMutex mutex;
+    Thread *threadp;
+
+    mutex.take();
+    threadp = Thread::spawn("MutexWaiter", [&]() {
+            mutex.take();
+            mutex.release();
+        }, ThreadSpawnOptions().joinable());
+    ThreadTimer::sleep(20);
+    mutex.release();
+    threadp->join(NULL);
+    threadp->releaseThread();
+
+    EXPECT_EQ(mutex.getContended(), 1);
+    EXPECT_EQ(mutex.getParks(), 1);
+    EXPECT_EQ(mutex.getSpinAcquires(), 0);
+}
+
+TEST(ThreadMutex, SpinningDisabled)
+{
+    static const uint32_t threadCount = 4;
+    ThreadMutex mutex;
+    Thread *threads[threadCount];
+    uint32_t i;
+
+    ThreadMutex::setMaxSpinTicks(0);
+    for(i=0;i<threadCount;i++) {
+        threads[i] = Thread::spawn("MutexTest", [&]() {
+                uint32_t j;
+
+                for(j=0;j<5000;j++) {
+                    mutex.take();
+                    mutex.release();
+                }
+            }, ThreadSpawnOptions().joinable());
+    }
+    for(i=0;i<threadCount;i++) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+    }
+    ThreadMutex::setMaxSpinTicks(50000);
+
+    EXPECT_EQ(mutex.getSpinAcquires(), 0);
+    EXPECT_EQ(mutex.getContended(), mutex.getParks());
+}
+
+/* a broadcast made holding the mutex moves the waiters to the mutex's
+ * queue, and they still all get through.
+ */
+TEST(ThreadCond, BroadcastMorphs)
+{
+    static const uint32_t threadCount = 6;
+    ThreadMutex mutex;
+    ThreadCond cv(&mutex);
+    Thread *threads[threadCount];
+    uint32_t waiting = 0;
+    uint32_t woken = 0;
+    int go = 0;
+    uint32_t i;
+
+    for(i=0;i<threadCount;i++) {
+        threads[i] = Thread::spawn("CondWaiter", [&]() {
+                mutex.take();
+                waiting++;
+                while(!go)
+                    cv.wait();
+                woken++;
+                mutex.release();
+            }, ThreadSpawnOptions().joinable());
+    }
+    while(1) {
+        mutex.take();
+        if (waiting == threadCount)
+            break;
+        mutex.release();
+        ThreadTimer::sleep(1);
+    }
+    go = 1;
+    cv.broadcast();
+    mutex.release();
+
+    for(i=0;i<threadCount;i++) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+    }
+    EXPECT_EQ(woken, threadCount);
+    EXPECT_EQ(cv.getMorphed(), threadCount);
+}
+
+/* waiters moved onto a mutex queue that already has a thread waiting
+ * for the mutex are all still woken, even once another thread queues
+ * behind them.
+ */
+TEST(ThreadCond, BroadcastMorphsBehindWaiter)
+{
+    static const uint32_t threadCount = 4;
+    ThreadMutex mutex;
+    ThreadCond cv(&mutex);
+    Thread *threads[threadCount];
+    Thread *takers[2];
+    uint32_t waiting = 0;
+    uint32_t woken = 0;
+    uint32_t taken = 0;
+    int go = 0;
+    uint32_t i;
+
+    for(i=0;i<threadCount;i++) {
+        threads[i] = Thread::spawn("CondWaiter", [&]() {
+                mutex.take();
+                waiting++;
+                while(!go)
+                    cv.wait();
+                woken++;
+                mutex.release();
+            }, ThreadSpawnOptions().joinable());
+    }
+    while(1) {
+        mutex.take();
+        if (waiting == threadCount)
+            break;
+        mutex.release();
+        ThreadTimer::sleep(1);
+    }
+
+    /* we're sleeping, so the takers park rather than spinning */
+    for(i=0;i<2;i++) {
+        if (i == 1) {
+            go = 1;
+            cv.broadcast();
+        }
+        takers[i] = Thread::spawn("Taker", [&]() {
+                mutex.take();
+                taken++;
+                mutex.release();
+            }, ThreadSpawnOptions().joinable());
+        ThreadTimer::sleep(20);
+    }
+    mutex.release();
+
+    for(i=0;i<2;i++) {
+        takers[i]->join(NULL);
+        takers[i]->releaseThread();
+    }
+    for(i=0;i<threadCount;i++) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+    }
+    EXPECT_EQ(taken, 2u);
+    EXPECT_EQ(woken, threadCount);
+}
+
+/* without the mutex held, signal wakes the waiter directly */
+TEST(ThreadCond, SignalUnlocked)
+{
+    ThreadMutex mutex;
+    ThreadCond cv(&mutex);
+    Thread *threadp;
+    int waiting = 0;
+    int go = 0;
+
+    /* no waiters is fine */
+    cv.signal();
+
+    threadp = Thread::spawn("CondWaiter", [&]() {
+            mutex.take();
+            waiting = 1;
+            while(!go)
+                cv.wait();
+            mutex.release();
+        }, ThreadSpawnOptions().joinable());
+    while(1) {
+        mutex.take();
+        if (waiting)
+            break;
+        mutex.release();
+        ThreadTimer::sleep(1);
+    }
+    go = 1;
+    mutex.release();
+    cv.signal();
+    threadp->join(NULL);
+    threadp->releaseThread();
+
+    EXPECT_EQ(cv.getMorphed(), 0);
+}
+
+/* readers and writers, some sleeping while they hold the lock so that
+ * they may release it on another dispatcher, never see a half update.
+ */
+TEST(ThreadLockRwBiased, Exclusion)
+{
+    static const uint32_t threadCount = 8;
+    static const uint32_t loops = 2000;
+    ThreadLockRwBiased lock;
+    Thread *threads[threadCount];
+    uint64_t a = 0;
+    uint64_t b = 0;
+    uint32_t errors = 0;
+    uint32_t i;
+
+    for(i=0;i<threadCount;i++) {
+        threads[i] = Thread::spawn("RwBiasedTest", [&, i]() {
+                ThreadLockTracker tracker;
+                uint32_t j;
+
+                for(j=0;j<loops;j++) {
+                    if ((i + j) % 10 == 0) {
+                        lock.lockWrite();
+                        a++;
+                        b++;
+                        lock.releaseWrite();
+                    }
+                    else {
+                        lock.lockRead((j & 1)? &tracker : NULL);
+                        if (j % 100 == 1)
+                            ThreadTimer::sleep(1);
+                        if (a != b)
+                            errors++;
+                        lock.releaseRead((j & 1)? &tracker : NULL);
+                    }
+                }
+            }, ThreadSpawnOptions().joinable());
+    }
+    for(i=0;i<threadCount;i++) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+    }
+    EXPECT_EQ(errors, 0);
+    EXPECT_EQ(a, b);
+    EXPECT_EQ(lock._trackerQueue.count(), 0);
+}
+
+/* a writer waits for a reader that has moved, and times out if it takes too long */
+TEST(ThreadLockRwBiased, WriterDrainsReaders)
+{
+    ThreadLockRwBiased lock;
+    Thread *threadp;
+    int32_t code = 0;
+
+    lock.lockRead();
+    EXPECT_EQ(lock.tryWrite(), 0);
+    EXPECT_EQ(lock.tryRead(), 1);
+    lock.releaseRead();
+
+    threadp = Thread::spawn("RwBiasedTest", [&]() {
+            code = lock.lockWriteFor(20);
+        }, ThreadSpawnOptions().joinable());
+    threadp->join(NULL);
+    threadp->releaseThread();
+    EXPECT_EQ(code, ThreadBaseLock::TL_ERR_TIMEDOUT);
+
+    /* the bias came back with the timeout */
+    EXPECT_EQ(lock.tryRead(), 1);
+    lock.releaseRead();
+
+    threadp = Thread::spawn("RwBiasedTest", [&]() {
+            code = lock.lockWriteFor(10000);
+            if (code == 0)
+                lock.releaseWrite();
+        }, ThreadSpawnOptions().joinable());
+    ThreadTimer::sleep(5);
+    lock.releaseRead();
+    threadp->join(NULL);
+    threadp->releaseThread();
+    EXPECT_EQ(code, ThreadBaseLock::TL_OK);
+}
+
+/* upgrading waits for the biased readers, and keeps out other writers */
+TEST(ThreadLockRwBiased, Upgrade)
+{
+    ThreadLockRwBiased lock;
+    Thread *readerp;
+    int readerDone = 0;
+    int readerHeld = 0;
+
+    readerp = Thread::spawn("RwBiasedTest", [&]() {
+            lock.lockRead();
+            readerHeld = 1;
+            ThreadTimer::sleep(10);
+            readerDone = 1;
+            lock.releaseRead();
+        }, ThreadSpawnOptions().joinable());
+    while(!readerHeld)
+        ThreadTimer::sleep(1);
+
+    lock.lockUpgrade();
+    lock.upgradeToWrite();
+    EXPECT_EQ(readerDone, 1);
+    EXPECT_EQ(lock.tryRead(), 0);
+    lock.writeToRead();
+    EXPECT_EQ(lock.tryRead(), 1);
+    lock.releaseRead();
+    lock.releaseRead();
+
+    readerp->join(NULL);
+    readerp->releaseThread();
+}
+
+/* condition variables work with the write lock */
+/* its methods hide ThreadLockRw's, so it mustn't pass for one */
+static_assert(!std::is_convertible<ThreadLockRwBiased *, ThreadLockRw *>::value,
+              "a ThreadLockRwBiased converts to a ThreadLockRw");
+
+TEST(ThreadLockRwBiased, CondWait)
+{
+    ThreadLockRwBiased lock;
+    ThreadCond cv(lock.baseLock());
+    Thread *threadp;
+    int go = 0;
+
+    threadp = Thread::spawn("RwBiasedTest", [&]() {
+            lock.lockWrite();
+            while(!go)
+                cv.wait();
+            lock.releaseWrite();
+        }, ThreadSpawnOptions().joinable());
+    ThreadTimer::sleep(5);
+
+    /* the waiter released the lock, and gave readers their bias back */
+    lock.lockRead();
+    lock.releaseRead();
+    lock.lockWrite();
+    go = 1;
+    cv.signal();
+    lock.releaseWrite();
+    threadp->join(NULL);
+    threadp->releaseThread();
+}
@@ -0,0 +1,69 @@
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string>
+
+#include "threadparallel.h"
+
+TEST(ThreadParallel, For)
+{
+    std::vector<long> values(100000);
+
+    ThreadParallel::parallelFor(0, values.size(), [&values](long i) { values[i] = i * 2; });
+    for(long i=0;i<(long) values.size();i++)
+        ASSERT_EQ(values[i], i * 2);
+
+    /* tiny grains split as finely as possible */
+    ThreadParallel::parallelFor(0, 1000, [&values](long i) { values[i] = -i; }, 1);
+    EXPECT_EQ(values[999], -999);
+
+    ThreadParallel::parallelFor(5, 5, [](long i) { FAIL(); });
+}
+
+TEST(ThreadParallel, Reduce)
+{
+    long sum;
+    std::string joined;
+
+    sum = ThreadParallel::parallelReduce(0, 1000000, 0L,
+                                         [](long i) { return i; },
+                                         [](long a, long b) { return a + b; });
+    EXPECT_EQ(sum, 1000000L * 999999 / 2);
+
+    /* order is kept for non-commutative combines */
+    joined = ThreadParallel::parallelReduce(0, 26, std::string(),
+                                            [](long i) { return std::string(1, 'a' + i); },
+                                            [](const std::string &a, const std::string &b) {
+                                                return a + b;
+                                            }, 2);
+    EXPECT_EQ(joined, "abcdefghijklmnopqrstuvwxyz");
+
+    EXPECT_EQ(ThreadParallel::parallelReduce(3, 3, 7L, [](long i) { return i; },
+                                             [](long a, long b) { return a + b; }), 7);
+}
+
+TEST(ThreadParallel, Sort)
+{
+    std::vector<int> values(200000);
+
+    srandom(1);
+    for(auto &value : values)
+        value = random() % 1000;
+    ThreadParallel::parallelSort(values.begin(), values.end());
+    EXPECT_TRUE(std::is_sorted(values.begin(), values.end()));
+
+    ThreadParallel::parallelSort(values.begin(), values.end(), std::greater<int>());
+    EXPECT_TRUE(std::is_sorted(values.begin(), values.end(), std::greater<int>()));
+}
+
+TEST(ThreadParallel, Transform)
+{
+    std::vector<int> in(50000);
+    std::vector<double> out(in.size());
+
+    for(int i=0;i<(int) in.size();i++)
+        in[i] = i;
+    ThreadParallel::parallelTransform(in.begin(), in.end(), out.begin(),
+                                      [](int x) { return x / 2.0; });
+    for(int i=0;i<(int) in.size();i++)
+        ASSERT_EQ(out[i], i / 2.0);
+}
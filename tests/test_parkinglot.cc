@@ -0,0 +1,240 @@
+#include <gtest/gtest.h>
+
+#include "thread.h"
+#include "threadparkinglot.h"
+#include "threadtimer.h"
+
+TEST(ThreadParkingLot, ValidateFails)
+{
+    std::atomic<int> word(1);
+    int32_t code;
+
+    code = ThreadParkingLot::park(&word, [&]() { return word.load() == 0; });
+    EXPECT_EQ(code, ThreadParkingLot::TP_ERR_INVALID);
+    EXPECT_EQ(ThreadParkingLot::unparkOne(&word), 0U);
+}
+
+TEST(ThreadParkingLot, TimesOut)
+{
+    std::atomic<int> word(0);
+    int32_t code;
+
+    code = ThreadParkingLot::park(&word, [&]() { return word.load() == 0; }, 20);
+    EXPECT_EQ(code, ThreadParkingLot::TP_ERR_TIMEDOUT);
+    code = ThreadParkingLot::park(&word, [&]() { return word.load() == 0; }, 0);
+    EXPECT_EQ(code, ThreadParkingLot::TP_ERR_TIMEDOUT);
+
+    /* the timed out waiters are gone */
+    EXPECT_EQ(ThreadParkingLot::unparkAll(&word), 0U);
+}
+
+TEST(ThreadParkingLot, UnparkByAddress)
+{
+    static const uint32_t threadCount = 8;
+    std::atomic<int> words[2];
+    Thread *threads[threadCount];
+    int32_t codes[threadCount];
+    std::atomic<uint32_t> parked(0);
+    uint32_t woken = 0;
+    uint32_t i;
+
+    words[0] = 0;
+    words[1] = 0;
+    for(i=0;i<threadCount;i++) {
+        threads[i] = Thread::spawn("ParkTest", [&, i]() {
+                codes[i] = ThreadParkingLot::park(&words[i % 2], [&]() {
+                        parked++;
+                        return 1;
+                    });
+            }, ThreadSpawnOptions().joinable());
+    }
+    while(parked.load() < threadCount)
+        ThreadTimer::sleep(1);
+
+    /* the threads park with the bucket locked, so they're all queued */
+    EXPECT_EQ(ThreadParkingLot::unparkOne(&words[0]), 1U);
+    EXPECT_EQ(ThreadParkingLot::unparkAll(&words[0]), threadCount/2 - 1);
+    EXPECT_EQ(ThreadParkingLot::unparkAll(&words[0]), 0U);
+    for(i=0;i<threadCount;i+=2) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+        EXPECT_EQ(codes[i], ThreadParkingLot::TP_OK);
+    }
+
+    while(woken < threadCount/2)
+        woken += ThreadParkingLot::unparkAll(&words[1]);
+    for(i=1;i<threadCount;i+=2) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+        EXPECT_EQ(codes[i], ThreadParkingLot::TP_OK);
+    }
+}
+
+/* parks on a word, counting the times it's asked where it should run */
+class PlacedThread : public Thread {
+ public:
+    std::atomic<int> *_wordp;
+    std::atomic<uint32_t> *_parkedp;
+    std::atomic<uint32_t> _placed;
+
+    PlacedThread(std::atomic<int> *wordp, std::atomic<uint32_t> *parkedp) : Thread("PlacedThread") {
+        _wordp = wordp;
+        _parkedp = parkedp;
+        _placed = 0;
+    }
+
+    void *start() {
+        ThreadParkingLot::park(_wordp, [this]() {
+                (*_parkedp)++;
+                return 1;
+            });
+        return NULL;
+    }
+
+    ThreadDispatcher *queueDispatcher() {
+        _placed++;
+        return Thread::queueDispatcher();
+    }
+};
+
+/* a batch wakeup places each thread where its own queue would */
+TEST(ThreadParkingLot, BatchUsesQueueDispatcher)
+{
+    static const uint32_t threadCount = 4;
+    std::atomic<int> word(0);
+    std::atomic<uint32_t> parked(0);
+    PlacedThread *threads[threadCount];
+    uint32_t i;
+
+    for(i=0;i<threadCount;i++) {
+        threads[i] = new PlacedThread(&word, &parked);
+        threads[i]->setJoinable();
+        threads[i]->queue();
+    }
+    while(parked.load() < threadCount)
+        ThreadTimer::sleep(1);
+
+    EXPECT_EQ(ThreadParkingLot::unparkAll(&word), threadCount);
+    for(i=0;i<threadCount;i++) {
+        threads[i]->join(NULL);
+        EXPECT_EQ(threads[i]->_placed.load(), 2U);
+        delete threads[i];
+    }
+}
+
+TEST(ThreadCompactMutex, Size)
+{
+    EXPECT_EQ(sizeof(ThreadCompactMutex), 1U);
+    EXPECT_EQ(sizeof(ThreadCompactCond), 4U);
+}
+
+TEST(ThreadCompactMutex, Counter)
+{
+    static const uint32_t threadCount = 16;
+    static const uint32_t loops = 2000;
+    ThreadCompactMutex mutex;
+    Thread *threads[threadCount];
+    uint64_t counter = 0;
+    uint32_t i;
+
+    for(i=0;i<threadCount;i++) {
+        threads[i] = Thread::spawn("CompactTest", [&]() {
+                uint32_t j;
+
+                for(j=0;j<loops;j++) {
+                    mutex.take();
+                    counter++;
+                    /* make others park now and then */
+                    if (j % 256 == 0)
+                        ThreadTimer::sleep(1);
+                    mutex.release();
+                }
+            }, ThreadSpawnOptions().joinable());
+    }
+    for(i=0;i<threadCount;i++) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+    }
+    EXPECT_EQ(counter, (uint64_t) threadCount * loops);
+    EXPECT_FALSE(mutex.isLocked());
+}
+
+TEST(ThreadCompactMutex, TakeFor)
+{
+    ThreadCompactMutex mutex;
+    Thread *threadp;
+    int32_t code = 0;
+
+    mutex.take();
+    EXPECT_EQ(mutex.tryLock(), 0);
+    threadp = Thread::spawn("CompactTest", [&]() {
+            code = mutex.takeFor(20);
+        }, ThreadSpawnOptions().joinable());
+    threadp->join(NULL);
+    threadp->releaseThread();
+    EXPECT_EQ(code, ThreadBaseLock::TL_ERR_TIMEDOUT);
+    mutex.release();
+
+    EXPECT_EQ(mutex.takeFor(0), ThreadBaseLock::TL_OK);
+    mutex.release();
+}
+
+TEST(ThreadCompactCond, ProducerConsumer)
+{
+    static const uint32_t consumerCount = 4;
+    static const uint32_t items = 1000;
+    ThreadCompactMutex mutex;
+    ThreadCompactCond cv;
+    Thread *consumers[consumerCount];
+    uint32_t queued = 0;
+    uint32_t consumed = 0;
+    int done = 0;
+    uint32_t i;
+
+    for(i=0;i<consumerCount;i++) {
+        consumers[i] = Thread::spawn("CompactTest", [&]() {
+                mutex.take();
+                while(1) {
+                    if (queued > 0) {
+                        queued--;
+                        consumed++;
+                    }
+                    else if (done)
+                        break;
+                    else
+                        cv.wait(&mutex);
+                }
+                mutex.release();
+            }, ThreadSpawnOptions().joinable());
+    }
+
+    for(i=0;i<items;i++) {
+        mutex.take();
+        queued++;
+        cv.signal();
+        mutex.release();
+        if (i % 64 == 0)
+            ThreadTimer::sleep(1);
+    }
+    mutex.take();
+    done = 1;
+    cv.broadcast();
+    mutex.release();
+
+    for(i=0;i<consumerCount;i++) {
+        consumers[i]->join(NULL);
+        consumers[i]->releaseThread();
+    }
+    EXPECT_EQ(consumed, items);
+}
+
+TEST(ThreadCompactCond, WaitForTimesOut)
+{
+    ThreadCompactMutex mutex;
+    ThreadCompactCond cv;
+
+    mutex.take();
+    EXPECT_EQ(cv.waitFor(&mutex, 20), ThreadBaseLock::TL_ERR_TIMEDOUT);
+    EXPECT_TRUE(mutex.isLocked());
+    mutex.release();
+}
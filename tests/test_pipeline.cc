@@ -0,0 +1,89 @@
+#include <gtest/gtest.h>
+
+#include "threadpipeline.h"
+#include "threadtimer.h"
+
+TEST(ThreadQueue, PushPop)
+{
+    ThreadQueue<int> queue(4);
+    std::vector<int> items;
+    int item;
+
+    EXPECT_EQ(queue.push(1), ThreadQueueBase::TQ_OK);
+    EXPECT_EQ(queue.push(2), ThreadQueueBase::TQ_OK);
+    EXPECT_EQ(queue.pop(&item), ThreadQueueBase::TQ_OK);
+    EXPECT_EQ(item, 1);
+
+    items = {3, 4, 5};
+    EXPECT_EQ(queue.pushBatch(&items), ThreadQueueBase::TQ_OK);
+    EXPECT_TRUE(items.empty());
+    EXPECT_EQ(queue.count(), 4u);
+
+    EXPECT_EQ(queue.popBatch(&items, 3), 3u);
+    EXPECT_EQ(items, std::vector<int>({2, 3, 4}));
+
+    /* a closed queue still drains */
+    queue.producerDone();
+    EXPECT_EQ(queue.push(6), ThreadQueueBase::TQ_ERR_CLOSED);
+    EXPECT_EQ(queue.pop(&item), ThreadQueueBase::TQ_OK);
+    EXPECT_EQ(item, 5);
+    EXPECT_EQ(queue.pop(&item), ThreadQueueBase::TQ_ERR_CLOSED);
+    EXPECT_EQ(queue.popBatch(&items, 3), 0u);
+}
+
+TEST(ThreadPipeline, Stages)
+{
+    ThreadPipeline pipeline;
+    ThreadQueue<long> *numbersp;
+    ThreadQueue<std::string> *stringsp;
+    std::atomic<long> total(0);
+    std::atomic<long> count(0);
+
+    numbersp = pipeline.source<long>("numbers", [](ThreadPipelineOut<long> &out) {
+            for(long i=0;i<10000;i++)
+                out.push(i);
+        });
+    stringsp = pipeline.stage<std::string>("format", numbersp,
+                                           [](long &value, ThreadPipelineOut<std::string> &out) {
+                                               /* drop odd numbers */
+                                               if (value % 2 == 0)
+                                                   out.push(std::to_string(value));
+                                           },
+                                           ThreadPipelineOptions().workers(4).queueSize(64));
+    pipeline.sink("parse", stringsp, [&](std::string &s) {
+            total += atol(s.c_str());
+            count++;
+        }, ThreadPipelineOptions().workers(2));
+    pipeline.start();
+    pipeline.wait();
+
+    EXPECT_EQ(count.load(), 5000);
+    EXPECT_EQ(total.load(), 2L * 4999 * 5000 / 2);
+}
+
+TEST(ThreadPipeline, Backpressure)
+{
+    ThreadPipeline pipeline;
+    ThreadQueue<int> *itemsp;
+    std::atomic<int> count(0);
+
+    itemsp = pipeline.source<int>("fast", [](ThreadPipelineOut<int> &out) {
+            for(int i=0;i<200;i++)
+                out.push(i);
+        }, ThreadPipelineOptions().queueSize(8).batchSize(4));
+    pipeline.sink("slow", itemsp, [&count](int &item) {
+            if (item % 20 == 0)
+                ThreadTimer::sleep(1);
+            count++;
+        }, ThreadPipelineOptions().batchSize(4));
+    pipeline.start();
+    pipeline.wait();
+    pipeline.displayStats();
+
+    EXPECT_EQ(count.load(), 200);
+
+    /* the source had to wait for the sink, and never overfilled the queue */
+    EXPECT_GT(itemsp->getFullWaits(), 0u);
+    EXPECT_LE(itemsp->getMaxCount(), 8u);
+    EXPECT_EQ(itemsp->getPopped(), 200u);
+}
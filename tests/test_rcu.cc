@@ -0,0 +1,133 @@
+#include <gtest/gtest.h>
+
+#include "thread.h"
+#include "threadrcu.h"
+#include "threadtimer.h"
+
+TEST(ThreadRcu, Synchronize)
+{
+    uint64_t before;
+
+    before = ThreadRcu::getGracePeriods();
+    ThreadRcu::synchronize();
+    EXPECT_GT(ThreadRcu::getGracePeriods(), before);
+}
+
+TEST(ThreadRcu, CallbacksRunInBatches)
+{
+    static const uint32_t callbacks = 5000;
+    uint32_t ran = 0;
+    uint64_t before;
+    uint32_t i;
+
+    before = ThreadRcu::getGracePeriods();
+    for(i=0;i<callbacks;i++)
+        ThreadRcu::call([&ran]() { ran++; });
+    ThreadRcu::barrier();
+    EXPECT_EQ(ran, callbacks);
+
+    /* far fewer grace periods than callbacks */
+    EXPECT_LT(ThreadRcu::getGracePeriods() - before, 50U);
+}
+
+class RcuEntry {
+public:
+    ThreadRcuHead _rcuHead;
+    int *_freedp;
+
+    RcuEntry(int *freedp) {
+        _freedp = freedp;
+    }
+
+    ~RcuEntry() {
+        (*_freedp)++;
+    }
+
+    static void free(ThreadRcuHead *headp) {
+        delete (RcuEntry *) ((char *) headp - offsetof(RcuEntry, _rcuHead));
+    }
+};
+
+TEST(ThreadRcu, EmbeddedHeadAndDeleteLater)
+{
+    RcuEntry *entryp;
+    int freed = 0;
+
+    entryp = new RcuEntry(&freed);
+    ThreadRcu::call(&entryp->_rcuHead, &RcuEntry::free);
+    ThreadRcu::deleteLater(new RcuEntry(&freed));
+
+    ThreadRcu::barrier();
+    EXPECT_EQ(freed, 2);
+}
+
+/* readers walk a published snapshot while writers replace it and free
+ * the old ones, poisoned, after a grace period.
+ */
+TEST(ThreadRcu, ReadersSeeLiveData)
+{
+    class Snapshot {
+    public:
+        uint64_t _a;
+        uint64_t _b;
+    };
+    static const uint32_t readerCount = 4;
+    static const uint32_t updates = 2000;
+    std::atomic<Snapshot *> snapp(new Snapshot{0, 0});
+    Thread *readers[readerCount];
+    Thread *writerp;
+    std::atomic<int> done(0);
+    uint32_t i;
+
+    for(i=0;i<readerCount;i++) {
+        readers[i] = Thread::spawn("RcuReader", [&]() {
+                Snapshot *p;
+                uint32_t n = 0;
+
+                while(!done.load()) {
+                    ThreadRcu::readLock();
+                    p = ThreadRcu::dereference(&snapp);
+                    EXPECT_EQ(p->_a, p->_b);
+                    ThreadRcu::readUnlock();
+                    if (++n % 16 == 0)
+                        ThreadTimer::sleep(0);
+                }
+            }, ThreadSpawnOptions().joinable());
+    }
+
+    writerp = Thread::spawn("RcuWriter", [&]() {
+            Snapshot *oldp;
+            Snapshot *newp;
+            uint32_t j;
+
+            for(j=1;j<=updates;j++) {
+                oldp = snapp.load();
+                newp = new Snapshot{j, j};
+                ThreadRcu::assign(&snapp, newp);
+                if (j % 2) {
+                    ThreadRcu::call([oldp]() {
+                            oldp->_a = ~0ULL;
+                            delete oldp;
+                        });
+                }
+                else {
+                    ThreadRcu::synchronize();
+                    oldp->_a = ~0ULL;
+                    delete oldp;
+                }
+                if (j % 8 == 0)
+                    ThreadTimer::sleep(0);
+            }
+        }, ThreadSpawnOptions().joinable());
+
+    writerp->join(NULL);
+    writerp->releaseThread();
+    done = 1;
+    for(i=0;i<readerCount;i++) {
+        readers[i]->join(NULL);
+        readers[i]->releaseThread();
+    }
+    ThreadRcu::barrier();
+    EXPECT_EQ(snapp.load()->_a, (uint64_t) updates);
+    delete snapp.load();
+}
@@ -0,0 +1,108 @@
+#include <gtest/gtest.h>
+
+#include "thread.h"
+#include "threadmutex.h"
+#include "threadseqlock.h"
+
+class Pair {
+public:
+    uint64_t _a;
+    uint64_t _b;
+    uint32_t _c;
+};
+
+TEST(ThreadSeqLock, RetryAfterWrite)
+{
+    ThreadSeqLock seqLock;
+    uint64_t seq;
+
+    seq = seqLock.readBegin();
+    EXPECT_EQ(seqLock.readRetry(seq), 0);
+
+    seqLock.writeLock();
+    seqLock.writeUnlock();
+    EXPECT_EQ(seqLock.readRetry(seq), 1);
+    EXPECT_EQ(seqLock.getWrites(), 1);
+
+    seq = seqLock.readBegin();
+    EXPECT_EQ(seqLock.readRetry(seq), 0);
+}
+
+/* writers can share an existing lock */
+TEST(ThreadSeqLock, ExternalLock)
+{
+    ThreadMutex mutex;
+    ThreadSeqLock seqLock(&mutex);
+
+    seqLock.writeLock();
+    EXPECT_EQ(mutex.getOwner(), Thread::getCurrent());
+    seqLock.writeUnlock();
+    EXPECT_EQ(mutex.getOwner(), (Thread *) NULL);
+}
+
+TEST(ThreadSeqValue, LoadStore)
+{
+    ThreadSeqValue<Pair> value;
+    Pair pair;
+
+    pair = value.load();
+    EXPECT_EQ(pair._a, 0);
+    EXPECT_EQ(pair._c, 0);
+
+    pair._a = 1;
+    pair._b = 2;
+    pair._c = 3;
+    value.store(pair);
+    value.update([](Pair *pairp) { pairp->_c++; });
+
+    pair = value.load();
+    EXPECT_EQ(pair._a, 1);
+    EXPECT_EQ(pair._b, 2);
+    EXPECT_EQ(pair._c, 4);
+    EXPECT_EQ(value.getWrites(), 2);
+}
+
+/* readers never see a half written pair, with writers racing each other */
+TEST(ThreadSeqValue, Consistent)
+{
+    static const uint32_t writerCount = 2;
+    static const uint32_t readerCount = 6;
+    static const uint32_t loops = 20000;
+    ThreadSeqValue<Pair> value;
+    Thread *threads[writerCount + readerCount];
+    uint32_t errors = 0;
+    uint32_t i;
+
+    for(i=0;i<writerCount+readerCount;i++) {
+        if (i < writerCount) {
+            threads[i] = Thread::spawn("SeqWriter", [&]() {
+                    uint32_t j;
+
+                    for(j=0;j<loops;j++) {
+                        value.update([](Pair *pairp) {
+                                pairp->_a++;
+                                pairp->_b = pairp->_a * 3;
+                            });
+                    }
+                }, ThreadSpawnOptions().joinable());
+        }
+        else {
+            threads[i] = Thread::spawn("SeqReader", [&]() {
+                    Pair pair;
+                    uint32_t j;
+
+                    for(j=0;j<loops;j++) {
+                        pair = value.load();
+                        if (pair._b != pair._a * 3)
+                            errors++;
+                    }
+                }, ThreadSpawnOptions().joinable());
+        }
+    }
+    for(i=0;i<writerCount+readerCount;i++) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+    }
+    EXPECT_EQ(errors, 0);
+    EXPECT_EQ(value.load()._a, writerCount * loops);
+}
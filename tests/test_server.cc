@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+
+#include "threadserver.h"
+#include "threadtimer.h"
+
+class AddRequest : public ThreadServerRequest<AddRequest> {
+public:
+    long _value;
+    long _result;
+};
+
+/* keeps a running total, replying to each request with the new total */
+class AddServer : public ThreadServer<AddRequest> {
+public:
+    long _total;
+    uint32_t _delayMs;
+
+    AddServer() {
+        _total = 0;
+        _delayMs = 0;
+    }
+
+    void handle(AddRequest *requestp) {
+        if (_delayMs)
+            ThreadTimer::sleep(_delayMs);
+        _total += requestp->_value;
+        requestp->_result = _total;
+        reply(requestp);
+    }
+};
+
+/* shut the server down and wait for it to exit */
+static void
+stopServer(AddServer *serverp)
+{
+    serverp->shutdown();
+    serverp->join(NULL);
+    delete serverp;
+}
+
+TEST(ThreadServer, Call)
+{
+    AddServer *serverp = new AddServer();
+    AddRequest request;
+
+    serverp->setJoinable();
+    serverp->queue();
+    for(long i=1;i<=10;i++) {
+        request._value = i;
+        EXPECT_EQ(serverp->call(&request), AddServer::TS_OK);
+        EXPECT_EQ(request._result, i*(i+1)/2);
+    }
+    stopServer(serverp);
+}
+
+TEST(ThreadServer, Batching)
+{
+    AddServer *serverp = new AddServer();
+    AddRequest requests[100];
+
+    /* everything's queued before the pinned server first runs, so it
+     * all arrives in one batch.
+     */
+    serverp->setJoinable();
+    serverp->pin(0);
+    for(long i=0;i<100;i++) {
+        requests[i]._value = 1;
+        requests[i]._reply.reset();
+        EXPECT_EQ(serverp->send(&requests[i]), AddServer::TS_OK);
+    }
+    serverp->queue();
+    for(long i=0;i<100;i++)
+        requests[i]._reply.wait();
+    EXPECT_EQ(serverp->_total, 100);
+    EXPECT_EQ(serverp->getHandled(), 100u);
+    EXPECT_EQ(serverp->getBatches(), 1u);
+    stopServer(serverp);
+}
+
+TEST(ThreadServer, Backpressure)
+{
+    AddServer *serverp = new AddServer();
+    AddRequest requests[4];
+
+    serverp->setJoinable();
+    serverp->setMaxQueued(2);
+    serverp->_delayMs = 5;
+    for(long i=0;i<2;i++) {
+        requests[i]._value = 1;
+        EXPECT_EQ(serverp->send(&requests[i]), AddServer::TS_OK);
+    }
+    requests[2]._value = 1;
+    EXPECT_EQ(serverp->send(&requests[2], /* !wait */ 0), AddServer::TS_ERR_FULL);
+
+    /* a waiting send completes once the server drains the mailbox */
+    serverp->queue();
+    requests[3]._value = 1;
+    EXPECT_EQ(serverp->call(&requests[3]), AddServer::TS_OK);
+    EXPECT_EQ(requests[3]._result, 3);
+    stopServer(serverp);
+}
+
+TEST(ThreadServer, Shutdown)
+{
+    AddServer *serverp = new AddServer();
+    AddRequest requests[10];
+    AddRequest late;
+
+    serverp->setJoinable();
+    for(long i=0;i<10;i++) {
+        requests[i]._value = i;
+        serverp->send(&requests[i]);
+    }
+    serverp->shutdown();
+    EXPECT_EQ(serverp->send(&late), AddServer::TS_ERR_SHUTDOWN);
+
+    /* queued requests are still handled before the server exits */
+    serverp->queue();
+    serverp->join(NULL);
+    EXPECT_EQ(serverp->_total, 45);
+    delete serverp;
+}
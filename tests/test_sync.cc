@@ -0,0 +1,154 @@
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include "thread.h"
+#include "threadsync.h"
+#include "threadtimer.h"
+
+/* spawn count joinable threads running fn(i), and join them all */
+template<class F> static void
+runThreads(uint32_t count, F &&fn)
+{
+    std::vector<Thread *> threads(count);
+    uint32_t i;
+
+    for(i=0;i<count;i++)
+        threads[i] = Thread::spawn("SyncTest", [&fn, i]() { fn(i); }, ThreadSpawnOptions().joinable());
+    for(i=0;i<count;i++) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+    }
+}
+
+TEST(ThreadSemaphore, LimitsConcurrency)
+{
+    ThreadSemaphore sem(2);
+    uint32_t inside = 0;
+    uint32_t maxInside = 0;
+    uint32_t done = 0;
+
+    runThreads(16, [&](uint32_t i) {
+            sem.acquire();
+            if (++inside > maxInside)
+                maxInside = inside;
+            ThreadTimer::sleep(1);
+            inside--;
+            done++;
+            sem.release();
+        });
+    EXPECT_EQ(done, 16U);
+    EXPECT_LE(maxInside, 2U);
+    EXPECT_EQ(sem.getCount(), 2);
+}
+
+TEST(ThreadSemaphore, TimesOut)
+{
+    ThreadSemaphore sem(0);
+    int32_t code = 0;
+
+    EXPECT_EQ(sem.tryAcquire(), 0);
+    EXPECT_EQ(sem.acquireFor(0), ThreadBaseLock::TL_ERR_TIMEDOUT);
+    runThreads(1, [&](uint32_t i) { code = sem.acquireFor(20); });
+    EXPECT_EQ(code, ThreadBaseLock::TL_ERR_TIMEDOUT);
+
+    /* a release wakes a waiter */
+    runThreads(2, [&](uint32_t i) {
+            if (i == 0)
+                code = sem.acquireFor(10000);
+            else {
+                ThreadTimer::sleep(5);
+                sem.release();
+            }
+        });
+    EXPECT_EQ(code, ThreadBaseLock::TL_OK);
+    EXPECT_EQ(sem.getCount(), 0);
+}
+
+TEST(ThreadLatch, OpensOnce)
+{
+    static const uint32_t workers = 8;
+    ThreadLatch latch(workers);
+    uint32_t finished = 0;
+    uint32_t sawAll = 0;
+
+    EXPECT_EQ(latch.waitFor(0), ThreadBaseLock::TL_ERR_TIMEDOUT);
+    EXPECT_EQ(latch.waitFor(10), ThreadBaseLock::TL_ERR_TIMEDOUT);
+
+    runThreads(workers + 4, [&](uint32_t i) {
+            if (i < workers) {
+                ThreadTimer::sleep(1 + i % 3);
+                finished++;
+                latch.countDown();
+            }
+            else {
+                latch.wait();
+                if (finished == workers)
+                    sawAll++;
+            }
+        });
+    EXPECT_EQ(sawAll, 4U);
+    EXPECT_EQ(latch.tryWait(), 1);
+    EXPECT_EQ(latch.getCount(), 0);
+}
+
+TEST(ThreadBarrier, Phases)
+{
+    static const uint32_t parties = 8;
+    static const uint32_t phases = 50;
+    ThreadBarrier barrier(parties);
+    uint32_t arrived[phases];
+    uint32_t serials[phases];
+    int inOrder = 1;
+
+    memset(arrived, 0, sizeof(arrived));
+    memset(serials, 0, sizeof(serials));
+    runThreads(parties, [&](uint32_t i) {
+            uint32_t phase;
+
+            for(phase=0; phase<phases; phase++) {
+                arrived[phase]++;
+                if (barrier.arriveAndWait())
+                    serials[phase]++;
+
+                /* everyone got to this phase before anyone left it */
+                if (arrived[phase] != parties)
+                    inOrder = 0;
+            }
+        });
+    EXPECT_TRUE(inOrder);
+    for(uint32_t phase=0; phase<phases; phase++)
+        EXPECT_EQ(serials[phase], 1U);
+    EXPECT_EQ(barrier.getPhase(), phases);
+}
+
+static uint32_t onceCalls;
+static uint32_t onceReady;
+
+static void
+onceInit(void *contextp)
+{
+    onceCalls++;
+
+    /* block, as an init function doing I/O would */
+    ThreadTimer::sleep(20);
+    onceReady = 1;
+}
+
+TEST(Once, ParksWaiters)
+{
+    Once once;
+    uint32_t ranIt = 0;
+    uint32_t sawReady = 0;
+
+    runThreads(8, [&](uint32_t i) {
+            if (once.call(onceInit, NULL))
+                ranIt++;
+            if (onceReady)
+                sawReady++;
+        });
+    EXPECT_EQ(onceCalls, 1U);
+    EXPECT_EQ(ranIt, 1U);
+    EXPECT_EQ(sawReady, 8U);
+    EXPECT_TRUE(once.called());
+    EXPECT_EQ(once.call(onceInit, NULL), 0);
+}
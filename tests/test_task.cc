@@ -0,0 +1,61 @@
+#include <gtest/gtest.h>
+#include <atomic>
+
+#include "thread.h"
+
+static std::atomic<int> stopRequeueing;
+static std::atomic<uint64_t> requeueRuns;
+
+/* a task that requeues itself on its dispatcher until told to stop */
+class RequeueTask : public ThreadTask {
+    ThreadDispatcher *_disp;
+    int _stopped;
+
+ public:
+    RequeueTask(ThreadDispatcher *disp) : _disp(disp), _stopped(0) {}
+
+    void run() {
+        requeueRuns++;
+        if (stopRequeueing)
+            _stopped = 1;
+        else
+            _disp->queueTask(this);
+    }
+
+    void releaseTask() {
+        if (_stopped)
+            delete this;
+    }
+};
+
+/* a steady stream of tasks on every dispatcher still lets threads run */
+TEST(ThreadTask, RequeueingTasksDontStarveThreads)
+{
+    uint16_t i;
+    uint32_t loops = 0;
+    Thread *threadp;
+
+    stopRequeueing = 0;
+    for(i=0;i<ThreadDispatcher::getDispatcherCount();i++) {
+        ThreadDispatcher *disp = ThreadDispatcher::getDispatcher(i);
+
+        disp->queueTask(new RequeueTask(disp));
+    }
+
+    threadp = Thread::spawn("Progress", [&]() {
+            Thread *yieldp;
+
+            /* each pass blocks in join, so we go back through the run queue */
+            for(loops=0; loops<100; loops++) {
+                yieldp = Thread::spawn("Yield", []() {}, ThreadSpawnOptions().joinable());
+                yieldp->join(NULL);
+                yieldp->releaseThread();
+            }
+        }, ThreadSpawnOptions().joinable());
+    threadp->join(NULL);
+    threadp->releaseThread();
+    stopRequeueing = 1;
+
+    EXPECT_EQ(loops, 100u);
+    EXPECT_GT(requeueRuns.load(), 0u);
+}
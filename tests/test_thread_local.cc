@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+#include <atomic>
+
+#include "thread.h"
+
+static std::atomic<int> destroyed;
+
+static void
+countDestroy(void *valuep)
+{
+    destroyed++;
+}
+
+class LocalThread : public Thread {
+public:
+    int32_t _key;
+    void *_seen;
+    void *_stored;
+
+    LocalThread(int32_t key) : Thread("LocalThread"), _key(key), _seen(this), _stored(NULL) {}
+
+    void *start() {
+        /* a fresh thread never sees another thread's value */
+        _seen = getLocal(_key);
+        setLocal(_key, this);
+        _stored = getLocal(_key);
+        return NULL;
+    }
+};
+
+class Counter {
+public:
+    int _count;
+
+    Counter() : _count(0) {}
+};
+
+static ThreadLocal<Counter> localCounter;
+
+class CounterThread : public Thread {
+public:
+    int _final;
+
+    CounterThread() : Thread("CounterThread"), _final(-1) {}
+
+    void *start() {
+        for(int i=0; i<10; i++)
+            localCounter->_count++;
+        _final = localCounter->_count;
+        return NULL;
+    }
+};
+
+TEST(ThreadLocal, CurrentThread)
+{
+    int32_t key = Thread::allocLocalKey();
+    ASSERT_GE(key, 0);
+
+    Thread *mep = Thread::getCurrent();
+    EXPECT_EQ(mep->getLocal(key), (void *) NULL);
+    mep->setLocal(key, &key);
+    EXPECT_EQ(mep->getLocal(key), (void *) &key);
+    mep->setLocal(key, NULL);
+    EXPECT_EQ(mep->getLocal(key), (void *) NULL);
+}
+
+TEST(ThreadLocal, PerThreadSlotsAndDestructors)
+{
+    static const int nthreads = 16;
+    LocalThread *threads[nthreads];
+    int32_t key = Thread::allocLocalKey(&countDestroy);
+
+    ASSERT_GE(key, 0);
+    Thread::getCurrent()->setLocal(key, &key);
+    destroyed = 0;
+
+    for(int i=0; i<nthreads; i++) {
+        threads[i] = new LocalThread(key);
+        threads[i]->setJoinable();
+        threads[i]->queue();
+    }
+
+    for(int i=0; i<nthreads; i++) {
+        threads[i]->join(NULL);
+        EXPECT_EQ(threads[i]->_stored, (void *) threads[i]);
+        EXPECT_EQ(threads[i]->_seen, (void *) NULL);
+        delete threads[i];
+    }
+
+    /* each exiting thread ran the destructor on its own slot */
+    EXPECT_EQ(destroyed.load(), nthreads);
+
+    /* and our own slot was untouched */
+    EXPECT_EQ(Thread::getCurrent()->getLocal(key), (void *) &key);
+    Thread::getCurrent()->setLocal(key, NULL);
+}
+
+TEST(ThreadLocal, TypedWrapper)
+{
+    static const int nthreads = 8;
+    CounterThread *threads[nthreads];
+
+    for(int i=0; i<nthreads; i++) {
+        threads[i] = new CounterThread();
+        threads[i]->setJoinable();
+        threads[i]->queue();
+    }
+
+    for(int i=0; i<nthreads; i++) {
+        threads[i]->join(NULL);
+        EXPECT_EQ(threads[i]->_final, 10);
+        delete threads[i];
+    }
+}
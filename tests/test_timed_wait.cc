@@ -0,0 +1,200 @@
+#include <gtest/gtest.h>
+
+#include "thread.h"
+#include "threadmutex.h"
+#include "threadtimer.h"
+#include "osp.h"
+
+/* run fn on its own thread and wait for it */
+template<class F> static void
+runAndJoin(F &&fn)
+{
+    Thread *threadp;
+
+    threadp = Thread::spawn("TimedWaitTest", fn, ThreadSpawnOptions().joinable());
+    threadp->join(NULL);
+    threadp->releaseThread();
+}
+
+TEST(TimedWait, MutexTimesOut)
+{
+    ThreadMutex mutex;
+    int32_t code = 0;
+    long long startUs;
+    long long elapsedUs = 0;
+
+    mutex.take();
+    runAndJoin([&]() {
+            startUs = osp_getUs();
+            code = mutex.takeFor(20);
+            elapsedUs = osp_getUs() - startUs;
+        });
+    EXPECT_EQ(code, ThreadBaseLock::TL_ERR_TIMEDOUT);
+    EXPECT_GE(elapsedUs, 20000);
+    EXPECT_EQ(mutex.getOwner(), Thread::getCurrent());
+
+    /* 0 just tries */
+    runAndJoin([&]() { code = mutex.takeFor(0); });
+    EXPECT_EQ(code, ThreadBaseLock::TL_ERR_TIMEDOUT);
+    mutex.release();
+
+    /* the timed out waiters left nothing behind */
+    runAndJoin([&]() {
+            code = mutex.takeFor(20);
+            if (code == 0)
+                mutex.release();
+        });
+    EXPECT_EQ(code, ThreadBaseLock::TL_OK);
+    mutex.take();
+    mutex.release();
+}
+
+TEST(TimedWait, MutexReleasedInTime)
+{
+    ThreadMutex mutex;
+    Thread *threadp;
+    int32_t code = -1;
+    long long startUs;
+
+    mutex.take();
+    startUs = osp_getUs();
+    threadp = Thread::spawn("TimedWaitTest", [&]() {
+            code = mutex.takeFor(10000);
+            if (code == 0)
+                mutex.release();
+        }, ThreadSpawnOptions().joinable());
+    ThreadTimer::sleep(20);
+    mutex.release();
+    threadp->join(NULL);
+    threadp->releaseThread();
+    EXPECT_EQ(code, ThreadBaseLock::TL_OK);
+    EXPECT_LT(osp_getUs() - startUs, 5000000);
+}
+
+/* many waiters with different deadlines all time out, and the mutex still works */
+TEST(TimedWait, ManyMutexTimeouts)
+{
+    static const uint32_t threadCount = 32;
+    ThreadMutex mutex;
+    Thread *threads[threadCount];
+    int32_t codes[threadCount];
+    uint32_t i;
+
+    mutex.take();
+    for(i=0;i<threadCount;i++) {
+        codes[i] = 0;
+        threads[i] = Thread::spawn("TimedWaitTest", [&, i]() {
+                codes[i] = mutex.takeFor(5 + (i * 7) % 30);
+            }, ThreadSpawnOptions().joinable());
+    }
+    for(i=0;i<threadCount;i++) {
+        threads[i]->join(NULL);
+        threads[i]->releaseThread();
+        EXPECT_EQ(codes[i], ThreadBaseLock::TL_ERR_TIMEDOUT);
+    }
+    mutex.release();
+    mutex.take();
+    mutex.release();
+}
+
+TEST(TimedWait, CondTimesOut)
+{
+    ThreadMutex mutex;
+    ThreadCond cv(&mutex);
+    int32_t code;
+
+    mutex.take();
+    code = cv.waitFor(20);
+    EXPECT_EQ(code, ThreadBaseLock::TL_ERR_TIMEDOUT);
+
+    /* we have the mutex back */
+    EXPECT_EQ(mutex.getOwner(), Thread::getCurrent());
+    mutex.release();
+}
+
+TEST(TimedWait, CondSignalled)
+{
+    ThreadMutex mutex;
+    ThreadCond cv(&mutex);
+    Thread *threadp;
+    int32_t code = -1;
+    int ready = 0;
+    int done = 0;
+
+    threadp = Thread::spawn("TimedWaitTest", [&]() {
+            mutex.take();
+            ready = 1;
+            while(!done) {
+                code = cv.waitFor(10000);
+                if (code != 0)
+                    break;
+            }
+            mutex.release();
+        }, ThreadSpawnOptions().joinable());
+
+    while(1) {
+        mutex.take();
+        if (ready)
+            break;
+        mutex.release();
+        ThreadTimer::sleep(1);
+    }
+    done = 1;
+    cv.signal();
+    mutex.release();
+
+    threadp->join(NULL);
+    threadp->releaseThread();
+    EXPECT_EQ(code, ThreadBaseLock::TL_OK);
+}
+
+TEST(TimedWait, ReadTimesOutBehindWriter)
+{
+    ThreadLockRw lock;
+    int32_t code = 0;
+
+    lock.lockWrite();
+    runAndJoin([&]() { code = lock.lockReadFor(20); });
+    EXPECT_EQ(code, ThreadBaseLock::TL_ERR_TIMEDOUT);
+    runAndJoin([&]() { code = lock.lockWriteFor(20); });
+    EXPECT_EQ(code, ThreadBaseLock::TL_ERR_TIMEDOUT);
+    lock.releaseWrite();
+
+    runAndJoin([&]() {
+            code = lock.lockReadFor(20);
+            if (code == 0)
+                lock.releaseRead();
+        });
+    EXPECT_EQ(code, ThreadBaseLock::TL_OK);
+    lock.lockWrite();
+    lock.releaseWrite();
+}
+
+/* a writer giving up must let in the readers queued behind it */
+TEST(TimedWait, WriterTimeoutAdmitsReaders)
+{
+    ThreadLockRw lock;
+    Thread *writerp;
+    Thread *readerp;
+    int32_t writeCode = 0;
+    int32_t readCode = -1;
+
+    lock.lockRead();
+    writerp = Thread::spawn("TimedWaitTest", [&]() {
+            writeCode = lock.lockWriteFor(30);
+        }, ThreadSpawnOptions().joinable());
+    ThreadTimer::sleep(5);
+    readerp = Thread::spawn("TimedWaitTest", [&]() {
+            readCode = lock.lockReadFor(10000);
+            if (readCode == 0)
+                lock.releaseRead();
+        }, ThreadSpawnOptions().joinable());
+
+    writerp->join(NULL);
+    writerp->releaseThread();
+    readerp->join(NULL);
+    readerp->releaseThread();
+    EXPECT_EQ(writeCode, ThreadBaseLock::TL_ERR_TIMEDOUT);
+    EXPECT_EQ(readCode, ThreadBaseLock::TL_OK);
+    lock.releaseRead();
+}
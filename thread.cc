@@ -31,9 +31,13 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <time.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <unordered_map>
 
 #include "thread.h"
+#include "threadcancel.h"
 #include "Exception.h"
 
 
@@ -44,6 +48,7 @@ extern int xsetcontext(ucontext_t *ctxp);
 
 pthread_key_t ThreadDispatcher::_dispatcherKey;
 pthread_once_t ThreadDispatcher::_once = PTHREAD_ONCE_INIT;
+thread_local ThreadDispatcher *ThreadDispatcher::_tlsDispatcherp;
 ThreadDispatcher *ThreadDispatcher::_allDispatchers[ThreadDispatcher::_maxDispatchers];
 uint16_t ThreadDispatcher::_dispatcherCount;
 
@@ -52,6 +57,21 @@ dqueue<ThreadEntry> Thread::_allThreads;
 dqueue<ThreadEntry> Thread::_joinThreads;
 uint32_t Thread::_defaultStackSize = 128*1024;
 int Thread::_trackStackUsage = 0;
+const char *Thread::_defaultNamep = "[None]";
+std::atomic<uint32_t> Thread::_localKeyCount;
+Thread::LocalDestructor *Thread::_localDestructors[Thread::_maxLocalKeys];
+
+/* interned thread names, with a count of the references handed out by
+ * internName; an entry is removed when its last reference is released.
+ * Node-based, so the string a name points into never moves.
+ */
+static SpinLock threadNameLock;
+static std::unordered_map<std::string, uint32_t> *threadNamesp;
+
+/* bytes reserved at the base of each stack allocation for the thread's
+ * register context; rounded to a cache line so the stack itself stays aligned.
+ */
+static const uint32_t threadCtxBytes = (sizeof(ucontext_t) + 63) & ~63;
 
 ThreadMon *ThreadMon::_monp = 0;
 
@@ -61,14 +81,27 @@ Thread::TraceProc *Thread::_traceProcp;
 
 /* internal function doing some of the initialization of a thread */
 void
-Thread::init(std::string name, uint32_t stackSize)
+Thread::init(const char *namep, uint32_t stackSize, int stackless)
 {
+    /* the fields the dispatcher uses on every switch, through _coldp,
+     * must stay within the first two cache lines.  Thread isn't
+     * standard layout, but gcc and clang lay it out in declaration
+     * order all the same.
+     */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+    static_assert(offsetof(Thread, _coldp) < 128, "Thread's dispatcher fields span more than two cache lines");
+#pragma GCC diagnostic pop
+
     if (stackSize == 0)
         _stackSize = _defaultStackSize;
     else
         _stackSize = stackSize;
     _goingToSleep = 0;
-    _marked = 0;
+    _coldp = NULL;
+    _localsp = NULL;
+    if (namep)
+        _coldp = new ThreadCold(namep);
     _globalThreadLock.take();
     _allEntry._threadp = this;
     _allThreads.append(&_allEntry);
@@ -76,36 +109,172 @@ Thread::init(std::string name, uint32_t stackSize)
     _currentDispatcherp = NULL;
     _wiredDispatcherp = NULL;
     _blockingMutexp = NULL;
+    _blockingRwp = NULL;
+    _blockSeq = 0;
+    _blockedUs = 0;
+    _blockingHolderCount = 0;
+    _holdersSeq = 0;
     _joinable = 0;
-    _joiningThreadp = 0;
     _inJoinThreads = 0;
-    _exitValuep = NULL;
     _exited = 0;
-    _name = name;
-    clock_gettime(CLOCK_REALTIME, &_createTs);
+    _priority = 0;
     _runTicks = 0;
-    _stackp = (char *) malloc(_stackSize);
+    _lastStartTicks = 0;
+    _sleepContext = 0;
+    _lockClock = 0;
+
+    if (stackless) {
+        _stackSize = 0;
+        _stackp = NULL;
+        _ctxp = NULL;
+        return;
+    }
+
+    /* the context lives at the low end of the allocation, below the
+     * usable stack, so it shares the allocation instead of bloating
+     * the Thread structure.
+     */
+    _stackp = (char *) malloc(threadCtxBytes + _stackSize);
+    _ctxp = (ucontext_t *) _stackp;
     if (_trackStackUsage)
-        memset(_stackp, 0x7A, _stackSize);
+        memset(_stackp + threadCtxBytes, 0x7A, _stackSize);
 
-    GETCONTEXT(&_ctx);
-    _ctx.uc_link = NULL;
-    _ctx.uc_stack.ss_sp = _stackp;
-    _ctx.uc_stack.ss_size = _stackSize;
-    _ctx.uc_stack.ss_flags = 0;
+    initContext();
+}
+
+/* internal: set up the context so that the next time the thread is
+ * resumed, it starts executing at ctxStart.  Must only be called on a
+ * thread that has never run, or that is asleep and not in any queue.
+ */
+void
+Thread::initContext()
+{
+    GETCONTEXT(_ctxp);
+    _ctxp->uc_link = NULL;
+    _ctxp->uc_stack.ss_sp = _stackp + threadCtxBytes;
+    _ctxp->uc_stack.ss_size = _stackSize;
+    _ctxp->uc_stack.ss_flags = 0;
 #if THREAD_PTR_FITS_IN_INT
-    makecontext(&_ctx, (void (*)()) &ctxStart, 
+    makecontext(_ctxp, (void (*)()) &ctxStart, 
                 2,
                 (int) ((long) this),
                 0);
 #else
-    makecontext(&_ctx, (void (*)()) &ctxStart, 
+    makecontext(_ctxp, (void (*)()) &ctxStart, 
                 2,
                 (int) (((long) this) & 0xFFFFFFFF),
                 (int)(((long)this)>>32));
 #endif
 }
 
+/* static */ const char *
+Thread::internName(const std::string &name)
+{
+    const char *namep;
+
+    threadNameLock.take();
+    if (!threadNamesp)
+        threadNamesp = new std::unordered_map<std::string, uint32_t>();
+    auto it = threadNamesp->emplace(name, 0).first;
+    it->second++;
+    namep = it->first.c_str();
+    threadNameLock.release();
+
+    return namep;
+}
+
+/* static */ void
+Thread::releaseName(const char *namep)
+{
+    if (namep == _defaultNamep)
+        return;
+
+    threadNameLock.take();
+    auto it = threadNamesp->find(namep);
+    assert(it != threadNamesp->end() && it->first.c_str() == namep);
+    if (--it->second == 0)
+        threadNamesp->erase(it);
+    threadNameLock.release();
+}
+
+ThreadCold::~ThreadCold()
+{
+    Thread::releaseName(_namep);
+}
+
+void
+ThreadCold::setName(const char *namep)
+{
+    const char *oldNamep = _namep;
+
+    _namep = namep;
+    Thread::releaseName(oldNamep);
+}
+
+/* static */ int32_t
+Thread::allocLocalKey(LocalDestructor *destructorp)
+{
+    uint32_t key;
+
+    key = _localKeyCount.fetch_add(1);
+    if (key >= _maxLocalKeys) {
+        _localKeyCount.store(_maxLocalKeys);
+        return -1;
+    }
+    _localDestructors[key] = destructorp;
+    return key;
+}
+
+void
+Thread::setLocal(uint32_t key, void *valuep)
+{
+    osp_assert(key < _maxLocalKeys);
+    if (!_localsp) {
+        if (!valuep)
+            return;
+        _localsp = (void **) calloc(_maxLocalKeys, sizeof(void *));
+    }
+    _localsp[key] = valuep;
+}
+
+/* internal: called by the exiting thread, on its own stack, so that
+ * destructors may block.  Like pthreads, we make a few passes in case a
+ * destructor sets another slot.
+ */
+void
+Thread::runLocalDestructors()
+{
+    static const uint32_t maxPasses = 4;
+    uint32_t pass;
+    uint32_t i;
+    uint32_t keyCount;
+    int didAny;
+    void *valuep;
+
+    if (!_localsp)
+        return;
+
+    keyCount = _localKeyCount.load();
+    if (keyCount > _maxLocalKeys)
+        keyCount = _maxLocalKeys;
+
+    for(pass = 0; pass < maxPasses; pass++) {
+        didAny = 0;
+        for(i=0; i<keyCount; i++) {
+            valuep = _localsp[i];
+            if (valuep) {
+                _localsp[i] = NULL;
+                if (_localDestructors[i]) {
+                    _localDestructors[i](valuep);
+                    didAny = 1;
+                }
+            }
+        }
+        if (!didAny)
+            break;
+    }
+}
+
 /* internal; called to start a light weight thread on a new stack */
 /* static */ void
 Thread::ctxStart(unsigned int p1, unsigned int p2)
@@ -119,10 +288,10 @@ Thread::ctxStart(unsigned int p1, unsigned int p2)
     Thread *threadp = (Thread *)threadInt;
 
     try {
-        threadp->start();
-
-        /* if the thread returns, just have it exit */
-        threadp->exit(NULL);
+        /* if the thread returns, just have it exit, passing the
+         * returned value to any join.
+         */
+        threadp->exit(threadp->start());
     } catch (Exception &e) {
         GetExceptionDetails(std::cerr, e);
         assert("unhandled Exception"==nullptr);
@@ -140,18 +309,22 @@ void
 Thread::exit(void *valuep)
 {
     Thread *joinThreadp;
+
+    runLocalDestructors();
+
     _globalThreadLock.take();
 
     /* threads shouldn't exit multiple times */
     assert(!_exited);
     _exited = 1;
-    _exitValuep = valuep;
 
     if (_joinable) {
+        _coldp->_exitValuep = valuep;
+
         /* note that joinable threads are actually deleted by the join call, which must
          * eventuall get performed
          */
-        if (_joiningThreadp) {
+        if (_coldp->_joiningThreadp) {
             /* Someone already did a join for us, and is waiting for our exit.
              * We're going to release the global lock and then queue the
              * thread that did the join.
@@ -165,18 +338,26 @@ Thread::exit(void *valuep)
              * the join operation also obtains the globalThreadLock
              * before proceeding.
              */
-            joinThreadp = _joiningThreadp;
-            _joiningThreadp = NULL;
+            joinThreadp = _coldp->_joiningThreadp;
+            _coldp->_joiningThreadp = NULL;
             joinThreadp->queue();
             sleep(&_globalThreadLock);
             printf("!back from sleep after thread=%p termination\n", this);
             assert(0);
         }
         else {
-            /* joinable thread is waiting for the join call */
+            /* joinable thread is waiting for the join call, or to be
+             * collected from its join set.
+             */
             assert(!_inJoinThreads);
-            _joinThreads.append(&_joinEntry);
-            _inJoinThreads = 1;
+            _coldp->_joinEntry._threadp = this;
+            if (_coldp->_joinSetp) {
+                _coldp->_joinSetp->threadExitedNL(this);
+            }
+            else {
+                _joinThreads.append(&_coldp->_joinEntry);
+                _inJoinThreads = 1;
+            }
             sleep(&_globalThreadLock);
         }
     }
@@ -202,8 +383,8 @@ Thread::join(void **ptrpp)
     _globalThreadLock.take();
     assert(_joinable);
     if (!_exited) {
-        _joiningThreadp = Thread::getCurrent();
-        _joiningThreadp->sleep(&_globalThreadLock);
+        _coldp->_joiningThreadp = Thread::getCurrent();
+        _coldp->_joiningThreadp->sleep(&_globalThreadLock);
 
         /* note that reobtaining this lock here also ensures that we don't
          * return from join until the joined thread is executing in the idle
@@ -219,7 +400,37 @@ Thread::join(void **ptrpp)
     }
 
     if (ptrpp)
-        *ptrpp = _exitValuep;
+        *ptrpp = _coldp->_exitValuep;
+
+    return 0;
+}
+
+int
+Thread::joinStart(Thread *waiterp)
+{
+    _globalThreadLock.take();
+    assert(_joinable);
+    if (_exited) {
+        _globalThreadLock.release();
+        return 1;
+    }
+    _coldp->_joiningThreadp = waiterp;
+    _globalThreadLock.release();
+    return 0;
+}
+
+/* as in join, taking the lock ensures the exiting thread is off its
+ * stack before our caller can delete it.
+ */
+int32_t
+Thread::joinFinish(void **ptrpp)
+{
+    _globalThreadLock.take();
+    assert(_exited);
+    _globalThreadLock.release();
+
+    if (ptrpp)
+        *ptrpp = _coldp->_exitValuep;
 
     return 0;
 }
@@ -236,12 +447,15 @@ Thread::displayStackUsage()
     if( _trackStackUsage) {
         for(entryp = _allThreads.head(); entryp; entryp=entryp->_dqNextp) {
             threadp = entryp->_threadp;
-            for(i=0, tp=threadp->_stackp; i<threadp->_stackSize; i++, tp++)
+            if (!threadp->_stackp)
+                continue;
+            tp = threadp->_stackp + threadCtxBytes;
+            for(i=0; i<threadp->_stackSize; i++, tp++)
                 if (*tp != 0x7a)
                     break;
             bytesUsed = threadp->_stackSize - i;
             printf("Thread %s used %d bytes of its %d bytes\n",
-                   threadp->_name.c_str(), bytesUsed, threadp->_stackSize);
+                   threadp->name(), bytesUsed, threadp->_stackSize);
         }
     }
     else {
@@ -253,20 +467,59 @@ Thread::displayStackUsage()
 void
 Thread::resume()
 {
-    SETCONTEXT(&_ctx);
+    SETCONTEXT(_ctxp);
 }
 
-/* external, find a suitable dispatcher and queue the thread for it.  Has round-robin
- * policy built in for now.
- */
+/* external, find a suitable dispatcher and queue the thread for it */
 void
 Thread::queue()
+{
+    queueDispatcher()->queueThread(this);
+}
+
+/* external; the dispatcher queue uses.  Has round-robin policy built
+ * in for now.
+ */
+ThreadDispatcher *
+Thread::queueDispatcher()
 {
     unsigned long ix;
-    
+
     ix = (unsigned long) this;
     ix = (ix % 127) % ThreadDispatcher::_dispatcherCount;
-    ThreadDispatcher::_allDispatchers[ix]->queueThread(this);
+    return ThreadDispatcher::_allDispatchers[ix];
+}
+
+/* external; queue a list of threads, placing them as queue would, but
+ * visiting each dispatcher once.  A thread without a queueDispatcher
+ * has a queue method of its own, so we use that, and one going to a
+ * special dispatcher is queued on its own.
+ */
+/* static */ void
+Thread::queueBatch(dqueue<Thread> *threadsp)
+{
+    dqueue<Thread> batches[ThreadDispatcher::_maxDispatchers];
+    ThreadDispatcher *disp;
+    Thread *threadp;
+    unsigned long ix;
+
+    while((threadp = threadsp->pop()) != NULL) {
+        disp = threadp->queueDispatcher();
+        if (!disp) {
+            threadp->queue();
+            continue;
+        }
+        if (disp->_ix < 0) {
+            disp->queueThread(threadp);
+            continue;
+        }
+        batches[disp->_ix].append(threadp);
+    }
+
+    for(ix=0; ix<ThreadDispatcher::_maxDispatchers; ix++) {
+        if (!batches[ix].empty())
+            ThreadDispatcher::_allDispatchers[ix]->queueThreads(&batches[ix]);
+    }
 }
 
 /* external, put a thread to sleep and then release the spin lock */
@@ -276,11 +529,15 @@ Thread::sleep(SpinLock *lockp)
     _currentDispatcherp->sleep(this, lockp);
 }
 
-/* static */ Thread *
+/* Note that this must never be inlined: a thread can sleep on one
+ * dispatcher's pthread and wake up on another's, and the compiler is
+ * free to cache the address of a thread_local variable across calls
+ * within a single function.
+ */
+/* static */ __attribute__((noinline)) Thread *
 Thread::getCurrent() 
 {
-    ThreadDispatcher *disp = ((ThreadDispatcher *)
-                              pthread_getspecific(ThreadDispatcher::_dispatcherKey));
+    ThreadDispatcher *disp = ThreadDispatcher::_tlsDispatcherp;
     osp_assert(disp!=NULL);
     return disp->_currentThreadp;
 }
@@ -291,17 +548,365 @@ Thread::~Thread()
     _allThreads.remove(&_allEntry);
     if (_inJoinThreads) {
         _inJoinThreads = 0;
-        _joinThreads.remove(&_joinEntry);
+        _joinThreads.remove(&_coldp->_joinEntry);
     }
     _globalThreadLock.release();
 
+    if (_coldp) {
+        delete _coldp;
+        _coldp = NULL;
+    }
+
+    if (_localsp) {
+        free(_localsp);
+        _localsp = NULL;
+    }
+
     if (_stackp) {
         free(_stackp);
     }
 }
 
+/*****************ThreadJoinSet*****************/
+
+/* internal; wake the waiter if it's waiting for any thread, or if
+ * this was the last one.
+ */
+void
+ThreadJoinSet::threadExitedNL(Thread *threadp)
+{
+    Thread *waiterp;
+
+    _done.append(&threadp->_coldp->_joinEntry);
+    _pending--;
+    if (_waiterp && (!_waitAll || _pending == 0)) {
+        waiterp = _waiterp;
+        _waiterp = NULL;
+        waiterp->queue();
+    }
+}
+
+void
+ThreadJoinSet::add(Thread *threadp)
+{
+    Thread::_globalThreadLock.take();
+    assert(threadp->_joinable);
+    assert(threadp->_coldp->_joinSetp == NULL &&
+           threadp->_coldp->_joiningThreadp == NULL);
+    threadp->_coldp->_joinSetp = this;
+    if (threadp->_exited) {
+        /* it's already waiting for a join; take it over */
+        if (threadp->_inJoinThreads) {
+            Thread::_joinThreads.remove(&threadp->_coldp->_joinEntry);
+            threadp->_inJoinThreads = 0;
+        }
+        _done.append(&threadp->_coldp->_joinEntry);
+    }
+    else {
+        _pending++;
+    }
+    Thread::_globalThreadLock.release();
+}
+
+Thread *
+ThreadJoinSet::waitAny(void **valuepp)
+{
+    ThreadEntry *entryp;
+    Thread *threadp;
+
+    Thread::_globalThreadLock.take();
+    while((entryp = _done.pop()) == NULL) {
+        if (_pending == 0) {
+            Thread::_globalThreadLock.release();
+            return NULL;
+        }
+        assert(_waiterp == NULL);
+        _waiterp = Thread::getCurrent();
+        _waitAll = 0;
+        _waiterp->sleep(&Thread::_globalThreadLock);
+        Thread::_globalThreadLock.take();
+    }
+    threadp = entryp->_threadp;
+    threadp->_coldp->_joinSetp = NULL;
+    Thread::_globalThreadLock.release();
+
+    /* the thread has exited, so this doesn't block */
+    threadp->join(valuepp);
+    return threadp;
+}
+
+void
+ThreadJoinSet::waitAll()
+{
+    Thread::_globalThreadLock.take();
+    while(_pending > 0) {
+        assert(_waiterp == NULL);
+        _waiterp = Thread::getCurrent();
+        _waitAll = 1;
+        _waiterp->sleep(&Thread::_globalThreadLock);
+        Thread::_globalThreadLock.take();
+    }
+    Thread::_globalThreadLock.release();
+}
+
+uint32_t
+ThreadJoinSet::count()
+{
+    uint32_t count;
+
+    Thread::_globalThreadLock.take();
+    count = _pending + _done._queueCount;
+    Thread::_globalThreadLock.release();
+    return count;
+}
+
+/*****************ThreadClosure*****************/
+
+SpinLock ThreadClosure::_poolLock;
+ThreadClosure *ThreadClosure::_poolHeadp;
+uint32_t ThreadClosure::_poolCount;
+
+/* static */ ThreadClosure *
+ThreadClosure::alloc(uint32_t stackSize)
+{
+    ThreadClosure *threadp;
+
+    if (stackSize == 0 || stackSize == _defaultStackSize) {
+        _poolLock.take();
+        threadp = _poolHeadp;
+        if (threadp) {
+            _poolHeadp = threadp->_poolNextp;
+            _poolCount--;
+            _poolLock.release();
+            threadp->_poolNextp = NULL;
+            return threadp;
+        }
+        _poolLock.release();
+    }
+
+    return new ThreadClosure(stackSize);
+}
+
+void
+ThreadClosure::launch(const char *namep, ThreadSpawnOptions &options)
+{
+    if (namep) {
+        if (!_coldp || strcmp(_coldp->_namep, namep) != 0)
+            cold()->setName(internName(namep));
+    }
+    else if (_coldp) {
+        _coldp->setName(_defaultNamep);
+    }
+    _priority = options._priority;
+    _runTicks = 0;
+    if (options._joinable)
+        setJoinable();
+    queue();
+}
+
+/* runs callables until we're told to exit; non-joinable closures
+ * wait in the pool between callables.
+ */
+void *
+ThreadClosure::start()
+{
+    void *resultp;
+
+    while(1) {
+        resultp = _invokep(_storagep);
+        _destroyp(_storagep, (_storagep == (void *) _inline));
+        _storagep = NULL;
+
+        if (_joinable || _stackSize != _defaultStackSize)
+            break;
+
+        /* each spawn looks like a new thread to fiber-local storage */
+        runLocalDestructors();
+
+        _poolLock.take();
+        if (_poolCount >= _maxPooled) {
+            _poolLock.release();
+            break;
+        }
+        _poolNextp = _poolHeadp;
+        _poolHeadp = this;
+        _poolCount++;
+
+        /* alloc/launch will queue us again with a new callable */
+        sleep(&_poolLock);
+    }
+
+    exit(resultp);
+    return resultp;
+}
+
+/* called by the helper thread after a non-pooled closure exits, or by
+ * the joiner after joining; either way, we're asleep in exit.
+ */
+void
+ThreadClosure::releaseThread()
+{
+    assert(Thread::getCurrent() != this);
+
+    if (_stackSize != _defaultStackSize) {
+        delete this;
+        return;
+    }
+
+    _poolLock.take();
+    if (_poolCount >= _maxPooled) {
+        _poolLock.release();
+        delete this;
+        return;
+    }
+    _poolLock.release();
+
+    recycle();
+}
+
+/* internal: reset an exited thread so it can be handed out by alloc */
+void
+ThreadClosure::recycle()
+{
+    _globalThreadLock.take();
+    if (_inJoinThreads) {
+        _inJoinThreads = 0;
+        _joinThreads.remove(&_coldp->_joinEntry);
+    }
+    _globalThreadLock.release();
+
+    _joinable = 0;
+    _exited = 0;
+    if (_coldp) {
+        _coldp->_joiningThreadp = NULL;
+        _coldp->_exitValuep = NULL;
+        _coldp->_joinSetp = NULL;
+    }
+    initContext();
+
+    _poolLock.take();
+    _poolNextp = _poolHeadp;
+    _poolHeadp = this;
+    _poolCount++;
+    _poolLock.release();
+}
+
+/*****************ThreadTask*****************/
+
+/* external: spread tasks over the dispatchers the same way threads are */
+void
+ThreadTask::queue()
+{
+    unsigned long ix;
+
+    ix = (unsigned long) this;
+    ix = (ix % 127) % ThreadDispatcher::_dispatcherCount;
+    ThreadDispatcher::_allDispatchers[ix]->queueTask(this);
+}
+
+/*****************ThreadGroup*****************/
+
+/* internal; the owner has already dropped its reference if we're the
+ * last, so it's asleep, or about to be, holding _lock.
+ */
+void
+ThreadGroup::childDone()
+{
+    Thread *waiterp;
+
+    if (_pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    _lock.take();
+    waiterp = _waiterp;
+    _waiterp = NULL;
+    _lock.release();
+    waiterp->queue();
+}
+
+void
+ThreadGroup::sync()
+{
+    Thread *threadp;
+
+    /* children that have finished never touch the group again */
+    if (_pending.load(std::memory_order_acquire) == 1)
+        return;
+
+    threadp = Thread::getCurrent();
+    _lock.take();
+    _waiterp = threadp;
+    if (_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        /* everyone's already done */
+        _waiterp = NULL;
+        _lock.release();
+    }
+    else {
+        threadp->sleep(&_lock);
+    }
+
+    /* ready for reuse */
+    _pending.store(1, std::memory_order_relaxed);
+}
+
 /*****************ThreadIdle*****************/
 
+SpinLock ThreadIdle::_poolLock;
+ThreadIdle *ThreadIdle::_poolHeadp;
+uint32_t ThreadIdle::_poolCount;
+
+/* static */ ThreadIdle *
+ThreadIdle::alloc(ThreadDispatcher *disp)
+{
+    ThreadIdle *idlep;
+
+    _poolLock.take();
+    idlep = _poolHeadp;
+    if (idlep) {
+        _poolHeadp = idlep->_poolNextp;
+        _poolCount--;
+    }
+    _poolLock.release();
+
+    if (idlep) {
+        /* retired threads are asleep, and nothing will resume their
+         * old context, so we can just start them over at ctxStart.
+         */
+        idlep->_poolNextp = NULL;
+        idlep->initContext();
+    }
+    else {
+        idlep = new ThreadIdle();
+    }
+    idlep->_disp = disp;
+
+    return idlep;
+}
+
+/* a promoted idle thread finished its task; we're running as a regular
+ * thread, possibly on another dispatcher, so park in the pool, or exit
+ * if the pool is full.
+ */
+void
+ThreadIdle::retire()
+{
+    _promoted = 0;
+    _disp = NULL;
+
+    _poolLock.take();
+    if (_poolCount >= _maxPooled) {
+        _poolLock.release();
+        exit(NULL);
+    }
+    _poolNextp = _poolHeadp;
+    _poolHeadp = this;
+    _poolCount++;
+    sleep(&_poolLock);
+
+    /* alloc rebuilds our context, so we never get here */
+    thread_assert(0);
+}
+
 /* internal idle thread whose context can be resumed; used to get off
  * of stack of thread going to sleep, so that if sleeping thread gets
  * woken immediately after the sleep lock is released, its use of its
@@ -314,7 +919,7 @@ ThreadIdle::start()
     SpinLock *lockp;
     
     while(1) {
-        GETCONTEXT(&_ctx);
+        GETCONTEXT(_ctxp);
         lockp = getLockAndClear();
         if (lockp)
             lockp->release();
@@ -322,6 +927,55 @@ ThreadIdle::start()
     }
 }
 
+/*****************ThreadWaitTimer*****************/
+
+void
+ThreadWaitTimer::start(uint32_t ms)
+{
+    ThreadDispatcher *disp = ThreadDispatcher::_tlsDispatcherp;
+    ThreadWaitTimer *timerp;
+
+    assert(!_dispatcherp);
+    _dispatcherp = disp;
+    _fired.store(0, std::memory_order_relaxed);
+    _expirationUs = osp_getUs() + (long long) ms * 1000;
+
+    /* timed waits are usually similar, so search from the tail */
+    disp->_timerLock.take();
+    for(timerp = disp->_timers.tail(); timerp; timerp=timerp->_dqPrevp) {
+        if (timerp->_expirationUs <= _expirationUs)
+            break;
+    }
+    disp->_timers.insertAfter(timerp, this);
+    _inList = 1;
+    disp->updateNextTimerNL();
+    disp->_timerLock.release();
+}
+
+void
+ThreadWaitTimer::stop()
+{
+    ThreadDispatcher *disp = _dispatcherp;
+
+    if (!disp)
+        return;
+
+    disp->_timerLock.take();
+    if (_inList) {
+        disp->_timers.remove(this);
+        _inList = 0;
+        disp->updateNextTimerNL();
+    }
+
+    /* the dispatcher firing us is on another pthread, and only holds spin locks */
+    while(_busy) {
+        disp->_timerLock.release();
+        disp->_timerLock.take();
+    }
+    disp->_timerLock.release();
+    _dispatcherp = NULL;
+}
+
 /*****************ThreadDispatcher*****************/
 
 /* statics */
@@ -332,6 +986,38 @@ ThreadDispatcher::~ThreadDispatcher()
     delete _currentThreadp;
 }
 
+/* static */ uint64_t
+ThreadDispatcher::getTaskPromotions()
+{
+    uint64_t count = 0;
+    uint32_t i;
+
+    for(i=0;i<_dispatcherCount;i++)
+        count += _allDispatchers[i]->_taskPromotions;
+    return count;
+}
+
+/* static */ ThreadDispatcher *
+ThreadDispatcher::getDispatcher(uint16_t ix)
+{
+    assert(_dispatcherCount > 0);
+    return _allDispatchers[ix % _dispatcherCount];
+}
+
+/* static */ ThreadDispatcher *
+ThreadDispatcher::findIdle()
+{
+    ThreadDispatcher *disp;
+    uint32_t i;
+
+    for(i=0;i<_dispatcherCount;i++) {
+        disp = _allDispatchers[i];
+        if (__atomic_load_n(&disp->_idle, __ATOMIC_RELAXED))
+            return disp;
+    }
+    return NULL;
+}
+
 /* A hook for destructing pthread thread specific keys; this
  * is called whenever a thread exits and ensures that any
  * thread specific lwt state is cleaned up/deallocated
@@ -339,6 +1025,7 @@ ThreadDispatcher::~ThreadDispatcher()
 void ThreadDispatcherCleanup(void *arg)
 {
     ThreadDispatcher *p = (ThreadDispatcher*)(arg);
+    ThreadDispatcher::_tlsDispatcherp = NULL;
     delete p;
 }
 
@@ -359,13 +1046,41 @@ void
 ThreadDispatcher::dispatch()
 {
     Thread *newThreadp;
+    ThreadTask *taskp;
     uint64_t currentTicks;
 
     while(1) {
+        rcuQuiescent();
+
+        if (_nextTimerUs.load(std::memory_order_relaxed) != LLONG_MAX &&
+            osp_getUs() >= _nextTimerUs.load(std::memory_order_relaxed))
+            runTimers();
+
         _runQueue._queueLock.take();
+
+        /* tasks go first, since they're cheap and can run right here,
+         * but not so many in a row that queued threads starve.
+         */
+        if (_taskRun < _maxTaskRun || _runQueue._queue.empty())
+            taskp = _runQueue._tasks.pop();
+        else
+            taskp = NULL;
+        if (taskp) {
+            _taskRun++;
+            _lastDispatchTicks = threadCpuTicks();
+            _runQueue._queueLock.release();
+            rcuRunning();
+            runTask(taskp);
+            continue;
+        }
+
         newThreadp = _runQueue._queue.pop();
+        _taskRun = 0;
         currentTicks = threadCpuTicks();
         if (!newThreadp) {
+            if (!_idle)
+                __atomic_store_n(&_idle, 1, __ATOMIC_RELAXED);
+
             /* CPU runs at about 2000-3000 cpu ticks per usec.  If we want
              * to wait at least a millisecond, 3 million ticks is about right
              */
@@ -378,9 +1093,19 @@ ThreadDispatcher::dispatch()
             _runQueue._queueLock.release();
             pthread_mutex_lock(&_runMutex);
             while(_sleeping || _pauseRequests) {
-                if (_pauseRequests)
+                if (_pauseRequests) {
                     _paused = 1;
-                pthread_cond_wait(&_runCV, &_runMutex);
+                    pthread_cond_wait(&_runCV, &_runMutex);
+                }
+                else if (_nextTimerUs.load(std::memory_order_relaxed) != LLONG_MAX) {
+                    /* sleep only until the first wait timer expires */
+                    if (idleUntilNL(_nextTimerUs.load(std::memory_order_relaxed))) {
+                        _sleeping = 0;
+                        break;
+                    }
+                }
+                else
+                    pthread_cond_wait(&_runCV, &_runMutex);
             }
             pthread_mutex_unlock(&_runMutex);
         }
@@ -390,11 +1115,42 @@ ThreadDispatcher::dispatch()
             _currentThreadp = newThreadp;
             newThreadp->_currentDispatcherp = this;
             newThreadp->_lastStartTicks = threadCpuTicks();
+            rcuRunning();
             newThreadp->resume();   /* doesn't return */
         }
     }
 }
 
+/* Internal; run a task on our idle thread's stack.  If the task
+ * blocks, sleep promotes the idle thread, and when the task finally
+ * returns, we're no longer running on this dispatcher's idle thread,
+ * and possibly not even on this dispatcher, so we must not touch any
+ * dispatcher state; the thread just retires.
+ */
+void
+ThreadDispatcher::runTask(ThreadTask *taskp)
+{
+    ThreadIdle *idlep = _idlep;
+
+    if (!_spareIdlep)
+        _spareIdlep = ThreadIdle::alloc(this);
+
+    _currentThreadp = idlep;
+    idlep->_currentDispatcherp = this;
+    idlep->_lastStartTicks = threadCpuTicks();
+
+    taskp->run();
+    taskp->releaseTask();
+
+    if (idlep->_localsp)
+        idlep->runLocalDestructors();
+
+    if (idlep->_promoted)
+        idlep->retire();        /* doesn't return */
+
+    _currentThreadp = NULL;
+}
+
 /* External.  When a thread needs to block for some condition, the
  * paradigm is that it will have some SpinLock held holding invariant
  * some condition, such as the state of a mutex.  As soon as that spin
@@ -422,7 +1178,7 @@ ThreadDispatcher::sleep(Thread *threadp, SpinLock *lockp)
 
     _currentThreadp = NULL;
     threadp->_goingToSleep = 1;
-    GETCONTEXT(&threadp->_ctx);
+    GETCONTEXT(threadp->_ctxp);
     if (threadp->_goingToSleep) {
         threadp->_goingToSleep = 0;
 
@@ -433,9 +1189,20 @@ ThreadDispatcher::sleep(Thread *threadp, SpinLock *lockp)
          * The idle context will resume at ThreadIdle::start, either at
          * the start or in the while loop, and will then dispatch the
          * next thread from the run queue.
+         *
+         * If we're the idle thread, a task is blocking on our
+         * stack; this thread becomes a regular thread that finishes
+         * the task when woken, and we dispatch from the spare.
          */
-        _idle._userLockToReleasep = lockp;
-        SETCONTEXT(&_idle._ctx);
+        if (threadp == _idlep) {
+            assert(_spareIdlep != NULL);
+            _idlep->_promoted = 1;
+            _idlep = _spareIdlep;
+            _spareIdlep = NULL;
+            _taskPromotions++;
+        }
+        _idlep->_userLockToReleasep = lockp;
+        SETCONTEXT(_idlep->_ctxp);
 
         printf("!Error: somehow back from sleep's setcontext disp=%p\n", this);
     }
@@ -450,7 +1217,98 @@ void
 ThreadDispatcher::queueThread(Thread *threadp)
 {
     _runQueue._queueLock.take();
-    _runQueue._queue.append(threadp);
+    if (threadp->_priority)
+        _runQueue._queue.prepend(threadp);
+    else
+        _runQueue._queue.append(threadp);
+    releaseQueueAndWake();
+}
+
+/* Internal; queue a list of threads on this dispatcher, with a single
+ * wakeup.
+ */
+void
+ThreadDispatcher::queueThreads(dqueue<Thread> *threadsp)
+{
+    Thread *threadp;
+
+    _runQueue._queueLock.take();
+    while((threadp = threadsp->pop()) != NULL) {
+        if (threadp->_priority)
+            _runQueue._queue.prepend(threadp);
+        else
+            _runQueue._queue.append(threadp);
+    }
+    releaseQueueAndWake();
+}
+
+/* Internal; called holding _runMutex to sleep on _runCV until woken
+ * or until osp_getUs reaches untilUs.  Returns 1 if the time came.
+ */
+int
+ThreadDispatcher::idleUntilNL(long long untilUs)
+{
+    struct timespec ts;
+    long long waitUs;
+    int code;
+
+    waitUs = untilUs - osp_getUs();
+    if (waitUs <= 0)
+        return 1;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += waitUs / 1000000;
+    ts.tv_nsec += (waitUs % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    code = pthread_cond_timedwait(&_runCV, &_runMutex, &ts);
+    return (code == ETIMEDOUT);
+}
+
+/* Internal; fire the expired wait timers.  As in ThreadCancel::cancel,
+ * a timer is marked busy while its cancel method runs without our lock,
+ * so that ThreadWaitTimer::stop waits for that to finish.
+ */
+void
+ThreadDispatcher::runTimers()
+{
+    ThreadWaitTimer *timerp;
+    long long nowUs;
+
+    nowUs = osp_getUs();
+    _timerLock.take();
+    while((timerp = _timers.head()) != NULL && timerp->_expirationUs <= nowUs) {
+        _timers.remove(timerp);
+        timerp->_inList = 0;
+        timerp->_busy = 1;
+        timerp->_fired.store(1, std::memory_order_release);
+        _timerLock.release();
+
+        timerp->_waitp->cancel();
+
+        _timerLock.take();
+        timerp->_busy = 0;
+    }
+    updateNextTimerNL();
+    _timerLock.release();
+}
+
+/* Internal; call to queue a task to this dispatcher */
+void
+ThreadDispatcher::queueTask(ThreadTask *taskp)
+{
+    _runQueue._queueLock.take();
+    _runQueue._tasks.append(taskp);
+    releaseQueueAndWake();
+}
+
+/* Internal; called with the run queue lock held, after queueing work */
+void
+ThreadDispatcher::releaseQueueAndWake()
+{
+    if (_idle)
+        __atomic_store_n(&_idle, 0, __ATOMIC_RELAXED);
     if (_sleeping) {
         _runQueue._queueLock.release();
         pthread_mutex_lock(&_runMutex);
@@ -469,7 +1327,8 @@ ThreadDispatcher::dispatcherTop(void *ctx)
 {
     ThreadDispatcher *disp = (ThreadDispatcher *)ctx;
     pthread_setspecific(_dispatcherKey, disp);
-    disp->_idle.resume(); /* idle thread switches to new stack and then calls the dispatcher */
+    _tlsDispatcherp = disp;
+    disp->_idlep->resume(); /* idle thread switches to new stack and then calls the dispatcher */
     printf("Error: dispatcher %p top level return!!\n", disp);
     return NULL;
 }
@@ -477,7 +1336,7 @@ ThreadDispatcher::dispatcherTop(void *ctx)
 bool
 ThreadDispatcher::isLwt()
 {
-    if (pthread_getspecific(_dispatcherKey)) {
+    if (_tlsDispatcherp) {
         return true;
     } else {
         return false;
@@ -501,6 +1360,7 @@ ThreadDispatcher::pthreadTop(const char *namep)
      */
     mainDisp = new ThreadDispatcher(1);
     pthread_setspecific(_dispatcherKey, mainDisp);
+    _tlsDispatcherp = mainDisp;
     if (namep)
         name = std::string(namep);
     else
@@ -564,15 +1424,24 @@ ThreadDispatcher::setup(uint16_t ndispatchers, int32_t spinUsec)
 
 /* Internal constructor to create a new dispatcher */
 ThreadDispatcher::ThreadDispatcher(int special) {
+    _ix = -1;
     if (!special) {
         Thread::_globalThreadLock.take();
+        _ix = _dispatcherCount;
         _allDispatchers[_dispatcherCount++] = this;
         Thread::_globalThreadLock.release();
     }
 
     _sleeping = 0;
+    _idle = 0;
     _currentThreadp = NULL;
-    _idle._disp = this;
+    _idlep = new ThreadIdle();
+    _idlep->_disp = this;
+    _spareIdlep = NULL;
+    _taskPromotions = 0;
+    _taskRun = 0;
+    _nextTimerUs = LLONG_MAX;
+    _rcuCount = 0;
     _pauseRequests = 0;
     _paused = 0;
     _lastDispatchTicks = 0;     /* last time a thread was dispatched */
@@ -714,31 +1583,6 @@ ThreadDispatcher::getCpuCount()
     return cpuCount;
 }
 
-/*****************Once*****************/
-/* returns true if called the function, false if already called; note
- * that the spinlock in the Once structure is held over the
- * initialization call.  We do that so we can guarantee that no one
- * proceeds from the call until the first Once initialization function
- * has returned.
- */
-int
-Once::call(OnceProc *procp, void *contextp)
-{
-    int rval;
-
-    _lock.take();
-    if (!_called) {
-        rval = 1;
-        _called = 1;
-        procp(contextp);
-    }
-    else
-        rval = 0;
-    _lock.release();
-    
-    return rval;
-}
-
 /*****************ThreadHelper****************/
 void *
 ThreadHelper::start()
@@ -767,11 +1611,11 @@ ThreadHelper::start()
 }
 
 /*****************ThreadMain*****************/
-void
-ThreadMain::queue()
+ThreadDispatcher *
+ThreadMain::queueDispatcher()
 {
     assert(_wiredDispatcherp != NULL);
-    _wiredDispatcherp->queueThread(this);
+    return _wiredDispatcherp;
 }
 
 /********************************Utilities********************************/
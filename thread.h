@@ -30,8 +30,13 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdlib.h>
 #include <ucontext.h>
 #include <pthread.h>
+#include <time.h>
+#include <limits.h>
 #include <string>
 #include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 #include "dqueue.h"
 #include "osp.h"
@@ -53,6 +58,12 @@ class Thread;
 class ThreadEntry;
 class ThreadDispatcher;
 class ThreadMutex;
+class ThreadLockRw;
+class ThreadClosure;
+class ThreadJoinSet;
+
+/* tag selecting the stackless Thread constructor */
+class ThreadStackless {};
 
 #include "spinlock.h"
 
@@ -101,13 +112,94 @@ class ThreadEntry {
     }
 };
 
+/* infrequently referenced per-thread state.  The dispatcher never looks at any
+ * of this, so it lives in a separately allocated block that is only created
+ * when a thread is named, made joinable, or visited by the deadlock detector.
+ * Fields are protected by the globalThreadLock, except for _namep, which only
+ * the thread's owner changes, and _createTs, which is set once when the block
+ * is created.
+ */
+class ThreadCold {
+ public:
+    /* interned name or _defaultNamep; holds a reference on the interned
+     * entry, dropped when the name is replaced or the block is freed.
+     */
+    const char *_namep;
+
+    /* timespec for when the cold block was created; for named threads, this
+     * is when the thread was created.
+     */
+    struct timespec _createTs;
+
+    /* list of threads waiting for join */
+    ThreadEntry _joinEntry;
+
+    /* non-null if _joiningThreadp called join on us, and we weren't ready */
+    Thread *_joiningThreadp;
+    void *_exitValuep;
+
+    /* join set that collects us when we exit, if any */
+    ThreadJoinSet *_joinSetp;
+
+    ThreadCold(const char *namep) {
+        _namep = namep;
+        clock_gettime(CLOCK_REALTIME, &_createTs);
+        _joiningThreadp = NULL;
+        _exitValuep = NULL;
+        _joinSetp = NULL;
+    }
+
+    ~ThreadCold();
+
+    /* replace the name; namep's reference from internName passes to us */
+    void setName(const char *namep);
+};
+
+/* options for Thread::spawn */
+class ThreadSpawnOptions {
+ public:
+    uint32_t _stackSize;        /* 0 means the default stack size */
+    uint8_t _priority;          /* non-zero to queue at the head of run queues */
+    uint8_t _joinable;          /* return a handle that must be joined */
+
+    ThreadSpawnOptions() {
+        _stackSize = 0;
+        _priority = 0;
+        _joinable = 0;
+    }
+
+    ThreadSpawnOptions &stackSize(uint32_t stackSize) {
+        _stackSize = stackSize;
+        return *this;
+    }
+
+    ThreadSpawnOptions &priority(uint8_t priority) {
+        _priority = priority;
+        return *this;
+    }
+
+    ThreadSpawnOptions &joinable(uint8_t joinable = 1) {
+        _joinable = joinable;
+        return *this;
+    }
+};
+
 /* one of these per user thread.  A thread can only exist in one spot in any collection
  * of run queues, unlike Avere Tasks.
+ *
+ * The fields referenced by the dispatcher on every context switch are
+ * grouped at the start of the structure, so that they span at most two
+ * cache lines.  The register context itself is stored at the base of
+ * the stack allocation, and everything else lives in a lazily
+ * allocated ThreadCold block.
  */
 class Thread {
     friend class ThreadDispatcher;
     friend class ThreadMutex;
     friend class ThreadMutexDetect;
+    friend class ThreadClosure;
+    friend class ThreadIdle;
+    friend class ThreadJoinSet;
 
  public:
     typedef void (TraceProc)( uint64_t mask,
@@ -121,6 +213,12 @@ class Thread {
 
     typedef void (InitProc) (void *contextp, Thread *threadp);
 
+    /* called at thread exit with the non-null value of a fiber-local slot */
+    typedef void (LocalDestructor) (void *valuep);
+
+    /* number of fiber-local slots available to the whole process */
+    static const uint32_t _maxLocalKeys = 64;
+
     /* a list of all threads in existence, and a spin lock that
      * protects the _allThreads and joinThreads lists, along with the
      * joinThreadp pointer.
@@ -132,6 +230,13 @@ class Thread {
     static int _trackStackUsage;
     static TraceProc *_traceProcp;      /* someone will init for us */
 
+    /* name used for threads that were never given one */
+    static const char *_defaultNamep;
+
+    /* fiber-local key allocation; keys are never freed */
+    static std::atomic<uint32_t> _localKeyCount;
+    static LocalDestructor *_localDestructors[_maxLocalKeys];
+
     static void traceProc( uint64_t mask,
                            const char *p,
                            uint64_t p0,
@@ -150,23 +255,25 @@ class Thread {
     Thread *_dqNextp;
     Thread *_dqPrevp;
 
-    /* so we have a list of all threads that exist, so gdb can find them all */ 
-    ThreadEntry _allEntry;
-
     /* the context used for stack switching; keep registers and PC when a user thread
-     * isn't running.
+     * isn't running.  Points into the base of the stack allocation.
+     *
+     * gdb-lwt.py follows this pointer to find a sleeping thread's registers.
      */
-    ucontext_t _ctx;
+    ucontext_t *_ctxp;
 
-    /* EVERYTHING BEFORE THIS POINT IS TRACKED IN GDB, i.e. there's a structure in gdb
-     * labeled kazar_thread that matches the earlier parts of this structure,
-     * so that gdb can read the thread and setup a copy of the registers for 
-     * debugging.
-     */
-    std::string _name;
+    /* set to the current dispatcher when a thread is loaded onto a processor */
+    ThreadDispatcher *_currentDispatcherp; /* current dispatcher for running thread */
 
-    /* timespec for when the thread was created */
-    struct timespec _createTs;
+    /* certain threads are really pthreads.  They only run on a dispatcher that
+     * runs if the thread sleeps, and the only thread that the dispatcher will
+     * ever see in its run queue is this thread.  These special threads
+     * have _wiredDispatcherp set to the dispatcher in question, and they
+     * override their thread's queue function to always put the thread
+     * in the wiredDispatcher's runQueue.  That dispatcher isn't in allDispatchers,
+     * so normal round robin threads never get queued to it.
+     */
+    ThreadDispatcher *_wiredDispatcherp;
 
     /* total run time in ticks for this thread */
     uint64_t _runTicks;
@@ -174,42 +281,23 @@ class Thread {
     /* last time this thread was started, for computing run time at next blocking */
     uint64_t _lastStartTicks;
 
-    /* When we're blocked, the lock clock is space available for the
-     * locking package to make use of to ensure fairness, by tracking
-     * how long a thread has been waiting for a lock/resource.
-     */
-    uint32_t _lockClock;
-
-    /* list of threads waiting for join */
-    ThreadEntry _joinEntry;
-
-    /* the mutex that we're blocked on, or null if not blocked on a mutex */
-    ThreadMutex *_blockingMutexp;
-
-    /* context used for deadlock detector */
-    uint32_t _marked;
-
     /* context available for use by task while it is asleep, so anyone waking us up
      * knows why we slept.  Lets our read/write locks indicate how to wake them up,
      */
     uint64_t _sleepContext;
 
-    /* set to the current dispatcher when a thread is loaded onto a processor */
-    ThreadDispatcher *_currentDispatcherp; /* current dispatcher for running thread */
-
-    /* certain threads are really pthreads.  They only run on a dispatcher that
-     * runs if the thread sleeps, and the only thread that the dispatcher will
-     * ever see in its run queue is this thread.  These special threads
-     * have _wiredDispatcherp set to the dispatcher in question, and they
-     * override their thread's queue function to always put the thread
-     * in the wiredDispatcher's runQueue.  That dispatcher isn't in allDispatchers,
-     * so normal round robin threads never get queued to it.
+    /* the mutex or read/write lock that we're blocked on, or null.
+     * The deadlock detector reads these without locks; see the
+     * detector's fields below, and setBlockingLock.
      */
-    ThreadDispatcher *_wiredDispatcherp;
+    ThreadMutex *_blockingMutexp;
+    ThreadLockRw *_blockingRwp;
 
-    /* pointer to base of stack, and count */
-    uint32_t _stackSize;
-    char *_stackp;
+    /* When we're blocked, the lock clock is space available for the
+     * locking package to make use of to ensure fairness, by tracking
+     * how long a thread has been waiting for a lock/resource.
+     */
+    uint32_t _lockClock;
 
  private:
     /* used by getcontext to differentiate between when the dispatcher calls it to
@@ -226,7 +314,7 @@ class Thread {
      * change, but we should wait until we can do the 64 bit x86
      * version at the same time.
      */
-    int _goingToSleep;
+    uint8_t _goingToSleep;
 
     /* flag set if exited thread should hang around until joined */
     uint8_t _joinable;
@@ -234,13 +322,44 @@ class Thread {
     /* flag set if we're in the joinThreads queue */
     uint8_t _inJoinThreads;
 
-    /* non-null if _joiningThreadp called join on us, and we weren't ready; protected
-     * by globalThreadLock.
-     */
-    Thread *_joiningThreadp;
-    void *_exitValuep;
     uint8_t _exited;
 
+    /* non-zero if queueThread should put us at the head of the run queue */
+    uint8_t _priority;
+
+ public:
+    /* pointer to base of stack, and count */
+    uint32_t _stackSize;
+    char *_stackp;
+
+ private:
+    /* everything not needed for dispatching; see ThreadCold */
+    ThreadCold *_coldp;
+
+    /* fiber-local slots, indexed by key; allocated on the first setLocal call */
+    void **_localsp;
+
+ public:
+    /* so we have a list of all threads that exist, so gdb can find them all */ 
+    ThreadEntry _allEntry;
+
+    /* only used by the deadlock detector, so kept clear of the fields
+     * above that the dispatcher touches on every switch.  Each wait
+     * bumps _blockSeq, telling one wait on a lock from the next, and
+     * notes when it started in _blockedUs.  While the detector is
+     * active, the lock's code also keeps the threads holding the lock
+     * we're blocked on in _blockingHolders, under its spin lock; the
+     * detector reads these instead of the lock.  _holdersSeq is odd
+     * while they're being changed; see setBlockingHolders.
+     */
+    static const uint32_t _maxBlockingHolders = 8;
+    uint32_t _blockSeq;
+    uint32_t _blockingHolderCount;
+    uint32_t _holdersSeq;
+    long long _blockedUs;
+    Thread *_blockingHolders[_maxBlockingHolders];
+
+ private:
     /* Internal C function called by the first activation of a thread
      * by makecontext.  Note that its signature is defined by the C
      * library, and we may have to split a context pointer across two
@@ -249,13 +368,31 @@ class Thread {
      */
     static void ctxStart(unsigned int p1, unsigned int p2);
 
+    /* run destructors for all non-null fiber-local slots */
+    void runLocalDestructors();
+
+    /* return the cold block, creating it if necessary */
+    ThreadCold *cold() {
+        if (!_coldp)
+            _coldp = new ThreadCold(_defaultNamep);
+        return _coldp;
+    }
+
  public:
     Thread(std::string name, uint32_t stackSize=0) {
-        init(name, stackSize);
+        init(internName(name), stackSize);
+    }
+
+    /* a thread without a stack or context, which stands in for a
+     * stackless waiter, like a coroutine, in lock wait queues.  It
+     * can never be resumed, so it must override queue.
+     */
+    Thread(ThreadStackless) {
+        init(NULL, 0, 1);
     }
 
     Thread(uint32_t stackSize=0) {
-        init("[None]", stackSize);
+        init(NULL, stackSize);
     }
 
     virtual ~Thread();
@@ -268,6 +405,7 @@ class Thread {
      * freed until the thread is joined.
      */
     void setJoinable() {
+        cold();
         _joinable = 1;
     }
 
@@ -293,13 +431,103 @@ class Thread {
     void sleep(SpinLock *lockp);
 
     /* queued to start a task that's been put to sleep, or freshly
-     * constructed.  Can be overridden to splice in a queue that uses
-     * a dedicated dispatcher.
+     * constructed.  Puts us on queueDispatcher's run queue; can be
+     * overridden to do something else entirely, in which case
+     * queueDispatcher must be overridden to return NULL.
      */
     virtual void queue();
 
+    /* the dispatcher queue puts us on, which queueBatch uses to place
+     * us without calling queue; by default, one picked by hashing our
+     * address.  Override it to use a dedicated dispatcher, or to return
+     * NULL if queue has been overridden, so queueBatch calls that.
+     */
+    virtual ThreadDispatcher *queueDispatcher();
+
+    /* queue all of the threads on threadsp, which are linked through
+     * their _dqNextp fields, taking each dispatcher's run queue lock, and
+     * waking it, once for all of the threads going to it.
+     */
+    static void queueBatch(dqueue<Thread> *threadsp);
+
     static Thread *getCurrent();
 
+    /* true if the thread is loaded on a dispatcher right now.  Only a
+     * hint, since it can stop running as soon as we look; used to decide
+     * whether spinning for something the thread holds is worthwhile.
+     */
+    int isRunning();
+
+    /* called by the locks, before this thread waits for mutexp or rwp,
+     * and with both null once it's done waiting.
+     */
+    void setBlockingLock(ThreadMutex *mutexp, ThreadLockRw *rwp) {
+        if (mutexp || rwp) {
+            _blockSeq++;
+            _blockedUs = osp_getUs();
+        }
+        __atomic_store_n(&_blockingMutexp, mutexp, __ATOMIC_RELEASE);
+        __atomic_store_n(&_blockingRwp, rwp, __ATOMIC_RELEASE);
+    }
+
+    /* called by the locks, holding their spin lock, with the threads
+     * that hold the lock this thread waits for; only the first
+     * _maxBlockingHolders are kept.  Calls are serialized by the spin
+     * lock, but the deadlock detector reads these at any time, so it
+     * retries if _holdersSeq changed, or was odd, while it looked.
+     */
+    void setBlockingHolders(Thread **holderspp, uint32_t count) {
+        uint32_t i;
+
+        if (count > _maxBlockingHolders)
+            count = _maxBlockingHolders;
+        __atomic_store_n(&_holdersSeq, _holdersSeq+1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        for(i=0;i<count;i++)
+            __atomic_store_n(&_blockingHolders[i], holderspp[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&_blockingHolderCount, count, __ATOMIC_RELAXED);
+        __atomic_store_n(&_holdersSeq, _holdersSeq+1, __ATOMIC_RELEASE);
+    }
+
+    void setBlockingHolder(Thread *holderp) {
+        setBlockingHolders(&holderp, (holderp? 1 : 0));
+    }
+
+    /* start running a callable (typically a lambda) on a lightweight
+     * thread, without defining a Thread subclass.  Threads are taken
+     * from a pool, and captures of up to ThreadClosure::_inlineBytes
+     * bytes are stored in the thread itself, so a warm spawn doesn't
+     * allocate at all.  The callable may return void or a pointer.
+     *
+     * Returns NULL, unless options._joinable is set, in which case the
+     * caller must call join on the returned thread, followed by
+     * releaseThread (not delete) to return it to the pool.
+     */
+    template<class F>
+    static Thread *spawn(const char *namep,
+                         F &&fn,
+                         ThreadSpawnOptions options = ThreadSpawnOptions());
+
+    void setPriority(uint8_t priority) {
+        _priority = priority;
+    }
+
+    /* allocate a fiber-local storage key, with an optional destructor
+     * that's called at thread exit for every thread with a non-null
+     * value in that slot.  Returns -1 if all keys are in use.
+     */
+    static int32_t allocLocalKey(LocalDestructor *destructorp = NULL);
+
+    /* O(1) access to this thread's value for a key; the slots are
+     * private to each lightweight thread, unlike pthread_getspecific,
+     * which is shared by all threads running on the same dispatcher.
+     */
+    void *getLocal(uint32_t key) {
+        return (_localsp? _localsp[key] : NULL);
+    }
+
+    void setLocal(uint32_t key, void *valuep);
+
     static uint32_t getDefaultStackSize() {
         return _defaultStackSize;
     }
@@ -307,15 +535,35 @@ class Thread {
     void exit(void *exitCodep);
 
     void setName(std::string name) {
-        _name = name;
+        cold()->setName(internName(name));
     }
 
-    std::string& name() {
-        return _name;
+    /* the returned string stays valid until the thread is renamed or
+     * destroyed; copy it to keep it any longer.
+     */
+    const char *name() {
+        return (_coldp? _coldp->_namep : _defaultNamep);
     }
 
+    /* return a copy of name, shared with all other users of the same name.
+     * Each call holds a reference on the copy, which releaseName drops.
+     */
+    static const char *internName(const std::string &name);
+
+    /* drop a reference from internName; ignores _defaultNamep */
+    static void releaseName(const char *namep);
+
     int32_t join(void **ptrpp);
 
+    /* join for stackless waiters: returns 1 if the thread has already
+     * exited, otherwise records waiterp, whose queue method is called
+     * when the thread exits, and returns 0.  Either way, the waiter
+     * then calls joinFinish to collect the exit value.
+     */
+    int joinStart(Thread *waiterp);
+
+    int32_t joinFinish(void **ptrpp);
+
     /* provide a way for someone to add reference counts and intercept our
      * deletion of the thread.  Note that Thread::exit will call this
      * on a different thread than the exiting thread (so that we don't free
@@ -340,24 +588,372 @@ class Thread {
     static void displayStackUsage();
 
  private:
-    /* internal function used in constructing a task */
-    void init(std::string name, uint32_t stackSize);
+    /* internal function used in constructing a task; namep must be interned */
+    void init(const char *namep, uint32_t stackSize, int stackless = 0);
+
+    /* internal: (re)build the context so the next resume calls ctxStart */
+    void initContext();
 
     void resume();
 };
 
+/* the thread type used by Thread::spawn.  Non-joinable closures park
+ * themselves in a free pool when their callable returns, still running
+ * inside their start method, so reusing one is just a matter of storing
+ * the next callable and queueing the thread.  Joinable closures exit
+ * normally, and are returned to the pool by releaseThread after the join,
+ * with their context reset.
+ *
+ * Only threads with the default stack size are pooled.
+ */
+class ThreadClosure : public Thread {
+ public:
+    /* captures up to this size are stored inline */
+    static const uint32_t _inlineBytes = 64;
+
+    /* most threads we'll keep in the pool */
+    static const uint32_t _maxPooled = 1024;
+
+ private:
+    typedef void *(InvokeProc) (void *storagep);
+    typedef void (DestroyProc) (void *storagep, int isInline);
+
+    static SpinLock _poolLock;
+    static ThreadClosure *_poolHeadp;
+    static uint32_t _poolCount;
+
+    alignas(16) char _inline[_inlineBytes];
+    void *_storagep;
+    InvokeProc *_invokep;
+    DestroyProc *_destroyp;
+    ThreadClosure *_poolNextp;
+
+    template<class F> static void *invoke(void *storagep) {
+        F *fnp = (F *) storagep;
+        if constexpr (std::is_void<decltype((*fnp)())>::value) {
+            (*fnp)();
+            return NULL;
+        }
+        else {
+            return (void *) (*fnp)();
+        }
+    }
+
+    template<class F> static void destroy(void *storagep, int isInline) {
+        F *fnp = (F *) storagep;
+        if (isInline)
+            fnp->~F();
+        else
+            delete fnp;
+    }
+
+    /* return the thread to the pool, or free it if the pool is full */
+    void recycle();
+
+ public:
+    ThreadClosure(uint32_t stackSize) : Thread(stackSize) {
+        _storagep = NULL;
+        _invokep = NULL;
+        _destroyp = NULL;
+        _poolNextp = NULL;
+    }
+
+    /* get a pooled thread, or make a new one */
+    static ThreadClosure *alloc(uint32_t stackSize);
+
+    template<class F> void setCallable(F &&fn) {
+        typedef typename std::decay<F>::type FnType;
+
+        if (sizeof(FnType) <= _inlineBytes && alignof(FnType) <= 16) {
+            _storagep = new (_inline) FnType(std::forward<F>(fn));
+        }
+        else {
+            _storagep = new FnType(std::forward<F>(fn));
+        }
+        _invokep = &ThreadClosure::invoke<FnType>;
+        _destroyp = &ThreadClosure::destroy<FnType>;
+    }
+
+    /* set the per-spawn state and queue the thread */
+    void launch(const char *namep, ThreadSpawnOptions &options);
+
+    void *start();
+
+    void releaseThread();
+};
+
+template<class F> Thread *
+Thread::spawn(const char *namep, F &&fn, ThreadSpawnOptions options)
+{
+    ThreadClosure *threadp;
+
+    threadp = ThreadClosure::alloc(options._stackSize);
+    threadp->setCallable(std::forward<F>(fn));
+    threadp->launch(namep, options);
+
+    return (options._joinable? threadp : NULL);
+}
+
+/* collects a group of joinable threads, so that a caller can wait for
+ * whichever finishes first, or for all of them, with a single sleep per
+ * wakeup instead of a join per thread.  Typical use:
+ *
+ *      for(i=0;i<n;i++)
+ *          set.add(Thread::spawn(NULL, fn, ThreadSpawnOptions().joinable()));
+ *      while((threadp = set.waitAny(&valuep)) != NULL) {
+ *          ...
+ *          threadp->releaseThread();
+ *      }
+ *
+ * waitAny returns threads in the order they exited, already joined;
+ * the caller then deletes them (or, for spawned threads, calls
+ * releaseThread).  Only one thread may wait on a set at a time, and
+ * every thread added must be collected by waitAny before the set is
+ * deleted.  The set's state is protected by Thread::_globalThreadLock.
+ */
+class ThreadJoinSet {
+    friend class Thread;
+
+    /* exited members, waiting to be returned by waitAny */
+    dqueue<ThreadEntry> _done;
+
+    /* members that haven't exited yet */
+    uint32_t _pending;
+
+    Thread *_waiterp;
+    uint8_t _waitAll;
+
+    /* called by Thread::exit with the global lock held */
+    void threadExitedNL(Thread *threadp);
+
+ public:
+    ThreadJoinSet() {
+        _pending = 0;
+        _waiterp = NULL;
+        _waitAll = 0;
+    }
+
+    /* add a joinable thread, which may already have exited, but which
+     * no one may have joined.
+     */
+    void add(Thread *threadp);
+
+    /* return the next thread to exit, with its exit value in *valuepp;
+     * returns NULL if the set is empty.
+     */
+    Thread *waitAny(void **valuepp = NULL);
+
+    /* wait until every member has exited; they still need to be
+     * collected with waitAny, which won't block.
+     */
+    void waitAll();
+
+    /* members not yet returned by waitAny */
+    uint32_t count();
+};
+
+/* typed wrapper around a fiber-local key; each lightweight thread that calls
+ * get() gets its own default-constructed T, which is deleted when that thread
+ * exits.  Typically declared static, since keys are never freed.
+ */
+template<class T> class ThreadLocal {
+    int32_t _key;
+
+    static void destroy(void *valuep) {
+        delete (T *) valuep;
+    }
+
+ public:
+    ThreadLocal() {
+        _key = Thread::allocLocalKey(&ThreadLocal<T>::destroy);
+        osp_assert(_key >= 0);
+    }
+
+    T *get() {
+        Thread *threadp = Thread::getCurrent();
+        T *valuep = (T *) threadp->getLocal(_key);
+        if (!valuep) {
+            valuep = new T();
+            threadp->setLocal(_key, valuep);
+        }
+        return valuep;
+    }
+
+    T *operator->() {
+        return get();
+    }
+
+    T &operator*() {
+        return *get();
+    }
+};
+
+/* a stackless, run-to-completion unit of work.  A dispatcher runs
+ * queued tasks directly on its idle thread's stack, ahead of its
+ * runnable threads, so submitting a task is just a run queue push,
+ * with no stack or context to set up.
+ *
+ * A task may still block on any of the usual primitives (ThreadMutex,
+ * ThreadCond, EpollEvent, etc).  If run sleeps, the idle thread it's
+ * running on is promoted to a regular thread that finishes the task
+ * once woken, and the dispatcher carries on using a spare idle thread.
+ *
+ * Thread::getCurrent returns the idle thread while a task runs, and
+ * any fiber-local values set by the task are destroyed when it returns.
+ */
+class ThreadTask {
+ public:
+    ThreadTask *_dqNextp;
+    ThreadTask *_dqPrevp;
+
+    ThreadTask() {
+        _dqNextp = NULL;
+        _dqPrevp = NULL;
+    }
+
+    virtual ~ThreadTask() {}
+
+    virtual void run() = 0;
+
+    /* called once run has returned; override to reuse embedded tasks */
+    virtual void releaseTask() {
+        delete this;
+    }
+
+    /* queue the task to a dispatcher */
+    void queue();
+
+    /* run a callable (typically a lambda) as a task */
+    template<class F> static void submit(F &&fn);
+};
+
+template<class F> class ThreadTaskClosure : public ThreadTask {
+    F _fn;
+
+ public:
+    template<class G> ThreadTaskClosure(G &&fn) : _fn(std::forward<G>(fn)) {}
+
+    void run() {
+        _fn();
+    }
+};
+
+template<class F> void
+ThreadTask::submit(F &&fn)
+{
+    typedef typename std::decay<F>::type FnType;
+
+    (new ThreadTaskClosure<FnType>(std::forward<F>(fn)))->queue();
+}
+
+/* fork-join groups for divide-and-conquer work.  The owning thread
+ * (or task) calls spawn for each child, and then sync, which returns
+ * once all the children have finished:
+ *
+ *      ThreadGroup group;
+ *      group.spawn([&]() { left = sum(lop, mid); });
+ *      right = sum(mid, hip);
+ *      group.sync();
+ *
+ * spawn runs the child as a task on an idle dispatcher if there is
+ * one, and otherwise just calls it inline, since no one could run it
+ * any sooner.  Children can spawn into groups of their own.  The
+ * counter starts with a reference held by the owner, which sync drops,
+ * so only the last child to finish touches the lock, to wake the owner.
+ *
+ * Only the owner may call spawn and sync; the group can be reused
+ * once sync returns.
+ */
+class ThreadGroup {
+    template<class F> friend class ThreadGroupTask;
+
+    /* children outstanding, plus one for the owner until it syncs */
+    std::atomic<uint32_t> _pending;
+    SpinLock _lock;
+    Thread *_waiterp;
+
+    /* stats: children run inline and as tasks */
+    uint32_t _inlined;
+    uint32_t _queued;
+
+    void childDone();
+
+ public:
+    ThreadGroup() {
+        _pending = 1;
+        _waiterp = NULL;
+        _inlined = 0;
+        _queued = 0;
+    }
+
+    template<class F> void spawn(F &&fn);
+
+    void sync();
+
+    uint32_t getInlined() {
+        return _inlined;
+    }
+
+    uint32_t getQueued() {
+        return _queued;
+    }
+};
+
+template<class F> class ThreadGroupTask : public ThreadTask {
+    ThreadGroup *_groupp;
+    F _fn;
+
+ public:
+    template<class G> ThreadGroupTask(ThreadGroup *groupp, G &&fn)
+        : _groupp(groupp), _fn(std::forward<G>(fn)) {}
+
+    void run() {
+        _fn();
+    }
+
+    /* free the callable before the owner can see the child finish */
+    void releaseTask() {
+        ThreadGroup *groupp = _groupp;
+
+        delete this;
+        groupp->childDone();
+    }
+};
+
 /* this thread provides a context for running the dispatcher, so that when a thread
  * blocks, we can run the dispatcher without staying on the same stack.
+ *
+ * Idle threads are also the stacks that tasks run on; when a task
+ * blocks, its idle thread is promoted, and after the task finishes, the
+ * thread parks itself in a pool of idle threads to be reused.
  */
 class ThreadIdle : public Thread {
+    /* most promoted idle threads we'll keep around */
+    static const uint32_t _maxPooled = 64;
+
+    static SpinLock _poolLock;
+    static ThreadIdle *_poolHeadp;
+    static uint32_t _poolCount;
+
  public:
     SpinLock *_userLockToReleasep;
     ThreadDispatcher *_disp;
+    ThreadIdle *_poolNextp;
+    uint8_t _promoted;          /* a task blocked on this thread's stack */
 
     void *start();
 
+    /* get an idle thread for a dispatcher, from the pool if possible */
+    static ThreadIdle *alloc(ThreadDispatcher *disp);
+
+    /* called by a promoted thread when its task is done; doesn't return */
+    void retire();
+
      ThreadIdle() : Thread("Idle thread") {
         _userLockToReleasep = NULL;
+        _disp = NULL;
+        _poolNextp = NULL;
+        _promoted = 0;
     }
 
     void setLock(SpinLock *lockp) {
@@ -379,7 +975,7 @@ class ThreadMain : public Thread {
  public:
 
     /* overridden to place the thread back in the wired dispatcher's run queue */
-    void queue();
+    ThreadDispatcher *queueDispatcher();
 
     ThreadMain(std::string name) : Thread(name) {
         return;
@@ -432,17 +1028,73 @@ class ThreadHelper : public Thread {
     }
 };
 
+class ThreadCancelWait;
+
+/* internal: a timeout for a thread blocked in a timed wait, like
+ * ThreadMutex::takeFor.  The timer lives in the waiting call's stack
+ * frame, and is kept on a list in the dispatcher the call started on,
+ * which checks for expired timers as it dispatches, so timed waits need
+ * no allocation, no timer pthread and no global lock.  When the timer
+ * expires, the dispatcher calls the ThreadCancelWait's cancel method,
+ * which removes the thread from its wait queue and wakes it, just as a
+ * canceled ThreadCancel token would.  Expiration is checked each time
+ * the dispatcher looks at its run queue, so a dispatcher kept busy by a
+ * single thread that never blocks delays its timers.
+ */
+class ThreadWaitTimer {
+ public:
+    ThreadWaitTimer *_dqNextp;
+    ThreadWaitTimer *_dqPrevp;
+    ThreadCancelWait *_waitp;
+    ThreadDispatcher *_dispatcherp;
+    long long _expirationUs;
+    uint8_t _inList;            /* in the dispatcher's list */
+    uint8_t _busy;              /* the dispatcher is running our cancel method */
+    std::atomic<uint8_t> _fired;
+
+    ThreadWaitTimer(ThreadCancelWait *waitp) {
+        _dqNextp = NULL;
+        _dqPrevp = NULL;
+        _waitp = waitp;
+        _dispatcherp = NULL;
+        _expirationUs = 0;
+        _inList = 0;
+        _busy = 0;
+        _fired = 0;
+    }
+
+    /* arm the timer; called once, or again after stop.  A timed wait
+     * calls it holding the spin lock that the cancel method takes,
+     * before the thread is visible in its wait queue.
+     */
+    void start(uint32_t ms);
+
+    /* disarm the timer, waiting for a running cancel method to finish;
+     * must be called, without spin locks held, before the timer goes away.
+     */
+    void stop();
+
+    int fired() {
+        return _fired.load(std::memory_order_acquire);
+    }
+};
+
 class ThreadDispatcherQueue {
     friend class ThreadDispatcher;
     friend class Thread;
 
     dqueue<Thread> _queue;
+    dqueue<ThreadTask> _tasks;
     SpinLock _queueLock;
 };
 
 class ThreadDispatcher {
     friend class Thread;
     friend class ThreadDispatcherQueue;
+    friend class ThreadTask;
+    friend class ThreadWaitTimer;
+    friend class ThreadRcu;
+    friend void ThreadDispatcherCleanup(void *arg);
 
  public:
     static const long _maxDispatchers=8;
@@ -451,9 +1103,18 @@ class ThreadDispatcher {
     static pthread_once_t _once;
     static pthread_key_t _dispatcherKey;
 
+    /* the dispatcher running on this pthread; read by Thread::getCurrent
+     * instead of calling pthread_getspecific.  The key above is still
+     * used, so that the dispatcher is freed when its pthread exits.
+     */
+    static thread_local ThreadDispatcher *_tlsDispatcherp;
+
     static ThreadDispatcher *_allDispatchers[_maxDispatchers];
     static uint16_t _dispatcherCount;
 
+    /* our index in _allDispatchers, or -1 for a special dispatcher */
+    int16_t _ix;
+
     /* queue of pending locks */
     ThreadDispatcherQueue _runQueue;
 
@@ -470,6 +1131,11 @@ class ThreadDispatcher {
 
     Thread *_currentThreadp;
     int _sleeping;
+
+    /* set when dispatch finds the run queue empty, and cleared when
+     * work is queued; read without locks by findIdle.
+     */
+    uint8_t _idle;
     pthread_cond_t _runCV;
     pthread_mutex_t _runMutex;
     uint64_t _lastDispatchTicks;
@@ -478,17 +1144,77 @@ class ThreadDispatcher {
     static uint32_t _spinTicks;
 
     /* an idle thread that provides a thread with a stack on which we can run
-     * the dispatcher.
+     * the dispatcher.  The spare is switched to if a task running on the
+     * idle thread blocks; it's allocated before running a task, so that we
+     * never allocate while sleep holds the caller's spin lock.
      */
-    ThreadIdle _idle;
+    ThreadIdle *_idlep;
+    ThreadIdle *_spareIdlep;
     ThreadHelper _helper;
 
+    /* count of tasks that blocked and were promoted to threads */
+    uint64_t _taskPromotions;
+
+    /* tasks run since we last ran a thread; after _maxTaskRun of them,
+     * a queued thread goes next, so tasks that keep requeueing tasks
+     * can't starve the threads.
+     */
+    static const uint32_t _maxTaskRun = 16;
+    uint32_t _taskRun;
+
+    /* ThreadWaitTimers started on this dispatcher, sorted by
+     * expiration, and the first expiration, or LLONG_MAX if there are
+     * none, which dispatch reads without the lock.
+     */
+    SpinLock _timerLock;
+    dqueue<ThreadWaitTimer> _timers;
+    std::atomic<long long> _nextTimerUs;
+
+    /* odd while a thread or task runs on us, and even while we're in
+     * the dispatch loop, which is a quiescent state for ThreadRcu.
+     * Only we write it.
+     */
+    std::atomic<uint64_t> _rcuCount;
+
+    /* entering and leaving dispatch's quiescent state; leaving it is a
+     * full barrier, so that the thread we run can't read RCU pointers
+     * before a synchronizer can see that we're running it.
+     */
+    void rcuRunning() {
+        _rcuCount.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    void rcuQuiescent() {
+        uint64_t count = _rcuCount.load(std::memory_order_relaxed);
+
+        if (count & 1)
+            _rcuCount.store(count + 1, std::memory_order_release);
+    }
+
     static void globalInit();
 
     static ThreadDispatcher *currentDispatcher();
 
     static void *dispatcherTop(void *ctx);
 
+    /* run a task on the idle thread's stack */
+    void runTask(ThreadTask *taskp);
+
+    /* release the run queue lock, waking the dispatcher if it's sleeping */
+    void releaseQueueAndWake();
+
+    /* fire the expired ThreadWaitTimers */
+    void runTimers();
+
+    int idleUntilNL(long long untilUs);
+
+    /* called with _timerLock held */
+    void updateNextTimerNL() {
+        ThreadWaitTimer *timerp = _timers.head();
+
+        _nextTimerUs.store(timerp? timerp->_expirationUs : LLONG_MAX, std::memory_order_relaxed);
+    }
+
  public:
     /* called to put thread to sleep on current dispatcher, and then dispatch
      * more threads.
@@ -498,6 +1224,39 @@ class ThreadDispatcher {
     /* queue this thread on this dispatcher */
     void queueThread(Thread *threadp);
 
+    /* queue a list of threads on this dispatcher */
+    void queueThreads(dqueue<Thread> *threadsp);
+
+    /* queue a task on this dispatcher */
+    void queueTask(ThreadTask *taskp);
+
+    /* total tasks promoted to threads, over all dispatchers */
+    static uint64_t getTaskPromotions();
+
+    /* the dispatcher with index ix (modulo the count) from setup, for
+     * threads that want to pin themselves to a dispatcher.
+     */
+    static ThreadDispatcher *getDispatcher(uint16_t ix);
+
+    /* a dispatcher with an empty run queue, or NULL if they're all
+     * busy.  Only a hint, since the answer can change immediately.
+     */
+    static ThreadDispatcher *findIdle();
+
+    static uint16_t getDispatcherCount() {
+        return _dispatcherCount;
+    }
+
+    /* index of the calling pthread's dispatcher, from 0 to
+     * _maxDispatchers-1, or -1 if it's a special dispatcher, like the
+     * ones pthreads get from pthreadTop.
+     */
+    static int currentIndex() {
+        ThreadDispatcher *disp = _tlsDispatcherp;
+
+        return (disp? disp->_ix : -1);
+    }
+
     /* called to look for work in the run queue, or wait until some shows up */
     void dispatch();
 
@@ -535,6 +1294,35 @@ class ThreadDispatcher {
     static bool isLwt();
 };
 
+/* defined here, since it needs ThreadDispatcher */
+template<class F> void
+ThreadGroup::spawn(F &&fn)
+{
+    typedef typename std::decay<F>::type FnType;
+    ThreadDispatcher *disp;
+
+    disp = ThreadDispatcher::findIdle();
+    if (!disp) {
+        _inlined++;
+        fn();
+        return;
+    }
+
+    _queued++;
+    _pending.fetch_add(1, std::memory_order_relaxed);
+    disp->queueTask(new ThreadGroupTask<FnType>(this, std::forward<F>(fn)));
+}
+
+/* defined here, since it needs ThreadDispatcher */
+inline int
+Thread::isRunning()
+{
+    ThreadDispatcher *disp;
+
+    disp = __atomic_load_n(&_currentDispatcherp, __ATOMIC_RELAXED);
+    return (disp && __atomic_load_n(&disp->_currentThreadp, __ATOMIC_RELAXED) == this);
+}
+
 /* lollipop comparison */
 int threadClockCmp(uint32_t a, uint32_t b);
 
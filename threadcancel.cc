@@ -0,0 +1,83 @@
+#include "threadcancel.h"
+
+/* called by the dispatcher running the deadline timer; stop waits for
+ * us to finish, so the token can't go away underneath us.
+ */
+void
+ThreadDeadlineWait::cancel()
+{
+    _cancelp->cancel();
+}
+
+ThreadCancel::~ThreadCancel()
+{
+    _deadlineMutex.take();
+    _deadlineTimer.stop();
+    _deadlineMutex.release();
+}
+
+void
+ThreadCancel::setDeadline(uint32_t ms)
+{
+    _deadlineMutex.take();
+    _deadlineTimer.stop();
+    _deadlineTimer.start(ms);
+    _deadlineMutex.release();
+}
+
+/* wake everyone blocked on the token.  We can't hold our spin lock
+ * while calling a wait's cancel method, since blocking operations
+ * call addWait while holding their own spin locks.  Instead, we mark
+ * the wait busy, so that its thread waits in removeWait until we're
+ * done with it.
+ */
+void
+ThreadCancel::cancel()
+{
+    ThreadCancelWait *waitp;
+
+    _lock.take();
+    _canceled = 1;
+    while((waitp = _waits.pop()) != NULL) {
+        waitp->_inList = 0;
+        waitp->_busy = 1;
+        _lock.release();
+
+        waitp->cancel();
+
+        _lock.take();
+        waitp->_busy = 0;
+    }
+    _lock.release();
+}
+
+int32_t
+ThreadCancel::addWait(ThreadCancelWait *waitp)
+{
+    _lock.take();
+    if (_canceled) {
+        _lock.release();
+        return TC_ERR_CANCELED;
+    }
+    _waits.append(waitp);
+    waitp->_inList = 1;
+    _lock.release();
+    return TC_OK;
+}
+
+void
+ThreadCancel::removeWait(ThreadCancelWait *waitp)
+{
+    _lock.take();
+    if (waitp->_inList) {
+        _waits.remove(waitp);
+        waitp->_inList = 0;
+    }
+
+    /* the canceler is on another dispatcher, and only holds spin locks */
+    while(waitp->_busy) {
+        _lock.release();
+        _lock.take();
+    }
+    _lock.release();
+}
@@ -0,0 +1,116 @@
+#ifndef __THREADCANCEL_H_ENV__
+#define __THREADCANCEL_H_ENV__ 1
+
+#include "thread.h"
+#include "threadmutex.h"
+#include "dqueue.h"
+
+/* usage: create a ThreadCancel for a request, and pass it to the
+ * blocking calls made on the request's behalf: ThreadMutex::take,
+ * ThreadCond::wait, EpollEvent::wait, ThreadPipe::read and write, and
+ * ThreadTimer::sleep all have variants taking a token.  Calling cancel
+ * on the token, or letting its deadline pass, wakes every call blocked
+ * on the token, removing each from its wait queue, and those calls
+ * return TC_ERR_CANCELED.  Once canceled, calls using the token fail
+ * immediately instead of blocking, though they still succeed if they
+ * don't have to wait.
+ *
+ * ThreadCond::wait reobtains the mutex before returning, canceled or
+ * not.  ThreadPipe calls that were canceled after transferring some
+ * data return the byte count; the next call returns the error.
+ *
+ * A deadline is a ThreadWaitTimer on the dispatcher of the thread
+ * that set it, so setDeadline must be called from a lightweight
+ * thread.  The token must not be deleted while calls are blocked on
+ * it.
+ */
+
+/* internal: one of these is registered with a token by each blocked
+ * call.  The cancel method removes the blocked thread from its wait
+ * queue (setting _removed if it was still there), and then queues it.
+ */
+class ThreadCancelWait {
+ public:
+    ThreadCancelWait *_dqNextp;
+    ThreadCancelWait *_dqPrevp;
+    Thread *_threadp;
+    uint8_t _inList;            /* in the token's queue */
+    uint8_t _busy;              /* cancel method is running */
+    uint8_t _removed;           /* cancel dequeued the thread */
+
+    ThreadCancelWait(Thread *threadp) {
+        _dqNextp = NULL;
+        _dqPrevp = NULL;
+        _threadp = threadp;
+        _inList = 0;
+        _busy = 0;
+        _removed = 0;
+    }
+
+    virtual void cancel() = 0;
+
+    virtual ~ThreadCancelWait() {}
+};
+
+class ThreadCancel;
+
+/* internal: the deadline timer's hook, which cancels the token */
+class ThreadDeadlineWait : public ThreadCancelWait {
+    ThreadCancel *_cancelp;
+
+ public:
+    ThreadDeadlineWait(ThreadCancel *cancelp) : ThreadCancelWait(NULL) {
+        _cancelp = cancelp;
+    }
+
+    void cancel();
+};
+
+class ThreadCancel {
+ public:
+    enum Error {
+        TC_OK = 0,
+        TC_ERR_CANCELED = -2
+    };
+
+ private:
+    SpinLock _lock;
+    uint8_t _canceled;
+    dqueue<ThreadCancelWait> _waits;
+
+    /* the deadline; _deadlineMutex serializes setDeadline and the
+     * destructor, but the timer firing doesn't need it.
+     */
+    ThreadMutex _deadlineMutex;
+    ThreadDeadlineWait _deadlineWait;
+    ThreadWaitTimer _deadlineTimer;
+
+ public:
+    ThreadCancel() : _deadlineWait(this), _deadlineTimer(&_deadlineWait) {
+        _canceled = 0;
+    }
+
+    ~ThreadCancel();
+
+    /* cancel automatically in ms milliseconds, replacing any earlier deadline */
+    void setDeadline(uint32_t ms);
+
+    void cancel();
+
+    int isCanceled() {
+        return _canceled;
+    }
+
+    /* internal: called by a blocking operation holding the spin lock
+     * that its cancel method will need.  Returns TC_ERR_CANCELED
+     * without registering if the token's already been canceled.
+     */
+    int32_t addWait(ThreadCancelWait *waitp);
+
+    /* internal: called after waking, without holding any locks; waits
+     * for a cancel method running on waitp to finish.
+     */
+    void removeWait(ThreadCancelWait *waitp);
+};
+
+#endif /* __THREADCANCEL_H_ENV__ */
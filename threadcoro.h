@@ -0,0 +1,410 @@
+#ifndef __THREADCORO_H_ENV__
+#define __THREADCORO_H_ENV__ 1
+
+#include <coroutine>
+#include <exception>
+
+#include "thread.h"
+#include "threadmutex.h"
+#include "threadtimer.h"
+#include "epoll.h"
+
+/* usage: C++20 coroutines that run on the lwt dispatchers, and that
+ * can wait for lwt primitives without tying up a stack.  Requires
+ * compiling with -std=c++20.
+ *
+ * A coroutine returns a ThreadCoro.  Calling it creates the coroutine
+ * suspended; call queue on the result to start it running on a
+ * dispatcher, after which the coroutine frees itself when it
+ * finishes.  Or, from another ThreadCoro coroutine, co_await the
+ * result to run it as a subroutine.
+ *
+ * Within a ThreadCoro coroutine, you can
+ *      co_await ThreadCoro::take(&mutex);
+ *      co_await ThreadCoro::release(&mutex);
+ *      co_await ThreadCoro::wait(&cv, &mutex);        mutex held
+ *      co_await ThreadCoro::wait(eventp, EpollEvent::epollIn, &code);
+ *      co_await ThreadCoro::sleep(ms);                 ThreadTimer::init'd
+ *      code = co_await ThreadCoro::join(threadp, &valuep);
+ *
+ * Mutexes must be released with ThreadCoro::release, rather than
+ * ThreadMutex::release, since lock ownership belongs to the
+ * coroutine, not to whichever thread happens to be running it.  A
+ * coroutine and the coroutines it awaits share the same identity, so
+ * a mutex taken in one can be released in another.  Signalling a
+ * ThreadCond or releasing a mutex that coroutines are waiting for
+ * works normally, from threads or coroutines.
+ *
+ * Whenever a coroutine is woken, it's resumed by a ThreadTask on a
+ * dispatcher's run queue, so it runs alongside the regular threads.
+ * Internally, each coroutine that needs to wait gets a stackless
+ * Thread, a ThreadCoroWaiter, which sits in the primitives' wait
+ * queues in its place; the waiter's queue method, instead of making
+ * a thread runnable, tells the awaiter to schedule the coroutine.
+ */
+
+class ThreadCoro;
+
+/* base class for awaiters that park a coroutine's waiter in a wait
+ * queue.  By default, a wakeup just schedules the coroutine.
+ */
+class ThreadCoroAwaiter {
+ public:
+    std::coroutine_handle<> _handle;
+
+    virtual void wake();
+
+    virtual ~ThreadCoroAwaiter() {}
+};
+
+/* the stackless thread standing in for a coroutine in wait queues */
+class ThreadCoroWaiter : public Thread {
+ public:
+    ThreadCoroAwaiter *_awaiterp;
+
+    ThreadCoroWaiter() : Thread(ThreadStackless()) {
+        _awaiterp = NULL;
+    }
+
+    void *start() {
+        thread_assert(0);
+        return NULL;
+    }
+
+    /* called by a primitive to wake us */
+    void queue() {
+        _awaiterp->wake();
+    }
+
+    /* we're never on a run queue, so queueBatch must call queue */
+    ThreadDispatcher *queueDispatcher() {
+        return NULL;
+    }
+};
+
+/* resumes a coroutine from a dispatcher's run queue */
+class ThreadCoroResume : public ThreadTask {
+    std::coroutine_handle<> _handle;
+
+ public:
+    ThreadCoroResume(std::coroutine_handle<> handle) {
+        _handle = handle;
+    }
+
+    void run() {
+        _handle.resume();
+    }
+};
+
+class ThreadCoro {
+ public:
+    class promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    class promise_type {
+     public:
+        /* set when awaited by another coroutine */
+        std::coroutine_handle<> _continuation;
+        promise_type *_parentp;
+
+        /* allocated the first time we wait for something */
+        ThreadCoroWaiter *_waiterp;
+
+        promise_type() {
+            _parentp = NULL;
+            _waiterp = NULL;
+        }
+
+        ~promise_type() {
+            if (_waiterp)
+                delete _waiterp;
+        }
+
+        /* return the waiter for this coroutine's outermost caller */
+        ThreadCoroWaiter *waiter() {
+            promise_type *rootp;
+
+            for(rootp = this; rootp->_parentp; rootp = rootp->_parentp)
+                ;
+            if (!rootp->_waiterp)
+                rootp->_waiterp = new ThreadCoroWaiter();
+            return rootp->_waiterp;
+        }
+
+        ThreadCoro get_return_object() {
+            return ThreadCoro(Handle::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return std::suspend_always();
+        }
+
+        /* continue with our caller, or free ourselves if queued */
+        class FinalAwaiter {
+         public:
+            bool await_ready() noexcept {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(Handle handle) noexcept {
+                std::coroutine_handle<> nextHandle = handle.promise()._continuation;
+                if (nextHandle)
+                    return nextHandle;
+                handle.destroy();
+                return std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept {
+            return FinalAwaiter();
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+ private:
+    Handle _handle;
+
+ public:
+    ThreadCoro(Handle handle) {
+        _handle = handle;
+    }
+
+    ThreadCoro(ThreadCoro &&other) {
+        _handle = other._handle;
+        other._handle = nullptr;
+    }
+
+    ThreadCoro(const ThreadCoro &) = delete;
+    ThreadCoro &operator=(const ThreadCoro &) = delete;
+
+    /* frees a coroutine that was never started, or that we awaited */
+    ~ThreadCoro() {
+        if (_handle)
+            _handle.destroy();
+    }
+
+    /* start the coroutine on a dispatcher; it frees itself when done */
+    void queue() {
+        Handle handle = _handle;
+        _handle = nullptr;
+        schedule(handle);
+    }
+
+    /* awaiting a ThreadCoro runs it immediately, and we continue
+     * when it finishes.
+     */
+    class CallAwaiter {
+        Handle _childHandle;
+
+     public:
+        CallAwaiter(Handle childHandle) {
+            _childHandle = childHandle;
+        }
+
+        bool await_ready() {
+            return false;
+        }
+
+        std::coroutine_handle<> await_suspend(Handle handle) {
+            _childHandle.promise()._continuation = handle;
+            _childHandle.promise()._parentp = &handle.promise();
+            return _childHandle;
+        }
+
+        void await_resume() {}
+    };
+
+    CallAwaiter operator co_await() && {
+        return CallAwaiter(_handle);
+    }
+
+    /* resume a coroutine from a dispatcher's run queue */
+    static void schedule(std::coroutine_handle<> handle) {
+        (new ThreadCoroResume(handle))->queue();
+    }
+
+    class TakeAwaiter : public ThreadCoroAwaiter {
+     protected:
+        ThreadMutex *_mutexp;
+        ThreadCoroWaiter *_waiterp;
+
+     public:
+        TakeAwaiter(ThreadMutex *mutexp) {
+            _mutexp = mutexp;
+            _waiterp = NULL;
+        }
+
+        bool await_ready() {
+            return false;
+        }
+
+        /* note that once takeOrQueue has queued us, we may be resumed
+         * on another dispatcher at any time, so don't touch this
+         * object after calling it.
+         */
+        bool await_suspend(Handle handle) {
+            _handle = handle;
+            _waiterp = handle.promise().waiter();
+            _waiterp->_awaiterp = this;
+            return !_mutexp->takeOrQueue(_waiterp);
+        }
+
+        /* the mutex was released; try again */
+        void wake() {
+            if (_mutexp->takeOrQueue(_waiterp))
+                schedule(_handle);
+        }
+
+        void await_resume() {}
+    };
+
+    class ReleaseAwaiter {
+        ThreadMutex *_mutexp;
+
+     public:
+        ReleaseAwaiter(ThreadMutex *mutexp) {
+            _mutexp = mutexp;
+        }
+
+        bool await_ready() {
+            return false;
+        }
+
+        /* never actually suspends */
+        bool await_suspend(Handle handle) {
+            _mutexp->releaseOwner(handle.promise().waiter());
+            return false;
+        }
+
+        void await_resume() {}
+    };
+
+    /* after the CV is signalled, this waits for the mutex just like
+     * TakeAwaiter, so it shares its wake method.
+     */
+    class CondAwaiter : public TakeAwaiter {
+        ThreadCond *_cvp;
+
+     public:
+        CondAwaiter(ThreadCond *cvp, ThreadMutex *mutexp) : TakeAwaiter(mutexp) {
+            _cvp = cvp;
+        }
+
+        void await_suspend(Handle handle) {
+            _handle = handle;
+            _waiterp = handle.promise().waiter();
+            _waiterp->_awaiterp = this;
+            _cvp->queueAndRelease(_waiterp, _mutexp);
+        }
+    };
+
+    class SleepAwaiter {
+        uint32_t _ms;
+
+        static void timerFired(ThreadTimer *timerp, void *contextp) {
+            schedule(std::coroutine_handle<>::from_address(contextp));
+        }
+
+     public:
+        SleepAwaiter(uint32_t ms) {
+            _ms = ms;
+        }
+
+        bool await_ready() {
+            return false;
+        }
+
+        /* the timer is freed automatically after it fires */
+        void await_suspend(std::coroutine_handle<> handle) {
+            ThreadTimer *timerp;
+
+            timerp = new ThreadTimer(_ms, &SleepAwaiter::timerFired, handle.address());
+            timerp->start();
+        }
+
+        void await_resume() {}
+    };
+
+    class JoinAwaiter : public ThreadCoroAwaiter {
+        Thread *_threadp;
+        void **_ptrpp;
+
+     public:
+        JoinAwaiter(Thread *threadp, void **ptrpp) {
+            _threadp = threadp;
+            _ptrpp = ptrpp;
+        }
+
+        bool await_ready() {
+            return false;
+        }
+
+        bool await_suspend(Handle handle) {
+            ThreadCoroWaiter *waiterp = handle.promise().waiter();
+
+            _handle = handle;
+            waiterp->_awaiterp = this;
+            return !_threadp->joinStart(waiterp);
+        }
+
+        int32_t await_resume() {
+            return _threadp->joinFinish(_ptrpp);
+        }
+    };
+
+    static TakeAwaiter take(ThreadMutex *mutexp) {
+        return TakeAwaiter(mutexp);
+    }
+
+    static ReleaseAwaiter release(ThreadMutex *mutexp) {
+        return ReleaseAwaiter(mutexp);
+    }
+
+    static CondAwaiter wait(ThreadCond *cvp, ThreadMutex *mutexp) {
+        return CondAwaiter(cvp, mutexp);
+    }
+
+    static SleepAwaiter sleep(uint32_t ms) {
+        return SleepAwaiter(ms);
+    }
+
+    /* as with Thread::join, the caller deletes or releases the thread afterwards */
+    static JoinAwaiter join(Thread *threadp, void **ptrpp) {
+        return JoinAwaiter(threadp, ptrpp);
+    }
+
+    /* same semantics as EpollEvent::wait, with the result in *codep */
+    static ThreadCoro wait(EpollEvent *eventp, EpollEvent::Flags flags, int32_t *codep) {
+        ThreadMutex *lockp = &eventp->_onep->_lock;
+
+        co_await take(lockp);
+        if (eventp->_triggered) {
+            eventp->_triggered = 0;
+            *codep = 0;
+        }
+        else {
+            while(!eventp->_triggered && !eventp->_closed) {
+                eventp->reenableNL(flags);
+                co_await wait(&eventp->_cv, lockp);
+            }
+            eventp->_triggered = 0;
+            *codep = (eventp->_closed? -1 : 0);
+        }
+        co_await release(lockp);
+    }
+};
+
+inline void
+ThreadCoroAwaiter::wake()
+{
+    ThreadCoro::schedule(_handle);
+}
+
+#endif /* __THREADCORO_H_ENV__ */
@@ -0,0 +1,411 @@
+#ifndef __THREADFUTURE_H_ENV__
+#define __THREADFUTURE_H_ENV__ 1
+
+#include <exception>
+#include <future>
+#include <optional>
+#include <vector>
+
+#include "thread.h"
+#include "threadmutex.h"
+
+/* usage: futures and promises whose waits park a lightweight thread,
+ * instead of a pthread as with std::future.
+ *
+ *      ThreadFuture<int> future = lwtAsync([]() { return compute(); });
+ *      ...
+ *      value = future.get();
+ *
+ * lwtAsync runs its callable on a pooled thread from Thread::spawn.
+ * Or, create a ThreadPromise, hand out futures from getFuture, and
+ * call setValue (or setException) on the promise exactly once.  A
+ * promise destroyed without being set completes its futures with a
+ * std::future_error of broken_promise.
+ *
+ * Futures are reference counted handles, so they can be freely
+ * copied, and get may be called any number of times; it returns a
+ * reference to the stored value, valid while any handle exists, or
+ * rethrows the exception the promise was completed with.
+ *
+ * then(fn) returns a future for fn(future), which runs as a ThreadTask
+ * once the future is ready; fn receives the ready future, so it can
+ * call get to see either the value or the exception.
+ *
+ * ThreadFuture<T>::whenAll(futures) returns a ThreadFuture<void> that
+ * becomes ready once every future in the vector is, and whenAny
+ * returns a ThreadFuture<uint32_t> holding the index of the first one
+ * to become ready.  Neither looks at the values or exceptions.  Each
+ * combinator keeps a little state until all of its futures are
+ * complete, so whenAny's bookkeeping outlives its result.
+ */
+
+template<class T> class ThreadFuture;
+template<class T> class ThreadPromise;
+
+/* internal: notified once a future's state becomes ready.  Called
+ * without any locks held, by whoever completes the promise, or by the
+ * registering thread if the state was already ready.
+ */
+class ThreadFutureCallback {
+ public:
+    ThreadFutureCallback *_dqNextp;
+    ThreadFutureCallback *_dqPrevp;
+
+    ThreadFutureCallback() {
+        _dqNextp = NULL;
+        _dqPrevp = NULL;
+    }
+
+    virtual void ready() = 0;
+
+    virtual ~ThreadFutureCallback() {}
+};
+
+/* internal: storage for the result, with no storage for void */
+template<class T> class ThreadFutureValue {
+    std::optional<T> _value;
+
+ public:
+    template<class U> void set(U &&value) {
+        _value.emplace(std::forward<U>(value));
+    }
+
+    T &get() {
+        return *_value;
+    }
+};
+
+template<> class ThreadFutureValue<void> {
+ public:
+    void set() {}
+
+    void get() {}
+};
+
+/* internal: the state shared by a promise and its futures */
+template<class T> class ThreadFutureState {
+ public:
+    ThreadMutex _mutex;
+    ThreadCond _cv;
+    std::atomic<uint32_t> _refCount;
+    std::atomic<uint8_t> _ready;
+    ThreadFutureValue<T> _value;
+    std::exception_ptr _exceptionp;
+    dqueue<ThreadFutureCallback> _callbacks;
+
+    ThreadFutureState() : _cv(&_mutex) {
+        _refCount = 1;
+        _ready = 0;
+    }
+
+    void hold() {
+        _refCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() {
+        if (_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    int isReady() {
+        return _ready.load(std::memory_order_acquire);
+    }
+
+    /* called with _mutex held, once the result's stored; drops the mutex */
+    void finishAndRelease() {
+        dqueue<ThreadFutureCallback> callbacks;
+        ThreadFutureCallback *callbackp;
+
+        thread_assert(!_ready);
+        _ready.store(1, std::memory_order_release);
+        callbacks.concat(&_callbacks);
+        _cv.broadcast();
+        _mutex.release();
+
+        while((callbackp = callbacks.pop()) != NULL) {
+            callbackp->ready();
+        }
+    }
+
+    void addCallback(ThreadFutureCallback *callbackp) {
+        _mutex.take();
+        if (_ready) {
+            _mutex.release();
+            callbackp->ready();
+            return;
+        }
+        _callbacks.append(callbackp);
+        _mutex.release();
+    }
+
+    void wait() {
+        if (isReady())
+            return;
+        _mutex.take();
+        while(!_ready)
+            _cv.wait();
+        _mutex.release();
+    }
+};
+
+template<class T> class ThreadPromise {
+    ThreadFutureState<T> *_statep;
+
+ public:
+    ThreadPromise() {
+        _statep = new ThreadFutureState<T>();
+    }
+
+    ThreadPromise(ThreadPromise &&other) {
+        _statep = other._statep;
+        other._statep = NULL;
+    }
+
+    ThreadPromise &operator=(ThreadPromise &&other) {
+        if (this != &other) {
+            abandon();
+            _statep = other._statep;
+            other._statep = NULL;
+        }
+        return *this;
+    }
+
+    ThreadPromise(const ThreadPromise &) = delete;
+    ThreadPromise &operator=(const ThreadPromise &) = delete;
+
+    ~ThreadPromise() {
+        abandon();
+    }
+
+    ThreadFuture<T> getFuture() {
+        return ThreadFuture<T>(_statep);
+    }
+
+    /* takes the value for non-void promises, and nothing for void ones */
+    template<class... U> void setValue(U &&... value) {
+        _statep->_mutex.take();
+        _statep->_value.set(std::forward<U>(value)...);
+        _statep->finishAndRelease();
+    }
+
+    void setException(std::exception_ptr exceptionp) {
+        _statep->_mutex.take();
+        _statep->_exceptionp = exceptionp;
+        _statep->finishAndRelease();
+    }
+
+    /* complete the promise with fn's return value, or with the
+     * exception it throws.
+     */
+    template<class F> void setResultOf(F &fn) {
+        try {
+            if constexpr (std::is_void<T>::value) {
+                fn();
+                setValue();
+            }
+            else {
+                setValue(fn());
+            }
+        }
+        catch(...) {
+            setException(std::current_exception());
+        }
+    }
+
+ private:
+    /* drop our reference, breaking the promise if it was never set */
+    void abandon() {
+        if (!_statep)
+            return;
+        if (!_statep->isReady()) {
+            setException(std::make_exception_ptr(
+                             std::future_error(std::future_errc::broken_promise)));
+        }
+        _statep->release();
+        _statep = NULL;
+    }
+};
+
+/* internal: runs a then() continuation as a task once its future's ready */
+template<class T, class R, class F>
+class ThreadFutureThen : public ThreadFutureCallback, public ThreadTask {
+    ThreadFuture<T> _future;
+    F _fn;
+    ThreadPromise<R> _promise;
+
+ public:
+    template<class G> ThreadFutureThen(ThreadFuture<T> &future, G &&fn, ThreadPromise<R> &&promise)
+        : _future(future), _fn(std::forward<G>(fn)), _promise(std::move(promise)) {}
+
+    void ready() {
+        queue();
+    }
+
+    void run() {
+        auto call = [this]() { return _fn(_future); };
+        _promise.setResultOf(call);
+    }
+};
+
+/* internal: the state behind whenAll (R is void) and whenAny (R is
+ * uint32_t).  One slot is registered with each future, and the gather
+ * frees itself once all of them have fired.
+ */
+template<class R> class ThreadFutureGather {
+ public:
+    class Slot : public ThreadFutureCallback {
+     public:
+        ThreadFutureGather *_gatherp;
+        uint32_t _index;
+
+        void ready() {
+            _gatherp->fired(_index);
+        }
+    };
+
+    std::vector<Slot> _slots;
+    std::atomic<uint32_t> _remaining;
+    std::atomic<uint8_t> _done;
+    ThreadPromise<R> _promise;
+
+    ThreadFutureGather(uint32_t count) : _slots(count) {
+        uint32_t i;
+
+        for(i=0;i<count;i++) {
+            _slots[i]._gatherp = this;
+            _slots[i]._index = i;
+        }
+        _remaining = count;
+        _done = 0;
+    }
+
+    void fired(uint32_t index) {
+        if constexpr (std::is_void<R>::value) {
+            if (_remaining.fetch_sub(1) == 1) {
+                _promise.setValue();
+                delete this;
+            }
+        }
+        else {
+            if (!_done.exchange(1))
+                _promise.setValue(index);
+            if (_remaining.fetch_sub(1) == 1)
+                delete this;
+        }
+    }
+};
+
+template<class T> class ThreadFuture {
+    template<class U> friend class ThreadPromise;
+
+    ThreadFutureState<T> *_statep;
+
+    explicit ThreadFuture(ThreadFutureState<T> *statep) {
+        _statep = statep;
+        statep->hold();
+    }
+
+    template<class R> static ThreadFuture<R>
+    gather(std::vector<ThreadFuture<T>> &futures) {
+        ThreadFutureGather<R> *gatherp;
+        ThreadFuture<R> result;
+        uint32_t count = futures.size();
+        uint32_t i;
+
+        gatherp = new ThreadFutureGather<R>(count);
+        result = gatherp->_promise.getFuture();
+
+        /* the gather may be freed by the last addCallback */
+        for(i=0;i<count;i++)
+            futures[i]._statep->addCallback(&gatherp->_slots[i]);
+        return result;
+    }
+
+ public:
+    ThreadFuture() {
+        _statep = NULL;
+    }
+
+    ThreadFuture(const ThreadFuture &other) {
+        _statep = other._statep;
+        if (_statep)
+            _statep->hold();
+    }
+
+    ThreadFuture(ThreadFuture &&other) {
+        _statep = other._statep;
+        other._statep = NULL;
+    }
+
+    ThreadFuture &operator=(ThreadFuture other) {
+        std::swap(_statep, other._statep);
+        return *this;
+    }
+
+    ~ThreadFuture() {
+        if (_statep)
+            _statep->release();
+    }
+
+    /* false for default-constructed futures */
+    int isValid() {
+        return _statep != NULL;
+    }
+
+    int isReady() {
+        return _statep->isReady();
+    }
+
+    void wait() {
+        _statep->wait();
+    }
+
+    typename std::add_lvalue_reference<T>::type get() {
+        _statep->wait();
+        if (_statep->_exceptionp)
+            std::rethrow_exception(_statep->_exceptionp);
+        return _statep->_value.get();
+    }
+
+    template<class F> ThreadFuture<typename std::invoke_result<F &, ThreadFuture<T> &>::type>
+    then(F &&fn) {
+        typedef typename std::invoke_result<F &, ThreadFuture<T> &>::type R;
+        typedef typename std::decay<F>::type FnType;
+        ThreadPromise<R> promise;
+        ThreadFuture<R> result = promise.getFuture();
+
+        _statep->addCallback(
+            new ThreadFutureThen<T, R, FnType>(*this, std::forward<F>(fn), std::move(promise)));
+        return result;
+    }
+
+    static ThreadFuture<void> whenAll(std::vector<ThreadFuture<T>> &futures) {
+        if (futures.empty()) {
+            ThreadPromise<void> promise;
+            promise.setValue();
+            return promise.getFuture();
+        }
+        return gather<void>(futures);
+    }
+
+    static ThreadFuture<uint32_t> whenAny(std::vector<ThreadFuture<T>> &futures) {
+        thread_assert(futures.size() > 0);
+        return gather<uint32_t>(futures);
+    }
+};
+
+/* run fn on a pooled lightweight thread, returning a future for its result */
+template<class F> ThreadFuture<typename std::invoke_result<F &>::type>
+lwtAsync(F &&fn)
+{
+    typedef typename std::invoke_result<F &>::type R;
+    ThreadPromise<R> promise;
+    ThreadFuture<R> future = promise.getFuture();
+
+    Thread::spawn("lwtAsync", [fn = std::forward<F>(fn), promise = std::move(promise)]() mutable {
+            promise.setResultOf(fn);
+        });
+    return future;
+}
+
+#endif /* __THREADFUTURE_H_ENV__ */
@@ -0,0 +1,259 @@
+#include <execinfo.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "threadlockprofile.h"
+#include "threadmutex.h"
+
+SpinLock ThreadLockProfiler::_lock;
+dqueue<ThreadLockProfile> ThreadLockProfiler::_profiles;
+uint64_t ThreadLockProfiler::_startTicks;
+long long ThreadLockProfiler::_startUs;
+uint8_t ThreadLockProfiler::_profileAll;
+
+ThreadLockProfile::ThreadLockProfile(ThreadBaseLock *lockp, const char *namep, const char *typep)
+{
+    char tbuffer[32];
+
+    _dqNextp = NULL;
+    _dqPrevp = NULL;
+    _lockp = lockp;
+    if (namep) {
+        _name = namep;
+    }
+    else {
+        snprintf(tbuffer, sizeof(tbuffer), "%p", lockp);
+        _name = tbuffer;
+    }
+    _typep = typep;
+
+    _acquires = 0;
+    _contended = 0;
+    _waitTicks = 0;
+    _maxWaitTicks = 0;
+    _holds = 0;
+    _holdTicks = 0;
+    _maxHoldTicks = 0;
+    _holdStartTicks = 0;
+    memset(_waitHist, 0, sizeof(_waitHist));
+    memset(_holdHist, 0, sizeof(_holdHist));
+    memset(_sites, 0, sizeof(_sites));
+}
+
+/* the site table keeps the heaviest call sites approximately: when
+ * it's full, a new site replaces the lightest one, inheriting its
+ * count, so a frequent site can't be kept out for long.
+ */
+void
+ThreadLockProfile::waited(uint64_t ticks, void *pcp)
+{
+    Site *sitep;
+    Site *minSitep = NULL;
+    uint32_t i;
+
+    _contended++;
+    _waitTicks += ticks;
+    if (ticks > _maxWaitTicks)
+        _maxWaitTicks = ticks;
+    _waitHist[bucket(ticks)]++;
+
+    for(i=0, sitep=_sites; i<_maxSites; i++, sitep++) {
+        if (sitep->_pcp == pcp || sitep->_pcp == NULL) {
+            sitep->_pcp = pcp;
+            sitep->_count++;
+            return;
+        }
+        if (!minSitep || sitep->_count < minSitep->_count)
+            minSitep = sitep;
+    }
+    minSitep->_pcp = pcp;
+    minSitep->_count++;
+}
+
+/* upper bound of the histogram bucket holding the pct'th percentile */
+uint64_t
+ThreadLockProfile::percentile(uint64_t *histp, uint64_t total, uint32_t pct)
+{
+    uint64_t target;
+    uint64_t sum = 0;
+    uint32_t i;
+
+    if (total == 0)
+        return 0;
+    target = (total * pct + 99) / 100;
+    for(i=0;i<_buckets;i++) {
+        sum += histp[i];
+        if (sum >= target)
+            break;
+    }
+    return (i == 0? 0 : (1ULL << i) - 1);
+}
+
+/* static */ void
+ThreadLockProfiler::profileAll(int enable)
+{
+    _lock.take();
+    if (_startUs == 0) {
+        _startUs = osp_getUs();
+        _startTicks = threadCpuTicks();
+    }
+    _lock.release();
+    _profileAll = (enable != 0);
+}
+
+/* static */ void
+ThreadLockProfiler::track(ThreadBaseLock *lockp, const char *namep, const char *typep)
+{
+    ThreadLockProfile *profilep;
+
+    _lock.take();
+    if (_startUs == 0) {
+        _startUs = osp_getUs();
+        _startTicks = threadCpuTicks();
+    }
+
+    if ((profilep = lockp->_profilep) != NULL) {
+        /* just renaming */
+        if (namep)
+            profilep->_name = namep;
+        _lock.release();
+        return;
+    }
+
+    profilep = new ThreadLockProfile(lockp, namep, typep);
+    _profiles.append(profilep);
+    _lock.release();
+
+    /* publish last, since the lock checks _profilep without our lock */
+    lockp->_profilep = profilep;
+}
+
+/* static */ void
+ThreadLockProfiler::untrack(ThreadBaseLock *lockp)
+{
+    ThreadLockProfile *profilep;
+
+    _lock.take();
+    profilep = lockp->_profilep;
+    lockp->_profilep = NULL;
+    _profiles.remove(profilep);
+    _lock.release();
+
+    delete profilep;
+}
+
+/* static */ double
+ThreadLockProfiler::ticksPerUs()
+{
+    long long elapsedUs;
+
+    elapsedUs = osp_getUs() - _startUs;
+    if (_startUs == 0 || elapsedUs < 1000) {
+        /* not enough time to calibrate; assume a typical clock rate */
+        return 2200.0;
+    }
+    return (double) (threadCpuTicks() - _startTicks) / elapsedUs;
+}
+
+/* static */ void
+ThreadLockProfiler::reset()
+{
+    ThreadLockProfile *profilep;
+
+    _lock.take();
+    for(profilep = _profiles.head(); profilep; profilep=profilep->_dqNextp) {
+        profilep->_acquires = 0;
+        profilep->_contended = 0;
+        profilep->_waitTicks = 0;
+        profilep->_maxWaitTicks = 0;
+        profilep->_holds = 0;
+        profilep->_holdTicks = 0;
+        profilep->_maxHoldTicks = 0;
+        memset(profilep->_waitHist, 0, sizeof(profilep->_waitHist));
+        memset(profilep->_holdHist, 0, sizeof(profilep->_holdHist));
+        memset(profilep->_sites, 0, sizeof(profilep->_sites));
+    }
+    _lock.release();
+}
+
+/* static */ void
+ThreadLockProfiler::report(FILE *filep, uint32_t maxLocks)
+{
+    std::vector<ThreadLockProfile *> profiles;
+    std::vector<ThreadLockProfile> worst;
+    ThreadLockProfile *profilep;
+    ThreadLockProfile::Site sites[ThreadLockProfile::_maxSites];
+    void *pcs[3];
+    char **symbolspp;
+    double ticksPerUs;
+    size_t nprofiles;
+    uint32_t nsites;
+    uint32_t i;
+    uint32_t j;
+
+    ticksPerUs = ThreadLockProfiler::ticksPerUs();
+
+    /* under our lock, which keeps profiles from going away, just pick the
+     * worst locks and copy their profiles; symbol lookup and printing are
+     * slow, and every profiled lock's constructor and destructor take this
+     * lock, too.
+     */
+    _lock.take();
+    for(profilep = _profiles.head(); profilep; profilep=profilep->_dqNextp) {
+        profiles.push_back(profilep);
+    }
+    nprofiles = profiles.size();
+    if (maxLocks > nprofiles)
+        maxLocks = nprofiles;
+    std::partial_sort(profiles.begin(), profiles.begin() + maxLocks, profiles.end(),
+                      [](ThreadLockProfile *ap, ThreadLockProfile *bp) {
+            if (ap->_waitTicks != bp->_waitTicks)
+                return ap->_waitTicks > bp->_waitTicks;
+            return ap->_contended > bp->_contended;
+        });
+    worst.reserve(maxLocks);
+    for(i=0; i<maxLocks; i++)
+        worst.push_back(*profiles[i]);
+    _lock.release();
+
+    fprintf(filep, "Lock profile: %d locks, worst %d by total wait (times in us):\n",
+            (int) nprofiles, (int) maxLocks);
+    for(i=0; i<maxLocks; i++) {
+        profilep = &worst[i];
+        fprintf(filep, "%2d: %s %s acquires=%lld contended=%lld (%.1f%%)\n",
+                i+1, profilep->_typep, profilep->_name.c_str(),
+                (long long) profilep->_acquires, (long long) profilep->_contended,
+                (profilep->_acquires? 100.0 * profilep->_contended / profilep->_acquires : 0.0));
+        fprintf(filep, "    wait total=%.0f p50<%.1f p99<%.1f max=%.1f\n",
+                profilep->_waitTicks / ticksPerUs,
+                profilep->percentile(profilep->_waitHist, profilep->_contended, 50) / ticksPerUs,
+                profilep->percentile(profilep->_waitHist, profilep->_contended, 99) / ticksPerUs,
+                profilep->_maxWaitTicks / ticksPerUs);
+        if (profilep->_holds) {
+            fprintf(filep, "    hold avg=%.2f p50<%.1f p99<%.1f max=%.1f\n",
+                    (double) profilep->_holdTicks / profilep->_holds / ticksPerUs,
+                    profilep->percentile(profilep->_holdHist, profilep->_holds, 50) / ticksPerUs,
+                    profilep->percentile(profilep->_holdHist, profilep->_holds, 99) / ticksPerUs,
+                    profilep->_maxHoldTicks / ticksPerUs);
+        }
+
+        /* the top 3 sites of contended acquisitions */
+        memcpy(sites, profilep->_sites, sizeof(sites));
+        std::sort(sites, sites + ThreadLockProfile::_maxSites,
+                  [](const ThreadLockProfile::Site &a, const ThreadLockProfile::Site &b) {
+                      return a._count > b._count;
+                  });
+        for(nsites=0; nsites<3 && sites[nsites]._pcp; nsites++)
+            pcs[nsites] = sites[nsites]._pcp;
+        if (nsites == 0)
+            continue;
+        symbolspp = backtrace_symbols(pcs, nsites);
+        for(j=0;j<nsites;j++) {
+            fprintf(filep, "    site %lld waits: %s\n", (long long) sites[j]._count,
+                    (symbolspp? symbolspp[j] : "?"));
+        }
+        free(symbolspp);
+    }
+}
@@ -0,0 +1,134 @@
+#ifndef __THREADLOCKPROFILE_H_ENV__
+#define __THREADLOCKPROFILE_H_ENV__ 1
+
+#include <stdio.h>
+#include <string>
+
+#include "thread.h"
+#include "dqueue.h"
+
+/* usage: opt-in contention profiling for ThreadMutex and ThreadLockRw.
+ *
+ *      mutex.setName("cache");                 profile one lock
+ *      ThreadLockProfiler::profileAll(1);      profile locks created from now on
+ *      ...
+ *      ThreadLockProfiler::report(stdout, 10); the 10 worst locks
+ *
+ * A profiled lock counts its acquisitions and contended acquisitions,
+ * keeps log2 histograms of wait and hold times, in rdtsc ticks, and
+ * remembers the call sites of its contended acquisitions.  Hold times
+ * are only kept for exclusive holds, i.e. mutexes and write and
+ * upgrade locks.  The report ranks locks by their total wait time.
+ *
+ * A lock that isn't profiled has a NULL _profilep, and pays just for
+ * testing that.  Profiles belong to their locks, and leave the report
+ * when their lock is destroyed.  Profile updates are made by the lock's
+ * owner, or while holding the lock's spin lock, so they need no locking
+ * of their own; the report reads them without any, so a busy lock's
+ * numbers may be slightly inconsistent.
+ */
+
+class ThreadBaseLock;
+
+class ThreadLockProfile {
+ public:
+    static const uint32_t _buckets = 40;
+    static const uint32_t _maxSites = 8;
+
+    class Site {
+     public:
+        void *_pcp;
+        uint64_t _count;
+    };
+
+    ThreadLockProfile *_dqNextp;
+    ThreadLockProfile *_dqPrevp;
+    ThreadBaseLock *_lockp;
+    std::string _name;
+    const char *_typep;
+
+    uint64_t _acquires;
+    uint64_t _contended;
+    uint64_t _waitTicks;
+    uint64_t _maxWaitTicks;
+    uint64_t _holds;
+    uint64_t _holdTicks;
+    uint64_t _maxHoldTicks;
+    uint64_t _holdStartTicks;
+    uint64_t _waitHist[_buckets];
+    uint64_t _holdHist[_buckets];
+    Site _sites[_maxSites];
+
+    ThreadLockProfile(ThreadBaseLock *lockp, const char *namep, const char *typep);
+
+    static uint32_t bucket(uint64_t ticks) {
+        uint32_t ix;
+
+        ix = (ticks == 0? 0 : 64 - __builtin_clzll(ticks));
+        return (ix < _buckets? ix : _buckets-1);
+    }
+
+    /* an exclusive hold starts */
+    void acquired() {
+        _acquires++;
+        _holdStartTicks = threadCpuTicks();
+    }
+
+    /* a shared hold starts; we don't time these */
+    void acquiredShared() {
+        _acquires++;
+    }
+
+    /* an exclusive hold ends.  A profile attached by setName while its
+     * lock was held never saw that hold start, so _holdStartTicks is still
+     * 0; skip the sample rather than record the whole uptime as a hold.
+     */
+    void released() {
+        uint64_t ticks;
+
+        if (_holdStartTicks == 0)
+            return;
+        ticks = threadCpuTicks() - _holdStartTicks;
+        _holdStartTicks = 0;
+        _holds++;
+        _holdTicks += ticks;
+        if (ticks > _maxHoldTicks)
+            _maxHoldTicks = ticks;
+        _holdHist[bucket(ticks)]++;
+    }
+
+    /* an acquisition had to wait ticks, called from pcp */
+    void waited(uint64_t ticks, void *pcp);
+
+    uint64_t percentile(uint64_t *histp, uint64_t total, uint32_t pct);
+};
+
+class ThreadLockProfiler {
+    friend class ThreadLockProfile;
+
+    static SpinLock _lock;
+    static dqueue<ThreadLockProfile> _profiles;
+    static uint64_t _startTicks;
+    static long long _startUs;
+
+ public:
+    static uint8_t _profileAll;
+
+    static void profileAll(int enable);
+
+    /* called by lock constructors and setName */
+    static void track(ThreadBaseLock *lockp, const char *namep, const char *typep);
+
+    /* called by lock destructors */
+    static void untrack(ThreadBaseLock *lockp);
+
+    /* print the maxLocks profiled locks with the most total wait time */
+    static void report(FILE *filep = stdout, uint32_t maxLocks = 10);
+
+    /* zero every profile's statistics */
+    static void reset();
+
+    static double ticksPerUs();
+};
+
+#endif /* __THREADLOCKPROFILE_H_ENV__ */
@@ -25,16 +25,282 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "thread.h"
 #include "threadmutex.h"
+#include "threadcancel.h"
 #include <assert.h>
 #include <stdio.h>
+#include <algorithm>
+
+/* remove threadp from a wait queue, if it's still there; returns true
+ * if it was.  Only used when canceling, so a linear search is fine.
+ */
+static int
+removeWaiter(dqueue<Thread> *queuep, Thread *threadp)
+{
+    Thread *tp;
+
+    for(tp = queuep->head(); tp; tp=tp->_dqNextp) {
+        if (tp == threadp) {
+            queuep->remove(tp);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* cancel hooks for blocked mutex and CV waits; see threadcancel.h */
+class ThreadMutexCancelWait : public ThreadCancelWait {
+    ThreadMutex *_mutexp;
+
+ public:
+    ThreadMutexCancelWait(ThreadMutex *mutexp, Thread *threadp) : ThreadCancelWait(threadp) {
+        _mutexp = mutexp;
+    }
+
+    void cancel() {
+        _mutexp->_lock.take();
+        _removed = removeWaiter(&_mutexp->_waiting, _threadp);
+        _mutexp->_lock.release();
+        if (_removed)
+            _threadp->queue();
+    }
+};
+
+class ThreadCondCancelWait : public ThreadCancelWait {
+    ThreadCond *_cvp;
+    ThreadBaseLock *_baseLockp;
+
+ public:
+    ThreadCondCancelWait(ThreadCond *cvp, ThreadBaseLock *baseLockp, Thread *threadp)
+        : ThreadCancelWait(threadp) {
+        _cvp = cvp;
+        _baseLockp = baseLockp;
+    }
+
+    void cancel() {
+        _baseLockp->_lock.take();
+        _removed = removeWaiter(&_cvp->_waiting, _threadp);
+        _baseLockp->_lock.release();
+        if (_removed)
+            _threadp->queue();
+    }
+};
+
+/* timeout hook for ThreadLockRw waits; removing a waiter can let
+ * others in, e.g. readers held back by a waiting writer.
+ */
+class ThreadLockRwCancelWait : public ThreadCancelWait {
+    ThreadLockRw *_lockp;
+    dqueue<Thread> *_queuep;
+
+ public:
+    ThreadLockRwCancelWait(ThreadLockRw *lockp, dqueue<Thread> *queuep, Thread *threadp)
+        : ThreadCancelWait(threadp) {
+        _lockp = lockp;
+        _queuep = queuep;
+    }
+
+    void cancel() {
+        _lockp->_lock.take();
+        _removed = removeWaiter(_queuep, _threadp);
+        if (_removed)
+            _lockp->wakeNext();
+        _lockp->_lock.release();
+        if (_removed)
+            _threadp->queue();
+    }
+};
+
+/* timeout hook for a ThreadLockRwBiased writer waiting for readers to
+ * drain; the drainer isn't in a queue, just in _drainWaiterp.
+ */
+class ThreadLockRwDrainWait : public ThreadCancelWait {
+    ThreadLockRwBiased *_lockp;
+
+ public:
+    ThreadLockRwDrainWait(ThreadLockRwBiased *lockp, Thread *threadp) : ThreadCancelWait(threadp) {
+        _lockp = lockp;
+    }
+
+    void cancel() {
+        _lockp->_lock.take();
+        if (_lockp->_drainWaiterp.load() == _threadp) {
+            _lockp->_drainWaiterp.store(NULL);
+            _removed = 1;
+        }
+        _lockp->_lock.release();
+        if (_removed)
+            _threadp->queue();
+    }
+};
 
 /*****************ThreadMutex*****************/
+uint32_t ThreadMutex::_maxSpinTicks = 50000;
+
+/* called with _lock held; claims the mutex for threadp if it's free,
+ * leaving the waiters bit set, and telling the waiters their new
+ * owner, if anyone's still queued.  Returns 1 if threadp now owns the
+ * mutex.  Even with _lock held, a free mutex can
+ * be grabbed by another thread's fast path, hence the CAS.
+ */
+int
+ThreadMutex::claimNL(Thread *threadp)
+{
+    uintptr_t state = _state.load(std::memory_order_relaxed);
+    uintptr_t newState;
+
+    while((state & ~_waitersBit) == 0) {
+        newState = (uintptr_t) threadp | (_waiting.empty()? 0 : _waitersBit);
+        if (_state.compare_exchange_weak(state, newState, std::memory_order_acquire)) {
+            if (newState & _waitersBit)
+                publishWaitersNL(threadp);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* called with _lock held; sets the waiters bit on an owned mutex, so
+ * that its owner's release has to take _lock.  Returns 0 if the mutex
+ * was released before we could set it.
+ */
+int
+ThreadMutex::markWaitersNL()
+{
+    uintptr_t state = _state.load(std::memory_order_relaxed);
+
+    while((state & ~_waitersBit) != 0) {
+        if (state & _waitersBit)
+            return 1;
+        if (_state.compare_exchange_weak(state, state | _waitersBit, std::memory_order_relaxed))
+            return 1;
+    }
+    return 0;
+}
+
+/* called with _lock held, by the owner; frees the mutex, keeping the
+ * waiters bit if there are still queued threads.  Since the waiters
+ * bit is set, nobody else can change the state until we drop _lock.
+ */
 void
-ThreadMutex::take() {
-    Thread *mep;
+ThreadMutex::releaseStateNL(Thread *mep)
+{
+    assert(getOwner() == mep);
+    if (_waiting.empty()) {
+        _state.store(0, std::memory_order_release);
+    }
+    else {
+        publishWaitersNL(NULL);
+        _state.store(_waitersBit, std::memory_order_release);
+    }
+}
+
+/* called with _lock held, whenever the owner changes while threads are
+ * queued: tell each of them who they're waiting for now, for the
+ * deadlock detector.
+ */
+void
+ThreadMutex::publishOwnerNL(Thread *ownerp)
+{
+    Thread *threadp;
+
+    for(threadp = _waiting.head(); threadp; threadp=threadp->_dqNextp)
+        threadp->setBlockingHolder(ownerp);
+}
+
+/* called with _lock held, and the waiters bit set on an owned mutex:
+ * queue threadp to be woken by a release.
+ */
+void
+ThreadMutex::queueWaiterNL(Thread *threadp)
+{
+    if (__builtin_expect(_trackHolders, 0))
+        threadp->setBlockingHolder(getOwner());
+    threadp->setBlockingLock(this, NULL);
+    _waiting.append(threadp);
+}
+
+/* called with _lock held, when the mutex is owned and the waiters bit
+ * is set.  If the owner is running on another dispatcher, it'll
+ * probably release the mutex soon, so drop _lock and spin for a while
+ * watching the state, which is much cheaper than a sleep, a queue and
+ * a context switch.  Returns 1, with _lock held again, if the caller
+ * should recheck the owner, or 0 if it should park.  *startTicksp is
+ * 0 on the first call of a take, and tracks when the take started
+ * spinning.
+ */
+int
+ThreadMutex::spinNL(uint64_t *startTicksp)
+{
+    Thread *ownerp = getOwner();
+    uint64_t now;
+    uint32_t i;
+
+    if (_maxSpinTicks == 0 || ThreadDispatcher::getDispatcherCount() < 2)
+        return 0;
+
+    /* the waiters bit keeps the owner from releasing the mutex, and
+     * so from going away, while we hold _lock.
+     */
+    if (!ownerp->isRunning())
+        return 0;
+
+    now = threadCpuTicks();
+    if (*startTicksp == 0) {
+        *startTicksp = now;
+    }
+    else if (now - *startTicksp >= std::min(_spinTicks, _maxSpinTicks)) {
+        /* the owner outlasted us, so spin less next time */
+        _spinTicks -= _spinTicks / 4;
+        if (_spinTicks < _minSpinTicks)
+            _spinTicks = _minSpinTicks;
+        return 0;
+    }
+
+    _lock.release();
+    for(i=0; i<64; i++) {
+        if (getOwner() != ownerp)
+            break;
+        spinLockPause();
+    }
+    _lock.take();
+    return 1;
+}
+
+/* called with _lock held, once a take that found the mutex owned has
+ * obtained it; updates the stats, and if we got the mutex by spinning,
+ * moves the spin budget toward twice what that spin took.
+ */
+void
+ThreadMutex::contendedDoneNL(uint64_t startTicks, int parked)
+{
+    int64_t target;
+
+    _contended++;
+    if (parked) {
+        _parks++;
+        return;
+    }
+
+    _spinAcquires++;
+    target = 2 * (int64_t) (threadCpuTicks() - startTicks);
+    if (target > _maxSpinTicks)
+        target = _maxSpinTicks;
+    _spinTicks += (target - (int64_t) _spinTicks) / 8;
+    if (_spinTicks < _minSpinTicks)
+        _spinTicks = _minSpinTicks;
+}
+
+/* take, once the fast path's CAS has failed.  take is always inlined,
+ * so our return address is in take's caller, at the call site.
+ */
+void
+ThreadMutex::takeSlow(Thread *mep) {
     long long blockedTime;
+    uint64_t startTicks = 0;
+    uint64_t waitTicks = 0;
+    int contended = 0;
+    int parked = 0;
 
-    mep = Thread::getCurrent();
     _lock.take();
 
     /* go in a loop waiting for a null owner, and then claim the lock;
@@ -42,60 +308,221 @@ ThreadMutex::take() {
      * the lock if it is available, since the release code will only wakeup
      * one sleeper at a time.
      */
-    assert(_ownerp != mep);
-    while(_ownerp != NULL) {
-        mep->_blockingMutexp = this;
+    assert(getOwner() != mep);
+    while(!claimNL(mep)) {
+        if (!markWaitersNL())
+            continue;
+        if (!contended) {
+            contended = 1;
+            waitTicks = threadCpuTicks();
+        }
+        if (!parked && spinNL(&startTicks))
+            continue;
+        parked = 1;
         blockedTime = osp_getUs();
-        _waiting.append(mep);
+        queueWaiterNL(mep);
         mep->sleep(&_lock);
-        mep->_blockingMutexp = NULL;
+        mep->setBlockingLock(NULL, NULL);
         _lock.take();
         _waitUs += osp_getUs() - blockedTime;
     }
-    _ownerp = mep;
+    if (contended)
+        contendedDoneNL(startTicks, parked);
+    if (_profilep) {
+        if (contended)
+            _profilep->waited(threadCpuTicks() - waitTicks, __builtin_return_address(0));
+        _profilep->acquired();
+    }
     _lock.release();
 }
 
+/* like take, but gives up if cancelp is canceled; note that when a
+ * release wakes us, we take the mutex if it's free, even if the token
+ * has been canceled in the meantime, since the release only wakes one
+ * waiter.
+ */
+int32_t
+ThreadMutex::take(ThreadCancel *cancelp) {
+    Thread *mep;
+    long long blockedTime;
+    uint64_t startTicks = 0;
+    uint64_t waitTicks = 0;
+    int contended = 0;
+    int parked = 0;
+
+    if (!cancelp) {
+        take();
+        return 0;
+    }
+
+    mep = Thread::getCurrent();
+    ThreadMutexCancelWait cancelWait(this, mep);
+    _lock.take();
+
+    assert(getOwner() != mep);
+    while(!claimNL(mep)) {
+        if (!markWaitersNL())
+            continue;
+        if (!contended) {
+            contended = 1;
+            waitTicks = threadCpuTicks();
+        }
+        if (!parked && spinNL(&startTicks))
+            continue;
+        parked = 1;
+        if (cancelp->addWait(&cancelWait) != 0) {
+            _lock.release();
+            return ThreadCancel::TC_ERR_CANCELED;
+        }
+        blockedTime = osp_getUs();
+        queueWaiterNL(mep);
+        mep->sleep(&_lock);
+        mep->setBlockingLock(NULL, NULL);
+        cancelp->removeWait(&cancelWait);
+        _lock.take();
+        _waitUs += osp_getUs() - blockedTime;
+        if (cancelWait._removed) {
+            _lock.release();
+            return ThreadCancel::TC_ERR_CANCELED;
+        }
+    }
+    if (contended)
+        contendedDoneNL(startTicks, parked);
+    if (_profilep) {
+        if (contended)
+            _profilep->waited(threadCpuTicks() - waitTicks, __builtin_return_address(0));
+        _profilep->acquired();
+    }
+    _lock.release();
+    return 0;
+}
+
+/* like take(cancelp), but the thread is removed from the wait queue
+ * by a ThreadWaitTimer instead of a token.  As there, a release that
+ * wakes us wins over a timer that fires at the same time.
+ */
+int32_t
+ThreadMutex::takeFor(uint32_t ms) {
+    Thread *mep = Thread::getCurrent();
+    uintptr_t expected = 0;
+    long long blockedTime;
+    uint64_t startTicks = 0;
+    uint64_t waitTicks = 0;
+    int contended = 0;
+    int parked = 0;
+    int32_t code = TL_OK;
+
+    if (_state.compare_exchange_strong(expected, (uintptr_t) mep, std::memory_order_acquire)) {
+        if (__builtin_expect(_profilep != NULL, 0))
+            _profilep->acquired();
+        return TL_OK;
+    }
+
+    ThreadMutexCancelWait cancelWait(this, mep);
+    ThreadWaitTimer timer(&cancelWait);
+    _lock.take();
+
+    assert(getOwner() != mep);
+    while(!claimNL(mep)) {
+        if (!markWaitersNL())
+            continue;
+        if (!contended) {
+            contended = 1;
+            waitTicks = threadCpuTicks();
+        }
+        if (!parked && spinNL(&startTicks))
+            continue;
+        if (ms == 0 || timer.fired()) {
+            code = TL_ERR_TIMEDOUT;
+            break;
+        }
+        if (!parked)
+            timer.start(ms);
+        parked = 1;
+        blockedTime = osp_getUs();
+        queueWaiterNL(mep);
+        mep->sleep(&_lock);
+        mep->setBlockingLock(NULL, NULL);
+        _lock.take();
+        _waitUs += osp_getUs() - blockedTime;
+        if (cancelWait._removed) {
+            code = TL_ERR_TIMEDOUT;
+            break;
+        }
+    }
+    if (code == TL_OK) {
+        if (contended)
+            contendedDoneNL(startTicks, parked);
+        if (_profilep) {
+            if (contended)
+                _profilep->waited(threadCpuTicks() - waitTicks, __builtin_return_address(0));
+            _profilep->acquired();
+        }
+    }
+    _lock.release();
+
+    timer.stop();
+    return code;
+}
+
 /* return 1 if we get the lock, but never block */
 int
 ThreadMutex::tryLock() {
     Thread *mep;
+    uintptr_t expected = 0;
 
     mep = Thread::getCurrent();
-    _lock.take();
+    if (_state.compare_exchange_strong(expected, (uintptr_t) mep, std::memory_order_acquire)) {
+        if (_profilep)
+            _profilep->acquired();
+        return 1;
+    }
 
-    /* go in a loop waiting for a null owner, and then claim the lock;
-     * note that when we're woken from the waiting queue, we must grab
-     * the lock if it is available, since the release code will only wakeup
-     * one sleeper at a time.
-     */
-        
-    assert(_ownerp != mep);
-    if (_ownerp != NULL) {
-        _lock.release();
+    /* held, or free with queued waiters, which only the slow path can claim */
+    assert((Thread *) (expected & ~_waitersBit) != mep);
+    if (expected & ~_waitersBit)
         return 0;
-    }
-    else {
-        _ownerp = mep;
+    _lock.take();
+    if (claimNL(mep)) {
+        if (_profilep)
+            _profilep->acquired();
         _lock.release();
         return 1;
     }
+    _lock.release();
+    return 0;
 }
 
-/* release a mutex */
+/* stackless version of take; see header */
+int
+ThreadMutex::takeOrQueue(Thread *threadp) {
+    _lock.take();
+    assert(getOwner() != threadp);
+    while(!claimNL(threadp)) {
+        if (markWaitersNL()) {
+            queueWaiterNL(threadp);
+            _lock.release();
+            return 0;
+        }
+    }
+
+    threadp->setBlockingLock(NULL, NULL);
+    if (_profilep)
+        _profilep->acquired();
+    _lock.release();
+    return 1;
+}
+
+/* release, once the fast path's CAS has failed because the waiters bit
+ * is set; wake the first queued thread.
+ */
 void
-ThreadMutex::release() {
-    Thread *mep;
+ThreadMutex::releaseSlow(Thread *mep) {
     Thread *nextp;
 
-    mep = Thread::getCurrent();
-
     _lock.take();
-    
-    assert(_ownerp == mep);
-    _ownerp = NULL;
-
     nextp = _waiting.pop();
+    releaseStateNL(mep);
     _lock.release();
 
     /* and now queue the task we've found in the waiting queue */
@@ -111,11 +538,12 @@ ThreadMutex::release() {
 void
 ThreadMutex::releaseAndSleep(Thread *mep) {
     Thread *nextp;
-    assert(_ownerp == mep);
 
     /* do the basics of the mutex release */
-    _ownerp = NULL;
+    if (_profilep)
+        _profilep->released();
     nextp = _waiting.pop();
+    releaseStateNL(mep);
 
     if (nextp)
         nextp->queue();
@@ -124,131 +552,390 @@ ThreadMutex::releaseAndSleep(Thread *mep) {
     mep->sleep(&_lock);
 }
 
-/*****************TheadMutexDetect*****************/
+/* Internal; like releaseAndSleep, except that mep is a stackless waiter
+ * that's already been queued for a wakeup, so we just drop the spin lock.
+ */
+void
+ThreadMutex::releaseAndUnlock(Thread *mep) {
+    Thread *nextp;
 
-/* check for deadlocks; note that we try to stop all dispatchers so
- * that mutexes aren't changed while we're checking for deadlocks.
- *
- * We're searching for lock cycles, but it is possible that some other
- * held mutexes are not part of a cycle.
+    if (_profilep)
+        _profilep->released();
+    nextp = _waiting.pop();
+    releaseStateNL(mep);
+    _lock.release();
+
+    if (nextp)
+        nextp->queue();
+}
+
+/* Internal; see ThreadBaseLock.  If the mutex is held, setting the
+ * waiters bit makes its release take _lock, which we hold, so it will
+ * find the morphed waiters.  The waiters wake up in ThreadCond::wait,
+ * which then calls take as usual.
  */
 int
-ThreadMutexDetect::checkForDeadlocks()
-{
+ThreadMutex::morphWaitersNL(dqueue<Thread> *waitersp) {
     Thread *threadp;
-    ThreadEntry *ep;
-    uint32_t sweepIx = 0;
-    int didAny = 0;
-    int allStopped;
 
-    ThreadDispatcher::pauseAllDispatching();
+    if (!markWaitersNL())
+        return 0;
 
-    allStopped = ThreadDispatcher::pausedAllDispatching();
+    for(threadp = waitersp->head(); threadp; threadp=threadp->_dqNextp) {
+        if (__builtin_expect(_trackHolders, 0))
+            threadp->setBlockingHolder(getOwner());
+        threadp->setBlockingLock(this, NULL);
+    }
+    _waiting.concat(waitersp);
+    return 1;
+}
 
-    if (allStopped) {
-        for( ep = Thread::_allThreads.head(); ep; ep=ep->_dqNextp) {
-            threadp = ep->_threadp;
-            threadp->_marked = 0;
-        }
+/*****************TheadMutexDetect*****************/
+
+int ThreadBaseLock::_trackHolders = 0;
+
+uint32_t ThreadMutexDetect::_intervalMs = 10000;
+int ThreadMutexDetect::_abortOnDeadlock = 1;
+
+void
+ThreadMutexDetect::Wait::addHolder(Thread *threadp)
+{
+    /* a thread waiting for itself is upgrading, or draining readers */
+    if (threadp == NULL || threadp == _threadp || holds(threadp))
+        return;
+    if (_holderCount < _maxHolders)
+        _holders[_holderCount++] = threadp;
+}
+
+int
+ThreadMutexDetect::Wait::holds(Thread *threadp)
+{
+    uint32_t i;
+
+    for(i=0;i<_holderCount;i++) {
+        if (_holders[i] == threadp)
+            return 1;
+    }
+    return 0;
+}
+
+/* internal: record the blocked threads' waits.  We only read the
+ * Thread fields that the locks publish for us, with atomic loads, never
+ * the locks or their trackers, which may be gone by the time we look.
+ * A thread whose _blockSeq changed while we looked has moved on, and
+ * one whose holders were being changed each time we tried is skipped
+ * until the next snapshot.
+ */
+void
+ThreadMutexDetect::snapshot()
+{
+    static const uint32_t maxTries = 8;
+    std::vector<Wait> waits;
+    ThreadEntry *ep;
+    Thread *threadp;
+    Thread *holders[Thread::_maxBlockingHolders];
+    uint32_t holderCount;
+    uint32_t holdersSeq;
+    uint32_t tries;
+    Wait wait;
+    uint32_t i;
 
-        didAny = 0;
-        for( ep = Thread::_allThreads.head(); ep; ep=ep->_dqNextp) {
-            threadp = ep->_threadp;
-            sweepIx++;
-            reset();
-            didAny = sweepFrom(threadp, sweepIx);
-            if (didAny)
+    Thread::_globalThreadLock.take();
+    for(ep = Thread::_allThreads.head(); ep; ep=ep->_dqNextp) {
+        threadp = ep->_threadp;
+        wait._blockSeq = __atomic_load_n(&threadp->_blockSeq, __ATOMIC_ACQUIRE);
+        wait._mutexp = __atomic_load_n(&threadp->_blockingMutexp, __ATOMIC_ACQUIRE);
+        wait._rwp = __atomic_load_n(&threadp->_blockingRwp, __ATOMIC_ACQUIRE);
+        if (!wait._mutexp && !wait._rwp)
+            continue;
+
+        wait._threadp = threadp;
+        wait._blockedUs = __atomic_load_n(&threadp->_blockedUs, __ATOMIC_RELAXED);
+        for(tries=0; tries<maxTries; tries++) {
+            holdersSeq = __atomic_load_n(&threadp->_holdersSeq, __ATOMIC_ACQUIRE);
+            if (holdersSeq & 1)
+                continue;
+            holderCount = __atomic_load_n(&threadp->_blockingHolderCount, __ATOMIC_RELAXED);
+            if (holderCount > Thread::_maxBlockingHolders)
+                holderCount = Thread::_maxBlockingHolders;
+            for(i=0; i<holderCount; i++)
+                holders[i] = __atomic_load_n(&threadp->_blockingHolders[i], __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&threadp->_holdersSeq, __ATOMIC_RELAXED) == holdersSeq)
                 break;
         }
+        if (tries >= maxTries)
+            continue;
+
+        if (__atomic_load_n(&threadp->_blockSeq, __ATOMIC_ACQUIRE) != wait._blockSeq)
+            continue;
+
+        wait._holderCount = 0;
+        for(i=0; i<holderCount; i++)
+            wait.addHolder(holders[i]);
+        waits.push_back(wait);
     }
-    else {
-        didAny = 0;
-    }
+    Thread::_globalThreadLock.release();
+
+    _lastWaits.swap(_waits);
+    _waits.clear();
+    for(i=0; i<waits.size(); i++)
+        _waits[waits[i]._threadp] = waits[i];
+}
+
+/* internal: true if waitp's wait, and its edge to nextp, were in the
+ * last snapshot too.
+ */
+int
+ThreadMutexDetect::stable(Wait *waitp, Thread *nextp)
+{
+    Wait *lastp;
+    auto it = _lastWaits.find(waitp->_threadp);
+
+    if (it == _lastWaits.end())
+        return 0;
+    lastp = &it->second;
+    return (lastp->_blockSeq == waitp->_blockSeq &&
+            lastp->_mutexp == waitp->_mutexp &&
+            lastp->_rwp == waitp->_rwp &&
+            lastp->holds(nextp));
+}
 
-    ThreadDispatcher::resumeAllDispatching();
+/* internal: print a confirmed cycle, each thread waiting for the next.
+ * The locks are only printed by address, since the waits may have
+ * ended, and the locks been freed, since the snapshot.
+ */
+void
+ThreadMutexDetect::report(std::vector<Wait *> *cyclep)
+{
+    Wait *waitp;
+    void *lockp;
+    Thread *nextp;
+    long long nowUs;
+    uint32_t i;
 
-    return didAny;
+    nowUs = osp_getUs();
+    printf("Deadlock detected, %d threads:\n", (int) cyclep->size());
+    for(i=0; i<cyclep->size(); i++) {
+        waitp = (*cyclep)[i];
+        nextp = (*cyclep)[(i+1) % cyclep->size()]->_threadp;
+        if (waitp->_mutexp)
+            lockp = waitp->_mutexp;
+        else
+            lockp = waitp->_rwp;
+        printf("  thread %s (%p) has waited %.3fs for %s %p held by thread %s (%p)\n",
+               waitp->_threadp->name(), waitp->_threadp,
+               (nowUs - waitp->_blockedUs) / 1000000.0,
+               (waitp->_mutexp? "mutex" : "rwlock"), lockp,
+               nextp->name(), nextp);
+    }
+    fflush(stdout);
 }
 
-/* internal function to sweep a thread, tagging it with sweepIx to see if we've 
- * already visited it.
+/* look for cycles with a depth first search over the snapshot's edges;
+ * a cycle is found whenever we reach a thread that's still on our path.
  */
 int
-ThreadMutexDetect::sweepFrom(Thread *threadp, uint32_t sweepIx)
+ThreadMutexDetect::checkForDeadlocks()
 {
-    ThreadMutex *mutexp;
-    int rcode;
+    enum {
+        _unvisited = 0,
+        _onPath = 1,
+        _done = 2
+    };
+    std::unordered_map<Thread *, int> states;
+    std::vector<std::pair<Wait *, uint32_t> > path;
+    std::vector<Wait *> cycle;
+    Wait *waitp;
+    Thread *nextp;
+    uint32_t i;
+    int newDeadlocks = 0;
+    int confirmed;
+    int reported;
+
+    snapshot();
+
+    for(auto &entry : _waits) {
+        if (states[entry.first] != _unvisited)
+            continue;
+        states[entry.first] = _onPath;
+        path.push_back(std::make_pair(&entry.second, 0));
+
+        while(!path.empty()) {
+            waitp = path.back().first;
+            if (path.back().second >= waitp->_holderCount) {
+                states[waitp->_threadp] = _done;
+                path.pop_back();
+                continue;
+            }
+            nextp = waitp->_holders[path.back().second++];
+
+            auto it = _waits.find(nextp);
+            if (it == _waits.end())
+                continue;       /* not blocked, so not in a cycle */
+            if (states[nextp] == _unvisited) {
+                states[nextp] = _onPath;
+                path.push_back(std::make_pair(&it->second, 0));
+                continue;
+            }
+            if (states[nextp] != _onPath)
+                continue;
+
+            /* a cycle, from nextp down the path to waitp */
+            cycle.clear();
+            for(i=0; path[i].first->_threadp != nextp; i++)
+                ;
+            for(; i<path.size(); i++)
+                cycle.push_back(path[i].first);
+
+            confirmed = 1;
+            reported = 1;
+            for(i=0; i<cycle.size(); i++) {
+                if (!stable(cycle[i], cycle[(i+1) % cycle.size()]->_threadp))
+                    confirmed = 0;
+                auto rit = _reported.find(cycle[i]->_threadp);
+                if (rit == _reported.end() || rit->second != cycle[i]->_blockSeq)
+                    reported = 0;
+            }
+            if (confirmed && !reported) {
+                report(&cycle);
+                for(i=0; i<cycle.size(); i++)
+                    _reported[cycle[i]->_threadp] = cycle[i]->_blockSeq;
+                newDeadlocks++;
+                _deadlocks++;
+            }
+        }
+    }
 
-    push(threadp);
+    return newDeadlocks;
+}
 
-    if (threadp->_marked == sweepIx) {
-        displayTrace();
-        return 1;
+/* internal monitor thread */
+/* static */ void *
+ThreadMutexDetect::mutexMonitorTop(void *acxp)
+{
+    ThreadMutexDetect detect;
+    int code;
+
+    while(1) {
+        usleep(_intervalMs * 1000);
+        code = detect.checkForDeadlocks();
+        if (code && _abortOnDeadlock) {
+            printf("main: deadlocks found\n\n");
+            assert("deadlocked" == 0);
+        }
     }
+}
+
+/* start a monitoring thread watching for deadlocks */
+/* static */ void
+ThreadMutexDetect::start(uint32_t intervalMs, int abortOnDeadlock)
+{
+    pthread_t junk;
 
-    threadp->_marked = sweepIx;
+    _intervalMs = intervalMs;
+    _abortOnDeadlock = abortOnDeadlock;
+    ThreadBaseLock::_trackHolders = 1;
+    pthread_create(&junk, NULL, mutexMonitorTop, NULL);
+}
+
+/*****************ThreadCond*****************/
+void
+ThreadCond::wait(ThreadBaseLock *baseLockp)
+{
+    Thread *mep = Thread::getCurrent();
+
+    /* keep track which mutex is associated with this condition variable */
+    if (_baseLockp == NULL)
+        _baseLockp = baseLockp;
+    else if (baseLockp == NULL) {
+        baseLockp = _baseLockp;
+    }
+    else {
+        assert(_baseLockp == baseLockp);
+    }
+
+    /* grab the spinlock protecting te mutex, and put ourselves to sleep
+     * on the CV.  Finally, drop the mutex.
+     */
+    baseLockp->_lock.take();
+    
+    /* queue our task for the CV */
+    _waiting.append(mep);
+
+    /* and block, releasing the associated mutex */
+    baseLockp->releaseAndSleep(mep);
+
+    /* and reobtain it on the way back out; if a signal moved us to the
+     * mutex's wait queue, we were woken by its release.
+     */
+    mep->setBlockingLock(NULL, NULL);
+    baseLockp->take();
+}
+
+void
+ThreadCond::queueAndRelease(Thread *threadp, ThreadBaseLock *baseLockp)
+{
+    if (_baseLockp == NULL)
+        _baseLockp = baseLockp;
+    else if (baseLockp == NULL) {
+        baseLockp = _baseLockp;
+    }
+    else {
+        assert(_baseLockp == baseLockp);
+    }
+
+    baseLockp->_lock.take();
+    _waiting.append(threadp);
+    baseLockp->releaseAndUnlock(threadp);
+}
+
+int32_t
+ThreadCond::wait(ThreadCancel *cancelp, ThreadBaseLock *baseLockp)
+{
+    Thread *mep;
 
-    mutexp = threadp->_blockingMutexp;
-    if (mutexp == NULL) {
+    if (!cancelp) {
+        wait(baseLockp);
         return 0;
     }
 
-    if (mutexp->_ownerp) {
-        rcode = sweepFrom(mutexp->_ownerp, sweepIx);
-        return rcode;
-    }
+    mep = Thread::getCurrent();
 
-    /* unlocked mutex, we're done */
-    return 0;
-}
+    if (_baseLockp == NULL)
+        _baseLockp = baseLockp;
+    else if (baseLockp == NULL) {
+        baseLockp = _baseLockp;
+    }
+    else {
+        assert(_baseLockp == baseLockp);
+    }
 
-/* internal function to display the thread trace when a deadlock has been detected */
-void
-ThreadMutexDetect::displayTrace()
-{
-    uint32_t i;
-    Thread *threadp;
+    ThreadCondCancelWait cancelWait(this, baseLockp, mep);
+    baseLockp->_lock.take();
 
-    printf("Deadlock detected:\n");
-    for(i=0;i<_currentIx;i++) {
-        threadp = _stack[i];
-        printf("Deadlock thread %p waits for mutex=%p owned by thread %p\n",
-               threadp, threadp->_blockingMutexp, threadp->_blockingMutexp->_ownerp);
+    /* if we're already canceled, return with the lock still held */
+    if (cancelp->addWait(&cancelWait) != 0) {
+        baseLockp->_lock.release();
+        return ThreadCancel::TC_ERR_CANCELED;
     }
-}
 
-/* internal monitor thread */
-/* static */ void *
-ThreadMutexDetect::mutexMonitorTop(void *acxp)
-{
-    ThreadMutexDetect detect;
-    int code;
+    _waiting.append(mep);
+    baseLockp->releaseAndSleep(mep);
+    cancelp->removeWait(&cancelWait);
 
-    while(1) {
-        sleep(10);
-        code = detect.checkForDeadlocks();
-        if (code) {
-            printf("main: deadlocks found\n\n");
-            assert("deadlocked" == 0);
-        }
-    }
+    mep->setBlockingLock(NULL, NULL);
+    baseLockp->take();
+    return (cancelWait._removed? ThreadCancel::TC_ERR_CANCELED : 0);
 }
 
-/* start a monitoring thread watching for deadlocks */
-/* static */ void
-ThreadMutexDetect::start()
+int32_t
+ThreadCond::waitFor(uint32_t ms, ThreadBaseLock *baseLockp)
 {
-    pthread_t junk;
-    pthread_create(&junk, NULL, mutexMonitorTop, NULL);
-}
+    Thread *mep;
 
-/*****************ThreadCond*****************/
-void
-ThreadCond::wait(ThreadBaseLock *baseLockp)
-{
-    Thread *mep = Thread::getCurrent();
+    mep = Thread::getCurrent();
 
-    /* keep track which mutex is associated with this condition variable */
     if (_baseLockp == NULL)
         _baseLockp = baseLockp;
     else if (baseLockp == NULL) {
@@ -258,42 +945,70 @@ ThreadCond::wait(ThreadBaseLock *baseLockp)
         assert(_baseLockp == baseLockp);
     }
 
-    /* grab the spinlock protecting te mutex, and put ourselves to sleep
-     * on the CV.  Finally, drop the mutex.
-     */
+    ThreadCondCancelWait cancelWait(this, baseLockp, mep);
+    ThreadWaitTimer timer(&cancelWait);
     baseLockp->_lock.take();
-    
-    /* queue our task for the CV */
-    _waiting.append(mep);
 
-    /* and block, releasing the associated mutex */
+    timer.start(ms);
+    _waiting.append(mep);
     baseLockp->releaseAndSleep(mep);
+    timer.stop();
 
-    /* and reobtain it on the way back out */
+    mep->setBlockingLock(NULL, NULL);
     baseLockp->take();
+    return (cancelWait._removed? ThreadBaseLock::TL_ERR_TIMEDOUT : ThreadBaseLock::TL_OK);
 }
 
-/* wakeup a single waiting thread */
+/* wakeup a single waiting thread; if the lock is held, typically by
+ * us, the waiter is moved to the lock's wait queue instead, since it
+ * would just block there as soon as it ran.
+ */
 void
 ThreadCond::signal()
 {
     Thread *headp;
+    dqueue<Thread> waiters;
+
+    if (!_baseLockp)
+        return;
 
     _baseLockp->_lock.take();
     headp = _waiting.pop();
+    if (!headp) {
+        _baseLockp->_lock.release();
+        return;
+    }
+    waiters.append(headp);
+    if (_baseLockp->morphWaitersNL(&waiters)) {
+        _morphed++;
+        _baseLockp->_lock.release();
+        return;
+    }
     _baseLockp->_lock.release();
 
     headp->queue();
 }
 
-/* wakeup all waiting threads */
+/* wakeup all waiting threads, or with the lock held, move them all to
+ * the lock's wait queue, where its releases wake them one at a time.
+ */
 void
 ThreadCond::broadcast()
 {
     Thread *headp;
     Thread *nextp;
+    uint32_t count;
+
+    if (!_baseLockp)
+        return;
 
     _baseLockp->_lock.take();
+    count = _waiting._queueCount;
+    if (count > 0 && _baseLockp->morphWaitersNL(&_waiting)) {
+        _morphed += count;
+        _baseLockp->_lock.release();
+        return;
+    }
     headp = _waiting.head();
     _waiting.init();
     _baseLockp->_lock.release();
@@ -335,13 +1050,21 @@ ThreadLockRw::lockWrite(ThreadLockTracker *trackerp)
 {
     Thread *threadp = Thread::getCurrent();
 
+    uint64_t waitTicks;
+
     _lock.take();
     
     if (_writeCount + _upgradeCount + _readCount > 0) {
+        waitTicks = threadCpuTicks();
         _writesWaiting.append(threadp);
         threadp->_lockClock = _lockClock++;
+        publishHoldersNL(threadp);
+        threadp->setBlockingLock(NULL, this);
         threadp->sleep(&_lock);
+        threadp->setBlockingLock(NULL, NULL);
         _lock.take();
+        if (_profilep)
+            _profilep->waited(threadCpuTicks() - waitTicks, __builtin_return_address(0));
     }
     else {
         /* we can get the lock immediately, and w/o any fairness issues; we know
@@ -351,10 +1074,61 @@ ThreadLockRw::lockWrite(ThreadLockTracker *trackerp)
         _ownerp = threadp;
         _writeCount++;
     }
+    if (_profilep)
+        _profilep->acquired();
 
     _lock.release();
 }
 
+int32_t
+ThreadLockRw::lockWriteFor(uint32_t ms, ThreadLockTracker *trackerp)
+{
+    Thread *threadp = Thread::getCurrent();
+    uint64_t waitTicks;
+
+    _lock.take();
+
+    if (_writeCount + _upgradeCount + _readCount == 0) {
+        /* no fairness issues, as in lockWrite */
+        _ownerp = threadp;
+        _writeCount++;
+        if (_profilep)
+            _profilep->acquired();
+        _lock.release();
+        return TL_OK;
+    }
+
+    if (ms == 0) {
+        _lock.release();
+        return TL_ERR_TIMEDOUT;
+    }
+
+    ThreadLockRwCancelWait cancelWait(this, &_writesWaiting, threadp);
+    ThreadWaitTimer timer(&cancelWait);
+
+    waitTicks = threadCpuTicks();
+    timer.start(ms);
+    _writesWaiting.append(threadp);
+    threadp->_lockClock = _lockClock++;
+    publishHoldersNL(threadp);
+    threadp->setBlockingLock(NULL, this);
+    threadp->sleep(&_lock);
+    threadp->setBlockingLock(NULL, NULL);
+    timer.stop();
+
+    /* if the timer didn't remove us, wakeNext granted us the lock */
+    if (cancelWait._removed)
+        return TL_ERR_TIMEDOUT;
+
+    if (_profilep) {
+        _lock.take();
+        _profilep->waited(threadCpuTicks() - waitTicks, __builtin_return_address(0));
+        _profilep->acquired();
+        _lock.release();
+    }
+    return TL_OK;
+}
+
 /* return 1 if got the lock.  TryLock calls ignore fairness */
 int
 ThreadLockRw::tryWrite(ThreadLockTracker *trackerp)
@@ -375,6 +1149,8 @@ ThreadLockRw::tryWrite(ThreadLockTracker *trackerp)
          */
          _ownerp = threadp;
          _writeCount++;
+         if (_profilep)
+             _profilep->acquired();
     }
 
     _lock.release();
@@ -481,7 +1257,7 @@ ThreadLockRw::wakeNext()
              * just performed the upgrade, we have a write lock and can't
              * grant anything else, either.
              */
-            return;
+            break;
         }
 
         if ((grantThreadp = _readsWaiting.head()) != NULL) {
@@ -516,6 +1292,63 @@ ThreadLockRw::wakeNext()
             }
         }
     } /* loop while granting new locks */
+
+    publishHoldersNL(NULL);
+}
+
+/* called with _lock held, whenever the holders may have changed: tell
+ * waiterp, or if it's null, every queued thread, who holds the lock,
+ * for the deadlock detector.  We only know of the write or upgrade
+ * lock owner, and of readers that registered a tracker.
+ */
+void
+ThreadLockRw::publishAllHoldersNL(Thread *waiterp)
+{
+    Thread *holders[Thread::_maxBlockingHolders];
+    ThreadLockTracker *trackerp;
+    Thread *threadp;
+    uint32_t count = 0;
+
+    if (!waiterp && _readsWaiting.empty() && _writesWaiting.empty() && _upgradesWaiting.empty())
+        return;
+
+    if (_ownerp)
+        holders[count++] = _ownerp;
+    for(trackerp = _trackerQueue.head();
+        trackerp && count < Thread::_maxBlockingHolders;
+        trackerp = trackerp->_dqNextp)
+        holders[count++] = trackerp->_threadp;
+
+    if (waiterp) {
+        waiterp->setBlockingHolders(holders, count);
+        return;
+    }
+    for(threadp = _readsWaiting.head(); threadp; threadp=threadp->_dqNextp)
+        threadp->setBlockingHolders(holders, count);
+    for(threadp = _writesWaiting.head(); threadp; threadp=threadp->_dqNextp)
+        threadp->setBlockingHolders(holders, count);
+    for(threadp = _upgradesWaiting.head(); threadp; threadp=threadp->_dqNextp)
+        threadp->setBlockingHolders(holders, count);
+}
+
+/* called with _lock held, once threadp has a read lock */
+void
+ThreadLockRw::trackReaderNL(ThreadLockTracker *trackerp, Thread *threadp)
+{
+    trackerp->_lockMode = ThreadLockTracker::_lockRead;
+    trackerp->_threadp = threadp;
+    _trackerQueue.append(trackerp);
+    publishHoldersNL(NULL);
+}
+
+/* called with _lock held, as a tracked read lock is released */
+void
+ThreadLockRw::untrackReaderNL(ThreadLockTracker *trackerp)
+{
+    trackerp->_lockMode = ThreadLockTracker::_lockNone;
+    trackerp->_threadp = NULL;
+    _trackerQueue.remove(trackerp);
+    publishHoldersNL(NULL);
 }
 
 void
@@ -527,6 +1360,8 @@ ThreadLockRw::releaseWrite(ThreadLockTracker *trackerp)
     assert(_writeCount > 0 && _ownerp == threadp);
 
     /* clear state indicating write locked */
+    if (_profilep)
+        _profilep->released();
     _writeCount--;
     _ownerp = NULL;
 
@@ -543,6 +1378,8 @@ ThreadLockRw::releaseAndSleep(Thread *threadp)
     assert(_writeCount > 0 && _ownerp == threadp);
 
     /* clear state indicating write locked */
+    if (_profilep)
+        _profilep->released();
     _writeCount--;
     _ownerp = NULL;
 
@@ -551,6 +1388,21 @@ ThreadLockRw::releaseAndSleep(Thread *threadp)
     threadp->sleep(&_lock);
 }
 
+void
+ThreadLockRw::releaseAndUnlock(Thread *threadp)
+{
+    assert(_writeCount > 0 && _ownerp == threadp);
+
+    if (_profilep)
+        _profilep->released();
+    _writeCount--;
+    _ownerp = NULL;
+
+    wakeNext();
+
+    _lock.release();
+}
+
 void
 ThreadLockRw::releaseUpgrade(ThreadLockTracker *trackerp)
 {
@@ -560,6 +1412,8 @@ ThreadLockRw::releaseUpgrade(ThreadLockTracker *trackerp)
     assert(_upgradeCount > 0 && _ownerp == threadp);
 
     /* clear state indicating write locked */
+    if (_profilep)
+        _profilep->released();
     _upgradeCount--;
     _ownerp = NULL;
 
@@ -571,6 +1425,7 @@ void
 ThreadLockRw::lockRead(ThreadLockTracker *trackerp)
 {
     Thread *threadp;
+    uint64_t waitTicks;
 
     threadp = Thread::getCurrent();
 
@@ -580,31 +1435,95 @@ ThreadLockRw::lockRead(ThreadLockTracker *trackerp)
     if (_writeCount == 0) {
         if ( !readUnfair(/* !lockQueued */ 0)) {
             if (trackerp) {
-                trackerp->_lockMode = ThreadLockTracker::_lockRead;
-                trackerp->_threadp = threadp;
-                _trackerQueue.append(trackerp);
+                trackReaderNL(trackerp, threadp);
             }
             _readCount++;
+            if (_profilep)
+                _profilep->acquiredShared();
             _lock.release();
             return;
         }
     }
 
     /* here, we queue the reader */
+    waitTicks = threadCpuTicks();
     threadp->_lockClock = _lockClock++;
     _readsWaiting.append(threadp);
+    publishHoldersNL(threadp);
+    threadp->setBlockingLock(NULL, this);
     threadp->sleep(&_lock);
+    threadp->setBlockingLock(NULL, NULL);
 
-    if (trackerp) {
+    if (trackerp || _profilep) {
         _lock.take();
-        trackerp->_lockMode = ThreadLockTracker::_lockRead;
-        trackerp->_threadp = threadp;
-        _trackerQueue.append(trackerp);
+        if (trackerp) {
+            trackReaderNL(trackerp, threadp);
+        }
+        if (_profilep) {
+            _profilep->waited(threadCpuTicks() - waitTicks, __builtin_return_address(0));
+            _profilep->acquiredShared();
+        }
         _lock.release();
     }
     return;
 }
 
+int32_t
+ThreadLockRw::lockReadFor(uint32_t ms, ThreadLockTracker *trackerp)
+{
+    Thread *threadp;
+    uint64_t waitTicks;
+
+    threadp = Thread::getCurrent();
+
+    _lock.take();
+
+    if (_writeCount == 0 && !readUnfair(/* !lockQueued */ 0)) {
+        if (trackerp) {
+            trackReaderNL(trackerp, threadp);
+        }
+        _readCount++;
+        if (_profilep)
+            _profilep->acquiredShared();
+        _lock.release();
+        return TL_OK;
+    }
+
+    if (ms == 0) {
+        _lock.release();
+        return TL_ERR_TIMEDOUT;
+    }
+
+    ThreadLockRwCancelWait cancelWait(this, &_readsWaiting, threadp);
+    ThreadWaitTimer timer(&cancelWait);
+
+    waitTicks = threadCpuTicks();
+    timer.start(ms);
+    threadp->_lockClock = _lockClock++;
+    _readsWaiting.append(threadp);
+    publishHoldersNL(threadp);
+    threadp->setBlockingLock(NULL, this);
+    threadp->sleep(&_lock);
+    threadp->setBlockingLock(NULL, NULL);
+    timer.stop();
+
+    if (cancelWait._removed)
+        return TL_ERR_TIMEDOUT;
+
+    if (trackerp || _profilep) {
+        _lock.take();
+        if (trackerp) {
+            trackReaderNL(trackerp, threadp);
+        }
+        if (_profilep) {
+            _profilep->waited(threadCpuTicks() - waitTicks, __builtin_return_address(0));
+            _profilep->acquiredShared();
+        }
+        _lock.release();
+    }
+    return TL_OK;
+}
+
 /* return 1 if got locked */
 int
 ThreadLockRw::tryRead(ThreadLockTracker *trackerp)
@@ -612,10 +1531,10 @@ ThreadLockRw::tryRead(ThreadLockTracker *trackerp)
     _lock.take();
     if (_writeCount == 0) {
         _readCount++;
+        if (_profilep)
+            _profilep->acquiredShared();
         if (trackerp) {
-            trackerp->_lockMode = ThreadLockTracker::_lockRead;
-            trackerp->_threadp = Thread::getCurrent();
-            _trackerQueue.append(trackerp);
+            trackReaderNL(trackerp, Thread::getCurrent());
         }
         _lock.release();
         return 1;
@@ -633,11 +1552,8 @@ ThreadLockRw::releaseRead(ThreadLockTracker *trackerp)
     
     assert(_readCount > 0);
     _readCount--;
-    if (trackerp) {
-        trackerp->_lockMode = ThreadLockTracker::_lockNone;
-        trackerp->_threadp = NULL;
-        _trackerQueue.remove( trackerp);
-    }
+    if (trackerp)
+        untrackReaderNL(trackerp);
 
     wakeNext();
 
@@ -653,11 +1569,14 @@ ThreadLockRw::writeToRead()
     assert(_writeCount > 0 && _ownerp == threadp);
 
     /* clear state indicating write locked */
+    if (_profilep)
+        _profilep->released();
     _writeCount--;
     _ownerp = NULL;
 
     /* and increment readers */
     _readCount++;
+    publishHoldersNL(NULL);
     
     _lock.release();
 }
@@ -667,20 +1586,30 @@ void
 ThreadLockRw::lockUpgrade(ThreadLockTracker *trackerp)
 {
     Thread *threadp;
+    uint64_t waitTicks;
 
     threadp = Thread::getCurrent();
 
     _lock.take();
     if (_ownerp == NULL) {
-        /* we can get the lock */
+        /* we can get the lock, even with writers waiting for readers */
         _ownerp = threadp;
         _upgradeCount++;
+        publishHoldersNL(NULL);
     }
     else {
+        waitTicks = threadCpuTicks();
         _upgradesWaiting.append(threadp);
+        publishHoldersNL(threadp);
+        threadp->setBlockingLock(NULL, this);
         threadp->sleep(&_lock);
+        threadp->setBlockingLock(NULL, NULL);
         _lock.take();
+        if (_profilep)
+            _profilep->waited(threadCpuTicks() - waitTicks, __builtin_return_address(0));
     }
+    if (_profilep)
+        _profilep->acquired();
 
     /* our rules for upgradeToWrite are that it is set to zero each
      * time a new thread bumps upgradeCount, before the lockUpgrade
@@ -702,6 +1631,7 @@ void
 ThreadLockRw::upgradeToWrite()
 {
     Thread *threadp = Thread::getCurrent();
+    uint64_t waitTicks;
 
     _lock.take();
     
@@ -720,8 +1650,14 @@ ThreadLockRw::upgradeToWrite()
         threadp->_lockClock = _lockClock - 100;
         _writesWaiting.prepend(threadp);
 
+        waitTicks = threadCpuTicks();
+        publishHoldersNL(threadp);
+        threadp->setBlockingLock(NULL, this);
         threadp->sleep(&_lock);
+        threadp->setBlockingLock(NULL, NULL);
         _lock.take();
+        if (_profilep)
+            _profilep->waited(threadCpuTicks() - waitTicks, __builtin_return_address(0));
     }
     else {
         /* no readers preventing our upgrade */
@@ -734,3 +1670,247 @@ ThreadLockRw::upgradeToWrite()
 
     _lock.release();
 }
+
+/*****************ThreadLockRwBiased*****************/
+
+int64_t
+ThreadLockRwBiased::readerCount()
+{
+    int64_t count = 0;
+    uint32_t i;
+
+    for(i=0; i<=ThreadDispatcher::_maxDispatchers; i++)
+        count += _slots[i]._readers.load();
+    return count;
+}
+
+/* called by a reader that released its slot while a writer was
+ * waiting for the readers to drain; wake the writer if we were the last.
+ */
+void
+ThreadLockRwBiased::wakeDrainer()
+{
+    Thread *threadp;
+
+    _lock.take();
+    threadp = _drainWaiterp.load();
+    if (threadp && readerCount() == 0) {
+        _drainWaiterp.store(NULL);
+        _lock.release();
+        threadp->queue();
+        return;
+    }
+    _lock.release();
+}
+
+/* the bias is revoked, so a writer holds, or is about to hold, the
+ * underlying write lock; wait behind it, and count ourselves in our
+ * slot while holding the underlying read lock, so no writer can be
+ * draining while we do.
+ */
+void
+ThreadLockRwBiased::lockReadSlow()
+{
+    ThreadLockRw::lockRead();
+    mySlot()->_readers.fetch_add(1);
+    ThreadLockRw::releaseRead();
+}
+
+void
+ThreadLockRwBiased::trackRead(ThreadLockTracker *trackerp)
+{
+    Thread *drainerp;
+
+    _lock.take();
+    trackReaderNL(trackerp, Thread::getCurrent());
+    if ((drainerp = _drainWaiterp.load()) != NULL)
+        publishHoldersNL(drainerp);
+    _lock.release();
+}
+
+void
+ThreadLockRwBiased::untrackRead(ThreadLockTracker *trackerp)
+{
+    Thread *drainerp;
+
+    _lock.take();
+    untrackReaderNL(trackerp);
+    if ((drainerp = _drainWaiterp.load()) != NULL)
+        publishHoldersNL(drainerp);
+    _lock.release();
+}
+
+/* called holding the underlying write lock; turn away new fast path
+ * readers, and wait for the ones holding the lock to release it.
+ * Readers usually hold the lock briefly, so we poll a little before
+ * sleeping.  If timed, gives up after ms, returning TL_ERR_TIMEDOUT
+ * with the bias still revoked.
+ */
+int32_t
+ThreadLockRwBiased::revokeAndDrain(int timed, uint32_t ms)
+{
+    Thread *mep;
+    uint32_t i;
+    int started = 0;
+    int32_t code = TL_OK;
+
+    _readerBias.store(0);
+    for(i=0; i<_drainSpins; i++) {
+        if (readerCount() == 0)
+            return TL_OK;
+        spinLockPause();
+    }
+
+    mep = Thread::getCurrent();
+    ThreadLockRwDrainWait drainWait(this, mep);
+    ThreadWaitTimer timer(&drainWait);
+
+    _lock.take();
+    while(1) {
+        /* set before counting, pairing with the readers' release */
+        _drainWaiterp.store(mep);
+        if (readerCount() == 0) {
+            _drainWaiterp.store(NULL);
+            break;
+        }
+        if (timed && (ms == 0 || timer.fired())) {
+            _drainWaiterp.store(NULL);
+            code = TL_ERR_TIMEDOUT;
+            break;
+        }
+        if (timed && !started) {
+            timer.start(ms);
+            started = 1;
+        }
+        publishHoldersNL(mep);
+        mep->setBlockingLock(NULL, this);
+        mep->sleep(&_lock);
+        mep->setBlockingLock(NULL, NULL);
+        _lock.take();
+        if (drainWait._removed) {
+            code = TL_ERR_TIMEDOUT;
+            break;
+        }
+    }
+    _lock.release();
+
+    if (started)
+        timer.stop();
+    return code;
+}
+
+int32_t
+ThreadLockRwBiased::lockReadFor(uint32_t ms, ThreadLockTracker *trackerp)
+{
+    int32_t code;
+
+    if (!readFast()) {
+        code = ThreadLockRw::lockReadFor(ms);
+        if (code != TL_OK)
+            return code;
+        mySlot()->_readers.fetch_add(1);
+        ThreadLockRw::releaseRead();
+    }
+    if (trackerp)
+        trackRead(trackerp);
+    return TL_OK;
+}
+
+int
+ThreadLockRwBiased::tryRead(ThreadLockTracker *trackerp)
+{
+    if (!readFast()) {
+        if (!ThreadLockRw::tryRead())
+            return 0;
+        mySlot()->_readers.fetch_add(1);
+        ThreadLockRw::releaseRead();
+    }
+    if (trackerp)
+        trackRead(trackerp);
+    return 1;
+}
+
+void
+ThreadLockRwBiased::lockWrite(ThreadLockTracker *trackerp)
+{
+    ThreadLockRw::lockWrite(trackerp);
+    revokeAndDrain(/* !timed */ 0, 0);
+}
+
+int32_t
+ThreadLockRwBiased::lockWriteFor(uint32_t ms, ThreadLockTracker *trackerp)
+{
+    long long startUs;
+    long long elapsedMs;
+    int32_t code;
+
+    startUs = osp_getUs();
+    code = ThreadLockRw::lockWriteFor(ms, trackerp);
+    if (code != TL_OK)
+        return code;
+
+    /* the drain gets whatever's left of the deadline */
+    elapsedMs = (osp_getUs() - startUs) / 1000;
+    code = revokeAndDrain(/* timed */ 1, (elapsedMs < ms? ms - elapsedMs : 0));
+    if (code != TL_OK) {
+        _readerBias.store(1);
+        ThreadLockRw::releaseWrite(trackerp);
+    }
+    return code;
+}
+
+int
+ThreadLockRwBiased::tryWrite(ThreadLockTracker *trackerp)
+{
+    if (!ThreadLockRw::tryWrite(trackerp))
+        return 0;
+    _readerBias.store(0);
+    if (readerCount() != 0) {
+        _readerBias.store(1);
+        ThreadLockRw::releaseWrite(trackerp);
+        return 0;
+    }
+    return 1;
+}
+
+/* restore the bias before releasing the underlying lock, so that a
+ * writer that gets it after us can't have its revocation undone.
+ */
+void
+ThreadLockRwBiased::releaseWrite(ThreadLockTracker *trackerp)
+{
+    _readerBias.store(1);
+    ThreadLockRw::releaseWrite(trackerp);
+}
+
+/* the underlying upgradeToWrite waits out the underlying readers, and
+ * then we wait out the ones in the slots.
+ */
+void
+ThreadLockRwBiased::upgradeToWrite()
+{
+    ThreadLockRw::upgradeToWrite();
+    revokeAndDrain(/* !timed */ 0, 0);
+}
+
+void
+ThreadLockRwBiased::writeToRead()
+{
+    mySlot()->_readers.fetch_add(1);
+    _readerBias.store(1);
+    ThreadLockRw::releaseWrite();
+}
+
+void
+ThreadLockRwBiased::releaseAndSleep(Thread *threadp)
+{
+    _readerBias.store(1);
+    ThreadLockRw::releaseAndSleep(threadp);
+}
+
+void
+ThreadLockRwBiased::releaseAndUnlock(Thread *threadp)
+{
+    _readerBias.store(1);
+    ThreadLockRw::releaseAndUnlock(threadp);
+}
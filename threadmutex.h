@@ -26,11 +26,16 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef __THREAD_MUTEX_H_ENV__
 #define __THREAD_MUTEX_H_ENV__ 1
 
+#include <unordered_map>
+#include <vector>
+
 #include "thread.h"
+#include "threadlockprofile.h"
 
 class ThreadCond;
 class ThreadMutex;
 class ThreadMutexDetect;
+class ThreadCancel;
 
 /* general lock-like class for both read/write locks and mutexes, so that we can
  * have a single condition variable class that can release either type of lock
@@ -41,9 +46,24 @@ class ThreadMutexDetect;
  */
 class ThreadBaseLock  {
  public:
+    /* returned by the timed waits, takeFor, lockReadFor and the like */
+    enum Error {
+        TL_OK = 0,
+        TL_ERR_TIMEDOUT = -3
+    };
+
     long long _waitUs;
     SpinLock _lock;
 
+    /* set once a ThreadMutexDetect exists; until then, the locks don't
+     * bother telling their waiters who holds them (see
+     * Thread::setBlockingHolders), since nobody would look.
+     */
+    static int _trackHolders;
+
+    /* non-null if the lock is being profiled; see threadlockprofile.h */
+    ThreadLockProfile *_profilep;
+
     virtual void take() = 0;
     virtual void lock() { take(); }
 
@@ -54,16 +74,41 @@ class ThreadBaseLock  {
 
     virtual void releaseAndSleep(Thread *threadp) = 0;
 
+    /* like releaseAndSleep, but just drops the spin lock instead of
+     * sleeping; used for stackless waiters.
+     */
+    virtual void releaseAndUnlock(Thread *threadp) = 0;
+
+    /* wait morphing: called by ThreadCond, holding _lock, to move
+     * signalled CV waiters straight onto the lock's own wait queue while
+     * the lock is held, so that each is woken only when it can get the
+     * lock, instead of all waking just to block again.  Returns 0,
+     * leaving the waiters alone, if the lock can't take them.
+     */
+    virtual int morphWaitersNL(dqueue<Thread> *waitersp) {
+        return 0;
+    }
+
     virtual long long getWaitUs() {
         return _waitUs;
     }
 
+    /* "mutex" or "rwlock", for reports */
+    virtual const char *lockType() = 0;
+
+    /* name the lock, and start profiling it if it isn't already */
+    void setName(const char *namep) {
+        ThreadLockProfiler::track(this, namep, lockType());
+    }
+
     ThreadBaseLock() {
         _waitUs = 0;
+        _profilep = NULL;
     }
 
     virtual ~ThreadBaseLock() {
-        return;
+        if (_profilep)
+            ThreadLockProfiler::untrack(this);
     }
 };
 
@@ -72,39 +117,115 @@ class ThreadBaseLock  {
  */
 class ThreadCond {
     friend class ThreadBaseLock;
+    friend class ThreadCondCancelWait;
 
  private:
     dqueue<Thread> _waiting;
     ThreadBaseLock *_baseLockp;
+    uint64_t _morphed;          /* waiters moved to the lock's queue; see signal */
 
  public:
 
     ThreadCond() {
         _baseLockp = NULL;
+        _morphed = 0;
     }
 
     ThreadCond(ThreadBaseLock *baseLockp) {
         _baseLockp = baseLockp;
+        _morphed = 0;
     }
 
     void wait(ThreadBaseLock *baseLockp = 0);
 
+    /* as above, but returns ThreadCancel::TC_ERR_CANCELED if the token
+     * is canceled while we wait (see threadcancel.h).  The lock is
+     * held again on return either way.
+     */
+    int32_t wait(ThreadCancel *cancelp, ThreadBaseLock *baseLockp = 0);
+
+    /* as wait, but gives up after ms milliseconds, returning
+     * ThreadBaseLock::TL_ERR_TIMEDOUT.  The lock is held again on
+     * return either way.
+     */
+    int32_t waitFor(uint32_t ms, ThreadBaseLock *baseLockp = 0);
+
     void signal();
 
     void broadcast();
 
+    /* wait for stackless callers, like coroutines, which pass the Thread
+     * standing in for them: queue threadp on the CV and release the lock
+     * it holds, without sleeping.  When the CV is signalled, threadp's
+     * queue method is called, and the caller must reobtain the lock.
+     */
+    void queueAndRelease(Thread *threadp, ThreadBaseLock *baseLockp = 0);
+
     void setMutex(ThreadBaseLock *baseLockp) {
         _baseLockp = baseLockp;
     }
+
+    /* how many signalled waiters went straight to the lock's wait queue */
+    uint64_t getMorphed() {
+        return _morphed;
+    }
 };
 
 class ThreadMutex : public ThreadBaseLock {
     friend class ThreadCond;
     friend class ThreadMutexDetect;
+    friend class ThreadMutexCancelWait;
 
  private:
+    /* the mutex state: the owning Thread pointer, or 0 if the mutex is
+     * free, plus _waitersBit.  Uncontended takes and releases are a
+     * single CAS on the state; the waiters bit forces releases into
+     * releaseSlow, which takes _lock, so that they see the threads
+     * queued in _waiting.  The bit is only set while holding _lock.
+     */
+    std::atomic<uintptr_t> _state;
     dqueue<Thread> _waiting;
-    Thread *_ownerp;
+
+    static const uintptr_t _waitersBit = 1;
+
+    /* adaptive spinning: how long a contended take spins for an owner
+     * that's running on another dispatcher before parking, learned
+     * from how long past spins took to succeed.
+     */
+    uint32_t _spinTicks;
+
+    /* stats, protected by _lock; _contended counts takes that found
+     * the mutex owned, which then either got it while spinning or
+     * parked at least once.
+     */
+    uint64_t _contended;
+    uint64_t _spinAcquires;
+    uint64_t _parks;
+
+    static uint32_t _maxSpinTicks;
+
+    int claimNL(Thread *threadp);
+
+    int markWaitersNL();
+
+    void releaseStateNL(Thread *threadp);
+
+    void publishOwnerNL(Thread *ownerp);
+
+    void publishWaitersNL(Thread *ownerp) {
+        if (__builtin_expect(_trackHolders, 0))
+            publishOwnerNL(ownerp);
+    }
+
+    void queueWaiterNL(Thread *threadp);
+
+    void takeSlow(Thread *mep);
+
+    void releaseSlow(Thread *mep);
+
+    int spinNL(uint64_t *startTicksp);
+
+    void contendedDoneNL(uint64_t startTicks, int parked);
 
     /* the releaseNL call is made while holding _lock, and releases the mutex, and finally
      * also releases the internal spin lock.  So, this call is just like release except
@@ -112,17 +233,104 @@ class ThreadMutex : public ThreadBaseLock {
      */
     void releaseAndSleep(Thread *threadp);
 
+    void releaseAndUnlock(Thread *threadp);
+
+    int morphWaitersNL(dqueue<Thread> *waitersp);
+
  public:
 
+    /* spin bounds, in rdtsc ticks */
+    static const uint32_t _minSpinTicks = 200;
+    static const uint32_t _initSpinTicks = 4000;
+
     ThreadMutex() {
-        _ownerp = NULL;
+        _state = 0;
+        _spinTicks = _initSpinTicks;
+        _contended = 0;
+        _spinAcquires = 0;
+        _parks = 0;
+        if (ThreadLockProfiler::_profileAll)
+            ThreadLockProfiler::track(this, NULL, "mutex");
+    }
+
+    const char *lockType() {
+        return "mutex";
+    }
+
+    /* always inlined, and final so that calls through a ThreadMutex
+     * pointer aren't virtual, even in an unoptimized build: the lock
+     * profiler records takeSlow's return address as the call site, and
+     * that must be in our caller, not in an out of line copy of take.
+     */
+    __attribute__((always_inline)) void take() final {
+        Thread *mep = Thread::getCurrent();
+        uintptr_t expected = 0;
+
+        if (!_state.compare_exchange_strong(expected, (uintptr_t) mep, std::memory_order_acquire))
+            takeSlow(mep);
+        else if (__builtin_expect(_profilep != NULL, 0))
+            _profilep->acquired();
     }
-    
-    void take();
+
+    /* returns ThreadCancel::TC_ERR_CANCELED, without the mutex, if the
+     * token is canceled while we wait (see threadcancel.h).
+     */
+    int32_t take(ThreadCancel *cancelp);
+
+    /* returns TL_ERR_TIMEDOUT, without the mutex, if we can't get it
+     * within ms milliseconds; ms of 0 just tries, after spinning.
+     */
+    int32_t takeFor(uint32_t ms);
 
     int tryLock();
 
-    void release();
+    void release() {
+        releaseOwner(Thread::getCurrent());
+    }
+
+    /* for stackless callers, which pass the Thread standing in for
+     * them: take the mutex and return 1 if it's free; otherwise queue
+     * threadp, whose queue method is called when the mutex is
+     * released, and return 0.  The caller should then try again.
+     */
+    int takeOrQueue(Thread *threadp);
+
+    /* release on behalf of the given owner */
+    void releaseOwner(Thread *threadp) {
+        uintptr_t expected = (uintptr_t) threadp;
+
+        if (__builtin_expect(_profilep != NULL, 0))
+            _profilep->released();
+
+        if (!_state.compare_exchange_strong(expected, 0, std::memory_order_release))
+            releaseSlow(threadp);
+    }
+
+    /* the owner, or NULL; only a hint unless you're the owner */
+    Thread *getOwner() {
+        return (Thread *) (_state.load(std::memory_order_relaxed) & ~_waitersBit);
+    }
+
+    uint64_t getContended() {
+        return _contended;
+    }
+
+    uint64_t getSpinAcquires() {
+        return _spinAcquires;
+    }
+
+    uint64_t getParks() {
+        return _parks;
+    }
+
+    uint32_t getSpinTicks() {
+        return _spinTicks;
+    }
+
+    /* cap on how long any mutex spins; 0 turns spinning off */
+    static void setMaxSpinTicks(uint32_t ticks) {
+        _maxSpinTicks = ticks;
+    }
 
     virtual ~ThreadMutex() {
         return;
@@ -205,6 +413,8 @@ class ThreadLockRw : public ThreadBaseLock {
     /* release a write lock and go to sleep atomically */
     void releaseAndSleep(Thread *threadp);
 
+    void releaseAndUnlock(Thread *threadp);
+
     void writeToRead();
 
  public:
@@ -217,6 +427,12 @@ class ThreadLockRw : public ThreadBaseLock {
         _upgradeToWrite = 0;
         _lockClock = 0;
         _ownerp = NULL;
+        if (ThreadLockProfiler::_profileAll)
+            ThreadLockProfiler::track(this, NULL, "rwlock");
+    }
+
+    const char *lockType() {
+        return "rwlock";
     }
     
     void lockWrite(ThreadLockTracker *trackerp=0);
@@ -227,6 +443,13 @@ class ThreadLockRw : public ThreadBaseLock {
 
     void lockRead(ThreadLockTracker *trackerp=0);
 
+    /* timed lockRead and lockWrite: return TL_ERR_TIMEDOUT, without
+     * the lock, if it can't be granted within ms milliseconds.
+     */
+    int32_t lockReadFor(uint32_t ms, ThreadLockTracker *trackerp=0);
+
+    int32_t lockWriteFor(uint32_t ms, ThreadLockTracker *trackerp=0);
+
     int tryRead(ThreadLockTracker *trackerp=0);
 
     void releaseRead(ThreadLockTracker *trackerp=0);
@@ -279,40 +502,265 @@ class ThreadLockRw : public ThreadBaseLock {
 
     void wakeNext();
 
+    /* internal; all called with _lock held */
+    void publishHoldersNL(Thread *waiterp) {
+        if (__builtin_expect(_trackHolders, 0))
+            publishAllHoldersNL(waiterp);
+    }
+
+    void publishAllHoldersNL(Thread *waiterp);
+
+    void trackReaderNL(ThreadLockTracker *trackerp, Thread *threadp);
+
+    void untrackReaderNL(ThreadLockTracker *trackerp);
+
     virtual ~ThreadLockRw() {
         return;
     }
 };
 
-class ThreadMutexDetect {
+/* a read-mostly ThreadLockRw, in the style of a per-CPU rwlock.  While
+ * no writer is around, a reader just bumps a counter in a slot that
+ * belongs to its dispatcher, so readers on different dispatchers don't
+ * share any cache lines.  A writer gets the underlying ThreadLockRw's
+ * write lock, revokes the readers' bias, and waits for the slot counts
+ * to drain; readers that find the bias revoked queue behind the writer
+ * on the underlying lock.  A reader can move to another dispatcher
+ * while it holds the lock, so the slots hold signed counts, and only
+ * their sum means anything.
+ *
+ * Writes are more expensive than ThreadLockRw's, since they sum all the
+ * slots, so this is for locks taken almost always for reading.
+ *
+ * Upgrade locks and upgradeToWrite work as for ThreadLockRw, as do
+ * trackers, though a tracked read takes the spin lock to queue its
+ * tracker.  Reads that go through a slot aren't counted by the lock
+ * profiler.  These methods hide ThreadLockRw's instead of overriding
+ * them, so ThreadLockRw is a private base, and a ThreadLockRwBiased
+ * can't be used as a plain ThreadLockRw by mistake.  baseLock returns
+ * it as a ThreadBaseLock, whose methods are virtual, for ThreadCond and
+ * ThreadSeqLock.
+ */
+class ThreadLockRwBiased : private ThreadLockRw {
+    friend class ThreadLockRwDrainWait;
+
+    /* a slot for each dispatcher, and a last one shared by the special
+     * dispatchers, each on its own cache line.
+     */
+    class Slot {
+     public:
+        alignas(64) std::atomic<int64_t> _readers;
+    };
+
+    /* how many times a writer checks for readers before sleeping */
+    static const uint32_t _drainSpins = 100;
+
+    Slot _slots[ThreadDispatcher::_maxDispatchers + 1];
+
+    /* read by every reader, and written only by writers */
+    alignas(64) std::atomic<uint8_t> _readerBias;
+    std::atomic<Thread *> _drainWaiterp;
+
+    Slot *mySlot() {
+        int ix = ThreadDispatcher::currentIndex();
+
+        return &_slots[ix >= 0? ix : ThreadDispatcher::_maxDispatchers];
+    }
+
+    /* the fetch_add is a full barrier, so either we see a writer's
+     * revocation, or the writer sees our count.
+     */
+    int readFast() {
+        Slot *slotp = mySlot();
+
+        slotp->_readers.fetch_add(1);
+        if (__builtin_expect(_readerBias.load(), 1))
+            return 1;
+        releaseSlot(slotp);
+        return 0;
+    }
+
+    void releaseSlot(Slot *slotp) {
+        slotp->_readers.fetch_sub(1);
+        if (__builtin_expect(_drainWaiterp.load() != NULL, 0))
+            wakeDrainer();
+    }
+
+    int64_t readerCount();
+
+    void wakeDrainer();
+
+    void lockReadSlow();
+
+    void trackRead(ThreadLockTracker *trackerp);
+
+    void untrackRead(ThreadLockTracker *trackerp);
+
+    int32_t revokeAndDrain(int timed, uint32_t ms);
+
  public:
-    static const uint32_t _maxCycleDepth = 1024;
-    uint32_t _currentIx;
-    Thread *_stack[_maxCycleDepth];
-    
-    ThreadMutexDetect() {
-        _currentIx = 0;
+    using ThreadLockRw::_trackerQueue;
+    using ThreadLockRw::lockUpgrade;
+    using ThreadLockRw::releaseUpgrade;
+    using ThreadLockRw::lock;
+    using ThreadLockRw::unlock;
+    using ThreadLockRw::getWaitUs;
+    using ThreadLockRw::lockType;
+    using ThreadLockRw::setName;
+
+    ThreadLockRwBiased() {
+        uint32_t i;
+
+        for(i=0; i<=ThreadDispatcher::_maxDispatchers; i++)
+            _slots[i]._readers = 0;
+        _readerBias = 1;
+        _drainWaiterp = NULL;
     }
 
-    void push(Thread *threadp) {
-        if (_currentIx >= _maxCycleDepth)
-            return;
-        _stack[_currentIx++] = threadp;
+    void lockRead(ThreadLockTracker *trackerp=0) {
+        if (!readFast())
+            lockReadSlow();
+        if (trackerp)
+            trackRead(trackerp);
     }
 
-    void reset() {
-        _currentIx = 0;
+    int32_t lockReadFor(uint32_t ms, ThreadLockTracker *trackerp=0);
+
+    int tryRead(ThreadLockTracker *trackerp=0);
+
+    void releaseRead(ThreadLockTracker *trackerp=0) {
+        if (trackerp)
+            untrackRead(trackerp);
+        releaseSlot(mySlot());
     }
 
-    void displayTrace();
+    void lockWrite(ThreadLockTracker *trackerp=0);
 
-    int sweepFrom(Thread *threadp, uint32_t sweepIx);
-    
+    int32_t lockWriteFor(uint32_t ms, ThreadLockTracker *trackerp=0);
+
+    int tryWrite(ThreadLockTracker *trackerp=0);
+
+    void releaseWrite(ThreadLockTracker *trackerp=0);
+
+    void upgradeToWrite();
+
+    void writeToRead();
+
+    void lockMode(ThreadLockTracker::LockMode mode, ThreadLockTracker *trackerp = 0) {
+        if (mode == ThreadLockTracker::_lockRead)
+            lockRead(trackerp);
+        else if (mode == ThreadLockTracker::_lockWrite)
+            lockWrite(trackerp);
+        else if (mode == ThreadLockTracker::_lockUpgrade)
+            lockUpgrade(trackerp);
+    }
+
+    void releaseMode(ThreadLockTracker::LockMode mode, ThreadLockTracker *trackerp = 0) {
+        if (mode == ThreadLockTracker::_lockRead)
+            releaseRead(trackerp);
+        else if (mode == ThreadLockTracker::_lockWrite)
+            releaseWrite(trackerp);
+        else if (mode == ThreadLockTracker::_lockUpgrade)
+            releaseUpgrade(trackerp);
+    }
+
+    void releaseAndSleep(Thread *threadp);
+
+    void releaseAndUnlock(Thread *threadp);
+
+    void take() {
+        lockWrite();
+    }
+
+    int tryLock() {
+        return tryWrite();
+    }
+
+    void release() {
+        releaseWrite(NULL);
+    }
+
+    ThreadBaseLock *baseLock() {
+        return this;
+    }
+};
+
+/* incremental deadlock detector.  Every so often, a background pthread
+ * takes a snapshot of who's waiting for whom, without pausing any
+ * dispatchers: a thread blocked on a ThreadMutex waits for the mutex's
+ * owner, and one blocked on a ThreadLockRw waits for its write or
+ * upgrade lock owner, and for any readers that registered a
+ * ThreadLockTracker.  The locks publish these holders into each
+ * blocked Thread, under their spin locks, and the snapshot reads only
+ * the Threads, never the locks themselves.  The locks only start doing
+ * so once a detector has been created, so threads already waiting then
+ * are only seen once they wait again.  Cycles in a snapshot are only candidates, since
+ * the snapshot is taken while the threads run, and a cycle is reported
+ * once it shows up unchanged in two successive snapshots: every thread
+ * still in the same wait (per Thread::_blockSeq) on the same lock,
+ * with the same holders.  A thread blocked all along can't have
+ * released anything in the meantime, so that cycle is a real deadlock.
+ *
+ * Taking a snapshot holds Thread::_globalThreadLock while walking the
+ * thread list, which only delays thread creation and exit.
+ */
+class ThreadMutexDetect {
+ public:
+    static const uint32_t _maxHolders = Thread::_maxBlockingHolders;
+
+    /* a blocked thread, and the threads it waits for */
+    class Wait {
+     public:
+        Thread *_threadp;
+        ThreadMutex *_mutexp;
+        ThreadLockRw *_rwp;
+        uint32_t _blockSeq;
+        long long _blockedUs;
+        uint32_t _holderCount;
+        Thread *_holders[_maxHolders];
+
+        void addHolder(Thread *threadp);
+
+        int holds(Thread *threadp);
+    };
+
+ private:
+    static uint32_t _intervalMs;
+    static int _abortOnDeadlock;
+
+    std::unordered_map<Thread *, Wait> _waits;          /* the latest snapshot */
+    std::unordered_map<Thread *, Wait> _lastWaits;      /* the one before */
+    std::unordered_map<Thread *, uint32_t> _reported;   /* _blockSeq when reported */
+    uint64_t _deadlocks;
+
+    void snapshot();
+
+    int stable(Wait *waitp, Thread *nextp);
+
+    void report(std::vector<Wait *> *cyclep);
+
+ public:
+    /* from now on, the locks record their holders for us */
+    ThreadMutexDetect() {
+        _deadlocks = 0;
+        ThreadBaseLock::_trackHolders = 1;
+    }
+
+    /* take a snapshot, and report the deadlocks that have been there
+     * since the last call; returns the number of new ones.
+     */
     int checkForDeadlocks();
 
+    uint64_t getDeadlocks() {
+        return _deadlocks;
+    }
+
     static void *mutexMonitorTop(void *cxp);
 
-    static void start();
+    /* check every intervalMs, asserting if there's a deadlock unless
+     * abortOnDeadlock is 0.
+     */
+    static void start(uint32_t intervalMs = 10000, int abortOnDeadlock = 1);
 };
 
 #endif /* __THREAD_MUTEX_H_ENV__ */
@@ -0,0 +1,189 @@
+#ifndef __THREADPARALLEL_H_ENV__
+#define __THREADPARALLEL_H_ENV__ 1
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include "thread.h"
+
+/* usage: data parallel loops that spread CPU-bound work over the
+ * dispatchers, instead of over a separate pthread pool competing with
+ * them for CPUs.  Call these from a lightweight thread or task:
+ *
+ *      ThreadParallel::parallelFor(0, n, [&](long i) { a[i] = f(i); });
+ *      sum = ThreadParallel::parallelReduce(0, n, 0L,
+ *                                           [&](long i) { return a[i]; },
+ *                                           [](long x, long y) { return x + y; });
+ *      ThreadParallel::parallelSort(v.begin(), v.end());
+ *      ThreadParallel::parallelTransform(in.begin(), in.end(), out.begin(), f);
+ *
+ * The splitting is adaptive: the caller works through its range a
+ * grain at a time, and before each grain, if ThreadDispatcher::findIdle
+ * reports an idle dispatcher, it hands the upper half of what's left
+ * to a ThreadGroup child, which does the same with its half.  So the
+ * calling thread is always one of the workers, and a range is only
+ * split when there's a dispatcher free to take the other piece; with
+ * every dispatcher busy, the loop runs serially with no extra cost
+ * beyond the idle checks.
+ *
+ * parallelSort partitions around a median of three pivot, handing
+ * the upper part to an idle dispatcher, and finishes with std::sort
+ * once the pieces are small or no dispatcher is idle.
+ *
+ * grain is the number of elements done between checks; 0 picks about
+ * 16 pieces per dispatcher.  parallelReduce's combine must be
+ * associative, but needn't be commutative.  parallelSort isn't stable.
+ */
+class ThreadParallel {
+    static long pickGrain(long count, long grain) {
+        if (grain > 0)
+            return grain;
+        grain = count / (16 * (ThreadDispatcher::getDispatcherCount() + 1));
+        return (grain > 0? grain : 1);
+    }
+
+    template<class F> static void forRange(long lo, long hi, F &fn, long grain) {
+        ThreadGroup group;
+        long mid;
+        long end;
+        long i;
+
+        while(lo < hi) {
+            if (hi - lo > grain && ThreadDispatcher::findIdle()) {
+                mid = lo + (hi - lo) / 2;
+                group.spawn([&fn, mid, hi, grain]() { forRange(mid, hi, fn, grain); });
+                hi = mid;
+                continue;
+            }
+            end = (hi - lo > grain? lo + grain : hi);
+            for(i=lo;i<end;i++)
+                fn(i);
+            lo = end;
+        }
+        group.sync();
+    }
+
+    template<class T, class M, class C>
+    static T reduceRange(long lo, long hi, const T &identity, M &map, C &combine, long grain) {
+        ThreadGroup group;
+        std::vector<T> parts;
+        T result = identity;
+        T *partp;
+        long mid;
+        long end;
+        long i;
+
+        while(lo < hi) {
+            if (hi - lo > grain && ThreadDispatcher::findIdle()) {
+                /* each split halves the range, so we never need more than
+                 * 64 slots, and the reserve keeps their addresses stable.
+                 */
+                if (parts.empty())
+                    parts.reserve(64);
+                mid = lo + (hi - lo) / 2;
+                parts.push_back(identity);
+                partp = &parts.back();
+                group.spawn([partp, &identity, &map, &combine, mid, hi, grain]() {
+                        *partp = reduceRange(mid, hi, identity, map, combine, grain);
+                    });
+                hi = mid;
+                continue;
+            }
+            end = (hi - lo > grain? lo + grain : hi);
+            for(i=lo;i<end;i++)
+                result = combine(result, map(i));
+            lo = end;
+        }
+        group.sync();
+
+        /* later splits cover lower pieces of the range */
+        for(i=(long) parts.size()-1;i>=0;i--)
+            result = combine(result, parts[i]);
+        return result;
+    }
+
+    template<class It, class C>
+    static void sortRange(It first, It last, C &comp, long grain, int depth) {
+        typedef typename std::iterator_traits<It>::value_type Value;
+        ThreadGroup group;
+        It mid1;
+        It mid2;
+        It middle;
+
+        while(last - first > grain && depth > 0) {
+            depth--;
+
+            /* median of three, then a three way partition */
+            middle = first + (last - first) / 2;
+            if (comp(*middle, *first))
+                std::iter_swap(middle, first);
+            if (comp(*(last-1), *middle)) {
+                std::iter_swap(last-1, middle);
+                if (comp(*middle, *first))
+                    std::iter_swap(middle, first);
+            }
+            Value pivot = *middle;
+            mid1 = std::partition(first, last, [&](const Value &x) { return comp(x, pivot); });
+            mid2 = std::partition(mid1, last, [&](const Value &x) { return !comp(pivot, x); });
+
+            if (!ThreadDispatcher::findIdle()) {
+                /* no one to share with; std::sort does the rest faster */
+                std::sort(first, mid1, comp);
+                first = mid2;
+                break;
+            }
+            group.spawn([mid2, last, &comp, grain, depth]() {
+                    sortRange(mid2, last, comp, grain, depth);
+                });
+            last = mid1;
+        }
+
+        /* small pieces, the rest of a busy range, or too many bad pivots */
+        std::sort(first, last, comp);
+        group.sync();
+    }
+
+ public:
+    /* call fn(i) for each i in [lo, hi) */
+    template<class F> static void parallelFor(long lo, long hi, F fn, long grain = 0) {
+        if (lo >= hi)
+            return;
+        forRange(lo, hi, fn, pickGrain(hi - lo, grain));
+    }
+
+    /* combine identity with map(i) for each i in [lo, hi), in order */
+    template<class T, class M, class C>
+    static T parallelReduce(long lo, long hi, T identity, M map, C combine, long grain = 0) {
+        if (lo >= hi)
+            return identity;
+        return reduceRange(lo, hi, identity, map, combine, pickGrain(hi - lo, grain));
+    }
+
+    /* sort random access iterators */
+    template<class It, class C> static void parallelSort(It first, It last, C comp, long grain = 0) {
+        long count = last - first;
+        int depth = 0;
+
+        while((1L << depth) < count)
+            depth++;
+        grain = pickGrain(count, grain);
+
+        /* std::sort is faster on small pieces than our partitioning */
+        if (grain < 2048)
+            grain = 2048;
+        sortRange(first, last, comp, grain, 2*depth);
+    }
+
+    template<class It> static void parallelSort(It first, It last, long grain = 0) {
+        parallelSort(first, last, std::less<typename std::iterator_traits<It>::value_type>(), grain);
+    }
+
+    /* out[i] = fn(first[i]), for random access iterators */
+    template<class It, class Out, class F>
+    static void parallelTransform(It first, It last, Out out, F fn, long grain = 0) {
+        parallelFor(0, last - first, [first, out, &fn](long i) { out[i] = fn(first[i]); }, grain);
+    }
+};
+
+#endif /* __THREADPARALLEL_H_ENV__ */
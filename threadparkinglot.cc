@@ -0,0 +1,96 @@
+#include "threadparkinglot.h"
+#include "threadcancel.h"
+
+ThreadParkingLot::Bucket ThreadParkingLot::_buckets[ThreadParkingLot::_bucketCount];
+
+/* cancel hook for a timed park; see threadcancel.h */
+class ThreadParkCancelWait : public ThreadCancelWait {
+    ThreadParkingLot::Bucket *_bucketp;
+    ThreadParkingLot::Waiter *_waiterp;
+
+ public:
+    ThreadParkCancelWait(ThreadParkingLot::Bucket *bucketp,
+                         ThreadParkingLot::Waiter *waiterp,
+                         Thread *threadp) : ThreadCancelWait(threadp) {
+        _bucketp = bucketp;
+        _waiterp = waiterp;
+    }
+
+    void cancel() {
+        _bucketp->_lock.take();
+        if (_waiterp->_queued) {
+            _bucketp->_waiters.remove(_waiterp);
+            _waiterp->_queued = 0;
+            _removed = 1;
+        }
+        _bucketp->_lock.release();
+        if (_removed)
+            _threadp->queue();
+    }
+};
+
+/* internal: called with the bucket locked, after validate said to
+ * park; releases the bucket lock.
+ */
+/* static */ int32_t
+ThreadParkingLot::parkNL(Bucket *bucketp, const void *addrp, uint32_t ms)
+{
+    Thread *mep = Thread::getCurrent();
+    Waiter waiter;
+
+    if (ms == 0) {
+        bucketp->_lock.release();
+        return TP_ERR_TIMEDOUT;
+    }
+
+    waiter._addrp = addrp;
+    waiter._threadp = mep;
+    waiter._queued = 1;
+
+    ThreadParkCancelWait cancelWait(bucketp, &waiter, mep);
+    ThreadWaitTimer timer(&cancelWait);
+    if (ms != _forever)
+        timer.start(ms);
+    bucketp->_waiters.append(&waiter);
+    mep->sleep(&bucketp->_lock);
+
+    timer.stop();
+    return (cancelWait._removed? TP_ERR_TIMEDOUT : TP_OK);
+}
+
+/* static */ uint32_t
+ThreadParkingLot::unpark(const void *addrp, uint32_t maxCount)
+{
+    Bucket *bucketp = bucket(addrp);
+    dqueue<Waiter> woken;
+    dqueue<Thread> threads;
+    Waiter *waiterp;
+    Waiter *nextp;
+    uint32_t count = 0;
+
+    bucketp->_lock.take();
+    for(waiterp = bucketp->_waiters.head(); waiterp && count < maxCount; waiterp = nextp) {
+        nextp = waiterp->_dqNextp;
+        if (waiterp->_addrp != addrp)
+            continue;
+        bucketp->_waiters.remove(waiterp);
+        waiterp->_queued = 0;
+        woken.append(waiterp);
+        count++;
+    }
+    bucketp->_lock.release();
+
+    /* a waiter lives on its thread's stack, so it's gone once we queue
+     * the thread.  A parked thread isn't in any other queue, so we can
+     * chain the threads together, and queue them with one visit to
+     * each dispatcher.
+     */
+    if (count == 1) {
+        woken.pop()->_threadp->queue();
+        return count;
+    }
+    while((waiterp = woken.pop()) != NULL)
+        threads.append(waiterp->_threadp);
+    Thread::queueBatch(&threads);
+    return count;
+}
@@ -0,0 +1,233 @@
+#ifndef __THREADPARKINGLOT_H_ENV__
+#define __THREADPARKINGLOT_H_ENV__ 1
+
+#include <atomic>
+
+#include "thread.h"
+#include "threadmutex.h"
+#include "dqueue.h"
+
+/* usage: a parking lot, where threads wait keyed by an address, like
+ * futexes for lightweight threads.
+ *
+ *      code = ThreadParkingLot::park(&word, [&]() {       waiter
+ *              return word.load() == value;
+ *          });
+ *
+ *      word.store(newValue);                              waker
+ *      ThreadParkingLot::unparkOne(&word);
+ *
+ * park calls its validate function holding the lock of the address's
+ * bucket, and only parks if it returns true, so a waker that changes
+ * the word before unparking can't be missed.  Parked threads live in
+ * a fixed, global hash table of buckets, each a spin lock and a queue
+ * of waiters that are on their threads' stacks, so the objects being
+ * waited for need no queue of their own, and nothing is allocated.
+ * Unrelated addresses may share a bucket; that's only slower.
+ *
+ * ThreadCompactMutex and ThreadCompactCond below are built this way,
+ * and take a byte and four bytes.
+ */
+
+class ThreadParkingLot {
+ public:
+    enum Error {
+        TP_OK = 0,
+        TP_ERR_INVALID = -1,            /* validate returned false */
+        TP_ERR_TIMEDOUT = -3
+    };
+
+    static const uint32_t _forever = ~0U;
+
+    class Waiter {
+     public:
+        Waiter *_dqNextp;
+        Waiter *_dqPrevp;
+        const void *_addrp;
+        Thread *_threadp;
+        uint8_t _queued;                /* in the bucket's queue */
+    };
+
+    class alignas(64) Bucket {
+     public:
+        SpinLock _lock;
+        dqueue<Waiter> _waiters;
+    };
+
+ private:
+    static const uint32_t _bucketBits = 10;
+    static const uint32_t _bucketCount = 1 << _bucketBits;
+
+    static Bucket _buckets[_bucketCount];
+
+    static int32_t parkNL(Bucket *bucketp, const void *addrp, uint32_t ms);
+
+ public:
+    static Bucket *bucket(const void *addrp) {
+        uint64_t hash;
+
+        hash = ((uint64_t) (uintptr_t) addrp >> 3) * 0x9E3779B97F4A7C15ULL;
+        return &_buckets[hash >> (64 - _bucketBits)];
+    }
+
+    /* park the current thread on addrp if validate(), called with the
+     * bucket locked, returns true, until it's unparked or ms
+     * milliseconds pass.  Returns TP_OK once unparked, TP_ERR_INVALID
+     * without parking if validate returned false, or TP_ERR_TIMEDOUT.
+     * validate mustn't block.
+     */
+    template<class F> static int32_t park(const void *addrp, F &&validate, uint32_t ms = _forever) {
+        Bucket *bucketp = bucket(addrp);
+
+        bucketp->_lock.take();
+        if (!validate()) {
+            bucketp->_lock.release();
+            return TP_ERR_INVALID;
+        }
+        return parkNL(bucketp, addrp, ms);
+    }
+
+    /* unpark up to maxCount threads parked on addrp, oldest first;
+     * returns how many were unparked.
+     */
+    static uint32_t unpark(const void *addrp, uint32_t maxCount);
+
+    static uint32_t unparkOne(const void *addrp) {
+        return unpark(addrp, 1);
+    }
+
+    static uint32_t unparkAll(const void *addrp) {
+        return unpark(addrp, ~0U);
+    }
+};
+
+/* a one byte mutex: 0 is free, 1 held and 2 held with possible waiters,
+ * which park on the byte.  Uncontended takes and releases are one
+ * atomic each; a release only visits the parking lot if the byte says
+ * there may be waiters.  It's meant for fine grained locks, like one
+ * per cache entry, that are rarely contended: it doesn't spin, isn't
+ * fair, isn't a ThreadBaseLock, and isn't seen by the lock profiler or
+ * deadlock detector, since it doesn't know its owner.
+ */
+class ThreadCompactMutex {
+    friend class ThreadCompactCond;
+
+    std::atomic<uint8_t> _state;
+
+    static const uint8_t _held = 1;
+    static const uint8_t _contended = 2;
+
+    /* take the mutex, marking it contended since others may be parked */
+    int32_t takeContended(uint32_t ms) {
+        long long deadlineUs = 0;
+        long long nowUs;
+
+        if (ms != ThreadParkingLot::_forever)
+            deadlineUs = osp_getUs() + (long long) ms * 1000;
+        while(_state.exchange(_contended, std::memory_order_acquire) != 0) {
+            if (ms != ThreadParkingLot::_forever) {
+                nowUs = osp_getUs();
+                if (nowUs >= deadlineUs)
+                    return ThreadBaseLock::TL_ERR_TIMEDOUT;
+                ms = (uint32_t) ((deadlineUs - nowUs + 999) / 1000);
+            }
+            ThreadParkingLot::park(&_state, [this]() {
+                    return _state.load(std::memory_order_relaxed) == _contended;
+                }, ms);
+        }
+        return ThreadBaseLock::TL_OK;
+    }
+
+ public:
+    ThreadCompactMutex() {
+        _state.store(0, std::memory_order_relaxed);
+    }
+
+    void take() {
+        uint8_t expected = 0;
+
+        if (__builtin_expect(_state.compare_exchange_strong(expected, _held, std::memory_order_acquire), 1))
+            return;
+        takeContended(ThreadParkingLot::_forever);
+    }
+
+    /* like take, but gives up after ms milliseconds, returning
+     * ThreadBaseLock::TL_ERR_TIMEDOUT.
+     */
+    int32_t takeFor(uint32_t ms) {
+        uint8_t expected = 0;
+
+        if (_state.compare_exchange_strong(expected, _held, std::memory_order_acquire))
+            return ThreadBaseLock::TL_OK;
+        if (ms == 0)
+            return ThreadBaseLock::TL_ERR_TIMEDOUT;
+        return takeContended(ms);
+    }
+
+    /* return 1 if we get the lock, but never block */
+    int tryLock() {
+        uint8_t expected = 0;
+
+        return _state.compare_exchange_strong(expected, _held, std::memory_order_acquire);
+    }
+
+    void release() {
+        if (__builtin_expect(_state.exchange(0, std::memory_order_release) == _contended, 0))
+            ThreadParkingLot::unparkOne(&_state);
+    }
+
+    int isLocked() {
+        return _state.load(std::memory_order_relaxed) != 0;
+    }
+};
+
+/* a four byte condition variable for ThreadCompactMutex.  Waiters park
+ * on a sequence number that signal and broadcast bump, so a wakeup
+ * between a waiter's release of the mutex and its parking isn't lost.
+ * As with any condition variable, wait can return without a signal,
+ * so callers should recheck their predicate.
+ */
+class ThreadCompactCond {
+    std::atomic<uint32_t> _seq;
+
+ public:
+    ThreadCompactCond() {
+        _seq.store(0, std::memory_order_relaxed);
+    }
+
+    void wait(ThreadCompactMutex *mutexp) {
+        waitFor(mutexp, ThreadParkingLot::_forever);
+    }
+
+    /* like wait, but gives up after ms milliseconds, returning
+     * ThreadBaseLock::TL_ERR_TIMEDOUT.  Either way, we hold the mutex
+     * again when we return.
+     */
+    int32_t waitFor(ThreadCompactMutex *mutexp, uint32_t ms) {
+        uint32_t seq;
+        int32_t code;
+
+        seq = _seq.load(std::memory_order_relaxed);
+        mutexp->release();
+        code = ThreadParkingLot::park(&_seq, [this, seq]() {
+                return _seq.load(std::memory_order_relaxed) == seq;
+            }, ms);
+
+        /* others woken with us may be parked on the mutex by now */
+        mutexp->takeContended(ThreadParkingLot::_forever);
+        return (code == ThreadParkingLot::TP_ERR_TIMEDOUT
+                ? ThreadBaseLock::TL_ERR_TIMEDOUT : ThreadBaseLock::TL_OK);
+    }
+
+    void signal() {
+        _seq.fetch_add(1, std::memory_order_release);
+        ThreadParkingLot::unparkOne(&_seq);
+    }
+
+    void broadcast() {
+        _seq.fetch_add(1, std::memory_order_release);
+        ThreadParkingLot::unparkAll(&_seq);
+    }
+};
+
+#endif /* __THREADPARKINGLOT_H_ENV__ */
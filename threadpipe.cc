@@ -2,9 +2,10 @@
 #include <stdio.h>
 
 #include "threadpipe.h"
+#include "threadcancel.h"
 
 int32_t
-ThreadPipe::write(const char *bufferp, int32_t count)
+ThreadPipe::write(const char *bufferp, int32_t count, ThreadCancel *cancelp)
 {
     int32_t endPos;
     int32_t tcount;
@@ -40,7 +41,10 @@ ThreadPipe::write(const char *bufferp, int32_t count)
             bytesThisTime = tcount;
 
         if (bytesThisTime <= 0) {
-            _cv.wait();
+            if (_cv.wait(cancelp) != 0) {
+                _lock.release();
+                return (bytesCopied > 0? bytesCopied : ThreadCancel::TC_ERR_CANCELED);
+            }
             continue;
         }
 
@@ -60,7 +64,7 @@ ThreadPipe::write(const char *bufferp, int32_t count)
 }
 
 int32_t
-ThreadPipe::read(char *bufferp, int32_t count)
+ThreadPipe::read(char *bufferp, int32_t count, ThreadCancel *cancelp)
 {
     int32_t tcount;
     int32_t bytesThisTime;
@@ -82,7 +86,10 @@ ThreadPipe::read(char *bufferp, int32_t count)
             /* here, we've run out of data, but EOF isn't set yet, and we do have
              * more room in the incoming buffer.  Wait for more data.
              */
-            _cv.wait();
+            if (_cv.wait(cancelp) != 0) {
+                _lock.release();
+                return (bytesCopied > 0? bytesCopied : ThreadCancel::TC_ERR_CANCELED);
+            }
             continue;
         }
 
@@ -43,13 +43,17 @@ class ThreadPipe {
         _lock.release();
     }
 
-    /* write data into the pipe; don't return until all data written */
-    int32_t write(const char *bufferp, int32_t count);
+    /* write data into the pipe; don't return until all data written.
+     * If cancelp is canceled while waiting, returns the bytes written
+     * so far, or ThreadCancel::TC_ERR_CANCELED if there weren't any.
+     */
+    int32_t write(const char *bufferp, int32_t count, ThreadCancel *cancelp = NULL);
 
     /* read data from the pipe, return any non-zero available data; return
-     * 0 bytes if EOF was called on the other side.
+     * 0 bytes if EOF was called on the other side.  Cancellation works as
+     * for write.
      */
-    int32_t read(char *bufferp, int32_t count);
+    int32_t read(char *bufferp, int32_t count, ThreadCancel *cancelp = NULL);
 
     /* called by writer when no more data will be sent */
     void eof();
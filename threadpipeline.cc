@@ -0,0 +1,196 @@
+#include "threadpipeline.h"
+
+/*****************ThreadQueueBase*****************/
+
+ThreadQueueBase::ThreadQueueBase(uint32_t maxItems, uint32_t producers)
+{
+    assert(maxItems > 0);
+    _notEmptyCv.setMutex(&_lock);
+    _notFullCv.setMutex(&_lock);
+    _maxItems = maxItems;
+    _count = 0;
+    _producers = producers;
+    _pushWaiters = 0;
+    _popWaiters = 0;
+    _closed = 0;
+
+    _pushed = 0;
+    _popped = 0;
+    _occupancySum = 0;
+    _pushes = 0;
+    _fullWaits = 0;
+    _emptyWaits = 0;
+    _maxCount = 0;
+}
+
+void
+ThreadQueueBase::notePush(uint32_t count)
+{
+    _pushes++;
+    _pushed += count;
+    _occupancySum += _count;
+    if (_count + count > _maxCount)
+        _maxCount = _count + count;
+}
+
+/* a single item can only satisfy one waiter, but a batch may satisfy
+ * several, so only batches broadcast.
+ */
+void
+ThreadQueueBase::releaseAfterPush(uint32_t count)
+{
+    if (_popWaiters) {
+        if (count > 1)
+            _notEmptyCv.broadcast();
+        else
+            _notEmptyCv.signal();
+    }
+    _lock.release();
+}
+
+void
+ThreadQueueBase::releaseAfterPop(uint32_t count)
+{
+    if (_pushWaiters) {
+        if (count > 1)
+            _notFullCv.broadcast();
+        else
+            _notFullCv.signal();
+    }
+    _lock.release();
+}
+
+void
+ThreadQueueBase::producerDone()
+{
+    _lock.take();
+    assert(_producers > 0);
+    if (--_producers > 0) {
+        _lock.release();
+        return;
+    }
+    _lock.release();
+    close();
+}
+
+void
+ThreadQueueBase::close()
+{
+    _lock.take();
+    _closed = 1;
+    _notEmptyCv.broadcast();
+    _notFullCv.broadcast();
+    _lock.release();
+}
+
+uint32_t
+ThreadQueueBase::count()
+{
+    uint32_t count;
+
+    _lock.take();
+    count = _count;
+    _lock.release();
+    return count;
+}
+
+/*****************ThreadPipelineStage*****************/
+
+void
+ThreadPipelineStage::workerDone()
+{
+    if (_running.fetch_sub(1) == 1)
+        _endUs = osp_getUs();
+}
+
+double
+ThreadPipelineStage::getRate()
+{
+    long long endUs;
+
+    endUs = (_endUs? _endUs : osp_getUs());
+    if (endUs <= _startUs)
+        return 0.0;
+    return (double) _items.load() * 1000000.0 / (endUs - _startUs);
+}
+
+/*****************ThreadPipeline*****************/
+
+ThreadPipeline::~ThreadPipeline()
+{
+    ThreadPipelineStage *stagep;
+    uint32_t i;
+
+    if (_started)
+        wait();
+
+    while((stagep = _stages.pop()) != NULL) {
+        delete stagep;
+    }
+    for(i=0;i<_queues.size();i++)
+        delete _queues[i];
+}
+
+void
+ThreadPipeline::start()
+{
+    ThreadPipelineStage *stagep;
+    Thread *threadp;
+    long long nowUs;
+    uint32_t i;
+
+    assert(!_started);
+    _started = 1;
+    nowUs = osp_getUs();
+    for(stagep = _stages.head(); stagep; stagep = stagep->_dqNextp) {
+        stagep->_startUs = nowUs;
+        stagep->_running = stagep->_options._workers;
+    }
+
+    for(stagep = _stages.head(); stagep; stagep = stagep->_dqNextp) {
+        for(i=0;i<stagep->_options._workers;i++) {
+            threadp = Thread::spawn(stagep->_name.c_str(), [stagep]() { stagep->work(); },
+                                    ThreadSpawnOptions().joinable());
+            _workers.add(threadp);
+        }
+    }
+}
+
+void
+ThreadPipeline::wait()
+{
+    Thread *threadp;
+
+    while((threadp = _workers.waitAny()) != NULL) {
+        threadp->releaseThread();
+    }
+    _started = 0;
+}
+
+void
+ThreadPipeline::displayStats()
+{
+    ThreadPipelineStage *stagep;
+    ThreadQueueBase *queuep;
+
+    printf("%-16s %12s %14s %18s %10s %10s\n",
+           "Stage", "Items", "Items/sec", "Input avg/max/cap", "Starved", "Blocked");
+    for(stagep = _stages.head(); stagep; stagep = stagep->_dqNextp) {
+        printf("%-16s %12lld %14.0f ",
+               stagep->_name.c_str(), (long long) stagep->getItems(), stagep->getRate());
+        queuep = stagep->_inputp;
+        if (queuep) {
+            printf("%8.1f/%4d/%4d %10lld ",
+                   queuep->getAverageCount(), (int) queuep->getMaxCount(),
+                   (int) queuep->getMaxItems(), (long long) queuep->getEmptyWaits());
+        }
+        else {
+            printf("%18s %10s ", "-", "-");
+        }
+        queuep = stagep->_outputp;
+        if (queuep)
+            printf("%10lld\n", (long long) queuep->getFullWaits());
+        else
+            printf("%10s\n", "-");
+    }
+}
@@ -0,0 +1,511 @@
+#ifndef __THREADPIPELINE_H_ENV__
+#define __THREADPIPELINE_H_ENV__ 1
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "thread.h"
+#include "threadmutex.h"
+
+/* usage: a ThreadPipeline runs a chain of stages, each on its own set
+ * of lightweight threads, connected by bounded ThreadQueues:
+ *
+ *      ThreadPipeline pipeline;
+ *      ThreadQueue<Block> *blocksp;
+ *      ThreadQueue<Chunk> *chunksp;
+ *
+ *      blocksp = pipeline.source<Block>("decode", [&](ThreadPipelineOut<Block> &out) {
+ *              while(more())
+ *                  out.push(decode());
+ *          });
+ *      chunksp = pipeline.stage<Chunk>("compress", blocksp,
+ *                                      [](Block &block, ThreadPipelineOut<Chunk> &out) {
+ *                                          out.push(compress(block));
+ *                                      },
+ *                                      ThreadPipelineOptions().workers(4));
+ *      pipeline.sink("write", chunksp, [](Chunk &chunk) { write(chunk); });
+ *      pipeline.start();
+ *      pipeline.wait();
+ *      pipeline.displayStats();
+ *
+ * A source's function runs once per worker; a stage's or sink's runs
+ * for each item.  Workers pull up to batchSize items from their input
+ * per wakeup, and buffer their output, pushing it a batch at a time.
+ * Queues hold at most queueSize items, so a slow stage blocks the
+ * stages feeding it, all the way back to the source.  When every
+ * worker of a stage has finished, its output queue is closed, and the
+ * next stage's workers finish once they've drained it.
+ *
+ * displayStats shows each stage's item count and rate, and how full
+ * its input queue ran; the bottleneck is the stage whose input queue
+ * is usually full while its output queue is usually empty.
+ */
+
+/* options for ThreadPipeline stages */
+class ThreadPipelineOptions {
+ public:
+    uint32_t _workers;          /* threads running the stage */
+    uint32_t _queueSize;        /* capacity of the stage's output queue */
+    uint32_t _batchSize;        /* most items moved per queue operation */
+
+    ThreadPipelineOptions() {
+        _workers = 1;
+        _queueSize = 256;
+        _batchSize = 32;
+    }
+
+    ThreadPipelineOptions &workers(uint32_t workers) {
+        _workers = workers;
+        return *this;
+    }
+
+    ThreadPipelineOptions &queueSize(uint32_t queueSize) {
+        _queueSize = queueSize;
+        return *this;
+    }
+
+    ThreadPipelineOptions &batchSize(uint32_t batchSize) {
+        _batchSize = batchSize;
+        return *this;
+    }
+};
+
+/* the untyped part of a queue: the lock, CVs, close state and stats */
+class ThreadQueueBase {
+ public:
+    enum Error {
+        TQ_OK = 0,
+        TQ_ERR_CLOSED = 1
+    };
+
+ protected:
+    ThreadMutex _lock;
+    ThreadCond _notEmptyCv;
+    ThreadCond _notFullCv;
+    uint32_t _maxItems;
+    uint32_t _count;
+    uint32_t _producers;
+    uint32_t _pushWaiters;
+    uint32_t _popWaiters;
+    uint8_t _closed;
+
+    /* stats */
+    uint64_t _pushed;
+    uint64_t _popped;
+    uint64_t _occupancySum;     /* _count summed at each push */
+    uint64_t _pushes;           /* push operations, batched or not */
+    uint64_t _fullWaits;        /* times a pusher waited for room */
+    uint64_t _emptyWaits;       /* times a popper waited for items */
+    uint32_t _maxCount;
+
+    /* called with _lock held, before adding count items */
+    void notePush(uint32_t count);
+
+    /* called with _lock held; drops it, waking those waiting for room */
+    void releaseAfterPop(uint32_t count);
+
+    /* called with _lock held; drops it, waking those waiting for items */
+    void releaseAfterPush(uint32_t count);
+
+ public:
+    ThreadQueueBase(uint32_t maxItems, uint32_t producers);
+
+    virtual ~ThreadQueueBase() {}
+
+    /* called by each producer when it's done; the last one closes the queue */
+    void producerDone();
+
+    /* no more pushes; pops drain what's left and then return 0 */
+    void close();
+
+    uint32_t count();
+
+    uint32_t getMaxItems() {
+        return _maxItems;
+    }
+
+    uint64_t getPushed() {
+        return _pushed;
+    }
+
+    uint64_t getPopped() {
+        return _popped;
+    }
+
+    uint64_t getFullWaits() {
+        return _fullWaits;
+    }
+
+    uint64_t getEmptyWaits() {
+        return _emptyWaits;
+    }
+
+    uint32_t getMaxCount() {
+        return _maxCount;
+    }
+
+    /* average items queued, as seen by pushers */
+    double getAverageCount() {
+        return (_pushes? (double) _occupancySum / _pushes : 0.0);
+    }
+};
+
+/* a bounded queue of T.  Pushes wait for room and pops wait for items,
+ * either one or a batch at a time.
+ */
+template<class T> class ThreadQueue : public ThreadQueueBase {
+    std::deque<T> _items;
+
+ public:
+    ThreadQueue(uint32_t maxItems, uint32_t producers = 1)
+        : ThreadQueueBase(maxItems, producers) {}
+
+    /* returns TQ_ERR_CLOSED, dropping the rest, if the queue is closed */
+    int32_t pushBatch(std::vector<T> *itemsp) {
+        uint32_t i = 0;
+        uint32_t total = itemsp->size();
+        uint32_t n;
+        uint32_t j;
+
+        _lock.take();
+        while(i < total) {
+            while(_count >= _maxItems && !_closed) {
+                _fullWaits++;
+                _pushWaiters++;
+                _notFullCv.wait();
+                _pushWaiters--;
+            }
+            if (_closed) {
+                _lock.release();
+                itemsp->clear();
+                return TQ_ERR_CLOSED;
+            }
+            n = _maxItems - _count;
+            if (n > total - i)
+                n = total - i;
+            notePush(n);
+            for(j=0;j<n;j++,i++)
+                _items.push_back(std::move((*itemsp)[i]));
+            _count += n;
+
+            /* wake consumers before waiting for room again */
+            releaseAfterPush(n);
+            if (i < total)
+                _lock.take();
+        }
+        itemsp->clear();
+        return TQ_OK;
+    }
+
+    int32_t push(T &&item) {
+        _lock.take();
+        while(_count >= _maxItems && !_closed) {
+            _fullWaits++;
+            _pushWaiters++;
+            _notFullCv.wait();
+            _pushWaiters--;
+        }
+        if (_closed) {
+            _lock.release();
+            return TQ_ERR_CLOSED;
+        }
+        notePush(1);
+        _items.push_back(std::move(item));
+        _count++;
+        releaseAfterPush(1);
+        return TQ_OK;
+    }
+
+    int32_t push(const T &item) {
+        T copy(item);
+        return push(std::move(copy));
+    }
+
+    /* append up to maxItems to *itemsp, waiting until there's at least
+     * one.  Returns the number added, which is 0 once the queue is
+     * closed and empty.
+     */
+    uint32_t popBatch(std::vector<T> *itemsp, uint32_t maxItems) {
+        uint32_t n;
+        uint32_t i;
+
+        _lock.take();
+        while(_count == 0) {
+            if (_closed) {
+                _lock.release();
+                return 0;
+            }
+            _emptyWaits++;
+            _popWaiters++;
+            _notEmptyCv.wait();
+            _popWaiters--;
+        }
+        n = (_count < maxItems? _count : maxItems);
+        for(i=0;i<n;i++) {
+            itemsp->push_back(std::move(_items.front()));
+            _items.pop_front();
+        }
+        _count -= n;
+        _popped += n;
+        releaseAfterPop(n);
+        return n;
+    }
+
+    /* returns TQ_ERR_CLOSED once the queue is closed and empty */
+    int32_t pop(T *itemp) {
+        _lock.take();
+        while(_count == 0) {
+            if (_closed) {
+                _lock.release();
+                return TQ_ERR_CLOSED;
+            }
+            _emptyWaits++;
+            _popWaiters++;
+            _notEmptyCv.wait();
+            _popWaiters--;
+        }
+        *itemp = std::move(_items.front());
+        _items.pop_front();
+        _count--;
+        _popped++;
+        releaseAfterPop(1);
+        return TQ_OK;
+    }
+};
+
+/* a stage worker's output, buffered so that it's pushed in batches */
+template<class U> class ThreadPipelineOut {
+    ThreadQueue<U> *_queuep;
+    std::vector<U> _batch;
+    uint32_t _batchSize;
+    uint64_t _pushed;
+
+ public:
+    ThreadPipelineOut(ThreadQueue<U> *queuep, uint32_t batchSize) {
+        _queuep = queuep;
+        _batchSize = batchSize;
+        _batch.reserve(batchSize);
+        _pushed = 0;
+    }
+
+    uint64_t getPushed() {
+        return _pushed;
+    }
+
+    void push(U &&item) {
+        _batch.push_back(std::move(item));
+        if (_batch.size() >= _batchSize)
+            flush();
+    }
+
+    void push(const U &item) {
+        _batch.push_back(item);
+        if (_batch.size() >= _batchSize)
+            flush();
+    }
+
+    /* push anything buffered; stages flush after each input batch,
+     * but a slow source may want to flush sooner.
+     */
+    void flush() {
+        if (!_batch.empty()) {
+            _pushed += _batch.size();
+            _queuep->pushBatch(&_batch);
+        }
+    }
+};
+
+class ThreadPipeline;
+
+/* the untyped part of a stage */
+class ThreadPipelineStage {
+    friend class ThreadPipeline;
+
+ public:
+    ThreadPipelineStage *_dqNextp;
+    ThreadPipelineStage *_dqPrevp;
+
+ protected:
+    std::string _name;
+    ThreadPipelineOptions _options;
+    ThreadQueueBase *_inputp;
+    ThreadQueueBase *_outputp;
+
+    /* stats */
+    std::atomic<uint64_t> _items;
+    std::atomic<uint32_t> _running;
+    long long _startUs;
+    long long _endUs;
+
+    /* called by each worker when it's done */
+    void workerDone();
+
+ public:
+    ThreadPipelineStage(const char *namep, ThreadPipelineOptions &options) {
+        _dqNextp = NULL;
+        _dqPrevp = NULL;
+        _name = namep;
+        _options = options;
+        _inputp = NULL;
+        _outputp = NULL;
+        _items = 0;
+        _running = 0;
+        _startUs = 0;
+        _endUs = 0;
+    }
+
+    virtual ~ThreadPipelineStage() {}
+
+    /* the body of one worker thread */
+    virtual void work() = 0;
+
+    uint64_t getItems() {
+        return _items.load();
+    }
+
+    /* items per second, so far */
+    double getRate();
+};
+
+template<class U, class F> class ThreadPipelineSource : public ThreadPipelineStage {
+    ThreadQueue<U> *_outp;
+    F _fn;
+
+ public:
+    ThreadPipelineSource(const char *namep, ThreadPipelineOptions &options,
+                         ThreadQueue<U> *outp, F &&fn)
+        : ThreadPipelineStage(namep, options), _fn(std::move(fn)) {
+        _outp = outp;
+        _outputp = outp;
+    }
+
+    void work() {
+        ThreadPipelineOut<U> out(_outp, _options._batchSize);
+
+        _fn(out);
+        out.flush();
+        _items += out.getPushed();
+        _outp->producerDone();
+        workerDone();
+    }
+};
+
+template<class T, class U, class F> class ThreadPipelineMap : public ThreadPipelineStage {
+    ThreadQueue<T> *_inp;
+    ThreadQueue<U> *_outp;
+    F _fn;
+
+ public:
+    ThreadPipelineMap(const char *namep, ThreadPipelineOptions &options,
+                      ThreadQueue<T> *inp, ThreadQueue<U> *outp, F &&fn)
+        : ThreadPipelineStage(namep, options), _fn(std::move(fn)) {
+        _inp = inp;
+        _outp = outp;
+        _inputp = inp;
+        _outputp = outp;
+    }
+
+    void work() {
+        ThreadPipelineOut<U> out(_outp, _options._batchSize);
+        std::vector<T> batch;
+        uint32_t n;
+
+        batch.reserve(_options._batchSize);
+        while((n = _inp->popBatch(&batch, _options._batchSize)) > 0) {
+            for(auto &item : batch)
+                _fn(item, out);
+            batch.clear();
+            out.flush();
+            _items += n;
+        }
+        _outp->producerDone();
+        workerDone();
+    }
+};
+
+template<class T, class F> class ThreadPipelineSink : public ThreadPipelineStage {
+    ThreadQueue<T> *_inp;
+    F _fn;
+
+ public:
+    ThreadPipelineSink(const char *namep, ThreadPipelineOptions &options,
+                       ThreadQueue<T> *inp, F &&fn)
+        : ThreadPipelineStage(namep, options), _fn(std::move(fn)) {
+        _inp = inp;
+        _inputp = inp;
+    }
+
+    void work() {
+        std::vector<T> batch;
+        uint32_t n;
+
+        batch.reserve(_options._batchSize);
+        while((n = _inp->popBatch(&batch, _options._batchSize)) > 0) {
+            for(auto &item : batch)
+                _fn(item);
+            batch.clear();
+            _items += n;
+        }
+        workerDone();
+    }
+};
+
+class ThreadPipeline {
+    dqueue<ThreadPipelineStage> _stages;
+    std::vector<ThreadQueueBase *> _queues;
+    ThreadJoinSet _workers;
+    uint8_t _started;
+
+    template<class U> ThreadQueue<U> *newQueue(ThreadPipelineOptions &options) {
+        ThreadQueue<U> *queuep;
+
+        queuep = new ThreadQueue<U>(options._queueSize, options._workers);
+        _queues.push_back(queuep);
+        return queuep;
+    }
+
+ public:
+    ThreadPipeline() {
+        _started = 0;
+    }
+
+    /* waits for the pipeline, if it was started */
+    ~ThreadPipeline();
+
+    /* add a source, which calls fn(out) once in each worker */
+    template<class U, class F> ThreadQueue<U> *
+    source(const char *namep, F fn, ThreadPipelineOptions options = ThreadPipelineOptions()) {
+        ThreadQueue<U> *outp = newQueue<U>(options);
+
+        _stages.append(new ThreadPipelineSource<U, F>(namep, options, outp, std::move(fn)));
+        return outp;
+    }
+
+    /* add a stage, calling fn(item, out) for each item from inp */
+    template<class U, class T, class F> ThreadQueue<U> *
+    stage(const char *namep, ThreadQueue<T> *inp, F fn,
+          ThreadPipelineOptions options = ThreadPipelineOptions()) {
+        ThreadQueue<U> *outp = newQueue<U>(options);
+
+        _stages.append(new ThreadPipelineMap<T, U, F>(namep, options, inp, outp, std::move(fn)));
+        return outp;
+    }
+
+    /* add the final stage, calling fn(item) for each item from inp */
+    template<class T, class F> void
+    sink(const char *namep, ThreadQueue<T> *inp, F fn,
+         ThreadPipelineOptions options = ThreadPipelineOptions()) {
+        _stages.append(new ThreadPipelineSink<T, F>(namep, options, inp, std::move(fn)));
+    }
+
+    /* start every stage's workers */
+    void start();
+
+    /* wait for every worker to finish */
+    void wait();
+
+    void displayStats();
+};
+
+#endif /* __THREADPIPELINE_H_ENV__ */
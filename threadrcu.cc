@@ -0,0 +1,154 @@
+#include "threadrcu.h"
+
+ThreadMutex ThreadRcu::_gpMutex;
+ThreadCond ThreadRcu::_gpCV(&ThreadRcu::_gpMutex);
+std::atomic<uint64_t> ThreadRcu::_gracePeriods;
+
+ThreadMutex ThreadRcu::_lock;
+ThreadCond ThreadRcu::_reclaimCV(&ThreadRcu::_lock);
+dqueue<ThreadRcuHead> ThreadRcu::_pending;
+uint8_t ThreadRcu::_reclaimerStarted;
+uint8_t ThreadRcu::_reclaimerIdle;
+std::atomic<uint64_t> ThreadRcu::_reclaimed;
+
+/* internal: called holding _gpMutex; wait for each dispatcher that was
+ * running a thread or task when we started to get back to its dispatch
+ * loop.  Our own dispatcher is running us, so nothing else on it can
+ * be in a read-side section.  The fences pair with the one in
+ * ThreadDispatcher::rcuRunning: a reader our snapshot misses reads
+ * the updater's new pointers.
+ */
+/* static */ void
+ThreadRcu::waitForReadersNL()
+{
+    uint64_t counts[ThreadDispatcher::_maxDispatchers];
+    ThreadDispatcher *disp;
+    uint32_t dispatcherCount;
+    int myIx;
+    uint32_t i;
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    dispatcherCount = ThreadDispatcher::_dispatcherCount;
+    myIx = ThreadDispatcher::currentIndex();
+    for(i=0; i<dispatcherCount; i++)
+        counts[i] = ThreadDispatcher::_allDispatchers[i]->_rcuCount.load(std::memory_order_acquire);
+
+    for(i=0; i<dispatcherCount; i++) {
+        if ((int) i == myIx || !(counts[i] & 1))
+            continue;
+        disp = ThreadDispatcher::_allDispatchers[i];
+        while(disp->_rcuCount.load(std::memory_order_acquire) == counts[i])
+            _gpCV.waitFor(1);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+/* static */ void
+ThreadRcu::synchronize()
+{
+    uint64_t startCount;
+
+    /* a grace period in progress when we were called might not cover
+     * us, but the one after it does, so if another caller has finished
+     * that one by the time we get the mutex, we're done.
+     */
+    startCount = _gracePeriods.load(std::memory_order_acquire);
+    _gpMutex.take();
+    if (_gracePeriods.load(std::memory_order_relaxed) < startCount + 2) {
+        waitForReadersNL();
+        _gracePeriods.fetch_add(1, std::memory_order_release);
+    }
+    _gpMutex.release();
+}
+
+/* static */ void
+ThreadRcu::call(ThreadRcuHead *headp, void (*procp)(ThreadRcuHead *headp))
+{
+    int startReclaimer = 0;
+
+    headp->_procp = procp;
+    _lock.take();
+    _pending.append(headp);
+    if (!_reclaimerStarted) {
+        _reclaimerStarted = 1;
+        startReclaimer = 1;
+    }
+    else if (_reclaimerIdle) {
+        _reclaimerIdle = 0;
+        _reclaimCV.signal();
+    }
+    _lock.release();
+
+    if (startReclaimer)
+        Thread::spawn("RCU reclaimer", []() { reclaimerTop(); });
+}
+
+/* internal: the reclaimer thread, which runs callbacks in batches,
+ * waiting for one grace period per batch.
+ */
+/* static */ void
+ThreadRcu::reclaimerTop()
+{
+    dqueue<ThreadRcuHead> batch;
+    ThreadRcuHead *headp;
+    uint64_t count;
+
+    _lock.take();
+    while(1) {
+        if (_pending.empty()) {
+            _reclaimerIdle = 1;
+            _reclaimCV.wait();
+            continue;
+        }
+
+        /* give a small batch a chance to grow */
+        if (_pending.count() < _batchCount) {
+            _reclaimCV.waitFor(_batchMs);
+        }
+        batch.concat(&_pending);
+        _lock.release();
+
+        synchronize();
+        count = 0;
+        while((headp = batch.pop()) != NULL) {
+            headp->_procp(headp);
+            count++;
+        }
+        _reclaimed.fetch_add(count, std::memory_order_relaxed);
+
+        _lock.take();
+    }
+}
+
+class ThreadRcuBarrier : public ThreadRcuHead {
+ public:
+    ThreadMutex _mutex;
+    ThreadCond _cv;
+    int _done;
+
+    ThreadRcuBarrier() : _cv(&_mutex) {
+        _done = 0;
+    }
+
+    static void done(ThreadRcuHead *headp) {
+        ThreadRcuBarrier *barrierp = static_cast<ThreadRcuBarrier *>(headp);
+
+        barrierp->_mutex.take();
+        barrierp->_done = 1;
+        barrierp->_cv.broadcast();
+        barrierp->_mutex.release();
+    }
+};
+
+/* static */ void
+ThreadRcu::barrier()
+{
+    ThreadRcuBarrier barrier;
+
+    /* callbacks run in the order they were queued */
+    call(&barrier, &ThreadRcuBarrier::done);
+    barrier._mutex.take();
+    while(!barrier._done)
+        barrier._cv.wait();
+    barrier._mutex.release();
+}
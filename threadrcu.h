@@ -0,0 +1,141 @@
+#ifndef __THREADRCU_H_ENV__
+#define __THREADRCU_H_ENV__ 1
+
+#include <atomic>
+#include <type_traits>
+#include <utility>
+
+#include "thread.h"
+#include "threadmutex.h"
+#include "dqueue.h"
+
+/* usage: read-copy-update, for lookup-heavy structures whose readers
+ * shouldn't take any lock at all.
+ *
+ *      ThreadRcu::readLock();                          reader
+ *      entryp = ThreadRcu::dereference(&_headp);
+ *      ... use entryp, without blocking ...
+ *      ThreadRcu::readUnlock();
+ *
+ *      newp = new Entry(*oldp);                        writer, serialized
+ *      ... change newp ...                             by its own lock
+ *      ThreadRcu::assign(&_headp, newp);
+ *      ThreadRcu::deleteLater(oldp);                   or synchronize(); delete oldp;
+ *
+ * A dispatcher that's back in its dispatch loop holds no references
+ * left over from the thread or task it last ran, so a grace period is
+ * over once every dispatcher has been through its loop, or was idle in
+ * it; dispatchers count their trips through it, so detecting that
+ * needs no help from the readers, and readLock and readUnlock cost
+ * nothing.  In return, a read-side section mustn't block, or even
+ * sleep, since that would let its dispatcher through the loop, and
+ * only threads and tasks on the dispatchers made by
+ * ThreadDispatcher::setup are covered, not threads on a pthread's own
+ * dispatcher (ThreadDispatcher::pthreadTop).  A thread that runs for a
+ * long time without blocking holds up grace periods on its dispatcher.
+ *
+ * synchronize waits for a grace period, sharing one with concurrent
+ * callers when it can.  call and deleteLater queue callbacks for a
+ * reclaimer thread, which runs them in batches, one grace period per
+ * batch; barrier waits for the callbacks queued so far to run.
+ */
+
+/* a queued RCU callback; embed one to avoid call's allocation */
+class ThreadRcuHead {
+ public:
+    ThreadRcuHead *_dqNextp;
+    ThreadRcuHead *_dqPrevp;
+    void (*_procp)(ThreadRcuHead *headp);
+};
+
+template<class F> class ThreadRcuClosure : public ThreadRcuHead {
+ public:
+    F _fn;
+
+    template<class G> ThreadRcuClosure(G &&fn) : _fn(std::forward<G>(fn)) {}
+
+    static void run(ThreadRcuHead *headp) {
+        ThreadRcuClosure *closurep = static_cast<ThreadRcuClosure *>(headp);
+
+        closurep->_fn();
+        delete closurep;
+    }
+};
+
+class ThreadRcu {
+    /* a batch waits at most this long for more callbacks, unless it
+     * has _batchCount of them already.
+     */
+    static const uint32_t _batchMs = 2;
+    static const uint32_t _batchCount = 1000;
+
+    /* grace periods are run one at a time, holding _gpMutex */
+    static ThreadMutex _gpMutex;
+    static ThreadCond _gpCV;
+    static std::atomic<uint64_t> _gracePeriods;
+
+    /* callbacks waiting for the reclaimer */
+    static ThreadMutex _lock;
+    static ThreadCond _reclaimCV;
+    static dqueue<ThreadRcuHead> _pending;
+    static uint8_t _reclaimerStarted;
+    static uint8_t _reclaimerIdle;
+    static std::atomic<uint64_t> _reclaimed;
+
+    static void waitForReadersNL();
+
+    static void reclaimerTop();
+
+ public:
+    static void readLock() {
+        return;
+    }
+
+    static void readUnlock() {
+        return;
+    }
+
+    /* load an RCU protected pointer, inside a read-side section */
+    template<class T> static T *dereference(std::atomic<T *> *ptrp) {
+        return ptrp->load(std::memory_order_acquire);
+    }
+
+    /* publish a new, fully initialized value for an RCU protected pointer */
+    template<class T> static void assign(std::atomic<T *> *ptrp, T *valuep) {
+        ptrp->store(valuep, std::memory_order_release);
+    }
+
+    /* wait until every read-side section that might have started
+     * before we were called is over; mustn't be called from one.
+     */
+    static void synchronize();
+
+    /* call procp(headp) from the reclaimer once a grace period has passed */
+    static void call(ThreadRcuHead *headp, void (*procp)(ThreadRcuHead *headp));
+
+    /* the same, for any callable, which we copy */
+    template<class F> static void call(F &&fn) {
+        typedef ThreadRcuClosure<typename std::decay<F>::type> Closure;
+        Closure *closurep = new Closure(std::forward<F>(fn));
+
+        call(closurep, &Closure::run);
+    }
+
+    /* delete objectp once a grace period has passed */
+    template<class T> static void deleteLater(T *objectp) {
+        call([objectp]() { delete objectp; });
+    }
+
+    /* wait until all of the callbacks queued so far have run */
+    static void barrier();
+
+    static uint64_t getGracePeriods() {
+        return _gracePeriods.load(std::memory_order_relaxed);
+    }
+
+    static uint64_t getReclaimed() {
+        return _reclaimed.load(std::memory_order_relaxed);
+    }
+};
+
+#endif /* __THREADRCU_H_ENV__ */
@@ -0,0 +1,149 @@
+#ifndef __THREADSEQLOCK_H_ENV__
+#define __THREADSEQLOCK_H_ENV__ 1
+
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+
+#include "thread.h"
+#include "threadmutex.h"
+
+/* usage: a sequence lock, for small, rarely written data that's read
+ * far too often for even a read lock, like stats snapshots or a
+ * pointer to the current epoch's state.
+ *
+ *      do {                                    reader
+ *          seq = seqLock.readBegin();
+ *          ... copy the data ...
+ *      } while(seqLock.readRetry(seq));
+ *
+ *      seqLock.writeLock();                    writer
+ *      ... update the data ...
+ *      seqLock.writeUnlock();
+ *
+ * Readers don't write shared memory at all: they note the sequence
+ * number, which is odd while a write is in progress, copy the data, and
+ * retry if the sequence number changed meanwhile.  Writers serialize on
+ * a lock, by default a ThreadMutex of our own, or any ThreadBaseLock
+ * passed to the constructor, so a writer waiting for another blocks as
+ * a thread rather than spinning.
+ *
+ * A reader may see a torn copy, which readRetry then throws away, so
+ * it mustn't act on what it read, e.g. by following a pointer, until
+ * readRetry returns 0.  To stay within the C++ memory model the shared
+ * data should be read and written with relaxed atomics;
+ * ThreadSeqValue<T> below does that for any trivially copyable T.
+ * Writers mustn't sleep between writeLock and writeUnlock, since
+ * readers spin while a write is in progress.
+ */
+class ThreadSeqLock {
+    std::atomic<uint64_t> _seq;
+    ThreadMutex _mutex;
+    ThreadBaseLock *_lockp;
+
+ public:
+    ThreadSeqLock(ThreadBaseLock *lockp = NULL) {
+        _seq = 0;
+        _lockp = (lockp? lockp : &_mutex);
+    }
+
+    uint64_t readBegin() {
+        uint64_t seq;
+
+        while((seq = _seq.load(std::memory_order_acquire)) & 1)
+            spinLockPause();
+        return seq;
+    }
+
+    /* returns 1 if a writer got in since readBegin returned seq */
+    int readRetry(uint64_t seq) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return (_seq.load(std::memory_order_relaxed) != seq);
+    }
+
+    void writeLock() {
+        _lockp->take();
+        _seq.store(_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void writeUnlock() {
+        _seq.store(_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        _lockp->release();
+    }
+
+    /* the number of completed writes */
+    uint64_t getWrites() {
+        return _seq.load(std::memory_order_relaxed) / 2;
+    }
+};
+
+/* a trivially copyable T guarded by a ThreadSeqLock, kept as relaxed
+ * atomic words so that racing copies are well defined.
+ */
+template<class T> class ThreadSeqValue {
+    static_assert(std::is_trivially_copyable<T>::value, "ThreadSeqValue needs a trivially copyable type");
+
+    static const uint32_t _nwords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    ThreadSeqLock _seqLock;
+    std::atomic<uint64_t> _words[_nwords];
+
+    void copyOut(T *valuep) {
+        uint64_t words[_nwords];
+        uint32_t i;
+
+        for(i=0;i<_nwords;i++)
+            words[i] = _words[i].load(std::memory_order_relaxed);
+        memcpy(valuep, words, sizeof(T));
+    }
+
+    void copyIn(const T *valuep) {
+        uint64_t words[_nwords];
+        uint32_t i;
+
+        words[_nwords-1] = 0;
+        memcpy(words, valuep, sizeof(T));
+        for(i=0;i<_nwords;i++)
+            _words[i].store(words[i], std::memory_order_relaxed);
+    }
+
+ public:
+    ThreadSeqValue(const T &value = T(), ThreadBaseLock *lockp = NULL) : _seqLock(lockp) {
+        copyIn(&value);
+    }
+
+    T load() {
+        T value;
+        uint64_t seq;
+
+        do {
+            seq = _seqLock.readBegin();
+            copyOut(&value);
+        } while(_seqLock.readRetry(seq));
+        return value;
+    }
+
+    void store(const T &value) {
+        _seqLock.writeLock();
+        copyIn(&value);
+        _seqLock.writeUnlock();
+    }
+
+    /* read-modify-write: fn gets a T * to change */
+    template<class F> void update(F &&fn) {
+        T value;
+
+        _seqLock.writeLock();
+        copyOut(&value);
+        fn(&value);
+        copyIn(&value);
+        _seqLock.writeUnlock();
+    }
+
+    uint64_t getWrites() {
+        return _seqLock.getWrites();
+    }
+};
+
+#endif /* __THREADSEQLOCK_H_ENV__ */
@@ -0,0 +1,252 @@
+#ifndef __THREADSERVER_H_ENV__
+#define __THREADSERVER_H_ENV__ 1
+
+#include "thread.h"
+#include "dqueue.h"
+
+/* usage: a ThreadServer<X> is a thread that serves requests of type X
+ * sent to its mailbox, replacing the usual hand-rolled ThreadMutex,
+ * ThreadCond and dqueue.  X needs _dqNextp and _dqPrevp pointers;
+ * deriving it from ThreadServerRequest<X> provides them, along with a
+ * reply for callers that want to wait for an answer.
+ *
+ * Subclass ThreadServer<X>, overriding handle, or handleBatch to see
+ * all the requests drained by one wakeup at once, and then queue the
+ * server like any other thread.  Before queueing it, setMaxQueued
+ * bounds the mailbox, and pin runs the server on a single dispatcher.
+ *
+ *      code = serverp->send(requestp);       fire and forget
+ *      code = serverp->call(requestp);       wait for requestp->_reply
+ *
+ * send appends the request and wakes the server if it's sleeping, so
+ * a request costs a queue push and at most one wakeup.  When the
+ * mailbox is full, send waits for the server to drain it, or returns
+ * TS_ERR_FULL if wait is 0.  call sends and then waits until the
+ * server calls reply on the request.
+ *
+ * shutdown makes later sends fail with TS_ERR_SHUTDOWN, and the server
+ * thread exits once it has handled everything already queued; make it
+ * joinable before queueing it to be able to wait for that.
+ */
+
+/* a one-shot reply, which a caller waits for and a server completes */
+class ThreadServerReply {
+    SpinLock _lock;
+    Thread *_waiterp;
+    uint8_t _done;
+
+ public:
+    ThreadServerReply() {
+        _waiterp = NULL;
+        _done = 0;
+    }
+
+    void reset() {
+        _done = 0;
+    }
+
+    void wait() {
+        _lock.take();
+        if (!_done) {
+            _waiterp = Thread::getCurrent();
+            _waiterp->sleep(&_lock);
+            return;
+        }
+        _lock.release();
+    }
+
+    /* the waiter may free the reply as soon as we drop the lock */
+    void complete() {
+        Thread *waiterp;
+
+        _lock.take();
+        _done = 1;
+        waiterp = _waiterp;
+        _waiterp = NULL;
+        _lock.release();
+        if (waiterp)
+            waiterp->queue();
+    }
+};
+
+template<class X> class ThreadServerRequest {
+ public:
+    X *_dqNextp;
+    X *_dqPrevp;
+    ThreadServerReply _reply;
+
+    ThreadServerRequest() {
+        _dqNextp = NULL;
+        _dqPrevp = NULL;
+    }
+};
+
+template<class X> class ThreadServer : public Thread {
+ public:
+    enum Error {
+        TS_OK = 0,
+        TS_ERR_FULL = 1,
+        TS_ERR_SHUTDOWN = 2
+    };
+
+ private:
+    SpinLock _lock;
+    dqueue<X> _requests;
+    dqueue<Thread> _blockedSenders;
+    uint32_t _maxQueued;        /* 0 means unbounded */
+    uint8_t _serverSleeping;
+    uint8_t _shutdown;
+    ThreadDispatcher *_pinnedp;
+
+    /* stats */
+    uint64_t _batches;
+    uint64_t _handled;
+
+    /* called with _lock held; releases it */
+    void releaseAndWakeSenders() {
+        dqueue<Thread> senders;
+        Thread *threadp;
+
+        senders.concat(&_blockedSenders);
+        _lock.release();
+        while((threadp = senders.pop()) != NULL) {
+            threadp->queue();
+        }
+    }
+
+ public:
+    ThreadServer(std::string name = "ThreadServer") : Thread(name) {
+        _maxQueued = 0;
+        _serverSleeping = 0;
+        _shutdown = 0;
+        _pinnedp = NULL;
+        _batches = 0;
+        _handled = 0;
+    }
+
+    virtual ~ThreadServer() {}
+
+    /* called once for each request */
+    virtual void handle(X *requestp) = 0;
+
+    /* called with each batch of requests drained from the mailbox */
+    virtual void handleBatch(dqueue<X> *batchp) {
+        X *requestp;
+
+        while((requestp = batchp->pop()) != NULL) {
+            handle(requestp);
+        }
+    }
+
+    /* bound the mailbox to maxQueued requests; 0 means unbounded */
+    void setMaxQueued(uint32_t maxQueued) {
+        _maxQueued = maxQueued;
+    }
+
+    /* run the server only on the dispatcher with index ix */
+    void pin(uint16_t ix) {
+        _pinnedp = ThreadDispatcher::getDispatcher(ix);
+    }
+
+    ThreadDispatcher *queueDispatcher() {
+        if (_pinnedp)
+            return _pinnedp;
+        return Thread::queueDispatcher();
+    }
+
+    int32_t send(X *requestp, int wait = 1) {
+        Thread *waiterp;
+
+        _lock.take();
+        while(1) {
+            if (_shutdown) {
+                _lock.release();
+                return TS_ERR_SHUTDOWN;
+            }
+            if (_maxQueued == 0 || _requests._queueCount < _maxQueued)
+                break;
+            if (!wait) {
+                _lock.release();
+                return TS_ERR_FULL;
+            }
+            waiterp = Thread::getCurrent();
+            _blockedSenders.append(waiterp);
+            waiterp->sleep(&_lock);
+            _lock.take();
+        }
+
+        _requests.append(requestp);
+        if (_serverSleeping) {
+            _serverSleeping = 0;
+            _lock.release();
+            queue();
+        }
+        else {
+            _lock.release();
+        }
+        return TS_OK;
+    }
+
+    /* send, and wait for the server to call reply on the request */
+    int32_t call(X *requestp) {
+        int32_t code;
+
+        requestp->_reply.reset();
+        code = send(requestp);
+        if (code == TS_OK)
+            requestp->_reply.wait();
+        return code;
+    }
+
+    /* called by the server; the request may be gone on return */
+    void reply(X *requestp) {
+        requestp->_reply.complete();
+    }
+
+    void shutdown() {
+        _lock.take();
+        _shutdown = 1;
+        if (_serverSleeping) {
+            _serverSleeping = 0;
+            releaseAndWakeSenders();
+            queue();
+        }
+        else {
+            releaseAndWakeSenders();
+        }
+    }
+
+    uint64_t getBatches() {
+        return _batches;
+    }
+
+    uint64_t getHandled() {
+        return _handled;
+    }
+
+    void *start() {
+        dqueue<X> batch;
+
+        while(1) {
+            _lock.take();
+            while(_requests.empty() && !_shutdown) {
+                _serverSleeping = 1;
+                sleep(&_lock);
+                _lock.take();
+            }
+            if (_requests.empty()) {
+                /* shut down, and everything's been handled */
+                _lock.release();
+                return NULL;
+            }
+            batch.concat(&_requests);
+            _batches++;
+            _handled += batch._queueCount;
+            releaseAndWakeSenders();
+
+            handleBatch(&batch);
+        }
+    }
+};
+
+#endif /* __THREADSERVER_H_ENV__ */
@@ -0,0 +1,120 @@
+#include <sched.h>
+
+#include "threadsync.h"
+
+/* internal: park until we get a permit or ms milliseconds pass.
+ * Releasers only visit the parking lot when _waiters is non-zero; both
+ * sides use seq_cst operations, so either the releaser sees our
+ * _waiters increment, or we see its permits when we validate.
+ */
+int32_t
+ThreadSemaphore::acquireSlow(uint32_t ms)
+{
+    long long deadlineUs = 0;
+    long long nowUs;
+    int32_t code = ThreadBaseLock::TL_OK;
+
+    if (ms == 0)
+        return ThreadBaseLock::TL_ERR_TIMEDOUT;
+    if (ms != ThreadParkingLot::_forever)
+        deadlineUs = osp_getUs() + (long long) ms * 1000;
+
+    _waiters.fetch_add(1, std::memory_order_seq_cst);
+    while(!tryAcquire()) {
+        if (ms != ThreadParkingLot::_forever) {
+            nowUs = osp_getUs();
+            if (nowUs >= deadlineUs) {
+                code = ThreadBaseLock::TL_ERR_TIMEDOUT;
+                break;
+            }
+            ms = (uint32_t) ((deadlineUs - nowUs + 999) / 1000);
+        }
+        ThreadParkingLot::park(&_count, [this]() {
+                return _count.load(std::memory_order_seq_cst) <= 0;
+            }, ms);
+    }
+    _waiters.fetch_sub(1, std::memory_order_relaxed);
+    return code;
+}
+
+int32_t
+ThreadLatch::waitSlow(uint32_t ms)
+{
+    long long deadlineUs = 0;
+    long long nowUs;
+
+    if (ms == 0)
+        return ThreadBaseLock::TL_ERR_TIMEDOUT;
+    if (ms != ThreadParkingLot::_forever)
+        deadlineUs = osp_getUs() + (long long) ms * 1000;
+
+    while(!tryWait()) {
+        if (ms != ThreadParkingLot::_forever) {
+            nowUs = osp_getUs();
+            if (nowUs >= deadlineUs)
+                return ThreadBaseLock::TL_ERR_TIMEDOUT;
+            ms = (uint32_t) ((deadlineUs - nowUs + 999) / 1000);
+        }
+        ThreadParkingLot::park(&_count, [this]() {
+                return _count.load(std::memory_order_relaxed) != 0;
+            }, ms);
+    }
+    return ThreadBaseLock::TL_OK;
+}
+
+/* internal: wait for the phase after phase to start */
+void
+ThreadBarrier::waitSlow(uint32_t phase)
+{
+    while(getPhase() == phase) {
+        ThreadParkingLot::park(&_state, [this, phase]() {
+                return getPhase() == phase;
+            });
+    }
+}
+
+/*****************Once*****************/
+/* internal: the function hasn't finished yet; run it, or wait for it */
+int
+Once::callSlow(OnceProc *procp, void *contextp)
+{
+    uint8_t state;
+
+    state = _idle;
+    if (_state.compare_exchange_strong(state, _running, std::memory_order_acquire)) {
+        procp(contextp);
+        state = _state.exchange(_done, std::memory_order_acq_rel);
+        if (state == _runningWaiters)
+            ThreadParkingLot::unparkAll(&_state);
+        return 1;
+    }
+
+    waitSlow();
+    return 0;
+}
+
+/* internal: wait for the caller running the function to finish, after
+ * marking the state so that it knows to unpark us.
+ */
+void
+Once::waitSlow()
+{
+    uint8_t state;
+
+    while(1) {
+        state = _state.load(std::memory_order_acquire);
+        if (state == _done)
+            return;
+        if (state == _running &&
+            !_state.compare_exchange_weak(state, _runningWaiters, std::memory_order_relaxed))
+            continue;
+
+        if (ThreadDispatcher::isLwt()) {
+            ThreadParkingLot::park(&_state, [this]() {
+                    return _state.load(std::memory_order_relaxed) == _runningWaiters;
+                });
+        }
+        else
+            sched_yield();
+    }
+}
@@ -0,0 +1,181 @@
+#ifndef __THREADSYNC_H_ENV__
+#define __THREADSYNC_H_ENV__ 1
+
+#include <atomic>
+
+#include "thread.h"
+#include "threadparkinglot.h"
+
+/* usage: blocking synchronization beyond mutexes and condition
+ * variables, all parking lightweight threads in ThreadParkingLot.
+ *
+ *      ThreadSemaphore sem(4);         at most 4 at a time
+ *      sem.acquire();
+ *      ...
+ *      sem.release();
+ *
+ *      ThreadLatch latch(n);           wait for n events
+ *      ... each of n workers calls latch.countDown() ...
+ *      latch.wait();
+ *
+ *      ThreadBarrier barrier(n);       n threads, in phases
+ *      while(...) {
+ *          ... this phase's share of the work ...
+ *          barrier.arriveAndWait();
+ *      }
+ *
+ * Each keeps its state in a single atomic word, so the common cases, a
+ * semaphore with permits left, a latch that's already open, or a
+ * thread that isn't the last to reach a barrier, are a single atomic
+ * operation with no lock.  Only threads that must wait visit the
+ * parking lot, and a latch opening or a barrier phase ending wakes all
+ * of its waiters in one unparkAll, which queues them with one visit to
+ * each dispatcher rather than one per thread.  None of them is fair.
+ *
+ * Once, in spinlock.h, parks its waiters here too.
+ */
+
+class ThreadSemaphore {
+    std::atomic<int64_t> _count;
+    std::atomic<uint32_t> _waiters;
+
+    int32_t acquireSlow(uint32_t ms);
+
+ public:
+    ThreadSemaphore(int64_t count = 0) {
+        _count.store(count, std::memory_order_relaxed);
+        _waiters.store(0, std::memory_order_relaxed);
+    }
+
+    /* return 1 if we got a permit, but never block */
+    int tryAcquire() {
+        int64_t count = _count.load(std::memory_order_relaxed);
+
+        while(count > 0) {
+            if (_count.compare_exchange_weak(count, count - 1, std::memory_order_acquire))
+                return 1;
+        }
+        return 0;
+    }
+
+    void acquire() {
+        if (__builtin_expect(tryAcquire(), 1))
+            return;
+        acquireSlow(ThreadParkingLot::_forever);
+    }
+
+    /* like acquire, but gives up after ms milliseconds, returning
+     * ThreadBaseLock::TL_ERR_TIMEDOUT.
+     */
+    int32_t acquireFor(uint32_t ms) {
+        if (tryAcquire())
+            return ThreadBaseLock::TL_OK;
+        return acquireSlow(ms);
+    }
+
+    void release(uint32_t count = 1) {
+        _count.fetch_add(count, std::memory_order_seq_cst);
+        if (_waiters.load(std::memory_order_seq_cst))
+            ThreadParkingLot::unpark(&_count, count);
+    }
+
+    int64_t getCount() {
+        return _count.load(std::memory_order_relaxed);
+    }
+};
+
+/* a one-shot countdown: wait returns once countDown has been called
+ * count times in all.
+ */
+class ThreadLatch {
+    std::atomic<int64_t> _count;
+
+    int32_t waitSlow(uint32_t ms);
+
+ public:
+    ThreadLatch(int64_t count) {
+        _count.store(count, std::memory_order_relaxed);
+    }
+
+    void countDown(int64_t count = 1) {
+        int64_t oldCount;
+
+        oldCount = _count.fetch_sub(count, std::memory_order_acq_rel);
+        osp_assert(oldCount >= count);
+        if (oldCount == count)
+            ThreadParkingLot::unparkAll(&_count);
+    }
+
+    /* return 1 if the latch is open */
+    int tryWait() {
+        return _count.load(std::memory_order_acquire) == 0;
+    }
+
+    void wait() {
+        if (__builtin_expect(tryWait(), 1))
+            return;
+        waitSlow(ThreadParkingLot::_forever);
+    }
+
+    /* like wait, but gives up after ms milliseconds, returning
+     * ThreadBaseLock::TL_ERR_TIMEDOUT.
+     */
+    int32_t waitFor(uint32_t ms) {
+        if (tryWait())
+            return ThreadBaseLock::TL_OK;
+        return waitSlow(ms);
+    }
+
+    void arriveAndWait(int64_t count = 1) {
+        countDown(count);
+        wait();
+    }
+
+    int64_t getCount() {
+        return _count.load(std::memory_order_relaxed);
+    }
+};
+
+/* a cyclic barrier for a fixed number of threads.  The state word
+ * holds the phase number in its high 32 bits, and the number of
+ * threads that have arrived in this phase in its low 32.
+ */
+class ThreadBarrier {
+    std::atomic<uint64_t> _state;
+    uint32_t _parties;
+
+    void waitSlow(uint32_t phase);
+
+ public:
+    ThreadBarrier(uint32_t parties) {
+        osp_assert(parties > 0);
+        _state.store(0, std::memory_order_relaxed);
+        _parties = parties;
+    }
+
+    /* wait for all of the parties to arrive.  Returns 1 in the last
+     * thread to arrive, which can do any work between phases, and 0 in
+     * the others.
+     */
+    int arriveAndWait() {
+        uint64_t state;
+        uint32_t phase;
+
+        state = _state.fetch_add(1, std::memory_order_acq_rel);
+        phase = (uint32_t) (state >> 32);
+        if ((uint32_t) state + 1 == _parties) {
+            _state.store((uint64_t) (phase + 1) << 32, std::memory_order_release);
+            ThreadParkingLot::unparkAll(&_state);
+            return 1;
+        }
+        waitSlow(phase);
+        return 0;
+    }
+
+    /* the number of completed phases, mod 2^32 */
+    uint32_t getPhase() {
+        return (uint32_t) (_state.load(std::memory_order_acquire) >> 32);
+    }
+};
+
+#endif /* __THREADSYNC_H_ENV__ */
@@ -25,6 +25,7 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <poll.h>
 #include "threadtimer.h"
+#include "threadcancel.h"
 
 /* stupid rabbit */
 pthread_mutex_t ThreadTimer::_timerMutex;
@@ -33,7 +34,6 @@ int ThreadTimer::_noticeFds[2];
 int ThreadTimer::_threadRunning;
 dqueue<ThreadTimer> ThreadTimer::_allTimers;
 int ThreadTimer::_didInit= 0;
-ThreadMutex ThreadCondTimed::_internalLock;
 
 /* static */ void
 ThreadTimer::init()
@@ -182,12 +182,67 @@ ThreadTimerSleep::condWakeup(ThreadTimer *timerp, void *contextp)
     sp->_mutex.release();
 }
 
+/* wakes a cancelable sleeper; the sleep's timer and its token each
+ * have one, sharing the sleeper's spin lock and sleeping flag, so
+ * whichever gets there first wakes the thread, and _removed says which
+ * it was.
+ */
+class ThreadSleepCancelWait : public ThreadCancelWait {
+    SpinLock *_lockp;
+    uint8_t *_sleepingp;
+
+ public:
+    ThreadSleepCancelWait(SpinLock *lockp, uint8_t *sleepingp, Thread *threadp)
+        : ThreadCancelWait(threadp) {
+        _lockp = lockp;
+        _sleepingp = sleepingp;
+    }
+
+    void cancel() {
+        _lockp->take();
+        if (*_sleepingp) {
+            *_sleepingp = 0;
+            _removed = 1;
+        }
+        _lockp->release();
+        if (_removed)
+            _threadp->queue();
+    }
+};
+
 int32_t
-ThreadTimerSleep::sleep(uint32_t ams)
+ThreadTimerSleep::sleepCancelable(uint32_t ms, ThreadCancel *cancelp)
+{
+    Thread *mep = Thread::getCurrent();
+    SpinLock lock;
+    uint8_t sleeping = 0;
+    ThreadSleepCancelWait timerWait(&lock, &sleeping, mep);
+    ThreadSleepCancelWait cancelWait(&lock, &sleeping, mep);
+    ThreadWaitTimer timer(&timerWait);
+
+    lock.take();
+    if (cancelp->addWait(&cancelWait) != 0) {
+        lock.release();
+        return ThreadCancel::TC_ERR_CANCELED;
+    }
+    sleeping = 1;
+    timer.start(ms);
+    mep->sleep(&lock);
+
+    cancelp->removeWait(&cancelWait);
+    timer.stop();
+    return (cancelWait._removed? ThreadCancel::TC_ERR_CANCELED : 0);
+}
+
+int32_t
+ThreadTimerSleep::sleep(uint32_t ams, ThreadCancel *cancelp)
 {
     ThreadTimer *localTimerp;
 
     _ms = ams;
+    if (cancelp)
+        return sleepCancelable(ams, cancelp);
+
     localTimerp = new ThreadTimer(ams, &ThreadTimerSleep::condWakeup, this);
 
     _mutex.take();
@@ -43,12 +43,19 @@ class ThreadTimerSleep {
 
     static void condWakeup(ThreadTimer *timerp, void *contextp);
 
+    /* cancelable sleeps use a ThreadWaitTimer on the sleeper's
+     * dispatcher instead, so that returning early needs no lock shared
+     * with a timer callback.
+     */
+    int32_t sleepCancelable(uint32_t ms, ThreadCancel *cancelp);
+
  public:
     ThreadTimerSleep() {
         _cv.setMutex(&_mutex);
     }
 
-    int32_t sleep(uint32_t ms);
+    /* returns ThreadCancel::TC_ERR_CANCELED if cancelp is canceled first */
+    int32_t sleep(uint32_t ms, ThreadCancel *cancelp = NULL);
 };
 
 /* The model for ThreadTimers is a little subtle.  Because we're on an MP, there's
@@ -132,91 +139,51 @@ class ThreadTimer {
         return _canceled;
     }
 
-    static int32_t sleep(uint32_t ams) {
+    static int32_t sleep(uint32_t ams, ThreadCancel *cancelp = NULL) {
         ThreadTimerSleep sleeper;
         int32_t code;
 
-        code = sleeper.sleep(ams);
+        code = sleeper.sleep(ams, cancelp);
         return code;
     }
 
     static void init();
 };
 
-/* the reason for all this complexity is that we can't recognize a canceled timer
- * without using a static lock, since the context may be freed by the time the
- * timer fires.
+/* a condition variable with a timed wait, bound to the mutex passed to
+ * the constructor or setMutex; a thin wrapper around ThreadCond::waitFor.
  */
 class ThreadCondTimed {
-    static ThreadMutex _internalLock;
-    ThreadTimer *_timerp;
     ThreadCond _cv;
     ThreadMutex *_mutexp;
 
-    static void timerFired(ThreadTimer *timerp, void *contextp) {
-        ThreadCondTimed *p = (ThreadCondTimed *) contextp;
-        _internalLock.take();
-        if (timerp->isCanceled()) {
-            _internalLock.release();
-            return;
-        }
-        p->_cv.broadcast();
-        p->_timerp = NULL;
-        _internalLock.release();
-    }
-
  public:
     void setMutex(ThreadMutex *mutexp) {
         _mutexp = mutexp;
+        _cv.setMutex(mutexp);
     }
 
     ThreadCondTimed() {
-        _cv.setMutex(&_internalLock);
         _mutexp = NULL;
-        _timerp = NULL;
     }
 
-    ThreadCondTimed(ThreadMutex *mutexp) {
+    ThreadCondTimed(ThreadMutex *mutexp) : _cv(mutexp) {
         _mutexp = mutexp;
-        _timerp = NULL;
     }
 
     void broadcast() {
-        _internalLock.take();
         _cv.broadcast();
-        _internalLock.release();
     }
 
     void wait() {
-        _internalLock.take();
-        _mutexp->release();
         _cv.wait();
-        _internalLock.release();
-        _mutexp->take();
     }
 
-    /* returns true if timer didn't fire, false if it did.  Note that timer firing
-     * still might mean we were woken up by a broadcast, but if timer didn't fire,
-     * we were definitely woken by a broadcast.  The return value really shouldn't be
-     * used, except by code coverage tests.
+    /* returns true if we were woken by a broadcast, false if the wait
+     * timed out; see ThreadCond::waitFor.
      */
     int timedWait(uint32_t ms) {
-        int rval;
-        _internalLock.take();
-        _mutexp->release();
-        _timerp = new ThreadTimer(ms, &ThreadCondTimed::timerFired, this);
-        _timerp->start();
-        _cv.wait();
-        if (_timerp) {
-            _timerp->cancel();
-            _timerp = NULL;
-            rval = 1;
-        }
-        else 
-            rval = 0;
-        _internalLock.release();
-        _mutexp->take();
-        return rval;
+        return (_cv.waitFor(ms) == ThreadBaseLock::TL_OK);
     }
 };
 
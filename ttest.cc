@@ -173,6 +173,80 @@ public:
     }
 };
 
+std::atomic<long> main_finished;
+
+/* one-shot thread for comparing with tasks */
+class CountThread : public Thread {
+public:
+    CountThread() : Thread("Count") {
+        return;
+    }
+
+    void *start() {
+        main_finished++;
+        return NULL;
+    }
+};
+
+/* task embedded in a caller's structure, so queueing it doesn't allocate */
+class CountTask : public ThreadTask {
+public:
+    void run() {
+        main_finished++;
+    }
+
+    void releaseTask() {
+        return;
+    }
+};
+
+/* sum of [lo, hi) by recursive halving, forking with a ThreadGroup */
+static long
+groupSum(long lo, long hi)
+{
+    ThreadGroup group;
+    long mid;
+    long left;
+    long right;
+
+    if (hi - lo == 1)
+        return lo;
+
+    mid = lo + (hi - lo) / 2;
+    group.spawn([&left, lo, mid]() { left = groupSum(lo, mid); });
+    right = groupSum(mid, hi);
+    group.sync();
+    return left + right;
+}
+
+/* the same, forking with joinable spawned threads */
+static long
+spawnSum(long lo, long hi)
+{
+    Thread *threadp;
+    long mid;
+    long left;
+    long right;
+
+    if (hi - lo == 1)
+        return lo;
+
+    mid = lo + (hi - lo) / 2;
+    threadp = Thread::spawn("SpawnSum", [&left, lo, mid]() { left = spawnSum(lo, mid); },
+                            ThreadSpawnOptions().joinable());
+    right = spawnSum(mid, hi);
+    threadp->join(NULL);
+    threadp->releaseThread();
+    return left + right;
+}
+
+static void
+waitFinished(long count)
+{
+    while(main_finished.load() < count)
+        usleep(100);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -236,6 +310,107 @@ main(int argc, char **argv)
     printf("%d thread create/deletes %ld ns each\n",
            (int) main_maxCount, (long) (getus() - startUs) * 1000 / main_maxCount);
 
+    printf("Starting timing test for spawn + joins\n");
+    startUs = getus();
+    for(i=0;i<main_maxCount;i++) {
+        Thread *spawnp;
+        spawnp = Thread::spawn("Spawned", [i]() { return (void *) i; },
+                               ThreadSpawnOptions().joinable());
+        spawnp->join(&junkp);
+        assert(junkp == (void *) i);
+        spawnp->releaseThread();
+    }
+    printf("%d spawn/joins %ld ns each\n",
+           (int) main_maxCount, (long) (getus() - startUs) * 1000 / main_maxCount);
+
+    printf("Starting timing test for detached spawns\n");
+    {
+        std::atomic<long> spawnDone(0);
+        startUs = getus();
+        for(i=0;i<main_maxCount;i++) {
+            Thread::spawn(NULL, [&spawnDone]() { spawnDone++; });
+        }
+        while(spawnDone.load() < main_maxCount)
+            usleep(100);
+        printf("%d detached spawns %ld ns each\n",
+               (int) main_maxCount, (long) (getus() - startUs) * 1000 / main_maxCount);
+    }
+
+    printf("Starting timing test for new Thread + queue\n");
+    main_finished = 0;
+    startUs = getus();
+    for(i=0;i<main_maxCount;i++) {
+        (new CountThread())->queue();
+    }
+    waitFinished(main_maxCount);
+    printf("%d thread create/queues %ld ns each\n",
+           (int) main_maxCount, (long) (getus() - startUs) * 1000 / main_maxCount);
+
+    printf("Starting timing test for embedded tasks\n");
+    {
+        CountTask *tasksp = new CountTask[main_maxCount];
+        main_finished = 0;
+        startUs = getus();
+        for(i=0;i<main_maxCount;i++) {
+            tasksp[i].queue();
+        }
+        waitFinished(main_maxCount);
+        printf("%d embedded tasks %ld ns each\n",
+               (int) main_maxCount, (long) (getus() - startUs) * 1000 / main_maxCount);
+        delete [] tasksp;
+    }
+
+    printf("Starting timing test for submitted tasks\n");
+    main_finished = 0;
+    startUs = getus();
+    for(i=0;i<main_maxCount;i++) {
+        ThreadTask::submit([]() { main_finished++; });
+    }
+    waitFinished(main_maxCount);
+    printf("%d submitted tasks %ld ns each\n",
+           (int) main_maxCount, (long) (getus() - startUs) * 1000 / main_maxCount);
+
+    /* tasks that block on a held mutex get promoted to threads */
+    printf("Starting test of blocking tasks\n");
+    main_finished = 0;
+    mlock.take();
+    for(i=0;i<pingCount;i++) {
+        ThreadTask::submit([&mlock]() {
+                mlock.take();
+                main_finished++;
+                mlock.release();
+            });
+    }
+    sleep(1);
+    mlock.release();
+    waitFinished(pingCount);
+    printf("%d blocking tasks done, %ld promoted\n",
+           pingCount, (long) ThreadDispatcher::getTaskPromotions());
+
+    printf("Starting timing test for fork-join recursion\n");
+    {
+        Thread *threadp;
+        long sum = 0;
+
+        startUs = getus();
+        threadp = Thread::spawn("GroupSum", [&sum]() { sum = groupSum(0, main_maxCount); },
+                                ThreadSpawnOptions().joinable());
+        threadp->join(NULL);
+        threadp->releaseThread();
+        assert(sum == main_maxCount * (main_maxCount-1) / 2);
+        printf("%d group leaves %ld ns each\n",
+               (int) main_maxCount, (long) (getus() - startUs) * 1000 / main_maxCount);
+
+        startUs = getus();
+        threadp = Thread::spawn("SpawnSum", [&sum]() { sum = spawnSum(0, main_maxCount); },
+                                ThreadSpawnOptions().joinable());
+        threadp->join(NULL);
+        threadp->releaseThread();
+        assert(sum == main_maxCount * (main_maxCount-1) / 2);
+        printf("%d spawn/join leaves %ld ns each\n",
+               (int) main_maxCount, (long) (getus() - startUs) * 1000 / main_maxCount);
+    }
+
     Thread::displayStackUsage();
     _exit(0);
     return 0;